@@ -0,0 +1,78 @@
+/*
+ * bench.h
+ *
+ *  Created on: 2026-10-16 10:02:37
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_BENCH_H_
+#define INCLUDE_BENCH_H_
+
+/*
+ * Build with HAVE_BENCH_SUITE to generate the synthetic clips and run the decode-throughput suite; it needs
+ * libavfilter, and psapi on Windows, which the library does not link otherwise. The Bench configuration
+ * builds so, with the runner 'src/bench/main.c', into the executable 'bench'.
+ */
+#ifndef HAVE_BENCH_SUITE
+#define HAVE_BENCH_SUITE 0
+#endif
+
+/* The list of 'list.h' alone, polled by sleeping as the media pipeline did before the queues */
+#define QUEUE_BENCH_RAW_LIST 2
+
+/*
+ * Micro-benchmark of the caches used by the media pipeline: one producer thread passes 'count'
+ * packets to one consumer thread through a queue of 'type'(QUEUE_LIST, QUEUE_SPSC or QUEUE_BENCH_RAW_LIST)
+ * with 'capacity'.
+ * Return the throughput in packets per second, or a negative error code.
+ */
+extern double ex_av_queue_bench(int type, int capacity, int count);
+
+/*
+ * Micro-benchmark of the gain kernels(see 'mix.h') available on this cpu, and of SDL_MixAudioFormat as
+ * the audio callback used it, on 'nb_samples' interleaved S16 samples 'iterations' times.
+ * The nanoseconds per sample of every kernel are logged.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_mix_bench(int nb_samples, int iterations);
+
+/*
+ * Check that the gain kernels available on this cpu output what the C ones do, with a constant gain and
+ * with ramps, on S16 and float samples, written and added.
+ * Return 0 if they all match, otherwise, return AVERROR_BUG.
+ */
+extern int ex_av_mix_check(void);
+
+/*
+ * Decode 'nb_sessions' copies of the synthetic clip 'url' at once in the headless mode, firstly with
+ * the dedicated threads of every media, then on a shared executor of 'nb_workers'(see 'ex_av_executor_create').
+ * The aggregate frames per second and the CPU usage of both runs are logged, and the frames per second
+ * are returned in '*threads_fps' and '*pool_fps' if they are not NULL.
+ * Every session also checks, by 'get_stats', that its pools of packets and frames stopped allocating once
+ * warm: no more entries were allocated than its caches could hold at once.
+ * Return 0 if success, AVERROR_BUG if a check failed, otherwise, return a negative error code.
+ */
+extern int ex_av_media_bench_sessions(const char *url, int nb_sessions, int nb_workers, double *threads_fps, double *pool_fps);
+
+/*
+ * The following ones return AVERROR(ENOSYS) if built without HAVE_BENCH_SUITE.
+ *
+ * Generate a deterministic synthetic clip 'url'(matroska) of 'duration' seconds: the lavfi testsrc2 pattern
+ * of 'width'x'height' at 'frame_rate' encoded by the video 'encoder'(e.g. "mpeg4"), and a sine beep in AAC.
+ * The encoders run single-threaded and bit-exact, so the same clip is generated on every machine.
+ * Return 0 if success, AVERROR_ENCODER_NOT_FOUND if 'encoder' is not in the build, or a negative error code.
+ */
+extern int ex_av_synthetic_media_create(const char *url, const char *encoder, int width, int height, int frame_rate, double duration);
+
+/*
+ * Decode-throughput suite: for several resolutions and codecs, a synthetic clip of 'duration' seconds is
+ * generated into the directory 'dir'(once, kept for the next runs), demuxed alone, then decoded in the
+ * headless mode. The results are written into 'json_path' as JSON, a case per clip: the demux throughput
+ * in MB/s, the decoded frames per second of every stream, the latency percentiles in microseconds of
+ * reading, sending and receiving(from the trace, see 'trace.h'), and the resident memory sampled while the case
+ * runs: its peak, and how much the case added to it at its start.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_media_bench_suite(const char *dir, double duration, const char *json_path);
+
+#endif /* INCLUDE_BENCH_H_ */
@@ -0,0 +1,45 @@
+/*
+ * budget.h
+ *
+ *  Created on: 2026-10-16 14:37:52
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_BUDGET_H_
+#define INCLUDE_BUDGET_H_
+
+/*
+ * Process-wide budget of the decoding threads, shared evenly by all the running decoders
+ * that join it: a single decoder gets all the threads, while 64 decoders on 8 cores get
+ * one thread each. A join/leave/set changes the generation only if it changes the share,
+ * and the decoders then reopen their codecs with the new share on the next keyframe.
+ */
+
+/*
+ * Set the number of threads of the budget, or one per CPU if 'nb_threads' <= 0(default).
+ */
+extern void ex_av_thread_budget_set(int nb_threads);
+
+/*
+ * Return the number of threads of the budget.
+ */
+extern int ex_av_thread_budget_get(void);
+
+/*
+ * Join or leave the budget, by a decoder when it is opened or closed.
+ */
+extern void ex_av_thread_budget_join(void);
+extern void ex_av_thread_budget_leave(void);
+
+/*
+ * Return the number of threads a decoder of the budget could use, which is at least 1,
+ * and store the generation of the budget in '*generation' if it is not NULL.
+ */
+extern int ex_av_thread_budget_share(unsigned int *generation);
+
+/*
+ * Return the generation of the budget, cheap enough to be checked for every packet.
+ */
+extern unsigned int ex_av_thread_budget_generation(void);
+
+#endif /* INCLUDE_BUDGET_H_ */
@@ -0,0 +1,98 @@
+/*
+ * executor.h
+ *
+ *  Created on: 2026-10-16 13:41:27
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_EXECUTOR_H_
+#define INCLUDE_EXECUTOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define EXECUTOR_MAX_WORKERS 256
+
+/* How many steps a task could run in a row before giving way to the other tasks */
+#define TASK_QUANTUM 16
+
+/* Return values of the step function of a task */
+#define TASK_AGAIN    0    /* made some progress, run it again */
+#define TASK_BLOCKED  1    /* unable to make progress, park it until 'ex_av_task_wake' is called */
+#define TASK_DONE     2    /* finished, it will never run again */
+
+struct exAVExecutor;
+
+/*
+ * A task is a resumable job cut into short non-blocking steps. Its step function must never sleep
+ * waiting for another task, but return TASK_BLOCKED instead, and the other task wakes it up.
+ */
+typedef struct exAVTask {
+	int (*step)(struct exAVTask *t, void *opaque);
+	void *opaque;
+	struct exAVExecutor *executor;
+	struct exAVTask *next;              /* link in the run queue of a worker */
+	int state;
+	int64_t nb_steps;                   /* how many steps it has run */
+} exAVTask;
+
+typedef struct exAVWorker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	exAVTask *head, *tail;              /* FIFO run queue, the other workers steal from its head too */
+	struct exAVExecutor *executor;
+	int idx;
+	int64_t nb_steals;                  /* how many tasks stolen from the other workers */
+} exAVWorker;
+
+/*
+ * Shared pool of worker threads running the tasks of many medias. Every worker runs the tasks in its own
+ * queue round-robin, a task giving way after TASK_QUANTUM steps, so that a busy media can not starve the
+ * others; an idle worker steals the tasks queued on the others before going to sleep.
+ */
+typedef struct exAVExecutor {
+	int nb_workers;
+	exAVWorker *workers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;                /* signaled when a task is queued */
+	pthread_cond_t done;                /* signaled when a task is done */
+	int nb_idle;                        /* how many workers sleeping on 'cond' */
+	int nb_pending;                     /* how many tasks queued */
+	unsigned int next_worker;           /* queue of the next task submitted from outside of the workers */
+	int quit;
+} exAVExecutor;
+
+/*
+ * Create an executor with 'nb_workers' worker threads, or one per CPU if 'nb_workers' <= 0.
+ * Return NULL if failed.
+ */
+extern exAVExecutor *ex_av_executor_create(int nb_workers);
+
+/*
+ * Stop the workers and free the executor. All its tasks must be done.
+ */
+extern void ex_av_executor_free(exAVExecutor **e);
+
+/*
+ * Create a parked task running 'step' with 'opaque' on the executor; it starts by 'ex_av_task_wake'.
+ * Return NULL if failed.
+ */
+extern exAVTask *ex_av_task_create(exAVExecutor *e, int (*step)(exAVTask *t, void *opaque), void *opaque);
+
+/*
+ * Schedule a parked task. If the task is running, it will run again instead of being parked
+ * when it returns TASK_BLOCKED. It could be called from any thread.
+ */
+extern void ex_av_task_wake(exAVTask *t);
+
+/*
+ * Wait until the task is done.
+ */
+extern void ex_av_task_wait(exAVTask *t);
+
+/*
+ * Free a task which is done, or which has never been woken up.
+ */
+extern void ex_av_task_free(exAVTask **t);
+
+#endif /* INCLUDE_EXECUTOR_H_ */
@@ -91,6 +91,7 @@ typedef struct exAVFrame {
 	struct list_head list;
 	atomic_t refcount;
 	pthread_rwlock_t rwlock;
+	struct exAVFramePool *pool;       /* the pool it is allocated from, NULL if it is allocated by 'ex_av_frame_alloc' */
 
 	struct exAVFrame *(*get)(struct exAVFrame *self);
 	void (*put)(struct exAVFrame *self);
@@ -117,4 +118,39 @@ exAVFrame *ex_av_frame_load_picture(const char *url);
  */
 extern void ex_av_frame_free_list_entry(struct list_head *);
 
+/*
+ * Recycling pool of frames of the same size, works as same as 'exAVPacketPool':
+ * a released frame only unrefs its AVFrame, and is kept to be handed out again.
+ */
+typedef struct exAVFramePool {
+	size_t size;                      /* size of every frame */
+	exAVFrame **frames;               /* released frames ready to be reused */
+	int nb_frames, max_frames;
+	int refcount;                     /* one for the pool itself, plus one for every frame in use */
+	int closed;
+	pthread_mutex_t mutex;
+
+	/* Statistics */
+	int64_t nb_allocs;                /* how many frames allocated from the heap */
+	int64_t nb_reuses;                /* how many frames reused from the pool */
+} exAVFramePool;
+
+/*
+ * Create a pool of frames of 'size'(see 'ex_av_frame_alloc'), which keeps at most 'max_frames'
+ * released frames. Return NULL if failed.
+ */
+extern exAVFramePool *ex_av_frame_pool_create(size_t size, int max_frames);
+
+/*
+ * Allocate a frame from the pool, free it via its 'put' function as usual.
+ * The fields following 'exAVFrame' in the frame of 'size' are zeroed.
+ * Return NULL if failed.
+ */
+extern exAVFrame *ex_av_frame_pool_alloc(exAVFramePool *pool);
+
+/*
+ * Free the pool. The frames still in use are freed when they are released.
+ */
+extern void ex_av_frame_pool_free(exAVFramePool **pool);
+
 #endif /* SRC_UTILS_FRAME_H_ */
@@ -0,0 +1,103 @@
+/*
+ * keyindex.h
+ *
+ *  Created on: 2026-10-16 16:48:21
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_KEYINDEX_H_
+#define INCLUDE_KEYINDEX_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+
+/* Containers poorly indexed by themselves, where seeking is a binary search over the file */
+#define KEY_INDEX_FORMATS  "mpegts,mpeg,mpegvideo,h264,hevc,flv,aac,mp3,ac3"
+/* Seconds between two entries of an audio stream, whose packets are all keyframes */
+#define KEY_INDEX_AUDIO_INTERVAL 1
+
+/* Sidecar files saving the indexes of the local media, in the cache directory of the user */
+#define KEY_INDEX_CACHE_DIR "libffmpeg/keyindex"
+#define KEY_INDEX_SUFFIX   ".kidx"
+/* Bytes at the start of a local media hashed to tell whether it has changed */
+#define KEY_INDEX_HEAD_SIZE (64 * 1024)
+
+typedef struct exAVKeyEntry {
+	int64_t pts;                        /* in the time base of the stream */
+	int64_t pos;                        /* byte position of the packet in the file */
+} exAVKeyEntry;
+
+/*
+ * Keyframe index of a stream: the keyframes sorted by pts, and the pts up to which the stream is indexed
+ * without a gap. It is filled by a builder thread reading the whole media from another context, or by
+ * the grabber while it demuxes contiguously from an indexed position.
+ */
+typedef struct exAVKeyIndex {
+	pthread_mutex_t mutex;
+	exAVKeyEntry *entries;
+	int nb_entries, capacity;
+	int stream_index;
+	AVRational time_base;
+	int64_t interval;                   /* least distance between two entries, in 'time_base'; 0 if every keyframe */
+	int wrap_bits;                      /* the timestamps wrap around(33 bits in MPEG-TS), unwrapped in the index */
+	int64_t covered;                    /* every keyframe before it is in the index, AV_NOPTS_VALUE if nothing */
+	/* Fingerprint of the media when indexed, the sidecar of a changed file is ignored */
+	int64_t file_size;
+	int64_t mtime;                      /* modification time, seconds since the epoch */
+	uint32_t head_crc;                  /* CRC-32 of the first KEY_INDEX_HEAD_SIZE bytes */
+	int complete;                       /* the whole media is indexed */
+	int dirty;                          /* changed since loaded or saved */
+	char *url;
+	char *sidecar;                      /* NULL if the media is not a local file, see 'ex_av_key_index_set_cache_dir' */
+
+	/* Builder */
+	pthread_t builder;
+	int builder_started;
+	int abort;
+} exAVKeyIndex;
+
+/*
+ * Set the directory of the sidecar files, KEY_INDEX_CACHE_DIR in the cache directory of the user(see
+ * 'ex_av_file_cache_dir') if NULL(default). A sidecar is named by a hash of the url of its media.
+ */
+extern void ex_av_key_index_set_cache_dir(const char *dir);
+
+/*
+ * Create the index of the stream 'stream_index' of the media 'url' opened by 'ic', loading its sidecar
+ * file if it is still valid. An audio stream is indexed every KEY_INDEX_AUDIO_INTERVAL seconds.
+ * Return NULL if failed, or if the container of the media keeps a good index by itself.
+ */
+extern exAVKeyIndex *ex_av_key_index_create(AVFormatContext *ic, const char *url, int stream_index);
+
+/*
+ * Start indexing the whole media in the background, unless the index is complete already.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_key_index_build(exAVKeyIndex *idx);
+
+/*
+ * Record a demuxed packet of the indexed stream; the caller must have demuxed contiguously
+ * from a position before 'covered'. A wrapped 'pts' is unwrapped from 'covered'.
+ */
+extern void ex_av_key_index_add(exAVKeyIndex *idx, int64_t pts, int64_t pos, int key);
+
+/*
+ * Find the last keyframe at or before 'pts'.
+ * Return 0 if found, AVERROR(ENOENT) if 'pts' is not covered by the index.
+ */
+extern int ex_av_key_index_lookup(exAVKeyIndex *idx, int64_t pts, exAVKeyEntry *e);
+
+/*
+ * Write the index into its sidecar file.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_key_index_save(exAVKeyIndex *idx);
+
+/*
+ * Stop the builder, save the index if it has changed, and free it.
+ */
+extern void ex_av_key_index_free(exAVKeyIndex **idx);
+
+#endif /* INCLUDE_KEYINDEX_H_ */
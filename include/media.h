@@ -14,6 +14,8 @@
 #include <frame.h>
 #include <packet.h>
 #include <clock.h>
+#include <queue.h>
+#include <mix.h>
 
 enum {
 		AV_SYNC_AUDIO_MASTER,   /* default choice */
@@ -38,6 +40,15 @@ enum {
 /* no AV correction is done if too big error */
 #define AV_NOSYNC_THRESHOLD 10.0
 
+/* the video decoder skips more work while the video lags behind the master clock by more than it */
+#define SKIP_LAG_THRESHOLD 0.1
+/* and less once the lag is below it */
+#define SKIP_CATCH_UP_THRESHOLD 0.02
+/* microseconds between two checks of the lag by the video decoder */
+#define SKIP_CHECK_INTERVAL 500000
+/* checks in a row without lag nor dropped frames before skipping less */
+#define SKIP_RELAX_CHECKS 4
+
 /* maximum audio speed change to get correct sync */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 
@@ -58,18 +69,57 @@ enum {
 #define MEDIA_FLAG_NO_VIDEO                       0x0100
 #define MEDIA_FLAG_NO_AUDIO                       0x0200
 #define MEDIA_FLAG_NO_SUBTITLE                    0x0400
+#define MEDIA_FLAG_SPSC_QUEUE                     0x1000
+#define MEDIA_FLAG_KEY_INDEX                      0x2000
+#define MEDIA_FLAG_MMAP                           0x4000
+#define MEDIA_FLAG_PREFETCH                       0x8000
+#define MEDIA_FLAG_PROBE_CACHE                    0x10000
+#define MEDIA_FLAG_CONVERT                        0x20000
 
 typedef struct exAVPacketQueue {
- struct list *list;
- int serial;
+	exAVQueue queue;
+	int serial;
 } exAVPacketQueue;
 
+struct exAVMedia;
+
+/*
+ * Frame sink of the headless mode(see 'set_frame_sink'), called from the decoder thread of the stream
+ * with every decoded frame. The frame is only borrowed during the call, take a reference via its 'get'
+ * to keep it. Return 0 to go on, or a negative error code to stop decoding the whole media.
+ */
+typedef int (*exAVFrameSink)(struct exAVMedia *m, enum AVMediaType type, exAVFrame *f, void *opaque);
+
 typedef struct exAVFrameQueue {
-	struct list *list;
+	exAVQueue queue;
 	exAVFrame *last;
 	int serial;
+	enum AVMediaType type;
+	exAVFrameSink sink;                 /* the decoded frames are handed to it instead of being cached */
+	void *sink_opaque;
+
+	/* Statistics of the decoder, only updated by atomic operations */
+	int64_t nb_decoded, decode_time, nb_dropped;
 } exAVFrameQueue;
 
+/*
+ * Snapshot of a stream of the media, see 'get_stats'.
+ */
+typedef struct exAVStreamStats {
+	exAVQueueStats packets, frames;     /* its caches */
+	int64_t nb_decoded;                 /* frames out of the codec */
+	int64_t decode_time;                /* microseconds spent in the codec, 'decode_time / nb_decoded' per frame */
+	int64_t nb_dropped;                 /* frames decoded but not delivered: before the target of a seek, or stale */
+} exAVStreamStats;
+
+typedef struct exAVMediaStats {
+	exAVStreamStats video, audio, subtitle;
+	int64_t nb_seeks;
+	/* Entries of the pools allocated from the heap and reused; once warm, the pipeline only reuses them */
+	int64_t packet_allocs, packet_reuses;
+	int64_t frame_allocs, frame_reuses;
+} exAVMediaStats;
+
 typedef struct exAudioParams {
     int sample_rate;
 //    int channels;
@@ -96,33 +146,176 @@ typedef struct exAVMedia {
 	void (*put)(struct exAVMedia *self);
 	int (*open)(struct exAVMedia *self, const char *url, int open_flags);     /* open the 'url' media file */
 	void (*close)(struct exAVMedia *self);                                    /* close the media file */
+	/*
+	 * Saving by stream copy, no decoding nor encoding(see 'remux.h'):
+	 *   save_as     : start saving the opened streams into 'url', from the current position; if the media is not
+	 *                 being decoded, only the grabber is started, and the media could not be decoded until the saving ends.
+	 *                 If a stream could not be stored into 'url' as it is, the media is transcoded instead,
+	 *                 only if it is not being decoded, otherwise, AVERROR(EBUSY) is returned.
+	 *   transcode_as: start saving the opened video and audio streams into 'url' re-encoded(see 'transcode.h');
+	 *                 the media is decoded for it, so it must not be being decoded nor have frame sinks.
+	 *   wait_save   : wait until the whole media is saved, then close the output.
+	 *   stop_save   : stop saving right now and close the output; a stream copy is not completed, its output
+	 *                 is removed and AVERROR_EXIT returned.
+	 * All of them return 0 if success, otherwise, return a negative error code.
+	 */
 	int (*save_as)(struct exAVMedia *self, const char *url);
-
-	/* Caches */
-#define VIDEO_PACKET_QUEUE_SIZE  32
+	int (*transcode_as)(struct exAVMedia *self, const char *url);
+	int (*wait_save)(struct exAVMedia *self);
+	int (*stop_save)(struct exAVMedia *self);
+	void (*set_cache_limits)(struct exAVMedia *self, int64_t max_bytes, double min_duration);  /* see 'cache_max_bytes' */
+
+	/*
+	 * Headless mode: no SDL window or audio device is involved, the decoded frames are delivered per stream
+	 * to a sink, or pulled by 'get_frame'. With MEDIA_RUN_PACED(or 'paced' set before 'start_decode' for
+	 * 'get_frame') the frames are delivered no faster than their timestamps, otherwise as fast as the decoders go.
+	 *   set_frame_sink: deliver the frames of the stream 'type' to 'sink'; it must be set before the decoding starts.
+	 *   run           : decode the media until all the decoders are finished or a sink fails; the frames of
+	 *                   the streams without a sink are dropped, unpaced. Return 0 if finished, the error of
+	 *                   the failed sink, or AVERROR_EXIT if stopped. With MEDIA_RUN_NOWAIT it returns once
+	 *                   the decoding is started, then 'wait' for it and 'stop_decode'.
+	 *   wait          : wait until all the decoders are finished. Return 0, the error of the failed sink,
+	 *                   or AVERROR_EXIT if stopped.
+	 *   get_frame     : after 'start_decode', pop a decoded frame of the stream 'type'(see 'ex_av_queue_pop'
+	 *                   for the 'timeout' and the return value); free it via its 'put' function. Every opened
+	 *                   stream without a sink must be consumed, or its decoder and then the grabber block.
+	 */
+	void (*set_frame_sink)(struct exAVMedia *self, enum AVMediaType type, exAVFrameSink sink, void *opaque);
+	int (*run)(struct exAVMedia *self, int run_flags);
+	int (*get_frame)(struct exAVMedia *self, enum AVMediaType type, exAVFrame **f, int64_t timeout);
+	int (*wait)(struct exAVMedia *self);
+#define MEDIA_RUN_PACED  0x0001
+#define MEDIA_RUN_NOWAIT 0x0002
+
+	/*
+	 * Run the grabber and decoders as tasks on a shared executor(see 'executor.h') instead of their own
+	 * threads; NULL(default) goes back to the threads. It must be set before the decoding starts, and the
+	 * executor must outlive the decoding. Paced sinks keep a worker busy while waiting, so they are better
+	 * left on their own threads.
+	 */
+	void (*set_executor)(struct exAVMedia *self, struct exAVExecutor *e);
+
+	/*
+	 * Threading of the decoders: 'nb_threads' > 0 opens every decoder with so many threads, while 0(default)
+	 * lets the video decoder share the process-wide thread budget(see 'budget.h') with the other medias, the
+	 * audio and subtitle decoders having one thread; 'thread_type' is FF_THREAD_FRAME and/or FF_THREAD_SLICE,
+	 * 0 means both(default). It must be set before the decoding starts.
+	 */
+	void (*set_decoder_threads)(struct exAVMedia *self, int nb_threads, int thread_type);
+	int decoder_threads, decoder_thread_type;
+
+	/*
+	 * Accurate seek: after seeking, the decoders catch up from the keyframe to the exact target, dropping the
+	 * frames before it without caching them, and skipping the frames nobody refers to. Off by default, seeking
+	 * lands on the keyframe. It could be changed at any time, and takes effect from the next seek.
+	 */
+	void (*set_accurate_seek)(struct exAVMedia *self, int enable);
+	int accurate_seek;
+
+	/*
+	 * Frame dropping while playing: the late video frames are dropped by the decoder before they are cached,
+	 * and by the player instead of being shown, and the video decoder skips the loop filter then the frames
+	 * nobody refers to while the video lags behind the master clock by more than 'SKIP_LAG_THRESHOLD'.
+	 * 'framedrop' < 0 (default) drops only when the video is not the master clock, 0 never, > 0 always.
+	 */
+	void (*set_framedrop)(struct exAVMedia *self, int framedrop);
+	int framedrop;
+	double video_lag;                           /* seconds the shown video is behind the master clock, atomic */
+
+	/*
+	 * Take a snapshot of the statistics of the caches and decoders since the media is opened, without taking
+	 * any lock; it could be called from any thread at any time, e.g. periodically to find out which stage is
+	 * starved(its input caches are empty and their consumer waits) or backed up(its output caches are full).
+	 */
+	void (*get_stats)(struct exAVMedia *self, exAVMediaStats *stats);
+	int64_t nb_seeks;
+
+	/* Caches: the sizes are hard limits of the number of entries, the caches are mainly limited by 'cache_max_bytes' and 'cache_min_duration' */
+#define VIDEO_PACKET_QUEUE_SIZE  1024
 #define VIDEO_PICTURE_QUEUE_SIZE 32
-#define SUBTITLE_PACKET_QUEUE_SIZE 16
+#define SUBTITLE_PACKET_QUEUE_SIZE 256
 #define SUBTITLE_PICTURE_QUEUE_SIZE 16
-#define AUDIO_PACKET_QUEUE_SIZE 128
+#define AUDIO_PACKET_QUEUE_SIZE 1024
 #define AUDIO_SAMPLE_QUEUE_SIZE 128
+#define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+#define MIN_QUEUE_DURATION 3.0
+#define PACKET_POOL_SIZE (VIDEO_PACKET_QUEUE_SIZE + AUDIO_PACKET_QUEUE_SIZE + SUBTITLE_PACKET_QUEUE_SIZE)
+#define FRAME_POOL_SIZE  (VIDEO_PICTURE_QUEUE_SIZE + AUDIO_SAMPLE_QUEUE_SIZE + SUBTITLE_PICTURE_QUEUE_SIZE)
 	exAVPacketQueue vpackets, apackets, spackets;
 	exAVFrameQueue vframes, aframes, sframes;
+	/*
+	 * Convert stage(MEDIA_OPEN_CONVERT): while playing, the video decoder puts its frames into 'vconvert', and
+	 * the converter thread puts them into 'vframes' once converted into a format uploaded without sws_scale,
+	 * downscaled to fit the window, so that the player only uploads them.
+	 */
+#define VIDEO_CONVERT_QUEUE_SIZE 4
+	int convert_stage;                          /* 'vconvert' is created */
+	int converting;                             /* the converter is running */
+	exAVQueue vconvert;
+	pthread_t video_converter;
+	struct SwsContext *convert_sws;
+	AVBufferPool *convert_pool;                 /* buffers of the converted frames, of 'convert_pool_size' bytes */
+	int convert_pool_size;
+	/*
+	 * Every cache stops accepting entries when it holds 'cache_max_bytes' bytes, or when the entries in it
+	 * last 'cache_min_duration' seconds; so the memory is bounded whatever the resolution is, and there is
+	 * enough lookahead whatever the bitrate is. Zero means no such limit. (default: MAX_QUEUE_SIZE/MIN_QUEUE_DURATION)
+	 */
+	int64_t cache_max_bytes;
+	double cache_min_duration;
+
+	/* Recycling pools of the packets and frames in the caches */
+	exAVPacketPool *packet_pool;
+	exAVFramePool *frame_pool;
 
 	/* Point to the opened media file */
 	AVFormatContext *ic;
 
 	/* Flags */
 	int decode_started, play_started, paused;
+	int flags;                  /* MEDIA_FLAG_XXX_FINISHED of the running grabber and decoders */
+	int abort_request;          /* interrupt the blocking I/O of the grabber */
+	pthread_mutex_t mutex;      /* guard 'flags', 'abort_request' and the pacing, signaled on their changes */
+	pthread_cond_t cond;
+
+	/* Headless mode */
+	int headless;               /* set by 'run', the frames of the streams without a sink are dropped */
+	int paced;                  /* deliver the frames at the pace of their timestamps */
+	int64_t pace_start_time;    /* wall clock(av_gettime_relative) of the first delivered frame, AV_NOPTS_VALUE if none */
+	int64_t pace_start_pts;     /* timestamp of the first delivered frame, in AV_TIME_BASE units */
+	int sink_error;             /* first error returned by a sink, reported by 'wait' */
 
 	/* Indexes of those streams opened; valid >= 0  and  invalid < 0 */
 	int video_idx, audio_idx, subtitle_idx;
 
 	/* Threads for decoding this opened media */
 	pthread_t packet_grabber, video_decoder, audio_decoder, subtitle_decoder;
+	exAVPacket *grabber_pending;                /* packet grabbed but not yet accepted by its full cache */
+
+	/* Saving */
+	struct exAVRemuxer *remuxer;                /* the grabbed packets are also sent to it, see 'save_as' */
+	pthread_mutex_t remux_mutex;
+	pthread_cond_t remux_cond;                  /* signaled when the grabber is done with sending a packet */
+	int remux_sending;                          /* the grabber is sending a packet to 'remuxer', without the mutex */
+	exAVPacket *save_pending;                   /* reference not yet accepted by the full remuxer */
+	int grabber_only;                           /* the grabber is started by 'save_as', without decoders */
+	struct exAVTranscoder *transcoder;          /* it takes the decoded frames from the caches, see 'transcode_as' */
+
+	/* Tasks replacing the threads above when decoding on a shared executor */
+	struct exAVExecutor *executor;
+	struct exAVTask *packet_grabber_task, *video_decoder_task, *audio_decoder_task, *subtitle_decoder_task;
 
 	/* Used to seek file */
 	int seek_flags, seek_requested, seek_rel;
 	double seek_step;
+	int64_t seek_target;                        /* target of the last seek in AV_TIME_BASE, AV_NOPTS_VALUE if by bytes */
+	struct exAVKeyIndex *key_index;             /* keyframe index of the main stream, see 'keyindex.h' */
+	AVIOContext *mmap_pb;                       /* the mapped input, see 'mmapio.h', NULL if read by the file protocol */
+	AVIOContext *prefetch_pb;                   /* the input read ahead, see 'prefetch.h' */
+	int probe_cached;                           /* the stream info is from the probe cache, see 'probecache.h' */
+	AVIOContext *user_pb;                       /* the input given by 'ex_av_media_open_buffer/callbacks' */
+	void (*user_pb_close)(AVIOContext **pb);
+	int key_index_contiguous;                   /* the grabber demuxes on from an indexed position */
 
 	/* The start point of this media would be decoded. Uinit: second */
 	double start_time;
@@ -159,19 +352,27 @@ typedef struct exAVMedia {
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_Texture *texture;
+	SDL_Texture *back_texture;             /* shown before 'texture', the next frame is uploaded into it */
+	int texture_stale;                     /* 'vframes.last' is not yet uploaded */
 
 	int muted, volume;
+	exAVVolume audio_volume;               /* ramps to 'volume', or to 0 if 'muted' */
 	int16_t sample_array[SAMPLE_ARRAY_SIZE];
 	int sample_array_index;
 	SDL_AudioDeviceID audio_dev;
 	SDL_AudioSpec audio_spec;
 	int audio_dev_buf_size;
 	int64_t audio_callback_time;
-	int audio_callback_timeout_count;      /* callback_timeout_value = one_callback_time_length /  callback_timeout_count */
 	exAudioParams audio_dev_params, audio_frame_params;
 	uint8_t *audio_buf;                    /* point to audio-frame data which has been re-sampled */
 	uint8_t *audio_cache;                  /* used to re-sample audio frame, should be freed via av_freep when it is no longer used. */
-	size_t audio_buf_size, audio_buf_write_size, audio_buf_index, audio_cache_size;
+	size_t audio_buf_write_size, audio_cache_size;
+	struct exAVPcmRing *audio_ring;        /* re-sampled samples ahead of the audio callback, see 'pcmring.h' */
+	pthread_t audio_renderer;              /* pops, re-samples and writes the audio-frames into 'audio_ring' */
+	int audio_renderer_started, audio_renderer_quit;
+	pthread_mutex_t audio_render_mutex;
+	pthread_cond_t audio_render_cond;      /* signaled by the audio callback once it has read from the full ring */
+	int audio_render_waiting;              /* the renderer waits on 'audio_render_cond' */
 #endif
 
 	/* Context used to convert picture frame */
@@ -197,19 +398,19 @@ typedef struct exAVMedia {
 } exAVMedia;
 
 static inline int ex_av_media_packet_grabber_stopped(exAVMedia *m) {
-	return !!pthread_kill(m->packet_grabber, 0);
+	return !!(m->flags & MEDIA_FLAG_GRABBER_FINISHED);
 }
 
 static inline int ex_av_media_video_decoder_stopped(exAVMedia *m) {
-	return !!pthread_kill(m->video_decoder, 0);
+	return !!(m->flags & MEDIA_FLAG_VIDEO_DECODER_FINISHED);
 }
 
 static inline int ex_av_media_audio_decoder_stopped(exAVMedia *m) {
-	return !!pthread_kill(m->audio_decoder, 0);
+	return !!(m->flags & MEDIA_FLAG_AUDIO_DECODER_FINISHED);
 }
 
 static inline int ex_av_media_subtitle_decoder_stopped(exAVMedia *m) {
-	return !!pthread_kill(m->subtitle_decoder, 0);
+	return !!(m->flags & MEDIA_FLAG_SUBTITLE_DECODER_FINISHED);
 }
 
 
@@ -219,6 +420,12 @@ static inline int ex_av_media_subtitle_decoder_stopped(exAVMedia *m) {
 #define MEDIA_OPEN_NO_VIDEO            MEDIA_FLAG_NO_VIDEO
 #define MEDIA_OPEN_NO_AUDIO            MEDIA_FLAG_NO_AUDIO
 #define MEDIA_OPEN_NO_SUBTITLE         MEDIA_FLAG_NO_SUBTITLE
+#define MEDIA_OPEN_SPSC_QUEUE          MEDIA_FLAG_SPSC_QUEUE    /* use lock-free ring buffers as the caches */
+#define MEDIA_OPEN_KEY_INDEX           MEDIA_FLAG_KEY_INDEX     /* seek by a keyframe index saved in the cache directory */
+#define MEDIA_OPEN_MMAP                MEDIA_FLAG_MMAP          /* read a local file through a memory mapping */
+#define MEDIA_OPEN_PREFETCH            MEDIA_FLAG_PREFETCH      /* read the input ahead in the background, unless mapped */
+#define MEDIA_OPEN_PROBE_CACHE         MEDIA_FLAG_PROBE_CACHE   /* reuse the probe result of the last open of the url */
+#define MEDIA_OPEN_CONVERT             MEDIA_FLAG_CONVERT       /* convert the video frames for the display on a thread ahead of the player */
 /*
  * Open a file located by 'url'.
  * You must free the returned media via its 'put' function.
@@ -226,6 +433,20 @@ static inline int ex_av_media_subtitle_decoder_stopped(exAVMedia *m) {
  */
 extern exAVMedia *ex_av_media_open(const char *url, int flags);
 
+/*
+ * Open a media already in memory: 'data' of 'size' bytes is demuxed in place, it must outlive the media.
+ * Return NULL, if anything wrong.
+ */
+extern exAVMedia *ex_av_media_open_buffer(const uint8_t *data, int64_t size, int flags);
+
+/*
+ * Open a media read by the callbacks of the caller, as those of an AVIOContext; 'seek' could be NULL
+ * if the input is not seekable.
+ * Return NULL, if anything wrong.
+ */
+extern exAVMedia *ex_av_media_open_callbacks(int (*read)(void *opaque, uint8_t *buf, int size),
+		int64_t (*seek)(void *opaque, int64_t offset, int whence), void *opaque, int flags);
+
 /*
  * Allocate a media.
  * Return NULL if failed, otherwise, return the newly allocated media.
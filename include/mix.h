@@ -0,0 +1,70 @@
+/*
+ * mix.h
+ *
+ *  Created on: 2026-10-16 20:41:07
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_MIX_H_
+#define INCLUDE_MIX_H_
+
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+#include <ffmpeg_config.h>
+
+/* Seconds a change of the gain is spread over, so that the volume or muting never clicks */
+#define MIX_RAMP_DURATION 0.005
+/* The gain is clamped into [0, MIX_MAX_GAIN] */
+#define MIX_MAX_GAIN      8.0f
+
+/*
+ * Kernels on interleaved samples, the gain of the sample 'i' is 'gain + i * step'.
+ * 'gain_xxx' writes 'dst = src * gain', 'mix_xxx' writes 'dst = dst + src * gain', both saturated
+ * to the range of the format([-1, 1] for floats).
+ */
+typedef struct exAVMixKernels {
+	const char *name;                   /* "c", "sse2" or "avx2" */
+	void (*gain_s16)(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step);
+	void (*mix_s16)(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step);
+	void (*gain_f32)(float *dst, const float *src, int nb_samples, float gain, float step);
+	void (*mix_f32)(float *dst, const float *src, int nb_samples, float gain, float step);
+} exAVMixKernels;
+
+/*
+ * Gain of a stream of samples, moving linearly to a new one within 'ramp' samples.
+ */
+typedef struct exAVVolume {
+	float gain;                         /* gain of the next sample */
+	float target;
+	float step;                         /* change of the gain per sample while ramping */
+	int remaining;                      /* samples until 'target' is reached */
+	int ramp;
+} exAVVolume;
+
+/*
+ * Get the fastest kernels for the cpu 'flags'(AV_CPU_FLAG_XXX, see 'av_get_cpu_flags').
+ */
+extern void ex_av_mix_get_kernels(int flags, exAVMixKernels *k);
+
+/*
+ * Get the kernels selected for this cpu, once.
+ */
+extern const exAVMixKernels *ex_av_mix_kernels(void);
+
+extern void ex_av_volume_init(exAVVolume *v, float gain, int ramp);
+
+/*
+ * Ramp to 'gain' from the next sample, nothing is done if it is already the target.
+ */
+extern void ex_av_volume_set(exAVVolume *v, float gain);
+
+/*
+ * Apply the gain to 'nb_samples' interleaved samples of 'fmt'(AV_SAMPLE_FMT_S16 or AV_SAMPLE_FMT_FLT),
+ * writing them into 'dst', or adding them to it if 'add' is not 0.
+ * Return 0 if success, or AVERROR(EINVAL) if 'fmt' is not supported.
+ */
+extern int ex_av_volume_apply(exAVVolume *v, uint8_t *dst, const uint8_t *src, int nb_samples, enum AVSampleFormat fmt, int add);
+
+#endif /* INCLUDE_MIX_H_ */
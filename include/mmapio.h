@@ -0,0 +1,109 @@
+/*
+ * mmapio.h
+ *
+ *  Created on: 2026-10-16 18:02:45
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_MMAPIO_H_
+#define INCLUDE_MMAPIO_H_
+
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+#include <ffmpeg_config.h>
+
+/* Size of the buffer of the AVIOContext, every read callback copies so many bytes out of the mapping */
+#define MMAP_IO_BUFFER_SIZE (256 * 1024)
+/* How far ahead of the position the pages are requested, while reading sequentially */
+#define MMAP_IO_READAHEAD   (8 * 1024 * 1024)
+
+/* Access patterns of a mapped file */
+#define MMAP_IO_SEQUENTIAL  0
+#define MMAP_IO_RANDOM      1
+
+/*
+ * A local file mapped into memory as a whole, read-only, or a memory region of the caller read the same way.
+ */
+typedef struct exAVMappedFile {
+	const uint8_t *data;
+	int64_t size;
+	int64_t pos;                        /* position of the AVIOContext reading it */
+	int64_t readahead_end;              /* the pages before it have been requested */
+	int advice;                         /* MMAP_IO_XXX */
+	void *file, *mapping;               /* handles of the file and its mapping on Windows */
+	int fd;                             /* the file on the other systems, kept to check its size */
+	int mapped;                         /* 0 if the memory belongs to the caller */
+} exAVMappedFile;
+
+/*
+ * Get the size and the modification time(seconds since the epoch) of the local file 'url'(a path, or a "file:"
+ * url, in UTF-8 on Windows too).
+ * Return AVERROR(ENOSYS) if 'url' is not handled by the file protocol, otherwise, return 0 if success,
+ * or a negative error code.
+ */
+extern int ex_av_file_stat(const char *url, int64_t *size, int64_t *mtime);
+
+/*
+ * Create the directory 'path'(in UTF-8 on Windows too) and its missing parents.
+ * Return 0 if success or it exists, otherwise, return a negative error code.
+ */
+extern int ex_av_file_make_dirs(const char *path);
+
+/*
+ * Get the cache directory of the user: %LOCALAPPDATA% on Windows, $XDG_CACHE_HOME or ~/.cache otherwise.
+ * Return 0 if success, free '*dir' by 'av_free', otherwise, return a negative error code.
+ */
+extern int ex_av_file_cache_dir(char **dir);
+
+/*
+ * Map the local file 'url'(a path, or a "file:" url).
+ * Return AVERROR(ENOSYS) if the platform or the protocol of 'url' does not support it,
+ * otherwise, return 0 if success, or a negative error code.
+ */
+extern int ex_av_file_map(exAVMappedFile **mf, const char *url);
+
+/*
+ * Tell the system how the mapping is going to be read(MMAP_IO_XXX).
+ */
+extern void ex_av_file_advise(exAVMappedFile *mf, int advice);
+
+/*
+ * Request the pages of the next read-ahead window, if the mapping is read sequentially up to 'pos'.
+ */
+extern void ex_av_file_readahead(exAVMappedFile *mf, int64_t pos);
+
+/*
+ * Return how many bytes of the mapping could be read now: its size, or less if the file has been truncated
+ * since it was mapped(the pages beyond the end are gone, reading them raises SIGBUS). Check it right before
+ * reading a bounded chunk.
+ */
+extern int64_t ex_av_file_readable_size(exAVMappedFile *mf);
+
+extern void ex_av_file_unmap(exAVMappedFile **mf);
+
+/*
+ * Open a read-only, seekable AVIOContext on the mapping of the local file 'url', to be set as the 'pb'
+ * of an AVFormatContext with AVFMT_FLAG_CUSTOM_IO. The packets are copied straight out of the mapping
+ * instead of through the small buffered reads of the file protocol.
+ * Return AVERROR(ENOSYS) if not supported(see 'ex_av_file_map'), otherwise, return 0 if success,
+ * or a negative error code.
+ */
+extern int ex_av_mmap_io_open(AVIOContext **pb, const char *url);
+
+/*
+ * Open a read-only, seekable AVIOContext on the memory region 'data' of 'size' bytes, which must outlive it.
+ * The region is read in place, never copied as a whole; close it by 'ex_av_mmap_io_close'.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_memory_io_open(AVIOContext **pb, const uint8_t *data, int64_t size);
+
+/*
+ * Switch the access pattern of a context opened by 'ex_av_mmap_io_open', e.g. random while seeking.
+ */
+extern void ex_av_mmap_io_advise(AVIOContext *pb, int advice);
+
+extern void ex_av_mmap_io_close(AVIOContext **pb);
+
+#endif /* INCLUDE_MMAPIO_H_ */
@@ -11,6 +11,7 @@
 #include <pthread.h>
 
 #include <libavcodec/packet.h>
+#include <libavcodec/codec_par.h>
 
 /*
  *  AVPacket wrapper. You must use 'ex_av_packet_alloc' to create a new packet,
@@ -21,6 +22,7 @@ typedef struct exAVPacket {
 	struct list_head list;
 	pthread_rwlock_t rwlock;
 	atomic_t refcount;
+	struct exAVPacketPool *pool;      /* the pool it is allocated from, NULL if it is allocated by 'ex_av_packet_alloc' */
 
 	struct exAVPacket *(*get)(struct exAVPacket *self);
 	void (*put)(struct exAVPacket *self);
@@ -38,4 +40,49 @@ extern exAVPacket *ex_av_packet_alloc(size_t size);
  */
 extern void ex_av_packet_free_list_entry(struct list_head *n);
 
+/*
+ * Recycling pool of packets of the same size. When the last reference of a packet allocated
+ * from a pool is 'put', only its payload is released; the packet(with its AVPacket and rwlock)
+ * is kept in the pool and handed out again by the next 'ex_av_packet_pool_alloc'.
+ * It could be shared by several threads.
+ */
+typedef struct exAVPacketPool {
+	size_t size;                      /* size of every packet */
+	exAVPacket **packets;             /* released packets ready to be reused */
+	int nb_packets, max_packets;
+	int refcount;                     /* one for the pool itself, plus one for every packet in use */
+	int closed;
+	pthread_mutex_t mutex;
+
+	/* Statistics */
+	int64_t nb_allocs;                /* how many packets allocated from the heap */
+	int64_t nb_reuses;                /* how many packets reused from the pool */
+} exAVPacketPool;
+
+/*
+ * Create a pool of packets of 'size'(see 'ex_av_packet_alloc'), which keeps at most 'max_packets'
+ * released packets. Return NULL if failed.
+ */
+extern exAVPacketPool *ex_av_packet_pool_create(size_t size, int max_packets);
+
+/*
+ * Allocate a packet from the pool, free it via its 'put' function as usual.
+ * The fields following 'exAVPacket' in the packet of 'size' are zeroed.
+ * Return NULL if failed.
+ */
+extern exAVPacket *ex_av_packet_pool_alloc(exAVPacketPool *pool);
+
+/*
+ * Free the pool. The packets still in use are freed when they are released.
+ */
+extern void ex_av_packet_pool_free(exAVPacketPool **pool);
+
+/*
+ * Whether the decoding of the stream 'par' could restart from the packet, as if the codec is just opened,
+ * without losing any frame. The keyframes of the codecs reordering frames could open a GOP; only the IDR
+ * pictures of H.264/HEVC(in avcC/hvcC or Annex B) are known not to, the keyframes of the other such codecs
+ * are never taken.
+ */
+extern int ex_av_packet_is_closed_gop(const AVCodecParameters *par, const AVPacket *pkt);
+
 #endif /* INCLUDE_PACKET_H_ */
@@ -0,0 +1,88 @@
+/*
+ * pcmring.h
+ *
+ *  Created on: 2026-10-16 20:08:33
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_PCMRING_H_
+#define INCLUDE_PCMRING_H_
+
+#include <stdint.h>
+
+#include <queue.h>
+
+/* Chunks the ring could hold at once, a power of 2 */
+#define PCM_RING_MAX_CHUNKS 256
+
+/*
+ * Samples written at once, with the audio clock at their end.
+ */
+typedef struct exAVPcmChunk {
+	uint64_t end;                       /* position just after the chunk in the stream of bytes */
+	double clock;                       /* audio clock at 'end', NAN if unknown */
+	int serial;
+} exAVPcmChunk;
+
+/*
+ * Lock-free ring buffer of PCM bytes in the format of the audio device, with exactly one producer thread
+ * (the audio renderer) and one consumer thread (the audio callback), which never waits nor allocates.
+ * The positions only grow; 'write_pos' is only written by the producer and 'read_pos' only by the consumer,
+ * they are kept on different cache lines.
+ */
+typedef struct exAVPcmRing {
+	uint64_t write_pos;
+	unsigned int chunk_tail;
+	char pad0[QUEUE_CACHE_LINE_SIZE - sizeof(uint64_t) - sizeof(unsigned int)];
+	uint64_t read_pos;
+	unsigned int chunk_head;
+	char pad1[QUEUE_CACHE_LINE_SIZE - sizeof(uint64_t) - sizeof(unsigned int)];
+	exAVPcmChunk current;               /* the chunk being read, or the last one read */
+	uint8_t *data;
+	unsigned int size, mask;
+	exAVPcmChunk chunks[PCM_RING_MAX_CHUNKS];
+} exAVPcmRing;
+
+/*
+ * Allocate a ring of at least 'size' bytes, rounded up to a power of 2.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_pcm_ring_alloc(exAVPcmRing **r, int size);
+
+extern void ex_av_pcm_ring_free(exAVPcmRing **r);
+
+/*
+ * Return the size of the ring in bytes.
+ */
+extern int ex_av_pcm_ring_size(exAVPcmRing *r);
+
+/*
+ * Producer: append 'size' bytes as a chunk ending at the audio clock 'clock' of 'serial'.
+ * Return 0 if success, or AVERROR(EAGAIN) if there is not enough free space, nothing is written then.
+ */
+extern int ex_av_pcm_ring_write(exAVPcmRing *r, const uint8_t *data, int size, double clock, int serial);
+
+/*
+ * Consumer: drop the chunks not of 'serial', written before seeking; the position is unknown until a chunk
+ * of 'serial' is read, if none is written yet.
+ */
+extern void ex_av_pcm_ring_drop_stale(exAVPcmRing *r, int serial);
+
+/*
+ * Consumer: point '*data' to the contiguous bytes at the read position, at most 'size'.
+ * Return how many bytes, 0 if the ring is empty.
+ */
+extern int ex_av_pcm_ring_peek(exAVPcmRing *r, const uint8_t **data, int size);
+
+/*
+ * Consumer: release 'size' bytes peeked.
+ */
+extern void ex_av_pcm_ring_advance(exAVPcmRing *r, int size);
+
+/*
+ * Consumer: get the chunk being read, and the bytes of it not yet read in '*pending'.
+ * Return 0, or AVERROR(EAGAIN) if nothing has ever been read.
+ */
+extern int ex_av_pcm_ring_position(exAVPcmRing *r, exAVPcmChunk *chunk, int *pending);
+
+#endif /* INCLUDE_PCMRING_H_ */
@@ -0,0 +1,131 @@
+/*
+ * prefetch.h
+ *
+ *  Created on: 2026-10-16 18:31:44
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_PREFETCH_H_
+#define INCLUDE_PREFETCH_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libavformat/avio.h>
+
+#include <ffmpeg_config.h>
+
+/*
+ * Local files are read through io_uring where liburing is found(Linux, link with -luring), otherwise threads
+ * read ahead. Define HAVE_LIBURING to 0 or 1 to override the detection.
+ */
+#ifndef HAVE_LIBURING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<liburing.h>)
+#define HAVE_LIBURING 1
+#endif
+#endif
+#endif
+#ifndef HAVE_LIBURING
+#define HAVE_LIBURING 0
+#endif
+
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define PREFETCH_BLOCK_SIZE    (1024 * 1024)
+#define PREFETCH_DEFAULT_DEPTH 8
+#define PREFETCH_MAX_DEPTH     64
+#define PREFETCH_MAX_READERS   4            /* threads of the thread backend, each one with its own connection */
+
+enum {
+	PREFETCH_BACKEND_THREAD,            /* up to PREFETCH_MAX_READERS threads read a block each, through any protocol */
+	PREFETCH_BACKEND_URING,             /* all the blocks are read at once by io_uring, local files only */
+};
+
+enum {
+	PREFETCH_BLOCK_EMPTY,
+	PREFETCH_BLOCK_PENDING,             /* being read */
+	PREFETCH_BLOCK_STALE,               /* being read, but dropped by a seek */
+	PREFETCH_BLOCK_READY,
+	PREFETCH_BLOCK_ERROR,
+};
+
+typedef struct exAVPrefetchBlock {
+	uint8_t *data;
+	int64_t pos;                        /* position of the block in the file */
+	int size;                           /* bytes read, smaller than PREFETCH_BLOCK_SIZE at the end of the file */
+	int state;
+	int error;
+} exAVPrefetchBlock;
+
+struct exAVPrefetcher;
+
+typedef struct exAVPrefetchReader {
+	struct exAVPrefetcher *p;
+	AVIOContext *src;
+	pthread_t thread;
+} exAVPrefetchReader;
+
+typedef struct exAVPrefetchStats {
+	int backend;
+	int depth;                          /* how many blocks read ahead */
+	int max_in_flight;                  /* how many blocks read at once at most */
+	int64_t nb_reads;                   /* how many blocks read */
+	int64_t nb_bytes;
+	int64_t nb_stalls;                  /* how many times the demuxer waited for a block */
+	int64_t stall_time;                 /* microseconds the demuxer waited */
+} exAVPrefetchStats;
+
+/*
+ * Read-ahead of a file through a ring of 'depth' blocks: the blocks after the position of the demuxer are
+ * read in the background, and consumed by the read callback of an AVIOContext; the blocks are read again
+ * from the new position if the demuxer seeks out of them.
+ */
+typedef struct exAVPrefetcher {
+	exAVPrefetchBlock *blocks;
+	int depth;
+	int head;                           /* block being consumed */
+	int tail;                           /* next block to be read */
+	int nb_assigned;                    /* blocks from 'head' to 'tail' */
+	int64_t read_pos;                   /* position of the demuxer */
+	int64_t next_pos;                   /* position of the next block to be read */
+	int64_t size;                       /* size of the file, <= 0 if unknown */
+	int eof;                            /* a block has reached the end of the file */
+	AVIOInterruptCB int_cb;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;                /* signaled when a block is read or consumed */
+	int quit;
+
+	int backend;                        /* PREFETCH_BACKEND_XXX */
+	exAVPrefetchReader readers[PREFETCH_MAX_READERS];    /* thread backend */
+	int nb_readers;
+#if HAVE_LIBURING
+	pthread_t thread;                   /* io_uring backend */
+	struct io_uring ring;
+	int fd;
+	int efd;                            /* written when a block is released, polled by the ring */
+	int wake_armed;                     /* the poll of 'efd' is in flight */
+#endif
+
+	exAVPrefetchStats stats;
+} exAVPrefetcher;
+
+/*
+ * Open a read-only, seekable AVIOContext reading 'url' ahead by 'depth' blocks(PREFETCH_DEFAULT_DEPTH if <= 0)
+ * in the background, to be set as the 'pb' of an AVFormatContext with AVFMT_FLAG_CUSTOM_IO. The read callback
+ * waits when the block it needs is not yet read, checking 'int_cb'(could be NULL) meanwhile.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_prefetch_io_open(AVIOContext **pb, const char *url, int depth, const AVIOInterruptCB *int_cb);
+
+/*
+ * Get the statistics of a context opened by 'ex_av_prefetch_io_open'.
+ */
+extern void ex_av_prefetch_io_stats(AVIOContext *pb, exAVPrefetchStats *stats);
+
+extern void ex_av_prefetch_io_close(AVIOContext **pb);
+
+#endif /* INCLUDE_PREFETCH_H_ */
@@ -0,0 +1,86 @@
+/*
+ * probecache.h
+ *
+ *  Created on: 2026-10-16 19:02:17
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_PROBECACHE_H_
+#define INCLUDE_PROBECACHE_H_
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#define PROBE_CACHE_DEFAULT_CAPACITY 64
+
+/* What 'avformat_find_stream_info' found out about a stream */
+typedef struct exAVProbeStream {
+	AVCodecParameters *codecpar;
+	AVRational time_base;
+	AVRational avg_frame_rate, r_frame_rate;
+	int64_t start_time, duration;
+} exAVProbeStream;
+
+/*
+ * Probe result of a media: its format and stream layout, keyed by its url. The size and the
+ * modification time of a local file are its fingerprint, a changed file misses the cache.
+ */
+typedef struct exAVProbeEntry {
+	char *url;
+	int64_t size, mtime;                /* -1 if not a local file */
+	const AVInputFormat *iformat;
+	exAVProbeStream *streams;
+	int nb_streams;
+	int64_t start_time, duration, bit_rate;
+	uint64_t last_used;                 /* the least recently used entry is evicted first */
+} exAVProbeEntry;
+
+/*
+ * Process-wide cache of the probe results of the media opened again and again, so that they could be
+ * opened without 'avformat_find_stream_info', which decodes frames and reads megabytes of the media:
+ *
+ *     iformat = ex_av_probe_cache_format(url);
+ *     avformat_open_input(&ic, url, iformat, NULL);
+ *     if (ex_av_probe_cache_apply(ic, url) < 0 && avformat_find_stream_info(ic, NULL) >= 0)
+ *         ex_av_probe_cache_store(ic, url);
+ */
+
+/*
+ * Set the maximum number of entries of the cache, PROBE_CACHE_DEFAULT_CAPACITY if <= 0.
+ */
+extern void ex_av_probe_cache_set_capacity(int capacity);
+
+/*
+ * Return the input format of the local file 'url' cached, to skip probing the format, or NULL if missed.
+ */
+extern const AVInputFormat *ex_av_probe_cache_format(const char *url);
+
+/*
+ * Fill the streams of 'ic' just opened from 'url' by the result cached, if it is of the format cached and
+ * the streams demuxed so far are the first ones cached; a cached result not matching is dropped. A demuxer
+ * without header(AVFMTCTX_NOHEADER) adds its streams while reading, the ones not yet added are left to
+ * 'avformat_find_stream_info', which is quicker with the others filled.
+ * Return 0 if filled, AVERROR(EAGAIN) if only some streams are filled, otherwise, return a negative error
+ * code; 'avformat_find_stream_info' is still needed unless 0 is returned.
+ */
+extern int ex_av_probe_cache_apply(AVFormatContext *ic, const char *url);
+
+/*
+ * Check a frame decoded from the stream 'stream_index' of 'url' against the result cached, if any; a cached
+ * result which disagrees is dropped, so that the media is probed again at its next open.
+ * Return 0 if it agrees or nothing is cached, otherwise, return AVERROR_INVALIDDATA.
+ */
+extern int ex_av_probe_cache_verify(const char *url, int stream_index, const AVFrame *frame);
+
+/*
+ * Cache the probe result of 'ic' opened from 'url', after 'avformat_find_stream_info'.
+ */
+extern void ex_av_probe_cache_store(AVFormatContext *ic, const char *url);
+
+/*
+ * Drop the result of 'url', or all of them if 'url' is NULL.
+ */
+extern void ex_av_probe_cache_remove(const char *url);
+
+#endif /* INCLUDE_PROBECACHE_H_ */
@@ -0,0 +1,203 @@
+/*
+ * queue.h
+ *
+ *  Created on: 2026-10-16 09:12:41
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_QUEUE_H_
+#define INCLUDE_QUEUE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libavutil/rational.h>
+
+#include <list.h>
+
+#define QUEUE_LIST    0    /* linked list guarded by the mutex, any number of producers and consumers */
+#define QUEUE_SPSC    1    /* lock-free ring buffer, exactly one producer thread and one consumer thread */
+
+#define QUEUE_CACHE_LINE_SIZE 64
+
+/* A queue always accepts this many entries, whatever its byte and duration limits are */
+#define QUEUE_MIN_ENTRIES 3
+
+/*
+ * Counters of a queue, see 'ex_av_queue_get_stats'.
+ */
+typedef struct exAVQueueStats {
+	int size;                           /* entries in the queue */
+	int high_water;                     /* most entries ever held at once */
+	int64_t bytes, duration;            /* see 'ex_av_queue_bytes/duration' */
+	int64_t nb_pushed, nb_popped;
+	int64_t nb_flushed;                 /* entries released by 'ex_av_queue_flush' */
+	/*
+	 * Microseconds the producer was blocked on the full queue, and the consumer on the empty one. A task
+	 * parked on the queue(see 'ex_av_queue_set_wakers') is blocked from its first failed attempt to its
+	 * next success; a side polling the queue without a waker is not accounted.
+	 */
+	int64_t push_wait, pop_wait;
+} exAVQueueStats;
+
+/*
+ * Blocking bounded queue of 'struct list_head' entries (the 'list' member of
+ * exAVPacket/exAVFrame). A producer blocks while the queue is full and a
+ * consumer blocks while it is empty; both are woken as soon as the other side
+ * makes progress, or when the queue is aborted.
+ *
+ * With the QUEUE_SPSC backend, push must always be called from the same thread, and
+ * pop/peek from another single thread; the mutex is only taken when one side has to sleep.
+ * A flush could be requested from any thread, it is then deferred: the flushed entries are
+ * released by the consumer itself on its next pop/peek.
+ *
+ * A flush releases all the entries, the peeked ones included: a consumer still using an entry after
+ * its peek takes a reference by 'ex_av_queue_peek_ref', and pops it by 'ex_av_queue_pop_entry'.
+ *
+ * All the 'timeout' arguments are in microseconds:
+ *   timeout < 0  : wait until the operation can be done or the queue is aborted;
+ *   timeout == 0 : do not wait at all;
+ *   timeout > 0  : wait at most 'timeout' microseconds.
+ */
+typedef struct exAVQueue {
+	int type;
+	struct list_head entries;           /* QUEUE_LIST backend, guarded by 'mutex' */
+	int count;
+	struct exAVRing *ring;              /* QUEUE_SPSC backend */
+	void (*free_entry)(struct list_head *);
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waiters;                        /* how many threads are sleeping on 'cond' */
+	int capacity;
+
+	/* Accounting of the entries, see 'ex_av_queue_set_measure' and 'ex_av_queue_set_limits' */
+	void (*measure)(struct exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration);
+	AVRational time_base;               /* time base of the timestamps carried by the entries */
+	int64_t bytes;                      /* total size of the entries */
+	int64_t duration;                   /* total duration of the entries, in AV_TIME_BASE units */
+	int64_t max_bytes, min_duration;
+
+	int abort_request;     /* set by 'ex_av_queue_abort', all waiters return AVERROR_EXIT */
+	int finished;          /* set by 'ex_av_queue_finish', the producer will not push any more */
+
+	/* Wakers of the sides which never sleep on 'cond', see 'ex_av_queue_set_wakers' */
+	void (*wake)(void *opaque);
+	void *producer, *consumer;
+	int notifying;                      /* calls of 'wake' in progress */
+
+	/* Statistics, only updated by atomic operations */
+	int high_water;
+	int64_t nb_pushed, nb_popped, nb_flushed;
+	int64_t push_wait, pop_wait;
+	int64_t push_parked, pop_parked;    /* when a parked side failed, 0 if it has succeeded since; atomic */
+} exAVQueue;
+
+/*
+ * Initialize a queue of 'type'(QUEUE_LIST or QUEUE_SPSC) which can hold at most 'capacity' entries.
+ * The capacity of a QUEUE_SPSC queue is rounded up to a power of 2.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_queue_init(exAVQueue *q, int type, int capacity);
+
+/*
+ * Account every entry by 'measure', which returns its size in bytes and its duration in AV_TIME_BASE
+ * units; 'time_base' is the time base of the timestamps carried by the entries, used by 'measure'.
+ * It must be called before any entry is inserted.
+ */
+extern void ex_av_queue_set_measure(exAVQueue *q,
+                                    void (*measure)(exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration),
+                                    AVRational time_base);
+
+/*
+ * Limit the queue by the measured entries(see 'ex_av_queue_set_measure'): it is full when it holds
+ * 'max_bytes' bytes, or when enough entries are buffered to last 'min_duration'(AV_TIME_BASE units);
+ * but it always accepts QUEUE_MIN_ENTRIES entries. A zero value means no such limit.
+ * The 'capacity' given to 'ex_av_queue_init' is always a hard limit of the number of entries.
+ */
+extern void ex_av_queue_set_limits(exAVQueue *q, int64_t max_bytes, int64_t min_duration);
+
+/*
+ * Let the queue call 'wake(producer)' whenever an entry may be pushed again, and 'wake(consumer)'
+ * whenever an entry may be popped; also both on abort and finish. It is meant for tasks on an executor
+ * which only push/pop with a zero timeout and park instead of sleeping. NULL means that side sleeps as usual.
+ * It must be set while neither side is running; but the wakers could be cleared(wake NULL) at any time,
+ * once it returns, no 'wake' is called any more, so the tasks could be freed.
+ */
+extern void ex_av_queue_set_wakers(exAVQueue *q, void (*wake)(void *opaque), void *producer, void *consumer);
+
+/*
+ * Return the total size in bytes, or the total duration in AV_TIME_BASE units, of the entries in the queue.
+ */
+extern int64_t ex_av_queue_bytes(exAVQueue *q);
+extern int64_t ex_av_queue_duration(exAVQueue *q);
+
+/*
+ * Take a snapshot of the counters of the queue, without taking its locks; it could be called from any
+ * thread. The counters are read one by one, so they may be slightly inconsistent with each other.
+ */
+extern void ex_av_queue_get_stats(exAVQueue *q, exAVQueueStats *stats);
+
+/*
+ * Release all the entries via 'free_entry' and destroy the queue.
+ */
+extern void ex_av_queue_destroy(exAVQueue *q, void (*free_entry)(struct list_head *));
+
+/*
+ * Append 'n' at the tail of the queue, waiting for free space if it is full.
+ * Return 0 if success, AVERROR(EAGAIN) if timeout, or AVERROR_EXIT if the queue is aborted.
+ * The caller still owns 'n' if it failed.
+ */
+extern int ex_av_queue_push(exAVQueue *q, struct list_head *n, int64_t timeout);
+
+/*
+ * Remove the head of the queue and return it in '*n', waiting for an entry if it is empty.
+ * Return 0 if success, AVERROR(EAGAIN) if timeout, AVERROR_EXIT if the queue is aborted,
+ * or AVERROR_EOF if the queue is empty and finished.
+ */
+extern int ex_av_queue_pop(exAVQueue *q, struct list_head **n, int64_t timeout);
+
+/*
+ * Return the 'idx'th entry (0 is the head) without removing it, or NULL if there is no such entry.
+ * It costs O(1) for a QUEUE_SPSC queue, and it must be called from the consumer thread.
+ */
+extern struct list_head *ex_av_queue_peek(exAVQueue *q, int idx);
+
+/*
+ * Same as 'ex_av_queue_peek', and 'ref' is called on the entry before any flush could release it,
+ * so that the consumer could still use it afterwards.
+ */
+extern struct list_head *ex_av_queue_peek_ref(exAVQueue *q, int idx, void (*ref)(struct list_head *));
+
+/*
+ * Remove the head of the queue if it is still 'n', an entry returned by a peek; it must be called from
+ * the consumer thread. Return 0 if success, or AVERROR(EAGAIN) if a flush has released 'n' since then.
+ */
+extern int ex_av_queue_pop_entry(exAVQueue *q, struct list_head *n);
+
+/*
+ * Return how many entries in the queue.
+ */
+extern int ex_av_queue_size(exAVQueue *q);
+
+/*
+ * Release all the entries via 'free_entry', and wake up the producer waiting for free space.
+ */
+extern void ex_av_queue_flush(exAVQueue *q, void (*free_entry)(struct list_head *));
+
+/*
+ * Wake up all the waiters and make all the following push/pop operations fail with AVERROR_EXIT,
+ * until 'ex_av_queue_start' is called.
+ */
+extern void ex_av_queue_abort(exAVQueue *q);
+
+/*
+ * Mark the queue as finished: once it is drained, 'ex_av_queue_pop' returns AVERROR_EOF.
+ */
+extern void ex_av_queue_finish(exAVQueue *q);
+
+/*
+ * Clear the aborted and finished state of the queue.
+ */
+extern void ex_av_queue_start(exAVQueue *q);
+
+#endif /* INCLUDE_QUEUE_H_ */
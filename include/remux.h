@@ -0,0 +1,92 @@
+/*
+ * remux.h
+ *
+ *  Created on: 2026-10-16 15:20:46
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_REMUX_H_
+#define INCLUDE_REMUX_H_
+
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/bsf.h>
+
+#include <list.h>
+#include <atomic.h>
+
+#include <packet.h>
+#include <queue.h>
+
+#define REMUX_QUEUE_SIZE 4096
+
+/*
+ * Stream-copy remuxer: the packets of some streams of an input are written into an output file
+ * without being decoded, on a thread of its own. The timestamps are shifted to start at zero
+ * (a stream starting earlier is shifted by the muxer to be non-negative) and rescaled into the
+ * time bases of the output streams, and the bitstream filters needed by the output container
+ * are applied(e.g. h264_mp4toannexb, aac_adtstoasc).
+ */
+typedef struct exAVRemuxer {
+	AVFormatContext *ic;                /* the input, whose streams are copied */
+	AVFormatContext *oc;
+	int *stream_map;                    /* output stream index of every input stream, -1 if not saved */
+	int nb_input_streams;               /* number of the entries of 'stream_map' */
+	AVBSFContext **bsfs;                /* bitstream filter of every output stream, NULL if none */
+	int *wait_keyframe;                 /* drop the packets of every output stream until its first keyframe */
+	int64_t start_dts;                  /* the first timestamp written, in AV_TIME_BASE units */
+	exAVQueue queue;
+	pthread_t thread;
+	int thread_started;
+	int result;                         /* 0 or the first error of the thread */
+	int discard;                        /* aborted, the output is removed when it is closed */
+
+	/* Statistics */
+	int64_t nb_packets, nb_bytes;
+} exAVRemuxer;
+
+/*
+ * Create a remuxer saving the streams 'stream_indexes' of 'ic' into 'url', write the header,
+ * and start its thread. 'ic' must outlive the remuxer.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_remuxer_create(exAVRemuxer **r, AVFormatContext *ic, const char *url, const int *stream_indexes, int nb_streams);
+
+/*
+ * Queue a packet of the input to be written, waiting at most 'timeout' microseconds(see 'ex_av_queue_push')
+ * if the queue is full; the remuxer takes the ownership of it unless AVERROR(EAGAIN) is returned.
+ * The packets of the streams not saved are simply released.
+ * Return 0 if success, AVERROR(EAGAIN) if timeout, otherwise, return a negative error code(AVERROR_EXIT if aborted).
+ */
+extern int ex_av_remuxer_send(exAVRemuxer *r, exAVPacket *pkt, int64_t timeout);
+
+/*
+ * Call 'wake(opaque)' whenever a packet could be sent again after AVERROR(EAGAIN), for a sender
+ * which never blocks(see 'ex_av_queue_set_wakers'); NULL clears it.
+ */
+extern void ex_av_remuxer_set_waker(exAVRemuxer *r, void (*wake)(void *opaque), void *opaque);
+
+/*
+ * Tell the remuxer that there are no more packets; it writes the queued ones and the trailer.
+ */
+extern void ex_av_remuxer_finish(exAVRemuxer *r);
+
+/*
+ * Stop the remuxer as soon as possible, the queued packets are dropped, the trailer is not written
+ * and the output file is removed when the remuxer is freed.
+ */
+extern void ex_av_remuxer_abort(exAVRemuxer *r);
+
+/*
+ * Wait until the thread of the remuxer exits, after it is finished or aborted.
+ * Return 0 if the output is complete, AVERROR_EXIT if aborted, otherwise, return a negative error code.
+ */
+extern int ex_av_remuxer_wait(exAVRemuxer *r);
+
+/*
+ * Abort the remuxer if it is still running, close the output and free the remuxer.
+ */
+extern void ex_av_remuxer_free(exAVRemuxer **r);
+
+#endif /* INCLUDE_REMUX_H_ */
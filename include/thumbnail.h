@@ -0,0 +1,57 @@
+/*
+ * thumbnail.h
+ *
+ *  Created on: 2026-10-16 17:31:08
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_THUMBNAIL_H_
+#define INCLUDE_THUMBNAIL_H_
+
+#include <list.h>
+#include <atomic.h>
+
+#include <frame.h>
+
+#define THUMBNAIL_DEFAULT_WIDTH 320
+#define THUMBNAIL_MAX_WORKERS   16
+
+/*
+ * Extract 'nb' thumbnails of the video of 'url', at 'timestamps'(in seconds from the start of the media),
+ * or evenly spaced over the whole media if 'timestamps' is NULL. Every thumbnail is the keyframe nearest
+ * before its timestamp: only the keyframes are demuxed and decoded, and they are scaled straight to
+ * 'width'x'height'(YUV420P); if one of them is <= 0, it is computed from the other keeping the display
+ * aspect ratio, and if both are, the width is THUMBNAIL_DEFAULT_WIDTH.
+ * The timestamps are shared among 'nb_workers' threads(one per CPU if <= 0), each of them opening the media
+ * by itself; the first one goes on with the media opened for the duration.
+ * 'thumbnails' receives the 'nb' frames, a slot is NULL if its thumbnail could not be extracted; you must
+ * free them via their 'put' function.
+ * Return how many thumbnails extracted, otherwise, return a negative error code.
+ */
+extern int ex_av_thumbnails_extract(const char *url, const double *timestamps, int nb, int width, int height,
+		int nb_workers, exAVFrame **thumbnails);
+
+/*
+ * Same as 'ex_av_thumbnails_extract', but save the thumbnails as pictures named by 'pattern', where "%d"
+ * (or "%03d" and so on) is replaced by the index of the thumbnail, e.g. "thumb-%03d.jpg".
+ * Return how many thumbnails saved, otherwise, return a negative error code.
+ */
+extern int ex_av_thumbnails_save(const char *url, const double *timestamps, int nb, int width, int height,
+		int nb_workers, const char *pattern);
+
+/*
+ * Compose a contact sheet of the video of 'url': a grid of 'cols'x'rows' thumbnails evenly spaced over the
+ * media, every tile of 'width'x'height'(see 'ex_av_thumbnails_extract'). Each tile is decoded once, at reduced
+ * resolution if the codec supports it, and scaled straight into the sheet allocated once; the tiles failed
+ * are black.
+ * Return the sheet(YUV420P) if success, you must free it via 'av_frame_free'; otherwise, return NULL.
+ */
+extern AVFrame *ex_av_contact_sheet_create(const char *url, int cols, int rows, int width, int height, int nb_workers);
+
+/*
+ * Same as 'ex_av_contact_sheet_create', but encode the sheet once into the picture 'out'(see 'av_frame_save').
+ * Return 0 if success, otherwise, return a negative error code, the last one met if no tile could be extracted.
+ */
+extern int ex_av_contact_sheet_save(const char *url, int cols, int rows, int width, int height, int nb_workers, const char *out);
+
+#endif /* INCLUDE_THUMBNAIL_H_ */
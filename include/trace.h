@@ -0,0 +1,104 @@
+/*
+ * trace.h
+ *
+ *  Created on: 2026-10-16 19:31:08
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_TRACE_H_
+#define INCLUDE_TRACE_H_
+
+#include <stdint.h>
+
+#include <libavutil/time.h>
+
+/* Spans kept per thread, the later ones are lost once it is full */
+#define TRACE_DEFAULT_CAPACITY (64 * 1024)
+
+typedef struct exAVTraceEvent {
+	const char *name;                   /* a string literal */
+	int64_t ts, dur;                    /* microseconds, av_gettime_relative */
+	int stream, serial;                 /* -1 if none */
+	int64_t pts;                        /* in the time base of the stream, AV_NOPTS_VALUE if none */
+} exAVTraceEvent;
+
+/*
+ * Spans recorded by a thread: only the thread writes them, publishing 'count' once a span is complete,
+ * so they could be dumped at any time without a lock. The buffer of an exited thread is reused by a new
+ * thread once the tracing is restarted. A thread is traced once it has a buffer: given by
+ * 'ex_av_trace_thread_name', or by 'ex_av_trace_start' to the thread calling it; its spans are allocated
+ * there, never while recording, and kept until 'ex_av_trace_free'.
+ */
+typedef struct exAVTraceBuffer {
+	struct exAVTraceBuffer *next;
+	exAVTraceEvent *events;
+	int capacity;
+	int count;
+	int64_t nb_lost;
+	unsigned int generation;            /* the spans belong to the tracing started as this generation */
+	int in_use;                         /* owned by a running thread */
+	int tid;
+	char name[32];
+} exAVTraceBuffer;
+
+extern int ex_av_trace_enabled;
+
+/*
+ * Start recording spans, at most 'capacity' per thread(TRACE_DEFAULT_CAPACITY if <= 0, a running thread
+ * keeps the capacity it was given); the spans of the last tracing are dropped. It must not be called while
+ * 'ex_av_trace_dump' is running.
+ */
+extern void ex_av_trace_start(int capacity);
+
+extern void ex_av_trace_stop(void);
+
+/*
+ * Stop tracing and free all the buffers, at shutdown: no other traced thread may be running.
+ */
+extern void ex_av_trace_free(void);
+
+/*
+ * Write the spans of the current tracing into 'path', as a Chrome trace-event JSON file which could be
+ * opened by Perfetto or chrome://tracing; it could be called while tracing.
+ * Return 0 if success, otherwise, return a negative error code.
+ */
+extern int ex_av_trace_dump(const char *path);
+
+/*
+ * Collect the durations(microseconds) of the spans named 'name' of the current tracing which carry a
+ * packet or a frame(their pts is set), into '*durations' to be freed by 'av_free'.
+ * Return the number of durations, or a negative error code.
+ */
+extern int ex_av_trace_collect(const char *name, int64_t **durations);
+
+/*
+ * Name the calling thread in the trace, and trace it: its buffer is allocated here if tracing, otherwise
+ * by the next 'ex_av_trace_start'. The threads never named are not traced.
+ */
+extern void ex_av_trace_thread_name(const char *name);
+
+/*
+ * Record a span of the calling thread from 'start' to now.
+ */
+extern void ex_av_trace_record(const char *name, int64_t start, int stream, int serial, int64_t pts);
+
+/*
+ * The tracing costs a single branch when it is disabled:
+ *     int64_t t = ex_av_trace_begin();
+ *     ret = av_read_frame(ic, pkt);
+ *     ex_av_trace_end(t, "av_read_frame", pkt->stream_index, serial, pkt->pts);
+ */
+static inline int ex_av_trace_is_enabled(void) {
+	return __builtin_expect(__atomic_load_n(&ex_av_trace_enabled, __ATOMIC_RELAXED), 0);
+}
+
+static inline int64_t ex_av_trace_begin(void) {
+	return ex_av_trace_is_enabled() ? av_gettime_relative() : 0;
+}
+
+static inline void ex_av_trace_end(int64_t start, const char *name, int stream, int serial, int64_t pts) {
+	if (__builtin_expect(start != 0, 0))
+		ex_av_trace_record(name, start, stream, serial, pts);
+}
+
+#endif /* INCLUDE_TRACE_H_ */
@@ -0,0 +1,119 @@
+/*
+ * transcode.h
+ *
+ *  Created on: 2026-10-16 16:05:13
+ *      Author: yui
+ */
+
+#ifndef INCLUDE_TRANSCODE_H_
+#define INCLUDE_TRANSCODE_H_
+
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+
+#include <list.h>
+#include <atomic.h>
+
+#include <frame.h>
+#include <packet.h>
+#include <queue.h>
+
+#define TRANSCODE_FRAME_QUEUE_SIZE  8
+#define TRANSCODE_PACKET_QUEUE_SIZE 256
+#define TRANSCODE_MAX_STREAMS       2
+
+/*
+ * Throughput of a stage of the pipeline. A stage is 'starved' while waiting for its input and 'stalled'
+ * while waiting for its output to be taken; the bottleneck is the stage busy all the time, while the
+ * stages before it are stalled and those after it are starved.
+ */
+typedef struct exAVStage {
+	const char *name;
+	int64_t nb_items;                   /* frames or packets output */
+	int64_t start_time, end_time;       /* av_gettime_relative, end_time is 0 while running */
+	int64_t starved, stalled;           /* microseconds */
+} exAVStage;
+
+typedef struct exAVTranscodeStream {
+	struct exAVTranscoder *t;
+	int idx;                            /* index of the output stream */
+	enum AVMediaType type;
+	AVStream *ist;
+	exAVQueue *input;                   /* the decoded frames, the frame cache of the media */
+	exAVQueue converted;                /* the frames converted for the encoder */
+	AVCodecContext *enc;
+	AVStream *ost;
+
+	/* Conversion */
+	struct SwsContext *sws;
+	struct SwrContext *swr;
+	AVAudioFifo *fifo;                  /* the resampled audio, cut into frames of the frame size of the encoder */
+	int frame_size;
+	int64_t next_pts;                   /* pts of the next audio frame, in samples */
+
+	pthread_t filter_thread, encoder_thread;
+	exAVStage decode;                   /* decoded frames taken from the cache, starved while the decoder is slow */
+	exAVStage filter, encode;
+} exAVTranscodeStream;
+
+/*
+ * Transcoder: the decoded frames of every stream are converted(scaled or resampled) by a filter
+ * thread, encoded by an encoder thread, and written by a single muxer thread; the stages are
+ * connected by bounded queues, so that they run at once on different cores.
+ */
+typedef struct exAVTranscoder {
+	AVFormatContext *oc;
+	exAVTranscodeStream streams[TRANSCODE_MAX_STREAMS];
+	int nb_streams;
+	exAVQueue packets;                  /* encoded packets of all the streams, to the muxer */
+	exAVFramePool *frame_pool;
+	exAVPacketPool *packet_pool;
+	int nb_encoders_running;            /* the packets queue is finished when the last encoder exits */
+	pthread_t muxer_thread;
+	int threads_started;
+	exAVStage mux;
+	int result;                         /* 0 or the first error of the threads */
+} exAVTranscoder;
+
+/*
+ * Return non-zero value if a stream of 'codec_id' could be stored into 'url' as it is.
+ */
+extern int ex_av_transcoder_can_copy(const char *url, enum AVCodecID codec_id);
+
+/*
+ * Create a transcoder writing 'url' with the encoders guessed from its container, fed by the decoded
+ * frames of the streams 'ist' taken from the queues 'input'(finished by their decoders); write the
+ * header and start the threads. Only the video and audio streams are supported, the others are skipped.
+ * Return 0 if success, otherwise, return a negative error code; the 'input' queues are aborted
+ * if the threads failed to start.
+ */
+extern int ex_av_transcoder_create(exAVTranscoder **t, const char *url, AVStream **ist, exAVQueue **input, int nb_streams);
+
+/*
+ * Stop the transcoder as soon as possible, the trailer is still written.
+ */
+extern void ex_av_transcoder_abort(exAVTranscoder *t);
+
+/*
+ * Wait until all the threads exit, after the inputs are finished or the transcoder is aborted,
+ * then log the throughput of every stage.
+ * Return 0 if the output is complete, otherwise, return a negative error code.
+ */
+extern int ex_av_transcoder_wait(exAVTranscoder *t);
+
+/*
+ * Log the throughput of every stage, it could be called while running.
+ */
+extern void ex_av_transcoder_report(exAVTranscoder *t);
+
+/*
+ * Abort the transcoder if it is still running, close the output and free the transcoder.
+ */
+extern void ex_av_transcoder_free(exAVTranscoder **t);
+
+#endif /* INCLUDE_TRANSCODE_H_ */
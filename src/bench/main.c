@@ -0,0 +1,57 @@
+/*
+ * main.c
+ *
+ *  Created on: 2026-10-17 09:12:40
+ *      Author: yui
+ */
+
+#include <stdlib.h>
+
+#include <libavutil/log.h>
+#include <libavutil/error.h>
+
+#include <queue.h>
+#include <bench.h>
+
+/* Samples and iterations of the micro-benchmark of the gain kernels: a second of stereo at 48kHz, 1000 times */
+#define BENCH_MIX_SAMPLES    (48000 * 2)
+#define BENCH_MIX_ITERATIONS 1000
+/* Packets passed through every queue by the micro-benchmark */
+#define BENCH_QUEUE_COUNT    200000
+#define BENCH_QUEUE_CAPACITY 64
+
+/*
+ * Runner of the checks and benchmarks of 'bench.h', built by the Bench configuration with HAVE_BENCH_SUITE:
+ *     bench [clip directory] [clip duration in seconds] [json path]
+ * The synthetic clips are generated into the directory on the first run, and kept.
+ */
+int main(int argc, char **argv) {
+	int ret = 0;
+	const char *dir = argc > 1 ? argv[1] : ".";
+	double duration = argc > 2 ? atof(argv[2]) : 10;
+	const char *json_path = argc > 3 ? argv[3] : "bench.json";
+	const int queue_types[] = { QUEUE_LIST, QUEUE_SPSC, QUEUE_BENCH_RAW_LIST };
+
+	av_log_set_level(AV_LOG_INFO);
+	if ((ret = ex_av_mix_check()) < 0 || (ret = ex_av_mix_bench(BENCH_MIX_SAMPLES, BENCH_MIX_ITERATIONS)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "bench: mix error: %s\n", av_err2str(ret));
+		return 1;
+	}
+	for (int i = 0; i < sizeof(queue_types) / sizeof(queue_types[0]); i++) {
+		double pps = ex_av_queue_bench(queue_types[i], BENCH_QUEUE_CAPACITY, BENCH_QUEUE_COUNT);
+		if (pps < 0) {
+			av_log(NULL, AV_LOG_ERROR, "bench: queue bench error: %s\n", av_err2str((int)pps));
+			return 1;
+		}
+	}
+	if (duration <= 0) {
+		av_log(NULL, AV_LOG_ERROR, "bench: invalid duration: %s\n", argv[2]);
+		return 1;
+	}
+	if ((ret = ex_av_media_bench_suite(dir, duration, json_path)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "bench: suite error: %s\n", av_err2str(ret));
+		return 1;
+	}
+	av_log(NULL, AV_LOG_INFO, "bench: results written into %s\n", json_path);
+	return 0;
+}
@@ -0,0 +1,772 @@
+/*
+ * bench.c
+ *
+ *  Created on: 2026-10-16 10:03:11
+ *      Author: yui
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/time.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+#include <libavutil/error.h>
+#include <libavutil/common.h>
+#include <libavutil/avstring.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/cpu.h>
+#include <libavutil/lfg.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <list.h>
+#include <atomic.h>
+
+#include <queue.h>
+#include <packet.h>
+#include <media.h>
+#include <executor.h>
+#include <trace.h>
+#include <mix.h>
+#include <bench.h>
+
+#if HAVE_SDL2
+# include <SDL2/SDL.h>
+# ifdef _WIN32
+#  undef main
+# endif
+#endif
+
+#if HAVE_BENCH_SUITE
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+
+#if HAVE_GETPROCESSMEMORYINFO
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <stdio.h>
+#include <unistd.h>
+#endif
+#endif
+
+/* Microseconds the sides of the raw list sleep when it is full or empty, as the pipeline polled it */
+#define QUEUE_BENCH_RAW_POLL 1000
+
+typedef struct exAVQueueBench {
+	exAVQueue queue;
+	struct list *list;                  /* QUEUE_BENCH_RAW_LIST */
+	int done;
+	exAVPacket **packets;
+	int nb_packets;
+	int count;
+} exAVQueueBench;
+
+static void *queue_bench_producer(void *arg) {
+	exAVQueueBench *b = arg;
+	for (int i = 0; i < b->count; i++) {
+		if (ex_av_queue_push(&b->queue, &b->packets[i % b->nb_packets]->list, -1) < 0)
+			break;
+	}
+	ex_av_queue_finish(&b->queue);
+	return NULL;
+}
+
+static void *queue_bench_consumer(void *arg) {
+	exAVQueueBench *b = arg;
+	struct list_head *n = NULL;
+	while (!ex_av_queue_pop(&b->queue, &n, -1));
+	return NULL;
+}
+
+static void *raw_list_bench_producer(void *arg) {
+	exAVQueueBench *b = arg;
+	for (int i = 0; i < b->count; i++) {
+		while (b->list->insert_tail(b->list, &b->packets[i % b->nb_packets]->list))
+			av_usleep(QUEUE_BENCH_RAW_POLL);
+	}
+	__atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *raw_list_bench_consumer(void *arg) {
+	exAVQueueBench *b = arg;
+	while (1) {
+		int done = __atomic_load_n(&b->done, __ATOMIC_ACQUIRE);
+		if (b->list->pop_front(b->list))
+			continue;
+		if (done)
+			break;
+		av_usleep(QUEUE_BENCH_RAW_POLL);
+	}
+	return NULL;
+}
+
+static const char *queue_bench_name(int type) {
+	switch (type) {
+	case QUEUE_SPSC:           return "spsc";
+	case QUEUE_BENCH_RAW_LIST: return "raw list";
+	default:                   return "list";
+	}
+}
+
+double ex_av_queue_bench(int type, int capacity, int count) {
+	double ret = AVERROR(ENOMEM);
+	int64_t start;
+	pthread_t producer, consumer;
+	exAVQueueBench b = { 0 };
+	int raw = type == QUEUE_BENCH_RAW_LIST, err;
+	if (ex_av_queue_init(&b.queue, raw ? QUEUE_LIST : type, capacity) < 0)
+		goto err0;
+	if (raw && (b.list = list_create(MUTEX, capacity)) == NULL)
+		goto err1;
+	/*
+	 * A packet is never pushed again before it has been popped, as long as there
+	 * are more packets than the queue could hold plus the one held by the consumer.
+	 */
+	b.nb_packets = b.queue.capacity + 2;
+	b.count = count;
+	b.packets = av_mallocz(b.nb_packets * sizeof(exAVPacket *));
+	if (b.packets == NULL)
+		goto err1;
+	for (int i = 0; i < b.nb_packets; i++) {
+		if ((b.packets[i] = ex_av_packet_alloc(0)) == NULL)
+			goto err2;
+	}
+	start = av_gettime_relative();
+	if ((err = pthread_create(&consumer, NULL, raw ? raw_list_bench_consumer : queue_bench_consumer, &b))) {
+		ret = AVERROR(err);
+		goto err2;
+	}
+	if ((err = pthread_create(&producer, NULL, raw ? raw_list_bench_producer : queue_bench_producer, &b))) {
+		/* nothing will be pushed, let the consumer end */
+		ret = AVERROR(err);
+		ex_av_queue_finish(&b.queue);
+		__atomic_store_n(&b.done, 1, __ATOMIC_RELEASE);
+		pthread_join(consumer, NULL);
+		goto err2;
+	}
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	ret = count * 1000000.0 / FFMAX(av_gettime_relative() - start, 1);
+	av_log(NULL, AV_LOG_INFO, "ex_av_queue_bench: %s queue, capacity %d: %d packets, %.0f packets/s\n",
+			queue_bench_name(type), b.queue.capacity, count, ret);
+err2:
+	for (int i = 0; i < b.nb_packets; i++) {
+		if (b.packets[i])
+			b.packets[i]->put(b.packets[i]);
+	}
+	av_freep(&b.packets);
+err1:
+	if (b.list)
+		b.list->put(b.list, NULL);
+	ex_av_queue_destroy(&b.queue, ex_av_packet_free_list_entry);
+err0:
+	return ret;
+}
+
+static void mix_bench_log(const char *name, int64_t start, int nb_samples, int iterations) {
+	av_log(NULL, AV_LOG_INFO, "ex_av_mix_bench: %-4s %.3f ns/sample\n", name,
+			(av_gettime_relative() - start) * 1000.0 / ((double)nb_samples * iterations));
+}
+
+int ex_av_mix_bench(int nb_samples, int iterations) {
+	static const int flags[] = { 0, AV_CPU_FLAG_SSE2, AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_AVX2 };
+	int cpu_flags = av_get_cpu_flags();
+	int16_t *src = NULL, *dst = NULL;
+	const char *last = NULL;
+	exAVMixKernels k;
+	int64_t start;
+	AVLFG lfg;
+	if ((src = av_malloc_array(nb_samples, sizeof(int16_t))) == NULL)
+		goto err0;
+	if ((dst = av_malloc_array(nb_samples, sizeof(int16_t))) == NULL)
+		goto err1;
+	av_lfg_init(&lfg, 0);
+	for (int i = 0; i < nb_samples; i++)
+		src[i] = av_lfg_get(&lfg);
+	for (int i = 0; i < FF_ARRAY_ELEMS(flags); i++) {
+		/* the kernels this cpu lacks fall back to the previous ones */
+		ex_av_mix_get_kernels(flags[i] & cpu_flags, &k);
+		if (last && !strcmp(k.name, last))
+			continue;
+		last = k.name;
+		start = av_gettime_relative();
+		for (int j = 0; j < iterations; j++)
+			k.gain_s16(dst, src, nb_samples, 0.75f, 0);
+		mix_bench_log(k.name, start, nb_samples, iterations);
+	}
+#if HAVE_SDL2
+	/* the way the audio callback lowered the volume before */
+	start = av_gettime_relative();
+	for (int j = 0; j < iterations; j++) {
+		memset(dst, 0, nb_samples * sizeof(int16_t));
+		SDL_MixAudioFormat((Uint8 *)dst, (const Uint8 *)src, AUDIO_S16SYS, nb_samples * sizeof(int16_t), 96);
+	}
+	mix_bench_log("sdl", start, nb_samples, iterations);
+#endif
+	av_free(dst);
+	av_free(src);
+	return 0;
+err1:
+	av_free(src);
+err0:
+	return AVERROR(ENOMEM);
+}
+
+/* Samples of the check of the kernels, not a multiple of any vector so that the tails are run too */
+#define MIX_CHECK_SAMPLES 1027
+
+/* Gains and steps checked: constant, ramping up and down, and saturating */
+static const float mix_check_gains[][2] = {
+	{ 1.0f, 0 }, { 0.5f, 0 }, { 0, 1.0f / MIX_CHECK_SAMPLES }, { 1.0f, -0.5f / MIX_CHECK_SAMPLES }, { 3.0f, 0.01f },
+};
+
+/*
+ * Compare the output of a kernel with the one of the C kernel, the S16 samples by at most one step of
+ * rounding, the floats by at most 'tolerance'.
+ */
+static int mix_check_compare(const char *kernel, const char *name, const void *ref, const void *out, int s16, int gain) {
+	for (int i = 0; i < MIX_CHECK_SAMPLES; i++) {
+		double diff = s16 ? abs(((const int16_t *)ref)[i] - ((const int16_t *)out)[i]) :
+				fabs(((const float *)ref)[i] - ((const float *)out)[i]);
+		if (diff > (s16 ? 1 : 1e-6)) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_mix_check: %s %s differs from c at sample %d, gain %g step %g\n",
+					kernel, name, i, mix_check_gains[gain][0], mix_check_gains[gain][1]);
+			return AVERROR_BUG;
+		}
+	}
+	return 0;
+}
+
+int ex_av_mix_check(void) {
+	static const int flags[] = { AV_CPU_FLAG_SSE2, AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_AVX2 };
+	int ret = 0, cpu_flags = av_get_cpu_flags();
+	int16_t src_s16[MIX_CHECK_SAMPLES], ref_s16[MIX_CHECK_SAMPLES], out_s16[MIX_CHECK_SAMPLES];
+	float src_f32[MIX_CHECK_SAMPLES], ref_f32[MIX_CHECK_SAMPLES], out_f32[MIX_CHECK_SAMPLES];
+	const char *last = "c";
+	exAVMixKernels c, k;
+	AVLFG lfg;
+	av_lfg_init(&lfg, 0);
+	for (int i = 0; i < MIX_CHECK_SAMPLES; i++) {
+		src_s16[i] = av_lfg_get(&lfg);
+		src_f32[i] = src_s16[i] / 32768.0f;
+	}
+	ex_av_mix_get_kernels(0, &c);
+	for (int i = 0; i < FF_ARRAY_ELEMS(flags); i++) {
+		/* the kernels this cpu lacks fall back to the previous ones */
+		ex_av_mix_get_kernels(flags[i] & cpu_flags, &k);
+		if (!strcmp(k.name, last))
+			continue;
+		last = k.name;
+		for (int g = 0; g < FF_ARRAY_ELEMS(mix_check_gains); g++) {
+			float gain = mix_check_gains[g][0], step = mix_check_gains[g][1];
+			c.gain_s16(ref_s16, src_s16, MIX_CHECK_SAMPLES, gain, step);
+			k.gain_s16(out_s16, src_s16, MIX_CHECK_SAMPLES, gain, step);
+			if ((ret = mix_check_compare(k.name, "gain_s16", ref_s16, out_s16, 1, g)) < 0)
+				return ret;
+			/* added to the output above, which saturates the loudest samples */
+			memcpy(out_s16, ref_s16, sizeof(ref_s16));
+			c.mix_s16(ref_s16, src_s16, MIX_CHECK_SAMPLES, gain, step);
+			k.mix_s16(out_s16, src_s16, MIX_CHECK_SAMPLES, gain, step);
+			if ((ret = mix_check_compare(k.name, "mix_s16", ref_s16, out_s16, 1, g)) < 0)
+				return ret;
+			c.gain_f32(ref_f32, src_f32, MIX_CHECK_SAMPLES, gain, step);
+			k.gain_f32(out_f32, src_f32, MIX_CHECK_SAMPLES, gain, step);
+			if ((ret = mix_check_compare(k.name, "gain_f32", ref_f32, out_f32, 0, g)) < 0)
+				return ret;
+			memcpy(out_f32, ref_f32, sizeof(ref_f32));
+			c.mix_f32(ref_f32, src_f32, MIX_CHECK_SAMPLES, gain, step);
+			k.mix_f32(out_f32, src_f32, MIX_CHECK_SAMPLES, gain, step);
+			if ((ret = mix_check_compare(k.name, "mix_f32", ref_f32, out_f32, 0, g)) < 0)
+				return ret;
+		}
+		av_log(NULL, AV_LOG_INFO, "ex_av_mix_check: %s matches c\n", k.name);
+	}
+	return 0;
+}
+
+static int count_frame(exAVMedia *m, enum AVMediaType type, exAVFrame *f, void *opaque) {
+	__atomic_add_fetch((int64_t *)opaque, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * CPU time consumed by all the threads of the process, in microseconds.
+ */
+static int64_t cpu_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Check that the pools of 'm' have only been warmed up: past the entries its caches could hold at once,
+ * every packet and frame must have been reused. Return 0 if so, otherwise, return AVERROR_BUG.
+ */
+static int media_pool_check(exAVMedia *m) {
+	exAVMediaStats stats;
+	m->get_stats(m, &stats);
+	av_log(NULL, AV_LOG_VERBOSE, "media_pool_check: packets %"PRId64" allocated, %"PRId64" reused; "
+			"frames %"PRId64" allocated, %"PRId64" reused\n",
+			stats.packet_allocs, stats.packet_reuses, stats.frame_allocs, stats.frame_reuses);
+	if (stats.packet_allocs > PACKET_POOL_SIZE || stats.frame_allocs > FRAME_POOL_SIZE) {
+		av_log(NULL, AV_LOG_ERROR, "media_pool_check error: the pools keep allocating from the heap\n");
+		return AVERROR_BUG;
+	}
+	return 0;
+}
+
+/*
+ * Decode 'nb_sessions' copies of 'url' at once, on the executor 'e', or on their own threads if it is NULL.
+ */
+static double media_bench_run(const char *url, int nb_sessions, exAVExecutor *e) {
+	double ret = AVERROR(ENOMEM);
+	int64_t frames = 0, start, cpu_start, elapsed;
+	exAVMedia **medias = av_calloc(nb_sessions, sizeof(exAVMedia *));
+	if (medias == NULL)
+		goto err0;
+	for (int i = 0; i < nb_sessions; i++) {
+		if ((medias[i] = ex_av_media_open(url, MEDIA_OPEN_NO_SUBTITLE)) == NULL) {
+			ret = AVERROR(EINVAL);
+			goto err1;
+		}
+		medias[i]->set_executor(medias[i], e);
+		medias[i]->set_frame_sink(medias[i], AVMEDIA_TYPE_VIDEO, count_frame, &frames);
+		medias[i]->set_frame_sink(medias[i], AVMEDIA_TYPE_AUDIO, count_frame, &frames);
+	}
+	start = av_gettime_relative();
+	cpu_start = cpu_time();
+	for (int i = 0; i < nb_sessions; i++) {
+		if ((ret = medias[i]->run(medias[i], MEDIA_RUN_NOWAIT)) < 0)
+			goto err1;
+	}
+	for (int i = 0; i < nb_sessions; i++) {
+		medias[i]->wait(medias[i]);
+		medias[i]->stop_decode(medias[i]);
+	}
+	elapsed = FFMAX(av_gettime_relative() - start, 1);
+	for (int i = 0; i < nb_sessions; i++) {
+		if ((ret = media_pool_check(medias[i])) < 0)
+			goto err1;
+	}
+	ret = frames * 1000000.0 / elapsed;
+	av_log(NULL, AV_LOG_INFO, "ex_av_media_bench_sessions: %s: %d sessions: %"PRId64" frames, %.0f frames/s, cpu %.0f%%\n",
+			e ? "executor" : "threads", nb_sessions, frames, ret, (cpu_time() - cpu_start) * 100.0 / elapsed);
+err1:
+	/* closing a media also stops its decoding */
+	for (int i = 0; i < nb_sessions; i++) {
+		if (medias[i])
+			medias[i]->put(medias[i]);
+	}
+	av_free(medias);
+err0:
+	return ret;
+}
+
+int ex_av_media_bench_sessions(const char *url, int nb_sessions, int nb_workers, double *threads_fps, double *pool_fps) {
+	double fps = 0;
+	exAVExecutor *e = NULL;
+	if ((fps = media_bench_run(url, nb_sessions, NULL)) < 0)
+		return fps;
+	if (threads_fps)
+		*threads_fps = fps;
+	if ((e = ex_av_executor_create(nb_workers)) == NULL)
+		return AVERROR(ENOMEM);
+	fps = media_bench_run(url, nb_sessions, e);
+	ex_av_executor_free(&e);
+	if (fps < 0)
+		return fps;
+	if (pool_fps)
+		*pool_fps = fps;
+	return 0;
+}
+
+#if HAVE_BENCH_SUITE
+/*
+ * A stream of a synthetic clip: frames pulled from a lavfi source, encoded and muxed.
+ */
+typedef struct exAVSynthStream {
+	AVFilterGraph *graph;
+	AVFilterContext *sink;
+	AVCodecContext *enc;
+	AVStream *st;
+	AVFrame *frame;
+	AVPacket *pkt;
+	int64_t next_pts;                   /* in the time base of the encoder */
+	int eof;
+} exAVSynthStream;
+
+static int synth_stream_write(exAVSynthStream *s, AVFormatContext *oc, AVFrame *frame) {
+	int ret = avcodec_send_frame(s->enc, frame);
+	while (ret >= 0) {
+		if ((ret = avcodec_receive_packet(s->enc, s->pkt)) < 0)
+			return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+		av_packet_rescale_ts(s->pkt, s->enc->time_base, s->st->time_base);
+		s->pkt->stream_index = s->st->index;
+		ret = av_interleaved_write_frame(oc, s->pkt);
+	}
+	return ret;
+}
+
+/*
+ * Encode the next frame of the source, or flush the encoder at the end of it.
+ */
+static int synth_stream_step(exAVSynthStream *s, AVFormatContext *oc) {
+	int ret = av_buffersink_get_frame(s->sink, s->frame);
+	if (ret == AVERROR_EOF) {
+		s->eof = 1;
+		return synth_stream_write(s, oc, NULL);
+	}
+	if (ret < 0)
+		return ret;
+	if (s->frame->nb_samples > 0)
+		s->next_pts = s->frame->pts + av_rescale_q(s->frame->nb_samples, (AVRational){ 1, s->frame->sample_rate }, s->enc->time_base);
+	else
+#if LIBAVUTIL_VERSION_MAJOR >= 58
+		s->next_pts = s->frame->pts + FFMAX(s->frame->duration, 1);
+#else
+		s->next_pts = s->frame->pts + FFMAX(s->frame->pkt_duration, 1);
+#endif
+	ret = synth_stream_write(s, oc, s->frame);
+	av_frame_unref(s->frame);
+	return ret;
+}
+
+static int synth_graph_open(exAVSynthStream *s, const char *desc, enum AVMediaType type) {
+	int ret = AVERROR(ENOMEM);
+	AVFilterInOut *inputs = NULL, *outputs = NULL;
+	if ((s->graph = avfilter_graph_alloc()) == NULL)
+		goto end;
+	/* single-threaded, so that the clips are the same on every machine */
+	s->graph->nb_threads = 1;
+	if ((ret = avfilter_graph_create_filter(&s->sink, avfilter_get_by_name(type == AVMEDIA_TYPE_VIDEO ? "buffersink" : "abuffersink"),
+			"out", NULL, NULL, s->graph)) < 0)
+		goto end;
+	if ((ret = avfilter_graph_parse_ptr(s->graph, desc, &inputs, &outputs, NULL)) < 0)
+		goto end;
+	if (outputs == NULL || outputs->next) {
+		ret = AVERROR(EINVAL);
+		goto end;
+	}
+	if ((ret = avfilter_link(outputs->filter_ctx, outputs->pad_idx, s->sink, 0)) < 0)
+		goto end;
+	ret = avfilter_graph_config(s->graph, NULL);
+end:
+	avfilter_inout_free(&inputs);
+	avfilter_inout_free(&outputs);
+	return ret;
+}
+
+static int synth_stream_open(exAVSynthStream *s, AVFormatContext *oc, const AVCodec *codec, const char *desc) {
+	int ret = 0;
+	if ((ret = synth_graph_open(s, desc, codec->type)) < 0)
+		return ret;
+	if ((s->enc = avcodec_alloc_context3(codec)) == NULL || (s->frame = av_frame_alloc()) == NULL ||
+			(s->pkt = av_packet_alloc()) == NULL || (s->st = avformat_new_stream(oc, NULL)) == NULL)
+		return AVERROR(ENOMEM);
+	s->enc->time_base = av_buffersink_get_time_base(s->sink);
+	if (codec->type == AVMEDIA_TYPE_VIDEO) {
+		s->enc->width     = av_buffersink_get_w(s->sink);
+		s->enc->height    = av_buffersink_get_h(s->sink);
+		s->enc->pix_fmt   = av_buffersink_get_format(s->sink);
+		s->enc->framerate = av_buffersink_get_frame_rate(s->sink);
+		s->enc->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(s->sink);
+		/* a keyframe every second, about 0.1 bit per pixel */
+		s->enc->gop_size  = av_q2d(s->enc->framerate) + 0.5;
+		s->enc->bit_rate  = (int64_t)s->enc->width * s->enc->height * av_q2d(s->enc->framerate) / 10;
+	}
+	else {
+		s->enc->sample_rate = av_buffersink_get_sample_rate(s->sink);
+		s->enc->sample_fmt  = av_buffersink_get_format(s->sink);
+		if ((ret = av_buffersink_get_ch_layout(s->sink, &s->enc->ch_layout)) < 0)
+			return ret;
+		s->enc->bit_rate = 128000;
+	}
+	s->enc->thread_count = 1;
+	s->enc->flags |= AV_CODEC_FLAG_BITEXACT;
+	if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+		s->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if ((ret = avcodec_open2(s->enc, codec, NULL)) < 0)
+		return ret;
+	s->st->time_base = s->enc->time_base;
+	return avcodec_parameters_from_context(s->st->codecpar, s->enc);
+}
+
+static void synth_stream_close(exAVSynthStream *s) {
+	avfilter_graph_free(&s->graph);
+	avcodec_free_context(&s->enc);
+	av_frame_free(&s->frame);
+	av_packet_free(&s->pkt);
+}
+
+int ex_av_synthetic_media_create(const char *url, const char *encoder, int width, int height, int frame_rate, double duration) {
+	int ret = 0;
+	char desc[256];
+	AVFormatContext *oc = NULL;
+	exAVSynthStream v = { 0 }, a = { 0 };
+	const AVCodec *vcodec = avcodec_find_encoder_by_name(encoder);
+	const AVCodec *acodec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+	if (vcodec == NULL || vcodec->type != AVMEDIA_TYPE_VIDEO || acodec == NULL || vcodec->pix_fmts == NULL)
+		return AVERROR_ENCODER_NOT_FOUND;
+	if ((ret = avformat_alloc_output_context2(&oc, NULL, "matroska", url)) < 0)
+		goto end;
+	oc->flags |= AVFMT_FLAG_BITEXACT;
+	snprintf(desc, sizeof(desc), "testsrc2=size=%dx%d:rate=%d:duration=%g,format=%s",
+			width, height, frame_rate, duration, av_get_pix_fmt_name(vcodec->pix_fmts[0]));
+	if ((ret = synth_stream_open(&v, oc, vcodec, desc)) < 0)
+		goto end;
+	snprintf(desc, sizeof(desc), "sine=frequency=440:beep_factor=4:sample_rate=48000:duration=%g,"
+			"aformat=sample_fmts=fltp:channel_layouts=stereo,asetnsamples=n=1024:p=0", duration);
+	if ((ret = synth_stream_open(&a, oc, acodec, desc)) < 0)
+		goto end;
+	if ((ret = avio_open(&oc->pb, url, AVIO_FLAG_WRITE)) < 0)
+		goto end;
+	if ((ret = avformat_write_header(oc, NULL)) < 0)
+		goto end;
+	/* the stream behind goes first, so that the muxer interleaves them with little buffering */
+	while (ret >= 0 && (!v.eof || !a.eof)) {
+		if (!v.eof && (a.eof || av_compare_ts(v.next_pts, v.enc->time_base, a.next_pts, a.enc->time_base) <= 0))
+			ret = synth_stream_step(&v, oc);
+		else
+			ret = synth_stream_step(&a, oc);
+	}
+	if (ret >= 0)
+		ret = av_write_trailer(oc);
+end:
+	if (ret < 0)
+		av_log(NULL, AV_LOG_ERROR, "ex_av_synthetic_media_create: %s: %s\n", url, av_err2str(ret));
+	synth_stream_close(&v);
+	synth_stream_close(&a);
+	if (oc)
+		avio_closep(&oc->pb);
+	avformat_free_context(oc);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Clips of the suite: the encoders missing in the build are skipped.
+ */
+typedef struct exAVBenchCase {
+	const char *name;
+	const char *encoder;
+	int width, height;
+} exAVBenchCase;
+
+static const exAVBenchCase bench_cases[] = {
+	{ "mpeg2_480p",  "mpeg2video", 640,  480  },
+	{ "mpeg4_720p",  "mpeg4",      1280, 720  },
+	{ "mpeg4_1080p", "mpeg4",      1920, 1080 },
+	{ "mjpeg_1080p", "mjpeg",      1920, 1080 },
+	{ "h264_1080p",  "libx264",    1920, 1080 },
+	{ "hevc_2160p",  "libx265",    3840, 2160 },
+};
+
+#define BENCH_FRAME_RATE 30
+/* Microseconds between two samples of the resident memory while a case runs */
+#define BENCH_RSS_INTERVAL 10000
+
+/* Spans of the pipeline whose latency percentiles are reported, see 'trace.h' */
+static const char *bench_stages[] = { "av_read_frame", "avcodec_send_packet", "avcodec_receive_frame" };
+
+/*
+ * Resident memory of the process in bytes, or -1 if unknown.
+ */
+static int64_t current_rss(void) {
+#if HAVE_GETPROCESSMEMORYINFO
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return pmc.WorkingSetSize;
+	return -1;
+#else
+	long long pages = -1;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return -1;
+	if (fscanf(fp, "%*lld %lld", &pages) != 1)
+		pages = -1;
+	fclose(fp);
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/*
+ * Samples the resident memory while a case runs: the peak of the process is that of its whole lifetime,
+ * so it would tell nothing about the cases after the heaviest one.
+ */
+typedef struct exAVRssSampler {
+	pthread_t thread;
+	int quit;
+	int64_t base, peak;                 /* at the start of the case, and the most sampled since */
+} exAVRssSampler;
+
+static void *rss_sampler_routine(void *arg) {
+	exAVRssSampler *s = arg;
+	while (!__atomic_load_n(&s->quit, __ATOMIC_ACQUIRE)) {
+		s->peak = FFMAX(s->peak, current_rss());
+		av_usleep(BENCH_RSS_INTERVAL);
+	}
+	return NULL;
+}
+
+static int rss_sampler_start(exAVRssSampler *s) {
+	s->quit = 0;
+	s->base = s->peak = current_rss();
+	if (s->base < 0)
+		return AVERROR(ENOSYS);
+	return AVERROR(pthread_create(&s->thread, NULL, rss_sampler_routine, s));
+}
+
+static void rss_sampler_stop(exAVRssSampler *s) {
+	__atomic_store_n(&s->quit, 1, __ATOMIC_RELEASE);
+	pthread_join(s->thread, NULL);
+	s->peak = FFMAX(s->peak, current_rss());
+}
+
+/*
+ * Demux the whole clip without decoding. Return its throughput in MB/s, or a negative error code.
+ */
+static double bench_demux(const char *url) {
+	int ret = 0;
+	int64_t start = 0, size = 0;
+	AVFormatContext *ic = NULL;
+	AVPacket *pkt = av_packet_alloc();
+	if (pkt == NULL)
+		return AVERROR(ENOMEM);
+	if ((ret = avformat_open_input(&ic, url, NULL, NULL)) < 0)
+		goto end;
+	size = avio_size(ic->pb);
+	start = av_gettime_relative();
+	while ((ret = av_read_frame(ic, pkt)) >= 0)
+		av_packet_unref(pkt);
+	if (ret == AVERROR_EOF)
+		ret = 0;
+end:
+	av_packet_free(&pkt);
+	avformat_close_input(&ic);
+	return ret < 0 ? ret : size / 1048576.0 * 1000000.0 / FFMAX(av_gettime_relative() - start, 1);
+}
+
+static int compare_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void write_percentiles(AVIOContext *pb, const char *stage) {
+	int64_t *durations = NULL;
+	int nb = ex_av_trace_collect(stage, &durations);
+	avio_printf(pb, "\"%s\":{\"count\":%d", stage, FFMAX(nb, 0));
+	if (nb > 0) {
+		qsort(durations, nb, sizeof(int64_t), compare_int64);
+		avio_printf(pb, ",\"p50\":%"PRId64",\"p90\":%"PRId64",\"p99\":%"PRId64",\"max\":%"PRId64,
+				durations[nb * 50 / 100], durations[nb * 90 / 100], durations[nb * 99 / 100], durations[nb - 1]);
+	}
+	avio_printf(pb, "}");
+	av_free(durations);
+}
+
+typedef struct exAVBenchCounters {
+	int64_t video, audio;
+} exAVBenchCounters;
+
+static int count_stream_frame(exAVMedia *m, enum AVMediaType type, exAVFrame *f, void *opaque) {
+	exAVBenchCounters *c = opaque;
+	__atomic_add_fetch(type == AVMEDIA_TYPE_VIDEO ? &c->video : &c->audio, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Run a case of the suite on the clip 'url', and write its result as a JSON object after 'sep', only
+ * if it succeeds.
+ */
+static int bench_case(AVIOContext *pb, const exAVBenchCase *c, const char *url, double duration, const char *sep) {
+	int ret = 0, sampled = 0;
+	int64_t start = 0, elapsed = 0;
+	exAVBenchCounters counters = { 0 };
+	exAVRssSampler rss = { 0 };
+	exAVMedia *m = NULL;
+	double demux_mbps = bench_demux(url);
+	if (demux_mbps < 0)
+		return demux_mbps;
+	sampled = rss_sampler_start(&rss) == 0;
+	if ((m = ex_av_media_open(url, MEDIA_OPEN_NO_SUBTITLE)) == NULL) {
+		ret = AVERROR(EINVAL);
+		goto end;
+	}
+	m->set_frame_sink(m, AVMEDIA_TYPE_VIDEO, count_stream_frame, &counters);
+	m->set_frame_sink(m, AVMEDIA_TYPE_AUDIO, count_stream_frame, &counters);
+	ex_av_trace_start(0);
+	start = av_gettime_relative();
+	ret = m->run(m, 0);
+	elapsed = FFMAX(av_gettime_relative() - start, 1);
+	ex_av_trace_stop();
+	m->put(m);
+end:
+	if (sampled)
+		rss_sampler_stop(&rss);
+	if (ret < 0)
+		return ret;
+	av_log(NULL, AV_LOG_INFO, "ex_av_media_bench_suite: %s: demux %.1f MB/s, video %.1f fps, audio %.1f fps\n", c->name,
+			demux_mbps, counters.video * 1000000.0 / elapsed, counters.audio * 1000000.0 / elapsed);
+	avio_printf(pb, "%s{\"name\":\"%s\",\"encoder\":\"%s\",\"width\":%d,\"height\":%d,\"frame_rate\":%d,\"duration\":%g,"
+			"\"demux_mbps\":%.3f,\"video_frames\":%"PRId64",\"audio_frames\":%"PRId64",\"video_fps\":%.3f,\"audio_fps\":%.3f,"
+			"\"wall_time_us\":%"PRId64",\"latency_us\":{",
+			sep, c->name, c->encoder, c->width, c->height, BENCH_FRAME_RATE, duration, demux_mbps, counters.video, counters.audio,
+			counters.video * 1000000.0 / elapsed, counters.audio * 1000000.0 / elapsed, elapsed);
+	for (int i = 0; i < FF_ARRAY_ELEMS(bench_stages); i++) {
+		avio_printf(pb, i ? "," : "");
+		write_percentiles(pb, bench_stages[i]);
+	}
+	/* the resident memory the case has added at its peak, and that peak */
+	avio_printf(pb, "},\"rss_growth\":%"PRId64",\"peak_rss\":%"PRId64"}",
+			sampled ? rss.peak - rss.base : -1, sampled ? rss.peak : -1);
+	return 0;
+}
+
+int ex_av_media_bench_suite(const char *dir, double duration, const char *json_path) {
+	int ret = 0, nb_cases = 0;
+	char url[1024];
+	AVIOContext *pb = NULL;
+	if ((ret = avio_open(&pb, json_path, AVIO_FLAG_WRITE)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_bench_suite: unable to open %s: %s\n", json_path, av_err2str(ret));
+		return ret;
+	}
+	avio_printf(pb, "{\"version\":\"%s\",\"cases\":[", av_version_info());
+	for (int i = 0; i < FF_ARRAY_ELEMS(bench_cases); i++) {
+		const exAVBenchCase *c = &bench_cases[i];
+		if (avcodec_find_encoder_by_name(c->encoder) == NULL) {
+			av_log(NULL, AV_LOG_INFO, "ex_av_media_bench_suite: %s skipped, no encoder %s\n", c->name, c->encoder);
+			continue;
+		}
+		/* the clips are the same for the same duration, they are generated once */
+		snprintf(url, sizeof(url), "%s/%s_%gs.mkv", dir, c->name, duration);
+		if (avio_check(url, AVIO_FLAG_READ) < 0 &&
+				(ret = ex_av_synthetic_media_create(url, c->encoder, c->width, c->height, BENCH_FRAME_RATE, duration)) < 0)
+			break;
+		if ((ret = bench_case(pb, c, url, duration, nb_cases ? ",\n" : "\n")) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_media_bench_suite: %s: %s\n", c->name, av_err2str(ret));
+			break;
+		}
+		nb_cases++;
+	}
+	avio_printf(pb, "\n]}\n");
+	avio_closep(&pb);
+	ex_av_trace_free(); /* the media of the cases have been closed, no thread traces any more */
+	return ret;
+}
+
+#else
+int ex_av_synthetic_media_create(const char *url, const char *encoder, int width, int height, int frame_rate, double duration) {
+	av_log(NULL, AV_LOG_ERROR, "ex_av_synthetic_media_create error: built without HAVE_BENCH_SUITE\n");
+	return AVERROR(ENOSYS);
+}
+
+int ex_av_media_bench_suite(const char *dir, double duration, const char *json_path) {
+	av_log(NULL, AV_LOG_ERROR, "ex_av_media_bench_suite error: built without HAVE_BENCH_SUITE\n");
+	return AVERROR(ENOSYS);
+}
+#endif /* HAVE_BENCH_SUITE */
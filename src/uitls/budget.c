@@ -0,0 +1,87 @@
+/*
+ * budget.c
+ *
+ *  Created on: 2026-10-16 14:38:20
+ *      Author: yui
+ */
+
+#include <pthread.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/common.h>
+
+#include <budget.h>
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int budget_threads;          /* 0 until it is set or first used */
+static int budget_members;          /* how many decoders joined */
+static unsigned int budget_generation;
+
+static int budget_threads_locked(void) {
+	if (budget_threads <= 0)
+		budget_threads = av_cpu_count();
+	return budget_threads;
+}
+
+static int budget_share_locked(void) {
+	return FFMAX(1, budget_threads_locked() / FFMAX(1, budget_members));
+}
+
+/*
+ * Bump the generation only if the share of a decoder differs from 'share' it was before the change,
+ * so that the decoders do not check the share again for nothing.
+ */
+static void budget_changed(int share) {
+	if (budget_share_locked() != share)
+		__atomic_add_fetch(&budget_generation, 1, __ATOMIC_RELEASE);
+}
+
+void ex_av_thread_budget_set(int nb_threads) {
+	int share = 0;
+	pthread_mutex_lock(&budget_mutex);
+	share = budget_share_locked();
+	budget_threads = nb_threads > 0 ? nb_threads : av_cpu_count();
+	budget_changed(share);
+	pthread_mutex_unlock(&budget_mutex);
+}
+
+int ex_av_thread_budget_get(void) {
+	int nb_threads = 0;
+	pthread_mutex_lock(&budget_mutex);
+	nb_threads = budget_threads_locked();
+	pthread_mutex_unlock(&budget_mutex);
+	return nb_threads;
+}
+
+void ex_av_thread_budget_join(void) {
+	int share = 0;
+	pthread_mutex_lock(&budget_mutex);
+	share = budget_share_locked();
+	budget_members++;
+	budget_changed(share);
+	pthread_mutex_unlock(&budget_mutex);
+}
+
+void ex_av_thread_budget_leave(void) {
+	int share = 0;
+	pthread_mutex_lock(&budget_mutex);
+	share = budget_share_locked();
+	if (budget_members > 0)
+		budget_members--;
+	budget_changed(share);
+	pthread_mutex_unlock(&budget_mutex);
+}
+
+int ex_av_thread_budget_share(unsigned int *generation) {
+	int share = 1;
+	pthread_mutex_lock(&budget_mutex);
+	share = budget_share_locked();
+	if (generation)
+		*generation = __atomic_load_n(&budget_generation, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&budget_mutex);
+	return share;
+}
+
+unsigned int ex_av_thread_budget_generation(void) {
+	return __atomic_load_n(&budget_generation, __ATOMIC_ACQUIRE);
+}
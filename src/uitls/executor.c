@@ -0,0 +1,254 @@
+/*
+ * executor.c
+ *
+ *  Created on: 2026-10-16 13:42:05
+ *      Author: yui
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/log.h>
+#include <libavutil/common.h>
+
+#include <executor.h>
+#include <trace.h>
+
+enum {
+	TASK_STATE_PARKED,      /* waiting for 'ex_av_task_wake' */
+	TASK_STATE_QUEUED,      /* in the run queue of a worker */
+	TASK_STATE_RUNNING,
+	TASK_STATE_NOTIFIED,    /* running, and woken up since it started */
+	TASK_STATE_DONE,
+};
+
+/* The worker running on the current thread, NULL if it is not a worker thread */
+static __thread exAVWorker *current_worker;
+
+static inline int cas_state(exAVTask *t, int *expected, int desired) {
+	return __atomic_compare_exchange_n(&t->state, expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Append a task to a run queue: that of the current worker if it belongs to the executor,
+ * so that a task woken up by another keeps its cache warm, otherwise the next one round-robin.
+ */
+static void executor_enqueue(exAVExecutor *e, exAVTask *t) {
+	exAVWorker *w = current_worker;
+	if (w == NULL || w->executor != e)
+		w = &e->workers[__atomic_fetch_add(&e->next_worker, 1, __ATOMIC_RELAXED) % e->nb_workers];
+	t->next = NULL;
+	pthread_mutex_lock(&w->mutex);
+	if (w->tail)
+		w->tail->next = t;
+	else
+		w->head = t;
+	w->tail = t;
+	pthread_mutex_unlock(&w->mutex);
+	__atomic_add_fetch(&e->nb_pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&e->nb_idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&e->mutex);
+		pthread_cond_signal(&e->cond);
+		pthread_mutex_unlock(&e->mutex);
+	}
+}
+
+static exAVTask *worker_dequeue(exAVWorker *w) {
+	exAVTask *t = NULL;
+	pthread_mutex_lock(&w->mutex);
+	if ((t = w->head) != NULL) {
+		w->head = t->next;
+		if (w->head == NULL)
+			w->tail = NULL;
+		__atomic_sub_fetch(&w->executor->nb_pending, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return t;
+}
+
+/*
+ * Take the oldest task queued on another worker.
+ */
+static exAVTask *worker_steal(exAVWorker *w) {
+	exAVExecutor *e = w->executor;
+	exAVTask *t = NULL;
+	for (int i = 1; i < e->nb_workers && t == NULL; i++) {
+		exAVWorker *victim = &e->workers[(w->idx + i) % e->nb_workers];
+		if (__atomic_load_n(&victim->head, __ATOMIC_RELAXED) == NULL)
+			continue;
+		if ((t = worker_dequeue(victim)) != NULL)
+			w->nb_steals++;
+	}
+	return t;
+}
+
+static void run_task(exAVWorker *w, exAVTask *t) {
+	int ret = TASK_AGAIN;
+	int state = TASK_STATE_RUNNING;
+	__atomic_store_n(&t->state, TASK_STATE_RUNNING, __ATOMIC_RELEASE);
+	for (int i = 0; i < TASK_QUANTUM && ret == TASK_AGAIN; i++) {
+		ret = t->step(t, t->opaque);
+		t->nb_steps++;
+	}
+	switch (ret) {
+	case TASK_BLOCKED:
+		if (cas_state(t, &state, TASK_STATE_PARKED))
+			break;
+		/* woken up while running, what it waits for may be ready now */
+		/* fall through */
+	case TASK_AGAIN:
+		/* go to the tail of the run queue, giving way to the other tasks */
+		__atomic_store_n(&t->state, TASK_STATE_QUEUED, __ATOMIC_RELEASE);
+		executor_enqueue(w->executor, t);
+		break;
+	default:
+		pthread_mutex_lock(&w->executor->mutex);
+		__atomic_store_n(&t->state, TASK_STATE_DONE, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&w->executor->done);
+		pthread_mutex_unlock(&w->executor->mutex);
+		break;
+	}
+}
+
+static void *worker_routine(void *arg) {
+	exAVWorker *w = arg;
+	exAVExecutor *e = w->executor;
+	exAVTask *t = NULL;
+	current_worker = w;
+	ex_av_trace_thread_name("executor worker");
+	while (1) {
+		if ((t = worker_dequeue(w)) == NULL && (t = worker_steal(w)) == NULL) {
+			int quit = 0;
+			pthread_mutex_lock(&e->mutex);
+			__atomic_add_fetch(&e->nb_idle, 1, __ATOMIC_SEQ_CST);
+			while (!e->quit && __atomic_load_n(&e->nb_pending, __ATOMIC_SEQ_CST) == 0)
+				pthread_cond_wait(&e->cond, &e->mutex);
+			__atomic_sub_fetch(&e->nb_idle, 1, __ATOMIC_SEQ_CST);
+			quit = e->quit;
+			pthread_mutex_unlock(&e->mutex);
+			if (quit)
+				break;
+			continue;
+		}
+		run_task(w, t);
+	}
+	return NULL;
+}
+
+exAVExecutor *ex_av_executor_create(int nb_workers) {
+	exAVExecutor *e = NULL;
+	int i = 0;
+	if (nb_workers <= 0)
+		nb_workers = av_cpu_count();
+	nb_workers = av_clip(nb_workers, 1, EXECUTOR_MAX_WORKERS);
+	if ((e = calloc(1, sizeof(exAVExecutor))) == NULL)
+		goto err0;
+	if ((e->workers = calloc(nb_workers, sizeof(exAVWorker))) == NULL)
+		goto err1;
+	if (pthread_mutex_init(&e->mutex, NULL))
+		goto err2;
+	if (pthread_cond_init(&e->cond, NULL))
+		goto err3;
+	if (pthread_cond_init(&e->done, NULL))
+		goto err4;
+	e->nb_workers = nb_workers;
+	for (i = 0; i < nb_workers; i++) {
+		exAVWorker *w = &e->workers[i];
+		w->executor = e;
+		w->idx = i;
+		if (pthread_mutex_init(&w->mutex, NULL))
+			goto err5;
+		if (pthread_create(&w->thread, NULL, worker_routine, w)) {
+			pthread_mutex_destroy(&w->mutex);
+			goto err5;
+		}
+	}
+	return e;
+err5:
+	av_log(NULL, AV_LOG_ERROR, "ex_av_executor_create error: unable to start worker %d\n", i);
+	pthread_mutex_lock(&e->mutex);
+	e->quit = 1;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->mutex);
+	while (i-- > 0) {
+		pthread_join(e->workers[i].thread, NULL);
+		pthread_mutex_destroy(&e->workers[i].mutex);
+	}
+	pthread_cond_destroy(&e->done);
+err4:
+	pthread_cond_destroy(&e->cond);
+err3:
+	pthread_mutex_destroy(&e->mutex);
+err2:
+	free(e->workers);
+err1:
+	free(e);
+err0:
+	return NULL;
+}
+
+void ex_av_executor_free(exAVExecutor **e) {
+	exAVExecutor *p = *e;
+	if (p == NULL)
+		return;
+	*e = NULL;
+	pthread_mutex_lock(&p->mutex);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	for (int i = 0; i < p->nb_workers; i++) {
+		pthread_join(p->workers[i].thread, NULL);
+		pthread_mutex_destroy(&p->workers[i].mutex);
+	}
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mutex);
+	free(p->workers);
+	free(p);
+}
+
+exAVTask *ex_av_task_create(exAVExecutor *e, int (*step)(exAVTask *t, void *opaque), void *opaque) {
+	exAVTask *t = calloc(1, sizeof(exAVTask));
+	if (t == NULL)
+		return NULL;
+	t->step = step;
+	t->opaque = opaque;
+	t->executor = e;
+	t->state = TASK_STATE_PARKED;
+	return t;
+}
+
+void ex_av_task_wake(exAVTask *t) {
+	int state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+	while (1) {
+		if (state == TASK_STATE_PARKED) {
+			if (cas_state(t, &state, TASK_STATE_QUEUED)) {
+				executor_enqueue(t->executor, t);
+				return;
+			}
+		}
+		else if (state == TASK_STATE_RUNNING) {
+			if (cas_state(t, &state, TASK_STATE_NOTIFIED))
+				return;
+		}
+		else {
+			return; /* already queued, notified or done */
+		}
+	}
+}
+
+void ex_av_task_wait(exAVTask *t) {
+	exAVExecutor *e = t->executor;
+	pthread_mutex_lock(&e->mutex);
+	while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != TASK_STATE_DONE)
+		pthread_cond_wait(&e->done, &e->mutex);
+	pthread_mutex_unlock(&e->mutex);
+}
+
+void ex_av_task_free(exAVTask **t) {
+	if (*t == NULL)
+		return;
+	free(*t);
+	*t = NULL;
+}
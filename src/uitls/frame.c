@@ -5,8 +5,11 @@
  *      Author: yui
  */
 
+#include <libavutil/pixdesc.h>
+
 #include <ffmpeg_config.h>
 #include <frame.h>
+#include <trace.h>
 
 AVFrame	*av_frame_load_picture(const char *url) {
 	int ret = 0, stream_idx = -1;
@@ -111,9 +114,104 @@ static const struct TextureFormatEntry {
 	{ AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
 	{ AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
 	{ AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+	{ AV_PIX_FMT_NV12,           SDL_PIXELFORMAT_NV12 },
+	{ AV_PIX_FMT_NV21,           SDL_PIXELFORMAT_NV21 },
+#endif
 	{ AV_PIX_FMT_NONE,           SDL_PIXELFORMAT_UNKNOWN },
 };
 
+/*
+ * Return the YUV texture a YUV format with no texture of its own is cheaply converted into: the chroma of
+ * 4:2:2 and 4:4:4 is point-sampled down to 4:2:0, and the samples deeper than 8 bits are shifted down,
+ * instead of going through sws_scale to BGRA; or SDL_PIXELFORMAT_UNKNOWN if the format is not handled.
+ */
+static Uint32 get_sdl_convert_pixelfmt(int format) {
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+	int bytes;
+	if (desc == NULL || desc->nb_components != 3 || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+			(desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL |
+			                AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_FLOAT)))
+		return SDL_PIXELFORMAT_UNKNOWN;
+	bytes = desc->comp[0].depth > 8 ? 2 : 1;
+	if (desc->comp[0].depth > 16 || desc->log2_chroma_w > 1 || desc->log2_chroma_h > 1)
+		return SDL_PIXELFORMAT_UNKNOWN;
+	/* planar: Y, U and V in planes 0, 1 and 2 */
+	if (desc->comp[1].plane == 1 && desc->comp[2].plane == 2 && desc->comp[1].step == bytes)
+		return SDL_PIXELFORMAT_IYUV;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+	/* semi-planar(e.g. P010): U and V interleaved in plane 1, horizontally subsampled */
+	if (desc->comp[1].plane == 1 && desc->comp[2].plane == 1 && desc->log2_chroma_w == 1 &&
+			desc->comp[1].offset == 0 && desc->comp[2].offset == bytes)
+		return SDL_PIXELFORMAT_NV12;
+#endif
+	return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+/*
+ * Write 'w'x'h' 8-bit samples into 'dst', the row 'y' taken from the row 'y << ys' of 'src', the sample 'x'
+ * from the sample 'x << xs'; the 16-bit samples are shifted right by 'shift'.
+ */
+static void plane_to_8bit(uint8_t *dst, int pitch, const uint8_t *src, int linesize, int w, int h, int xs, int ys, int bytes, int shift) {
+	for (int y = 0; y < h; y++, dst += pitch) {
+		const uint8_t *s = src + (ptrdiff_t)(y << ys) * linesize;
+		if (bytes == 1 && xs == 0)
+			memcpy(dst, s, w);
+		else if (bytes == 1) {
+			for (int x = 0; x < w; x++)
+				dst[x] = s[x << xs];
+		}
+		else {
+			const uint16_t *s16 = (const uint16_t *)s;
+			for (int x = 0; x < w; x++)
+				dst[x] = s16[x << xs] >> shift;
+		}
+	}
+}
+
+/*
+ * Convert the frame into the locked YUV texture 'texture_fmt'(see 'get_sdl_convert_pixelfmt'), whose planes
+ * follow each other from 'pixels': Y with 'pitch', then U and V with half of it for IYUV, or UV with it rounded
+ * up to even for NV12.
+ */
+static void convert_to_texture(AVFrame *frame, Uint32 texture_fmt, uint8_t *pixels, int pitch) {
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int bytes = desc->comp[0].depth > 8 ? 2 : 1;
+	/* the samples are aligned to the most significant bit by 'shift' */
+	int shift = bytes == 2 ? desc->comp[0].shift + desc->comp[0].depth - 8 : 0;
+	int xs = 1 - desc->log2_chroma_w, ys = 1 - desc->log2_chroma_h;
+	int w2 = AV_CEIL_RSHIFT(frame->width, 1), h2 = AV_CEIL_RSHIFT(frame->height, 1);
+	uint8_t *u = pixels + pitch * frame->height;
+	plane_to_8bit(pixels, pitch, frame->data[0], frame->linesize[0], frame->width, frame->height, 0, 0, bytes, shift);
+	if (texture_fmt == SDL_PIXELFORMAT_NV12) {
+		/* the pairs of U and V are taken as the samples of a plane twice as wide */
+		plane_to_8bit(u, 2 * ((pitch + 1) / 2), frame->data[1], frame->linesize[1], 2 * w2, h2, 0, ys, bytes, shift);
+		return;
+	}
+	plane_to_8bit(u, (pitch + 1) / 2, frame->data[1], frame->linesize[1], w2, h2, xs, ys, bytes, shift);
+	plane_to_8bit(u + h2 * ((pitch + 1) / 2), (pitch + 1) / 2, frame->data[2], frame->linesize[2], w2, h2, xs, ys, bytes, shift);
+}
+
+/*
+ * Tell SDL the matrix and the range of the YUV frames, as the texture formats do not carry them.
+ * The mode is global and applies to both the upload and the rendering of the texture, so it is set
+ * before the upload and reset(with a NULL 'frame') once the texture is rendered.
+ */
+void set_sdl_yuv_conversion_mode(AVFrame *frame) {
+#if SDL_VERSION_ATLEAST(2, 0, 8)
+	SDL_YUV_CONVERSION_MODE mode = SDL_YUV_CONVERSION_AUTOMATIC;
+	if (!frame)
+		mode = SDL_YUV_CONVERSION_AUTOMATIC;
+	else if (frame->color_range == AVCOL_RANGE_JPEG)
+		mode = SDL_YUV_CONVERSION_JPEG;
+	else if (frame->colorspace == AVCOL_SPC_BT709)
+		mode = SDL_YUV_CONVERSION_BT709;
+	else if (frame->colorspace == AVCOL_SPC_BT470BG || frame->colorspace == AVCOL_SPC_SMPTE170M)
+		mode = SDL_YUV_CONVERSION_BT601;
+	SDL_SetYUVConversionMode(mode);
+#endif
+}
+
 static void get_sdl_pixelfmt_and_blendmode(int format, Uint32 *sdl_pixelfmt, SDL_BlendMode *sdl_blendmode) {
 	int i;
 	*sdl_blendmode = SDL_BLENDMODE_NONE;
@@ -152,11 +250,39 @@ static int realloc_texture(SDL_Renderer *renderer, SDL_Texture **texture, Uint32
 	return 0;
 }
 
-int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx) {
-	int ret = 0;
+/*
+ * Whether the frames of 'format' are uploaded by 'sdl_update_texture' as they are, without any conversion.
+ */
+int sdl_texture_format_supported(int format) {
 	Uint32 sdl_pixelfmt;
 	SDL_BlendMode sdl_blendmode;
+	get_sdl_pixelfmt_and_blendmode(format, &sdl_pixelfmt, &sdl_blendmode);
+	return sdl_pixelfmt != SDL_PIXELFORMAT_UNKNOWN;
+}
+
+/*
+ * Upload 'frame' into '*tex', converted if SDL could not take its format; 'stream' and 'serial' tag the
+ * conversion in the trace, -1 if none.
+ */
+int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx,
+                       int stream, int serial) {
+	int ret = 0;
+	Uint32 sdl_pixelfmt, convert_pixelfmt = SDL_PIXELFORMAT_UNKNOWN;
+	SDL_BlendMode sdl_blendmode;
 	get_sdl_pixelfmt_and_blendmode(frame->format, &sdl_pixelfmt, &sdl_blendmode);
+	if (sdl_pixelfmt == SDL_PIXELFORMAT_UNKNOWN)
+		convert_pixelfmt = get_sdl_convert_pixelfmt(frame->format);
+	if (convert_pixelfmt != SDL_PIXELFORMAT_UNKNOWN) {
+		uint8_t *pixels;
+		int pitch;
+		if (realloc_texture(render, tex, convert_pixelfmt, frame->width, frame->height, sdl_blendmode, 0) < 0)
+			return -1;
+		if ((ret = SDL_LockTexture(*tex, NULL, (void **)&pixels, &pitch)) < 0)
+			return ret;
+		convert_to_texture(frame, convert_pixelfmt, pixels, pitch);
+		SDL_UnlockTexture(*tex);
+		return 0;
+	}
 	if (realloc_texture(render, tex, sdl_pixelfmt == SDL_PIXELFORMAT_UNKNOWN ? SDL_PIXELFORMAT_ARGB8888 : sdl_pixelfmt, frame->width, frame->height, sdl_blendmode, 0) < 0)
 		return -1;
 	switch (sdl_pixelfmt) {
@@ -169,7 +295,9 @@ int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame,
 				uint8_t *pixels[4];
 				int pitch[4];
 				if(!SDL_LockTexture(*tex, NULL, (void **)pixels, pitch)) {
+					int64_t trace = ex_av_trace_begin();
 					sws_scale(*img_convert_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, pixels, pitch);
+					ex_av_trace_end(trace, "sws_scale", stream, serial, frame->pts);
 					SDL_UnlockTexture(*tex);
 				}
 			}
@@ -194,6 +322,22 @@ int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame,
 				return -1;
 			}
 			break;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+		case SDL_PIXELFORMAT_NV12:
+		case SDL_PIXELFORMAT_NV21:
+			if (frame->linesize[0] > 0 && frame->linesize[1] > 0) {
+				ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1]);
+			}
+			else if (frame->linesize[0] < 0 && frame->linesize[1] < 0) {
+				ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height                    - 1), -frame->linesize[0],
+																							frame->data[1] + frame->linesize[1] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[1]);
+			}
+			else {
+				av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+				return -1;
+			}
+			break;
+#endif
 		default:
 			if (frame->linesize[0] < 0) {
 				ret = SDL_UpdateTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
@@ -226,7 +370,8 @@ void av_frame_show(AVFrame *frame) {
 		av_log(NULL, AV_LOG_ERROR, "av_frame_show error: failed to create SDL_Renderer.\n");
 		goto err1;
 	}
-	sdl_update_texture(renderer, &texture, frame, &img_convert_ctx);
+	set_sdl_yuv_conversion_mode(frame);
+	sdl_update_texture(renderer, &texture, frame, &img_convert_ctx, -1, -1);
 	SDL_SetRenderTarget(renderer, texture);
 	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 	while (1) {
@@ -236,6 +381,7 @@ void av_frame_show(AVFrame *frame) {
 		SDL_RenderCopy(renderer, texture, NULL, NULL);
 		SDL_RenderPresent(renderer);
 	}
+	set_sdl_yuv_conversion_mode(NULL);
 
 err1:
 	if (window) {
@@ -432,18 +578,57 @@ static exAVFrame *get(exAVFrame *self) {
 	return self;
 }
 
+static void frame_free(exAVFrame *self) {
+	av_frame_free(&self->avframe);
+	pthread_rwlock_destroy(&self->rwlock);
+	free(self);
+}
+
+static void pool_destroy(exAVFramePool *pool) {
+	for (int i = 0; i < pool->nb_frames; i++)
+		frame_free(pool->frames[i]);
+	free(pool->frames);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+/*
+ * Release the data of a frame and give it back to its pool.
+ */
+static void frame_recycle(exAVFrame *self) {
+	int destroy = 0;
+	exAVFramePool *pool = self->pool;
+	av_frame_unref(self->avframe);
+	memset((uint8_t *)self + sizeof(exAVFrame), 0, pool->size - sizeof(exAVFrame));
+	INIT_LIST_HEAD(&self->list);
+	atomic_set(&self->refcount, 1);
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->closed && pool->nb_frames < pool->max_frames) {
+		pool->frames[pool->nb_frames++] = self;
+		self = NULL;
+	}
+	destroy = (--pool->refcount == 0);
+	pthread_mutex_unlock(&pool->mutex);
+	if (self)
+		frame_free(self);
+	if (destroy)
+		pool_destroy(pool);
+}
+
 static void put(exAVFrame *self) {
 	if(atomic_dec_and_test(&self->refcount)) {
 		if(pthread_rwlock_trywrlock(&self->rwlock))
 			return; /* there is someone else has 'get' this frame, so let that caller free the frame */
 		atomic_dec(&self->refcount);
 		list_del(&self->list);
+		pthread_rwlock_unlock(&self->rwlock);
+		if (self->pool) {
+			frame_recycle(self);
+			return;
+		}
 		if(self->avframe && av_frame_is_writable(self->avframe))
 			av_frame_unref(self->avframe);
-		av_frame_free(&self->avframe);
-		pthread_rwlock_unlock(&self->rwlock);
-		pthread_rwlock_destroy(&self->rwlock);
-		free(self);
+		frame_free(self);
 	}
 }
 
@@ -508,4 +693,62 @@ void ex_av_frame_free_list_entry(struct list_head *n) {
 	put(self);
 }
 
+exAVFramePool *ex_av_frame_pool_create(size_t size, int max_frames) {
+	exAVFramePool *pool = calloc(1, sizeof(exAVFramePool));
+	if (pool == NULL)
+		goto err0;
+	pool->size = size < sizeof(exAVFrame) ? sizeof(exAVFrame) : size;
+	pool->max_frames = max_frames;
+	pool->refcount = 1;
+	pool->frames = calloc(max_frames, sizeof(exAVFrame *));
+	if (pool->frames == NULL)
+		goto err1;
+	if (pthread_mutex_init(&pool->mutex, NULL))
+		goto err2;
+	return pool;
+err2:
+	free(pool->frames);
+err1:
+	free(pool);
+err0:
+	return NULL;
+}
+
+exAVFrame *ex_av_frame_pool_alloc(exAVFramePool *pool) {
+	exAVFrame *f = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->nb_frames > 0) {
+		f = pool->frames[--pool->nb_frames];
+		pool->nb_reuses++;
+	}
+	else {
+		pool->nb_allocs++;
+	}
+	pool->refcount++;
+	pthread_mutex_unlock(&pool->mutex);
+	if (f)
+		return f;
+	f = ex_av_frame_alloc(pool->size);
+	if (f == NULL) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->refcount--; /* never reach 0 here, the caller still holds the pool */
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+	f->pool = pool;
+	return f;
+}
 
+void ex_av_frame_pool_free(exAVFramePool **pool) {
+	int destroy = 0;
+	exAVFramePool *p = *pool;
+	if (p == NULL)
+		return;
+	*pool = NULL;
+	pthread_mutex_lock(&p->mutex);
+	p->closed = 1;
+	destroy = (--p->refcount == 0);
+	pthread_mutex_unlock(&p->mutex);
+	if (destroy)
+		pool_destroy(p);
+}
@@ -8,12 +8,60 @@
 #include <libavformat/avio.h>
 #include <libavutil/hash.h>
 #include <libavutil/mem.h>
+#include <libavutil/common.h>
+
+#include <mmapio.h>
+
+/* How many bytes of the mapping hashed at once, the size of the file is checked again before each of them */
+#define HASH_MAP_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Hash a local file straight from its mapping, without copying it.
+ * Return AVERROR(EAGAIN) if the file is truncated meanwhile, then it is hashed by reading instead.
+ */
+static int hash_mapped_file(const char *hash_type, exAVMappedFile *mf, uint8_t **out) {
+	int ret = 0, hash_size = 0;
+	uint8_t *dst = *out;
+	struct AVHashContext *hash_ctx = NULL;
+	if ((ret = av_hash_alloc(&hash_ctx, hash_type)) < 0)
+		return ret;
+	av_hash_init(hash_ctx);
+	hash_size = av_hash_get_size(hash_ctx);
+	if (dst == NULL && (dst = av_malloc(hash_size)) == NULL) {
+		ret = AVERROR(ENOMEM);
+		goto end;
+	}
+	for (int64_t pos = 0; pos < mf->size; pos += HASH_MAP_CHUNK_SIZE) {
+		int64_t len = FFMIN(HASH_MAP_CHUNK_SIZE, mf->size - pos);
+		if (ex_av_file_readable_size(mf) < pos + len) {
+			ret = AVERROR(EAGAIN);
+			goto end;
+		}
+		ex_av_file_readahead(mf, pos);
+		av_hash_update(hash_ctx, mf->data + pos, len);
+	}
+	av_hash_final(hash_ctx, dst);
+	ret = hash_size;
+	*out = dst;
+end:
+	if (ret < 0 && dst != *out)
+		av_free(dst);
+	av_hash_freep(&hash_ctx);
+	return ret;
+}
 
 int av_hash_file(const char *hash_type, const char *url, uint8_t **out) {
 	int ret = 0, hash_size = 0;
 	uint8_t buf[4096] = { 0 }, *dst = NULL;
 	AVIOContext *avio_ctx = NULL;
 	struct AVHashContext *hash_ctx = NULL;
+	exAVMappedFile *mf = NULL;
+	if (ex_av_file_map(&mf, url) == 0) {
+		ret = hash_mapped_file(hash_type, mf, out);
+		ex_av_file_unmap(&mf);
+		if (ret != AVERROR(EAGAIN))
+			return ret;
+	}
 	ret = avio_open(&avio_ctx, url, AVIO_FLAG_READ);
 	if(ret < 0)
 		goto end;
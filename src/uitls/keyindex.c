@@ -0,0 +1,463 @@
+/*
+ * keyindex.c
+ *
+ *  Created on: 2026-10-16 16:52:37
+ *      Author: yui
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+#include <libavutil/crc.h>
+
+#include <keyindex.h>
+#include <mmapio.h>
+
+/*
+ * Sidecar file: the magic, the version, the 'complete' flag, then varints(LEB128): the length and the bytes
+ * of the url of the media(the file name is only a hash of it), the stream index, the time base, the size,
+ * the modification time and the head CRC of the media, the number of entries, the zigzag-coded 'covered',
+ * and the zigzag-coded deltas of the pts and the position of every entry from the previous one;
+ * a keyframe costs 3 or 4 bytes usually.
+ */
+#define KEY_INDEX_MAGIC   MKTAG('E', 'X', 'K', 'I')
+#define KEY_INDEX_VERSION 3
+#define KEY_INDEX_MAX_ENTRIES (1 << 26)
+#define KEY_INDEX_MAX_URL 4096
+
+static pthread_mutex_t cache_dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir;             /* NULL for the default, see 'ex_av_key_index_set_cache_dir' */
+
+void ex_av_key_index_set_cache_dir(const char *dir) {
+	pthread_mutex_lock(&cache_dir_mutex);
+	av_freep(&cache_dir);
+	if (dir)
+		cache_dir = av_strdup(dir);
+	pthread_mutex_unlock(&cache_dir_mutex);
+}
+
+/*
+ * Return the path of the sidecar of the media 'url' in the cache directory, or NULL if failed.
+ */
+static char *sidecar_path(const char *url) {
+	char *dir = NULL, *base = NULL, *path = NULL;
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	/* FNV-1a */
+	for (const char *p = url; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * UINT64_C(0x100000001b3);
+	pthread_mutex_lock(&cache_dir_mutex);
+	if (cache_dir)
+		dir = av_strdup(cache_dir);
+	pthread_mutex_unlock(&cache_dir_mutex);
+	if (dir == NULL) {
+		if (ex_av_file_cache_dir(&base) < 0)
+			return NULL;
+		dir = av_asprintf("%s/%s", base, KEY_INDEX_CACHE_DIR);
+		av_free(base);
+		if (dir == NULL)
+			return NULL;
+	}
+	path = av_asprintf("%s/%016"PRIx64"%s", dir, hash, KEY_INDEX_SUFFIX);
+	av_free(dir);
+	return path;
+}
+
+/*
+ * Create the directory of the sidecar if it is missing.
+ */
+static int make_sidecar_dir(const char *sidecar) {
+	int ret = 0;
+	char *dir = av_strdup(sidecar), *sep = NULL;
+	if (dir == NULL)
+		return AVERROR(ENOMEM);
+	if ((sep = strrchr(dir, '/')) != NULL) {
+		*sep = '\0';
+		ret = ex_av_file_make_dirs(dir);
+	}
+	av_free(dir);
+	return ret;
+}
+
+static void write_varint(AVIOContext *pb, uint64_t v) {
+	while (v >= 0x80) {
+		avio_w8(pb, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	avio_w8(pb, v);
+}
+
+static uint64_t read_varint(AVIOContext *pb) {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = avio_r8(pb);
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+	return v;
+}
+
+static inline uint64_t zigzag_encode(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Return the index of the first entry whose pts is greater than 'pts'.
+ */
+static int upper_bound(exAVKeyIndex *idx, int64_t pts) {
+	int lo = 0, hi = idx->nb_entries;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (idx->entries[mid].pts <= pts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int insert_entry(exAVKeyIndex *idx, int64_t pts, int64_t pos) {
+	int i = upper_bound(idx, pts);
+	/* indexed already, or closer than 'interval' to an entry */
+	if (i > 0 && pts - idx->entries[i - 1].pts < FFMAX(idx->interval, 1))
+		return 0;
+	if (i < idx->nb_entries && idx->entries[i].pts - pts < idx->interval)
+		return 0;
+	if (idx->nb_entries >= KEY_INDEX_MAX_ENTRIES)
+		return AVERROR(ENOMEM);
+	if (idx->nb_entries == idx->capacity) {
+		int capacity = idx->capacity ? idx->capacity * 2 : 1024;
+		exAVKeyEntry *entries = av_realloc_array(idx->entries, capacity, sizeof(exAVKeyEntry));
+		if (entries == NULL)
+			return AVERROR(ENOMEM);
+		idx->entries = entries;
+		idx->capacity = capacity;
+	}
+	memmove(&idx->entries[i + 1], &idx->entries[i], (idx->nb_entries - i) * sizeof(exAVKeyEntry));
+	idx->entries[i].pts = pts;
+	idx->entries[i].pos = pos;
+	idx->nb_entries++;
+	return 0;
+}
+
+/*
+ * Return the unwrapped timestamp the closest to 'covered', of all those 'pts' could be before wrapping around.
+ */
+static int64_t unwrap_pts(exAVKeyIndex *idx, int64_t pts) {
+	int64_t period = 0;
+	if (idx->wrap_bits <= 0 || idx->wrap_bits >= 63 || idx->covered == AV_NOPTS_VALUE)
+		return pts;
+	period = INT64_C(1) << idx->wrap_bits;
+	while (pts < idx->covered - period / 2)
+		pts += period;
+	while (pts > idx->covered + period / 2)
+		pts -= period;
+	return pts;
+}
+
+void ex_av_key_index_add(exAVKeyIndex *idx, int64_t pts, int64_t pos, int key) {
+	if (pts == AV_NOPTS_VALUE)
+		return;
+	pthread_mutex_lock(&idx->mutex);
+	pts = unwrap_pts(idx, pts);
+	if (idx->complete || (idx->covered != AV_NOPTS_VALUE && pts <= idx->covered))
+		goto out; /* indexed already */
+	if (key && pos >= 0 && insert_entry(idx, pts, pos) < 0)
+		goto out;
+	idx->covered = pts;
+	idx->dirty = 1;
+out:
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+int ex_av_key_index_lookup(exAVKeyIndex *idx, int64_t pts, exAVKeyEntry *e) {
+	int ret = AVERROR(ENOENT), i = 0;
+	pthread_mutex_lock(&idx->mutex);
+	if (!idx->complete && (idx->covered == AV_NOPTS_VALUE || pts > idx->covered))
+		goto out; /* there could be a closer keyframe not yet indexed */
+	if ((i = upper_bound(idx, pts)) > 0) {
+		*e = idx->entries[i - 1];
+		ret = 0;
+	}
+out:
+	pthread_mutex_unlock(&idx->mutex);
+	return ret;
+}
+
+/*
+ * Whether the sidecar is of the media 'url', and not of another one of the same hash.
+ */
+static int read_url_matches(AVIOContext *pb, const char *url) {
+	int ret = 0;
+	uint64_t len = read_varint(pb);
+	char *buf = NULL;
+	if (len != strlen(url) || len > KEY_INDEX_MAX_URL || (buf = av_malloc(len + 1)) == NULL)
+		return 0;
+	ret = avio_read(pb, buf, len) == len && !memcmp(buf, url, len);
+	av_free(buf);
+	return ret;
+}
+
+static int load_sidecar(exAVKeyIndex *idx) {
+	int ret = 0, complete = 0, stream_index = 0;
+	int64_t pts = 0, pos = 0, file_size = 0, mtime = 0, covered = 0;
+	uint32_t head_crc = 0;
+	uint64_t nb_entries = 0;
+	AVRational tb;
+	AVIOContext *pb = NULL;
+	if ((ret = avio_open(&pb, idx->sidecar, AVIO_FLAG_READ)) < 0)
+		return ret;
+	if (avio_rl32(pb) != KEY_INDEX_MAGIC || avio_r8(pb) != KEY_INDEX_VERSION) {
+		ret = AVERROR_INVALIDDATA;
+		goto out;
+	}
+	complete = avio_r8(pb);
+	if (!read_url_matches(pb, idx->url)) {
+		ret = AVERROR_INVALIDDATA;
+		goto out;
+	}
+	stream_index = read_varint(pb);
+	tb.num = read_varint(pb);
+	tb.den = read_varint(pb);
+	file_size = read_varint(pb);
+	mtime = zigzag_decode(read_varint(pb));
+	head_crc = read_varint(pb);
+	nb_entries = read_varint(pb);
+	covered = zigzag_decode(read_varint(pb));
+	if (stream_index != idx->stream_index || av_cmp_q(tb, idx->time_base) || file_size != idx->file_size ||
+			mtime != idx->mtime || head_crc != idx->head_crc || nb_entries > KEY_INDEX_MAX_ENTRIES) {
+		ret = AVERROR_INVALIDDATA; /* the media has changed */
+		goto out;
+	}
+	if ((idx->entries = av_malloc_array(FFMAX(nb_entries, 1), sizeof(exAVKeyEntry))) == NULL) {
+		ret = AVERROR(ENOMEM);
+		goto out;
+	}
+	idx->capacity = FFMAX(nb_entries, 1);
+	for (int i = 0; i < nb_entries; i++) {
+		pts += zigzag_decode(read_varint(pb));
+		pos += zigzag_decode(read_varint(pb));
+		idx->entries[i].pts = pts;
+		idx->entries[i].pos = pos;
+	}
+	if (pb->error || avio_feof(pb)) {
+		ret = pb->error ? pb->error : AVERROR_INVALIDDATA;
+		goto out;
+	}
+	idx->nb_entries = nb_entries;
+	idx->covered = covered;
+	idx->complete = complete;
+out:
+	avio_closep(&pb);
+	return ret;
+}
+
+/*
+ * The entries are copied under the mutex, and written without it, so that the grabber and the lookups
+ * are not blocked by the file I/O.
+ */
+int ex_av_key_index_save(exAVKeyIndex *idx) {
+	int ret = 0, complete = 0, nb_entries = 0;
+	int64_t pts = 0, pos = 0, covered = 0;
+	exAVKeyEntry *entries = NULL;
+	AVIOContext *pb = NULL;
+	if (idx->sidecar == NULL)
+		return AVERROR(ENOSYS);
+	pthread_mutex_lock(&idx->mutex);
+	complete = idx->complete;
+	covered = idx->covered;
+	nb_entries = idx->nb_entries;
+	if (nb_entries && (entries = av_memdup(idx->entries, nb_entries * sizeof(exAVKeyEntry))) == NULL) {
+		pthread_mutex_unlock(&idx->mutex);
+		return AVERROR(ENOMEM);
+	}
+	idx->dirty = 0;
+	pthread_mutex_unlock(&idx->mutex);
+	if ((ret = make_sidecar_dir(idx->sidecar)) < 0 || (ret = avio_open(&pb, idx->sidecar, AVIO_FLAG_WRITE)) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "ex_av_key_index_save: avio_open error: %s: %s\n", av_err2str(ret), idx->sidecar);
+		goto out;
+	}
+	avio_wl32(pb, KEY_INDEX_MAGIC);
+	avio_w8(pb, KEY_INDEX_VERSION);
+	avio_w8(pb, complete);
+	write_varint(pb, strlen(idx->url));
+	avio_write(pb, (const uint8_t *)idx->url, strlen(idx->url));
+	write_varint(pb, idx->stream_index);
+	write_varint(pb, idx->time_base.num);
+	write_varint(pb, idx->time_base.den);
+	write_varint(pb, idx->file_size);
+	write_varint(pb, zigzag_encode(idx->mtime));
+	write_varint(pb, idx->head_crc);
+	write_varint(pb, nb_entries);
+	write_varint(pb, zigzag_encode(covered));
+	for (int i = 0; i < nb_entries; i++) {
+		write_varint(pb, zigzag_encode(entries[i].pts - pts));
+		write_varint(pb, zigzag_encode(entries[i].pos - pos));
+		pts = entries[i].pts;
+		pos = entries[i].pos;
+	}
+	avio_flush(pb);
+	ret = pb->error;
+	avio_closep(&pb);
+out:
+	if (ret < 0) {
+		pthread_mutex_lock(&idx->mutex);
+		idx->dirty = 1;
+		pthread_mutex_unlock(&idx->mutex);
+	}
+	av_free(entries);
+	return ret;
+}
+
+static int builder_interrupt_cb(void *opaque) {
+	exAVKeyIndex *idx = opaque;
+	return __atomic_load_n(&idx->abort, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read the whole media from another context, so that the grabber is not disturbed.
+ */
+static void *builder_routine(void *arg) {
+	exAVKeyIndex *idx = arg;
+	AVFormatContext *ic = NULL;
+	AVPacket *pkt = NULL;
+	int ret = AVERROR(ENOMEM);
+	if ((ic = avformat_alloc_context()) == NULL || (pkt = av_packet_alloc()) == NULL)
+		goto out;
+	ic->interrupt_callback.callback = builder_interrupt_cb;
+	ic->interrupt_callback.opaque = idx;
+	if ((ret = avformat_open_input(&ic, idx->url, NULL, NULL)) < 0 ||
+			(ret = avformat_find_stream_info(ic, NULL)) < 0)
+		goto out;
+	if (idx->stream_index >= ic->nb_streams) {
+		ret = AVERROR_STREAM_NOT_FOUND;
+		goto out;
+	}
+	for (int i = 0; i < ic->nb_streams; i++) {
+		if (i != idx->stream_index)
+			ic->streams[i]->discard = AVDISCARD_ALL;
+	}
+	while ((ret = av_read_frame(ic, pkt)) >= 0) {
+		if (pkt->stream_index == idx->stream_index)
+			ex_av_key_index_add(idx, pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts, pkt->pos, pkt->flags & AV_PKT_FLAG_KEY);
+		av_packet_unref(pkt);
+	}
+	if (ret == AVERROR_EOF) {
+		pthread_mutex_lock(&idx->mutex);
+		idx->complete = 1;
+		idx->dirty = 1;
+		pthread_mutex_unlock(&idx->mutex);
+		if (idx->sidecar)
+			ex_av_key_index_save(idx);
+		av_log(NULL, AV_LOG_VERBOSE, "key index of %s: %d keyframes\n", idx->url, idx->nb_entries);
+	}
+out:
+	if (ret < 0 && ret != AVERROR_EOF && ret != AVERROR_EXIT)
+		av_log(NULL, AV_LOG_WARNING, "key index builder error: %s: %s\n", av_err2str(ret), idx->url);
+	av_packet_free(&pkt);
+	avformat_close_input(&ic);
+	return NULL;
+}
+
+/*
+ * Compute the CRC-32 of the first KEY_INDEX_HEAD_SIZE bytes of the local media, read from another context.
+ */
+static int compute_head_crc(const char *url, uint32_t *crc) {
+	int ret = 0;
+	uint8_t *buf = NULL;
+	AVIOContext *pb = NULL;
+	if ((buf = av_malloc(KEY_INDEX_HEAD_SIZE)) == NULL)
+		return AVERROR(ENOMEM);
+	if ((ret = avio_open(&pb, url, AVIO_FLAG_READ)) < 0)
+		goto out;
+	if ((ret = avio_read(pb, buf, KEY_INDEX_HEAD_SIZE)) < 0)
+		goto out;
+	*crc = av_crc(av_crc_get_table(AV_CRC_32_IEEE_LE), UINT32_MAX, buf, ret);
+	ret = 0;
+out:
+	avio_closep(&pb);
+	av_free(buf);
+	return ret;
+}
+
+int ex_av_key_index_build(exAVKeyIndex *idx) {
+	int ret = 0;
+	if (idx->complete || idx->builder_started)
+		return 0;
+	if ((ret = pthread_create(&idx->builder, NULL, builder_routine, idx)))
+		return AVERROR(ret);
+	idx->builder_started = 1;
+	return 0;
+}
+
+exAVKeyIndex *ex_av_key_index_create(AVFormatContext *ic, const char *url, int stream_index) {
+	const char *proto = avio_find_protocol_name(url);
+	exAVKeyIndex *idx = NULL;
+	int64_t size = 0;
+	if (stream_index < 0 || stream_index >= ic->nb_streams)
+		goto err0;
+	if (!av_match_name(ic->iformat->name, KEY_INDEX_FORMATS) || (ic->iformat->flags & AVFMT_NO_BYTE_SEEK))
+		goto err0;
+	if ((idx = av_mallocz(sizeof(exAVKeyIndex))) == NULL)
+		goto err0;
+	if (pthread_mutex_init(&idx->mutex, NULL))
+		goto err1;
+	idx->stream_index = stream_index;
+	idx->time_base = ic->streams[stream_index]->time_base;
+	idx->wrap_bits = ic->streams[stream_index]->pts_wrap_bits;
+	if (ic->streams[stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+		idx->interval = av_rescale_q(KEY_INDEX_AUDIO_INTERVAL, (AVRational){ 1, 1 }, idx->time_base);
+	idx->covered = AV_NOPTS_VALUE;
+	idx->file_size = ic->pb ? avio_size(ic->pb) : -1;
+	if ((idx->url = av_strdup(url)) == NULL)
+		goto err2;
+	if (proto && !strcmp(proto, "file") && idx->file_size > 0) {
+		if ((idx->sidecar = sidecar_path(url)) == NULL) {
+			av_log(NULL, AV_LOG_WARNING, "ex_av_key_index_create: no cache directory, the index of %s is not saved\n", url);
+			return idx;
+		}
+		/* a media of the same size may still have been rewritten */
+		if (ex_av_file_stat(url, &size, &idx->mtime) < 0 || compute_head_crc(url, &idx->head_crc) < 0) {
+			av_freep(&idx->sidecar);
+			return idx;
+		}
+		if (load_sidecar(idx) < 0) {
+			/* build it from scratch */
+			av_freep(&idx->entries);
+			idx->nb_entries = idx->capacity = 0;
+		}
+	}
+	return idx;
+err2:
+	pthread_mutex_destroy(&idx->mutex);
+err1:
+	av_free(idx);
+err0:
+	return NULL;
+}
+
+void ex_av_key_index_free(exAVKeyIndex **idx) {
+	exAVKeyIndex *p = *idx;
+	if (p == NULL)
+		return;
+	*idx = NULL;
+	if (p->builder_started) {
+		__atomic_store_n(&p->abort, 1, __ATOMIC_RELAXED);
+		pthread_join(p->builder, NULL);
+	}
+	if (p->dirty && p->sidecar)
+		ex_av_key_index_save(p);
+	pthread_mutex_destroy(&p->mutex);
+	av_free(p->entries);
+	av_free(p->sidecar);
+	av_free(p->url);
+	av_free(p);
+}
@@ -6,6 +6,7 @@
  */
 
 #include <pthread.h>
+#include <time.h>
 
 #include <libavutil/time.h>
 #include <libavutil/common.h>
@@ -13,12 +14,33 @@
 #include <libavutil/error.h>
 #include <libavutil/avstring.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
 
 #define EVENT_HANDLER_RESULT_EXIT   1
 #define EVENT_HANDLER_RESULT_OK     0
 #define EVENT_HANDLER_REUSLT_ERROR -1
 
+/* Size of the buffer of an AVIOContext over the callbacks of the caller */
+#define MEDIA_IO_BUFFER_SIZE       (64 * 1024)
+
+/* Seconds of re-sampled samples the audio renderer keeps ahead of the audio callback */
+#define AUDIO_RING_DURATION        0.2
+/* Microseconds the audio renderer waits at once for a frame or for free space in the ring */
+#define AUDIO_RENDER_WAIT          10000
+
 #include <media.h>
+#include <executor.h>
+#include <budget.h>
+#include <remux.h>
+#include <transcode.h>
+#include <keyindex.h>
+#include <mmapio.h>
+#include <prefetch.h>
+#include <probecache.h>
+#include <trace.h>
+#include <pcmring.h>
 
 typedef struct exFFFrame {
 	exAVFrame frame;
@@ -65,9 +87,17 @@ static exFFFrame *to_exffframe(exAVMedia *m, exAVFrame *f, enum AVMediaType type
 	return ff;
 }
 
+static void frame_ref_list_entry(struct list_head *n) {
+	exAVFrame *f = list_entry(n, exAVFrame, list);
+	f->get(f);
+}
+
+/*
+ * Peek a frame along with a reference of it, which is put once done with it: a seek may flush the queue meanwhile.
+ */
 static exAVFrame *_ex_av_frame_queue_peek(exAVFrameQueue *q, int idx) {
 	exAVFrame *f = NULL;
-	struct list_head *n = q->list->peek(q->list, idx);
+	struct list_head *n = ex_av_queue_peek_ref(&q->queue, idx, frame_ref_list_entry);
 	if (n) {
 		f = list_entry(n, exAVFrame, list);
 	}
@@ -78,19 +108,33 @@ static inline exAVFrame *ex_av_frame_queue_peek(exAVFrameQueue *q) {
 	return _ex_av_frame_queue_peek(q, 0);
 }
 
-//static inline exAVFrame *ex_av_frame_queue_peek_next(exAVFrameQueue *q) {
-//	return _ex_av_frame_queue_peek(q, 1);
-//}
+static inline exAVFrame *ex_av_frame_queue_peek_next(exAVFrameQueue *q) {
+	return _ex_av_frame_queue_peek(q, 1);
+}
 
-static exAVFrame *ex_av_frame_queue_pop(exAVFrameQueue *q) {
-	exAVFrame *f = NULL;
-	struct list_head *n = q->list->pop_front(q->list);
-	if (n)
-		f = list_entry(n, exAVFrame, list);
-	return f;
+/*
+ * Pop the peeked head 'f', and put the reference of the peek.
+ * Return 'f', or NULL if it has been flushed since the peek; the caller peeks again then.
+ */
+static exAVFrame *ex_av_frame_queue_next(exAVFrameQueue *q, exAVFrame *f) {
+	int ret = ex_av_queue_pop_entry(&q->queue, &f->list);
+	f->put(f);
+	return ret == 0 ? f : NULL;
+}
+
+/*
+ * Make the popped 'f' the last frame, which the next one is timed from, and put the one before.
+ */
+static void ex_av_frame_queue_set_last(exAVFrameQueue *q, exAVFrame *f) {
+	if (q->last)
+		q->last->put(q->last);
+	q->last = f;
 }
 
-extern int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx);
+extern int sdl_update_texture(SDL_Renderer *render, SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx,
+                              int stream, int serial);
+extern int sdl_texture_format_supported(int format);
+extern void set_sdl_yuv_conversion_mode(AVFrame *frame);
 
 static void calculate_display_rect(SDL_Rect *rect,
                                    int scr_xleft, int scr_ytop,
@@ -138,12 +182,24 @@ static void video_image_display(exAVMedia *m, exAVFrame *f) {
 													m->screen_width, m->screen_height,
 													m->video_width, m->video_height,
 													m->video_sar);
+	/* 'f' is the frame in the texture, or the one uploaded into it below */
 	if (f)
-		sdl_update_texture(m->renderer, &m->texture, f->avframe, &m->sws_ctx);
+		set_sdl_yuv_conversion_mode(f->avframe);
+	if (f && m->texture_stale) {
+		/* upload into the texture of the frame before, the renderer may still be reading the one just shown */
+		SDL_Texture *tex = m->back_texture;
+		int64_t trace = ex_av_trace_begin();
+		sdl_update_texture(m->renderer, &tex, f->avframe, &m->sws_ctx, m->video_idx, m->vframes.serial);
+		ex_av_trace_end(trace, "upload", m->video_idx, m->vframes.serial, f->avframe->pts);
+		m->back_texture = m->texture;
+		m->texture = tex;
+		m->texture_stale = 0;
+	}
 	SDL_ShowWindow(m->window);
 	SDL_SetRenderDrawColor(m->renderer, 0, 0, 0, 255);
 	SDL_RenderClear(m->renderer);
 	SDL_RenderCopyEx(m->renderer, m->texture, NULL, &rect, 0, NULL, m->flip ? SDL_FLIP_VERTICAL : 0);
+	set_sdl_yuv_conversion_mode(NULL);
 	SDL_RenderPresent(m->renderer);
 }
 
@@ -181,6 +237,13 @@ double get_master_clock(exAVMedia *m) {
 	return val;
 }
 
+/*
+ * Whether the late video frames are dropped, see 'set_framedrop'.
+ */
+static int media_framedrop(exAVMedia *m) {
+	return m->framedrop > 0 || (m->framedrop < 0 && get_master_sync_type(m) != AV_SYNC_VIDEO_MASTER);
+}
+
 static double frame_duration(exAVMedia *m, exFFFrame *last, exFFFrame *cur) {
 	if (last && last->serial != cur->serial)
 		return 0.0;
@@ -192,7 +255,7 @@ static double frame_duration(exAVMedia *m, exFFFrame *last, exFFFrame *cur) {
 }
 
 static double compute_target_delay(double delay, exAVMedia *m) {
-	double sync_threshold, diff = 0;
+	double sync_threshold, diff = 0, lag;
 
 	/* update delay to follow master synchronization source */
 	if (get_master_sync_type(m) != AV_SYNC_VIDEO_MASTER) {
@@ -214,6 +277,9 @@ static double compute_target_delay(double delay, exAVMedia *m) {
 		}
 	}
 	av_log(NULL, AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n",	delay, -diff);
+	lag = isnan(diff) ? 0 : -diff;
+	/* read by the video decoder to adapt its skipping */
+	__atomic_store(&m->video_lag, &lag, __ATOMIC_RELAXED);
 
 	return delay;
 }
@@ -226,21 +292,21 @@ static void update_video_avclock(exAVMedia *m, double pts, int64_t pos, int seri
 }
 
 static void video_refresh(exAVMedia *m, double *remaining_time) {
-	exAVFrame *f = NULL;
+	exAVFrame *f = NULL, *next = NULL;
 	exFFFrame *ff = NULL, *last = NULL;;
 	double now, last_duration, delay;
+	int64_t trace = 0;
 
 	if (m->paused)
 		goto refresh;
 
 retry:
-	if (m->vframes.list->size(m->vframes.list) == 0)
+	if (ex_av_queue_size(&m->vframes.queue) == 0 || (f = ex_av_frame_queue_peek(&m->vframes)) == NULL)
 		goto refresh;
-	f = ex_av_frame_queue_peek(&m->vframes);
 	ff = to_exffframe(m, f, AVMEDIA_TYPE_VIDEO);
 	if (m->vframes.serial != ff->serial) {
-		f = ex_av_frame_queue_pop(&m->vframes);
-		f->put(f);
+		if ((f = ex_av_frame_queue_next(&m->vframes, f)) != NULL)
+			f->put(f);
 		goto retry;
 	}
 	last = (exFFFrame *)m->vframes.last;
@@ -251,6 +317,7 @@ retry:
 	now = av_gettime_relative()/1000000.0;
 	if (now < m->frame_timer + delay) {
 		*remaining_time = FFMIN(m->frame_timer + delay - now, *remaining_time);
+		f->put(f);
 		goto refresh;
 	}
 	m->frame_timer += delay;
@@ -258,12 +325,30 @@ retry:
 		m->frame_timer = now;
 	if (!isnan(ff->pts))
 		update_video_avclock(m, ff->pts, ff->pos, ff->serial);
-	if (m->vframes.last)
-		m->vframes.last->put(m->vframes.last);
-	m->vframes.last = ex_av_frame_queue_pop(&m->vframes);
+	/* the next frame is already due as well, this one would never be shown */
+	if ((next = ex_av_frame_queue_peek_next(&m->vframes)) != NULL) {
+		int late = media_framedrop(m) && now > m->frame_timer + frame_duration(m, ff, to_exffframe(m, next, AVMEDIA_TYPE_VIDEO));
+		next->put(next);
+		if (late) {
+			/* still the last frame, the next one is timed from it; the texture keeps the one shown */
+			if ((f = ex_av_frame_queue_next(&m->vframes, f)) != NULL) {
+				ex_av_frame_queue_set_last(&m->vframes, f);
+				__atomic_add_fetch(&m->vframes.nb_dropped, 1, __ATOMIC_RELAXED);
+			}
+			goto retry;
+		}
+	}
+	/* flushed since the peek, the frames after the seek are shown instead */
+	if ((f = ex_av_frame_queue_next(&m->vframes, f)) == NULL)
+		goto retry;
+	ex_av_frame_queue_set_last(&m->vframes, f);
+	m->texture_stale = 1;
 
 refresh:
-  video_image_display(m, m->vframes.last);
+	trace = ex_av_trace_begin();
+	video_image_display(m, m->vframes.last);
+	ex_av_trace_end(trace, "video_refresh", m->video_idx, m->vframes.serial,
+			m->vframes.last ? m->vframes.last->avframe->pts : AV_NOPTS_VALUE);
 }
 
 static void refresh_loop_wait_event(exAVMedia *media, SDL_Event *event) {
@@ -364,6 +449,11 @@ static void window_event_resize(exAVMedia *m, SDL_Event *e) {
 			SDL_DestroyTexture(m->texture);
 			m->texture = NULL;
 		}
+		if (m->back_texture) {
+			SDL_DestroyTexture(m->back_texture);
+			m->back_texture = NULL;
+		}
+		m->texture_stale = 1;
 	}
 }
 
@@ -483,16 +573,9 @@ static void update_sample_display(exAVMedia *m, short *samples, int samples_size
 	}
 }
 
-/*
- * Return non-zero value if audio_callback is timeout waiting for new audio-frames.
- */
-static inline int audio_callback_wait_is_timeout(exAVMedia *m) {
-	uint64_t timeout_value = m->audio_dev_buf_size / m->audio_dev_params.bytes_per_sec / m->audio_callback_timeout_count;
-	return av_gettime_relative() - m->audio_callback_time > timeout_value;
-}
-
 static int _audio_convert_frame(exAVMedia *m, exAVFrame *f, int wanted_nb_samples) {
 	int len = 0, ret = 0;
+	int64_t trace = 0;
 	const uint8_t **in = (const uint8_t **)f->avframe->extended_data;
 	uint8_t **out = &m->audio_cache;
 	int out_count = (int64_t)wanted_nb_samples * m->audio_dev_params.sample_rate / f->avframe->sample_rate + 256;
@@ -512,7 +595,9 @@ static int _audio_convert_frame(exAVMedia *m, exAVFrame *f, int wanted_nb_sample
 	av_fast_malloc(&m->audio_cache, (unsigned int *)&m->audio_cache_size, out_size);
 	if (!m->audio_cache)
 		return AVERROR(ENOMEM);
+	trace = ex_av_trace_begin();
 	len = swr_convert(m->swr_ctx, out, out_count, in, f->avframe->nb_samples);
+	ex_av_trace_end(trace, "swr_convert", m->audio_idx, m->aframes.serial, f->avframe->pts);
 	if (len < 0) {
 		av_log(NULL, AV_LOG_ERROR, "audio_convert_frame: swr_convert error: %s\n", av_err2str(ret));
 		return -1;
@@ -570,90 +655,133 @@ static int audio_convert_frame(exAVMedia *m, exAVFrame *f) {
 }
 
 /*
- * Convert an audio-frame to be the playable format which is supported by the audio-device.
- * Return the size in bytes of the audio-frame after successful conversion, otherwise,
- * return a negative value.
+ * Write a piece of re-sampled bytes into the ring, waiting while it is full until the audio callback reads
+ * from it. The callback signals without the mutex, as it never waits: a signal sent between the attempt and
+ * the wait is missed, then the renderer retries after AUDIO_RENDER_WAIT.
+ * Return 0 if success, or AVERROR_EXIT if the renderer is stopped meanwhile.
+ */
+static int audio_render_write_piece(exAVMedia *m, const uint8_t *data, int size, double clock, int serial) {
+	int ret = 0;
+	struct timespec ts;
+	pthread_mutex_lock(&m->audio_render_mutex);
+	__atomic_store_n(&m->audio_render_waiting, 1, __ATOMIC_SEQ_CST);
+	while ((ret = ex_av_pcm_ring_write(m->audio_ring, data, size, clock, serial)) == AVERROR(EAGAIN)) {
+		if (__atomic_load_n(&m->audio_renderer_quit, __ATOMIC_ACQUIRE)) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += AUDIO_RENDER_WAIT * 1000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&m->audio_render_cond, &m->audio_render_mutex, &ts);
+	}
+	__atomic_store_n(&m->audio_render_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->audio_render_mutex);
+	return ret;
+}
+
+/*
+ * Write 'size' re-sampled bytes ending at the audio clock 'clock' into the ring, in pieces of at most half
+ * of it, waiting while it is full.
+ * Return 0 if success, or AVERROR_EXIT if the renderer is stopped meanwhile.
+ */
+static int audio_render_write(exAVMedia *m, const uint8_t *data, int size, double clock, int serial) {
+	int ret = 0;
+	int frame_size = m->audio_dev_params.frame_size;
+	int max = ex_av_pcm_ring_size(m->audio_ring) / 2 / frame_size * frame_size;
+	while (size > 0) {
+		int bytes = FFMIN(size, max);
+		double end = clock - (double)(size - bytes) / m->audio_dev_params.bytes_per_sec;
+		if ((ret = audio_render_write_piece(m, data, bytes, end, serial)) < 0)
+			return ret;
+		data += bytes;
+		size -= bytes;
+	}
+	return 0;
+}
+
+/*
+ * Pop the audio-frames, convert them to the format of the audio-device and write them into the ring ahead of
+ * the audio callback, so that the callback never waits for a frame nor re-samples.
  */
-static int audio_decode_frame(exAVMedia *m) {
-	int resampled_data_size;
+static void *audio_renderer(void *arg) {
+	exAVMedia *m = arg;
 	exAVFrame *f = NULL;
 	exFFFrame *ff = NULL;
 	struct list_head *n = NULL;
+	int ret, size, serial;
+	double clock;
 
-	if (m->paused)
-		return -1;
-
-  /* get a valid frame */
-	do {
-retry: /* try to get a frame */
-		n = m->aframes.list->pop_front(m->aframes.list);
-		if (n == NULL) {
-			if (audio_callback_wait_is_timeout(m))
-				return -1;
-			av_usleep(1000);
-			goto retry;
+	ex_av_trace_thread_name("audio renderer");
+	while (!__atomic_load_n(&m->audio_renderer_quit, __ATOMIC_ACQUIRE)) {
+		if ((ret = ex_av_queue_pop(&m->aframes.queue, &n, AUDIO_RENDER_WAIT)) == AVERROR(EAGAIN))
+			continue;
+		if (ret < 0) {
+			/* finished or aborted, wait until the playing stops */
+			av_usleep(AUDIO_RENDER_WAIT);
+			continue;
 		}
 		f = list_entry(n, exAVFrame, list);
 		ff = to_exffframe(m, f, AVMEDIA_TYPE_AUDIO);
-		if (m->aframes.last) {
-			m->aframes.last->put(m->aframes.last);
-			m->aframes.last = f;
-			f->get(f);
+		serial = m->aframes.serial;
+		if (ff->serial != serial) {
+			f->put(f);
+			continue;
 		}
-	} while (ff->serial != m->aframes.serial);
-
-	/* convert the frame to fit the opened audio-device */
-	if ((resampled_data_size = audio_convert_frame(m, f)) < 0)
-		return -1;
-
-	/* update the audio clock with the PTS */
-	if (!isnan(ff->pts))
-		m->audio_clock = ff->pts + (double) f->avframe->nb_samples / f->avframe->sample_rate;
-	else
-		m->audio_clock = NAN;
-	m->audio_clock_serial = ff->serial;
-	f->put(f);
-	return resampled_data_size;
+		/* convert the frame to fit the opened audio-device */
+		if ((size = audio_convert_frame(m, f)) > 0) {
+			if (!isnan(ff->pts))
+				clock = ff->pts + (double) f->avframe->nb_samples / f->avframe->sample_rate;
+			else
+				clock = NAN;
+			if (m->show_mode != SHOW_MODE_VIDEO)
+				update_sample_display(m, (int16_t *)m->audio_buf, size);
+			audio_render_write(m, m->audio_buf, size, clock, serial);
+		}
+		f->put(f);
+	}
+	return NULL;
 }
 
+/*
+ * Copy the re-sampled bytes out of the ring, never waiting: silence is played if the ring is empty,
+ * and the bytes written before the last seek are dropped.
+ */
 static void audio_callback(void *opaque, Uint8 *stream, int len) {
-  exAVMedia *m = opaque;
-  int audio_size, bytes;
-
-  /* update callback_time */
-  m->audio_callback_time = av_gettime_relative();
-
-  while (len > 0) {
-		if (m->audio_buf_index >= m->audio_buf_size) {
-		 audio_size = audio_decode_frame(m);
-		 if (audio_size < 0) {
-				/* if error, just output silence */
-			 m->audio_buf = NULL;
-			 m->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / m->audio_dev_params.frame_size * m->audio_dev_params.frame_size;
-		 }
-		 else {
-			 if (m->show_mode != SHOW_MODE_VIDEO)
-				 update_sample_display(m, (int16_t *)m->audio_buf, audio_size);
-			 m->audio_buf_size = audio_size;
-		 }
-		 m->audio_buf_index = 0;
-		}
-		bytes = m->audio_buf_size - m->audio_buf_index;
-		if (bytes > len)
-			bytes = len;
-		if (!m->muted && m->audio_buf && m->volume == SDL_MIX_MAXVOLUME)
-			memcpy(stream, (uint8_t *)m->audio_buf + m->audio_buf_index, bytes);
-		else {
-			memset(stream, 0, bytes);
-			if (!m->muted && m->audio_buf)
-				SDL_MixAudioFormat(stream, (uint8_t *)m->audio_buf + m->audio_buf_index, AUDIO_S16SYS, bytes, m->volume);
+	exAVMedia *m = opaque;
+	exAVPcmChunk chunk;
+	const uint8_t *data = NULL;
+	int bytes, pending;
+
+	/* update callback_time */
+	m->audio_callback_time = av_gettime_relative();
+
+	ex_av_pcm_ring_drop_stale(m->audio_ring, m->aframes.serial);
+	ex_av_volume_set(&m->audio_volume, m->muted ? 0 : (float)m->volume / SDL_MIX_MAXVOLUME);
+	while (len > 0) {
+		if (m->paused || (bytes = ex_av_pcm_ring_peek(m->audio_ring, &data, len)) <= 0) {
+			/* paused or underrun, just output silence */
+			memset(stream, 0, len);
+			break;
 		}
+		if (ex_av_volume_apply(&m->audio_volume, stream, data, bytes / av_get_bytes_per_sample(m->audio_dev_params.sample_fmt),
+				m->audio_dev_params.sample_fmt, 0) < 0)
+			memset(stream, 0, bytes); /* a format of the device the kernels do not handle */
+		ex_av_pcm_ring_advance(m->audio_ring, bytes);
 		len -= bytes;
 		stream += bytes;
-		m->audio_buf_index += bytes;
-  }
-  m->audio_buf_write_size = m->audio_buf_size - m->audio_buf_index;
-  update_audio_avclock(m);
+		/* room has been made, wake the renderer if it waits for it */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&m->audio_render_waiting, __ATOMIC_RELAXED))
+			pthread_cond_signal(&m->audio_render_cond);
+	}
+	if (ex_av_pcm_ring_position(m->audio_ring, &chunk, &pending))
+		return;
+	m->audio_clock = chunk.clock;
+	m->audio_clock_serial = chunk.serial;
+	m->audio_buf_write_size = pending;
+	update_audio_avclock(m);
 }
 
 static void audio_spec_init(exAVMedia *m) {
@@ -728,15 +856,29 @@ err:
 
 static void ex_av_media_prepare_play_audio(exAVMedia *m) {
 	m->volume = 100;
-	m->audio_callback_timeout_count = 2;
 	ex_av_clock_set(&m->audio_avclock, 0, 0);
 	m->audio_clock = ex_av_clock_get(&m->audio_avclock);
 	audio_spec_init(m);
 }
 
 static void ex_av_media_start_play_audio(exAVMedia *m) {
+	int size;
 	if (audio_open(m))
 		return;
+	size = FFMAX(4 * m->audio_dev_buf_size, m->audio_dev_params.bytes_per_sec * AUDIO_RING_DURATION);
+	if (ex_av_pcm_ring_alloc(&m->audio_ring, size) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_start_play_audio: ex_av_pcm_ring_alloc failed\n");
+		return;
+	}
+	ex_av_volume_init(&m->audio_volume, m->muted ? 0 : (float)m->volume / SDL_MIX_MAXVOLUME,
+			m->audio_dev_params.sample_rate * MIX_RAMP_DURATION * m->audio_dev_params.channel_layout.nb_channels);
+	m->audio_renderer_quit = 0;
+	m->audio_render_waiting = 0;
+	if (pthread_create(&m->audio_renderer, NULL, audio_renderer, m)) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_start_play_audio: create audio renderer failed\n");
+		return;
+	}
+	m->audio_renderer_started = 1;
 	/*
 	 * If the video stream exists, transfer the control to video-player
 	 */
@@ -750,6 +892,15 @@ static void ex_av_media_start_play_audio(exAVMedia *m) {
 }
 
 static void ex_av_media_prepare_stop_audio(exAVMedia *m) {
+	/* the renderer uses the cache, the callback keeps playing silence until the device is closed */
+	if (m->audio_renderer_started) {
+		pthread_mutex_lock(&m->audio_render_mutex);
+		__atomic_store_n(&m->audio_renderer_quit, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&m->audio_render_cond);
+		pthread_mutex_unlock(&m->audio_render_mutex);
+		pthread_join(m->audio_renderer, NULL);
+		m->audio_renderer_started = 0;
+	}
 	av_freep(&m->audio_cache);
 	m->audio_cache_size = 0;
 }
@@ -757,6 +908,7 @@ static void ex_av_media_prepare_stop_audio(exAVMedia *m) {
 static void ex_av_media_stop_play_audio(exAVMedia *m) {
 	if (m->audio_dev > 0)
 		SDL_CloseAudioDevice(m->audio_dev);
+	ex_av_pcm_ring_free(&m->audio_ring);
 }
 
 static void ex_av_media_prepare_play_video(exAVMedia *m) {
@@ -805,6 +957,10 @@ static void ex_av_media_prepare_stop_video(exAVMedia *m) {
 		SDL_DestroyTexture(m->texture);
 		m->texture = NULL;
 	}
+	if (m->back_texture) {
+		SDL_DestroyTexture(m->back_texture);
+		m->back_texture = NULL;
+	}
 	if (m->sws_ctx) {
 		sws_freeContext(m->sws_ctx);
 		m->sws_ctx = NULL;
@@ -851,25 +1007,89 @@ static void ex_av_media_stop_play(exAVMedia *m) {}
 #endif
 
 static int media_is_decoding (exAVMedia *m) {
-	if (m->decode_started)
-		return 1;
-	if (!(ex_av_media_packet_grabber_stopped(m) &&
-		    ex_av_media_video_decoder_stopped(m)  &&
-		    ex_av_media_audio_decoder_stopped(m)  &&
-		    ex_av_media_subtitle_decoder_stopped(m)))
-		return 1;
-	return 0;
+	return m->decode_started;
+}
+
+static void media_set_flags(exAVMedia *m, int flags) {
+	pthread_mutex_lock(&m->mutex);
+	m->flags |= flags;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static void ex_av_media_abort_caches(exAVMedia *m);
+
+/*
+ * Stop the grabber and the decoders: interrupt the I/O, and wake up all the threads blocked on the caches or pacing.
+ */
+static void media_abort(exAVMedia *m) {
+	pthread_mutex_lock(&m->mutex);
+	__atomic_store_n(&m->abort_request, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	ex_av_media_abort_caches(m);
+}
+
+/*
+ * Interrupt callback of the opened media, to abort the blocking I/O of the grabber when closing.
+ */
+static int media_interrupt_cb(void *opaque) {
+	exAVMedia *m = opaque;
+	return __atomic_load_n(&m->abort_request, __ATOMIC_ACQUIRE);
 }
 
-static inline int skip_packet(exAVPacket *pkt, struct list *list) {
+static inline int skip_packet(exAVPacket *pkt, exAVPacketQueue *q) {
 	pkt->put(pkt);
 	return 0;
 }
 
-static inline int insert_packet(exAVPacket *pkt, struct list *list) {
-	while (list->insert_tail(list, &pkt->list)) {
-		av_usleep(100000); /* the list maybe full, then wait a bit */
-	}
+static inline int insert_packet(exAVMedia *m, exAVPacket *pkt, exAVPacketQueue *q, int64_t timeout) {
+	int ret = ex_av_queue_push(&q->queue, &pkt->list, timeout); /* wait until the decoder consumes a packet */
+	if (ret == AVERROR(EAGAIN))
+		m->grabber_pending = pkt; /* the cache is full, retry on the next grab */
+	else if (ret < 0)
+		pkt->put(pkt);
+	return ret;
+}
+
+static exAVPacketQueue *get_packet_queue(exAVMedia *m, int stream_idx) {
+	if (stream_idx == m->video_idx)
+		return &m->vpackets;
+	if (stream_idx == m->audio_idx)
+		return &m->apackets;
+	if (stream_idx == m->subtitle_idx)
+		return &m->spackets;
+	return NULL;
+}
+
+/*
+ * Tell the decoders that there are no more packets.
+ */
+static void finish_packet_queues(exAVMedia *m) {
+	ex_av_queue_finish(&m->vpackets.queue);
+	ex_av_queue_finish(&m->apackets.queue);
+	ex_av_queue_finish(&m->spackets.queue);
+}
+
+/*
+ * Seek to the keyframe before 'seek_target' found in the keyframe index by its byte position, a single read
+ * instead of the binary search over the file done by the demuxer.
+ * Return 0 if success, and set the time of the keyframe into 'seek_target'.
+ */
+static int seek_by_index(exAVMedia *m, int64_t *seek_target, int64_t seek_min, int64_t seek_max) {
+	int ret = 0;
+	exAVKeyEntry e;
+	AVRational tb = m->key_index->time_base;
+	if (m->seek_flags & AVSEEK_FLAG_BYTE)
+		return AVERROR(EINVAL);
+	if ((ret = ex_av_key_index_lookup(m->key_index, av_rescale_q(*seek_target, AV_TIME_BASE_Q, tb), &e)) < 0)
+		return ret;
+	int64_t target = av_rescale_q(e.pts, tb, AV_TIME_BASE_Q);
+	if (target < seek_min || target > seek_max)
+		return AVERROR(ERANGE);
+	if ((ret = avformat_seek_file(m->ic, -1, e.pos, e.pos, e.pos, AVSEEK_FLAG_BYTE)) < 0)
+		return ret;
+	*seek_target = target;
 	return 0;
 }
 
@@ -878,84 +1098,204 @@ static int do_seek(exAVMedia *m) {
 	int64_t seek_target = av_clip64(m->start_time * AV_TIME_BASE, 0, INT64_MAX);
 	int64_t seek_min    = m->seek_rel > 0 ? seek_target - m->seek_rel + 2: INT64_MIN;
 	int64_t seek_max    = m->seek_rel < 0 ? seek_target - m->seek_rel - 2: INT64_MAX;
-	if ((ret = avformat_seek_file(m->ic, -1, seek_min, seek_target, seek_max, m->seek_flags)) < 0) {
+	/* the decoders catch up with it from the keyframe if the seek is accurate, see 'decoder_flush' */
+	__atomic_store_n(&m->seek_target, (m->seek_flags & AVSEEK_FLAG_BYTE) ? AV_NOPTS_VALUE : seek_target, __ATOMIC_RELEASE);
+	/* demuxing from an indexed keyframe goes on extending the index without a gap */
+	m->key_index_contiguous = m->key_index && seek_by_index(m, &seek_target, seek_min, seek_max) == 0;
+	if (!m->key_index_contiguous && m->mmap_pb) {
+		/* the demuxer probes here and there, the pages ahead are useless until it finds the target */
+		ex_av_mmap_io_advise(m->mmap_pb, MMAP_IO_RANDOM);
+		ret = avformat_seek_file(m->ic, -1, seek_min, seek_target, seek_max, m->seek_flags);
+		ex_av_mmap_io_advise(m->mmap_pb, MMAP_IO_SEQUENTIAL);
+	}
+	else if (!m->key_index_contiguous) {
+		ret = avformat_seek_file(m->ic, -1, seek_min, seek_target, seek_max, m->seek_flags);
+	}
+	if (ret < 0) {
 		av_log(NULL, AV_LOG_ERROR, "avformat_seek_file error: %s\n", av_err2str(ret));
 		return ret;
 	}
 	else {
+		/* flushing also wakes up the decoders blocked on the full frame queues */
 		if (m->audio_idx >= 0) {
-			m->apackets.list->clear(m->apackets.list, ex_av_packet_free_list_entry);
+			ex_av_queue_flush(&m->apackets.queue, ex_av_packet_free_list_entry);
 			m->apackets.serial++;
-			m->aframes.list->clear(m->aframes.list, ex_av_frame_free_list_entry);
+			ex_av_queue_flush(&m->aframes.queue, ex_av_frame_free_list_entry);
 			m->aframes.serial++;
 		}
 		if (m->subtitle_idx >= 0) {
-			m->spackets.list->clear(m->spackets.list, ex_av_packet_free_list_entry);
+			ex_av_queue_flush(&m->spackets.queue, ex_av_packet_free_list_entry);
 			m->spackets.serial++;
-			m->sframes.list->clear(m->sframes.list, ex_av_frame_free_list_entry);
+			ex_av_queue_flush(&m->sframes.queue, ex_av_frame_free_list_entry);
 			m->sframes.serial++;
 		}
 		if (m->video_idx >= 0) {
-			m->vpackets.list->clear(m->vpackets.list, ex_av_packet_free_list_entry);
+			ex_av_queue_flush(&m->vpackets.queue, ex_av_packet_free_list_entry);
 			m->vpackets.serial++;
-			m->vframes.list->clear(m->vframes.list, ex_av_frame_free_list_entry);
+			/*
+			 * the converter drops the frames stamped with another serial than the packets'; it is changed
+			 * before flushing the frames, for the converter to know that the frame its flush woke it up to
+			 * insert is stale, see 'video_converter'
+			 */
+			if (m->convert_stage)
+				ex_av_queue_flush(&m->vconvert, ex_av_frame_free_list_entry);
 			m->vframes.serial++;
+			ex_av_queue_flush(&m->vframes.queue, ex_av_frame_free_list_entry);
 		}
-		if (m->seek_flags & AVSEEK_FLAG_BYTE) {
+		if ((m->seek_flags & AVSEEK_FLAG_BYTE) && !m->key_index_contiguous) {
 			ex_av_clock_set(&m->external_avclock, NAN, 0);
 		}
 		else {
-			ex_av_clock_set(&m->external_avclock, seek_target / (double)AV_TIME_BASE, 0);
+			ex_av_clock_set(&m->external_avclock, (m->accurate_seek ? m->seek_target : seek_target) / (double)AV_TIME_BASE, 0);
 		}
+		__atomic_add_fetch(&m->nb_seeks, 1, __ATOMIC_RELAXED);
+		/* the paced delivery restarts from the first frame after seeking */
+		pthread_mutex_lock(&m->mutex);
+		m->pace_start_time = AV_NOPTS_VALUE;
+		pthread_mutex_unlock(&m->mutex);
 	}
 	m->seek_requested = 0;
 	return 0;
 }
 
 /*
- * Grab a packet and insert it into the list if success.
+ * Hand a reference of the grabbed packet 'pkt', or the one kept by the previous call if NULL, to the remuxer,
+ * if the media is being saved, waiting at most 'timeout' microseconds for the output.
+ * The send waits without the mutex; the remuxer is not freed meanwhile, see 'media_end_save'.
+ * Return AVERROR(EAGAIN) if timeout, the reference is kept in 'save_pending' and sent by the next call.
+ */
+static int save_packet(exAVMedia *m, exAVPacket *pkt, int64_t timeout) {
+	int ret = 0;
+	exAVPacket *ref = m->save_pending;
+	exAVRemuxer *r = NULL;
+	m->save_pending = NULL;
+	if (__atomic_load_n(&m->remuxer, __ATOMIC_ACQUIRE) != NULL) {
+		pthread_mutex_lock(&m->remux_mutex);
+		if ((r = m->remuxer) != NULL)
+			m->remux_sending = 1;
+		pthread_mutex_unlock(&m->remux_mutex);
+	}
+	if (r == NULL) {
+		if (ref)
+			ref->put(ref); /* the saving has ended */
+		return 0;
+	}
+	if (ref == NULL && pkt && ((ref = ex_av_packet_pool_alloc(m->packet_pool)) == NULL || av_packet_ref(ref->avpkt, pkt->avpkt) < 0)) {
+		av_log(NULL, AV_LOG_ERROR, "save_packet error: no memory\n");
+		if (ref)
+			ref->put(ref);
+		ref = NULL;
+	}
+	if (ref && (ret = ex_av_remuxer_send(r, ref, timeout)) == AVERROR(EAGAIN))
+		m->save_pending = ref;
+	pthread_mutex_lock(&m->remux_mutex);
+	m->remux_sending = 0;
+	pthread_cond_broadcast(&m->remux_cond);
+	pthread_mutex_unlock(&m->remux_mutex);
+	/* the other errors are the remuxer's, reported by 'wait_save' */
+	return ret == AVERROR(EAGAIN) ? ret : 0;
+}
+
+/*
+ * Grab a packet and insert it into the list if success, waiting at most 'timeout' microseconds if the list is full.
+ * Return AVERROR(EAGAIN) if timeout, the packet is kept and inserted by the next call.
  */
-static int grab_packet(exAVMedia *m) {
+static int grab_packet(exAVMedia *m, int64_t timeout) {
 	int ret = -1;
-	struct list *pkt_list = NULL;
+	exAVPacketQueue *q = NULL;
+	exAVPacket *pkt = NULL;
+	exFFPacket *ffpkt = NULL;
+	int64_t trace = 0;
 
-	if (m->seek_requested)
-		if (do_seek(m))
-			return -1;
+	if (m->seek_requested && (ret = do_seek(m)) < 0)
+		return ret;
+	if (m->save_pending && (ret = save_packet(m, NULL, timeout)) < 0)
+		return ret;
+
+	if ((pkt = m->grabber_pending) != NULL) {
+		m->grabber_pending = NULL;
+		q = get_packet_queue(m, pkt->avpkt->stream_index);
+		if (((exFFPacket *)pkt)->serial != q->serial)
+			return skip_packet(pkt, q); /* flushed by seeking */
+		return insert_packet(m, pkt, q, timeout);
+	}
 
-	exAVPacket *pkt = ex_av_packet_alloc(sizeof(exFFPacket));
-	exFFPacket *ffpkt = (exFFPacket *)pkt;
+	pkt = ex_av_packet_pool_alloc(m->packet_pool);
+	ffpkt = (exFFPacket *)pkt;
 	if (pkt == NULL) {
 		av_log(NULL, AV_LOG_FATAL, "grab_packet error: unable to create packet: no memory\n");
 		return AVERROR(ENOMEM);
 	}
+	trace = ex_av_trace_begin();
 	ret = av_read_frame(m->ic, pkt->avpkt);
 	if (ret == 0) {
-		if (pkt->avpkt->stream_index == m->video_idx) {
-			ffpkt->serial = m->vpackets.serial;
-			pkt_list = m->vpackets.list;
+		q = m->grabber_only ? NULL : get_packet_queue(m, pkt->avpkt->stream_index);
+		ex_av_trace_end(trace, "av_read_frame", pkt->avpkt->stream_index, q ? q->serial : -1, pkt->avpkt->pts);
+		if (m->key_index_contiguous && pkt->avpkt->stream_index == m->key_index->stream_index)
+			ex_av_key_index_add(m->key_index, pkt->avpkt->pts != AV_NOPTS_VALUE ? pkt->avpkt->pts : pkt->avpkt->dts,
+					pkt->avpkt->pos, pkt->avpkt->flags & AV_PKT_FLAG_KEY);
+		if (q)
+			ffpkt->serial = q->serial;
+		if ((ret = save_packet(m, pkt, timeout)) < 0) {
+			/* inserted once the remuxer takes its reference */
+			if (q)
+				m->grabber_pending = pkt;
+			else
+				pkt->put(pkt);
+			return ret;
 		}
-		else if (pkt->avpkt->stream_index == m->audio_idx) {
-			ffpkt->serial = m->apackets.serial;
-			pkt_list = m->apackets.list;
+		if (q) {
+			ret = insert_packet(m, pkt, q, timeout);
 		}
-		else if (pkt->avpkt->stream_index == m->subtitle_idx) {
-			ffpkt->serial = m->spackets.serial;
-			pkt_list = m->spackets.list;
+		else {
+			ret = skip_packet(pkt, q);
 		}
-		if (pkt_list)
-			ret = insert_packet(pkt, pkt_list);
-		else
-			ret = skip_packet(pkt, pkt_list);
 		return ret;
 	}
+	ex_av_trace_end(trace, "av_read_frame", -1, -1, AV_NOPTS_VALUE);
 	pkt->put(pkt);
 	return ret;
 }
 
+static void grabber_finish(exAVMedia *m) {
+	if (m->grabber_pending) {
+		m->grabber_pending->put(m->grabber_pending);
+		m->grabber_pending = NULL;
+	}
+	if (m->save_pending) {
+		m->save_pending->put(m->save_pending);
+		m->save_pending = NULL;
+	}
+	finish_packet_queues(m);
+	/* along with the flag, so that 'save_as' finishes a remuxer installed too late for it */
+	pthread_mutex_lock(&m->remux_mutex);
+	if (m->remuxer)
+		ex_av_remuxer_finish(m->remuxer);
+	media_set_flags(m, MEDIA_FLAG_GRABBER_FINISHED);
+	pthread_mutex_unlock(&m->remux_mutex);
+}
+
 static void run_grabber_routine(exAVMedia *m) {
-	while (!grab_packet(m));
-	pthread_detach(pthread_self());
+	int ret;
+	while ((ret = grab_packet(m, -1)) == 0)
+		;
+	if (ret != AVERROR_EOF && ret != AVERROR_EXIT)
+		av_log(NULL, AV_LOG_ERROR, "packet_grabber error: %s\n", av_err2str(ret));
+	grabber_finish(m);
+}
+
+/*
+ * Packet-grabber task on the executor
+ */
+static int packet_grabber_step(exAVTask *t, void *arg) {
+	exAVMedia *m = (exAVMedia *)arg;
+	int ret = grab_packet(m, 0);
+	if (ret == AVERROR(EAGAIN))
+		return TASK_BLOCKED;
+	if (ret == 0)
+		return TASK_AGAIN;
+	grabber_finish(m);
+	return TASK_DONE;
 }
 
 /*
@@ -963,45 +1303,108 @@ static void run_grabber_routine(exAVMedia *m) {
  */
 static void *packet_grabber(void *arg) {
 	exAVMedia *m = (exAVMedia *)arg;
+	ex_av_trace_thread_name("packet grabber");
 	run_grabber_routine(m);
 	return NULL;
 }
 
 /*
- * Insert a frame into the list after successfully decoding.
+ * Wait until the frame is due, measured from the first delivered frame.
+ * Return 0 if it is due, or AVERROR_EXIT if the decoding is stopped.
  */
-static int grab_frame(AVCodecContext *ic, exAVFrameQueue *q) {
-	int ret = -1;
-	exAVFrame *f = ex_av_frame_alloc(sizeof(exFFFrame));
-	if (f == NULL) {
-		av_log(NULL, AV_LOG_FATAL, "grab_frame error: unable to allocate frame: no memory\n");
-		goto err0;
-	}
-	ret = avcodec_receive_frame(ic, f->avframe);
-	if (ret == 0) { /* successfully received a frame, insert it into the list */
-retry:
-		if (q->list->insert_tail(q->list, &f->list)) {
-			av_usleep(1000000);
-			goto retry;
-		}
-	}
-	else { /* failed to received a frame, then release the memory */
-		f->put(f);
-	}
-err0:
+static int pace_frame(exAVMedia *m, exAVFrameQueue *q, exAVFrame *f) {
+	int ret = 0;
+	int64_t pts = f->avframe->best_effort_timestamp;
+	int64_t delay = 0;
+	struct timespec ts;
+	if (pts == AV_NOPTS_VALUE)
+		return 0;
+	pts = av_rescale_q(pts, q->queue.time_base, AV_TIME_BASE_Q);
+	pthread_mutex_lock(&m->mutex);
+	if (m->pace_start_time == AV_NOPTS_VALUE) {
+		m->pace_start_time = av_gettime_relative();
+		m->pace_start_pts = pts;
+	}
+	while (!m->abort_request && m->pace_start_time != AV_NOPTS_VALUE) {
+		delay = m->pace_start_time + (pts - m->pace_start_pts) - av_gettime_relative();
+		if (delay <= 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec  += (ts.tv_nsec + (delay % 1000000) * 1000) / 1000000000 + delay / 1000000;
+		ts.tv_nsec  = (ts.tv_nsec + (delay % 1000000) * 1000) % 1000000000;
+		pthread_cond_timedwait(&m->cond, &m->mutex, &ts);
+	}
+	if (m->abort_request)
+		ret = AVERROR_EXIT;
+	pthread_mutex_unlock(&m->mutex);
 	return ret;
 }
 
-static int decode(AVCodecContext *codec_ctx, exAVPacket *pkt, exAVFrameQueue *q) {
-	int ret = AVERROR(EAGAIN);
-	while (ret == AVERROR(EAGAIN)) {
-		ret = avcodec_send_packet(codec_ctx, pkt->avpkt);
-		if (ret == 0 || ret == AVERROR(EAGAIN))
-			grab_frame(codec_ctx, q);
+/*
+ * Hand a decoded frame to the sink of its stream in the headless mode.
+ */
+static int deliver_frame(exAVMedia *m, exAVFrameQueue *q, exAVFrame *f) {
+	int ret = 0;
+	if (q->sink == NULL)
+		return 0; /* nobody wants the frames of this stream, dropped unpaced */
+	if (m->paced && (ret = pace_frame(m, q, f)) < 0)
+		return ret;
+	if ((ret = q->sink(m, q->type, f, q->sink_opaque)) < 0) {
+		/* the first failure is reported by 'wait' as is */
+		pthread_mutex_lock(&m->mutex);
+		if (m->sink_error == 0)
+			m->sink_error = ret;
+		pthread_mutex_unlock(&m->mutex);
+		media_abort(m);
 	}
 	return ret;
 }
 
+/*
+ * Decoder of a stream, run by its own thread, or as a task on the executor.
+ */
+typedef struct exAVDecoder {
+	exAVMedia *m;
+	enum AVMediaType type;
+	AVCodecContext *codec_ctx;
+	exAVPacketQueue *pq;
+	exAVFrameQueue *q;
+	exAVFrame *frame;            /* decoded frame not yet accepted by the full cache */
+	const AVCodec *codec;
+	AVStream *stream;
+	int nb_threads;              /* threads of the opened codec */
+	int budget;                  /* whether it shares the thread budget, see 'budget.h' */
+	unsigned int generation;     /* generation of the budget when 'nb_threads' was computed */
+	exAVPacket *reopen_pkt;      /* closed-GOP keyframe to be sent once the codec is drained and reopened */
+	exAVPacket *pending_pkt;     /* packet refused by the full codec, sent again once its frames are received */
+	int probe_check;             /* the first decoded frame is checked against the probe cache */
+
+	/* Accurate seek */
+	int pkt_serial;              /* serial of the last packet sent to the codec */
+	int64_t catch_up_pts;        /* the frames before it are dropped, AV_NOPTS_VALUE if not catching up */
+	AVFrame *scratch;            /* the frames received while catching up, not yet taken from the pool */
+	enum AVDiscard skip_frame, skip_loop_filter, skip_idct;  /* settings the codec is opened with */
+
+	/* Frame dropping, see 'set_framedrop' */
+	int skip_level;              /* index of 'skip_levels' */
+	int skip_clean;              /* checks in a row without lag nor dropped frames */
+	int64_t skip_checked;        /* time of the last check of the lag */
+	int64_t skip_decoded, skip_dropped;  /* counters of the frame cache at the last check */
+} exAVDecoder;
+
+static inline int get_decoder_finished_flag(enum AVMediaType type) {
+	switch (type) {
+	case AVMEDIA_TYPE_VIDEO:
+		return MEDIA_FLAG_VIDEO_DECODER_FINISHED;
+	case AVMEDIA_TYPE_AUDIO:
+		return MEDIA_FLAG_AUDIO_DECODER_FINISHED;
+	case AVMEDIA_TYPE_SUBTITLE:
+		return MEDIA_FLAG_SUBTITLE_DECODER_FINISHED;
+	default:
+		return 0;
+	}
+}
+
 static inline int get_stream_idx(exAVMedia *m, enum AVMediaType type) {
 	if (type == AVMEDIA_TYPE_VIDEO && m->video_idx >= 0)
 		return m->video_idx;
@@ -1012,153 +1415,961 @@ static inline int get_stream_idx(exAVMedia *m, enum AVMediaType type) {
 	return -1;
 }
 
-static void run_decode_routine(exAVMedia *m, enum AVMediaType type) {
-	int ret = -1;
-	const AVCodec *codec = NULL;
-	AVCodecContext *codec_ctx = NULL;
-	AVStream *stream = NULL;
-	struct list_head *n = NULL;
-	struct list *pkt_list = NULL;
-	exAVFrameQueue *q = NULL;
-	/*
-	 * if there is no such stream of type 'type', then it's unnecessary to create
-	 * its corresponding decoder
-	 */
-	int stream_idx = get_stream_idx(m, type);
-	if (stream_idx < 0)
-		return;
+static exAVFrameQueue *get_frame_queue(exAVMedia *m, enum AVMediaType type) {
 	switch (type) {
 	case AVMEDIA_TYPE_VIDEO:
-		pkt_list = m->vpackets.list; q = &m->vframes; break;
+		return &m->vframes;
 	case AVMEDIA_TYPE_AUDIO:
-		pkt_list = m->apackets.list; q = &m->aframes; break;
+		return &m->aframes;
 	case AVMEDIA_TYPE_SUBTITLE:
-		pkt_list = m->spackets.list; q = &m->sframes; break;
-	default: break;
+		return &m->sframes;
+	default:
+		return NULL;
 	}
-	stream = m->ic->streams[stream_idx];
-	codec = avcodec_find_decoder(stream->codecpar->codec_id);
-	if (codec == NULL) {
-		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: no such avcodec for %s\n", av_get_media_type_string(type), avcodec_get_name(stream->codecpar->codec_id));
-		goto err0;
+}
+
+/*
+ * Return the cache the decoded frames are inserted into, the input of the converter if it is running.
+ */
+static exAVQueue *decoder_output(exAVDecoder *d) {
+	return d->type == AVMEDIA_TYPE_VIDEO && d->m->converting ? &d->m->vconvert : &d->q->queue;
+}
+
+/*
+ * Check the first decoded frame against the stream info taken from the probe cache.
+ */
+static void decoder_check_probe(exAVDecoder *d, const AVFrame *frame) {
+	d->probe_check = 0;
+	if (ex_av_probe_cache_verify(d->m->ic->url, d->stream->index, frame) < 0)
+		av_log(NULL, AV_LOG_WARNING, "decoder: stream %d disagrees with the probe cache, probed again at the next open\n",
+				d->stream->index);
+}
+
+/*
+ * Insert a decoded frame into the list, or deliver it to the sink.
+ * Return AVERROR(EAGAIN) if the list is still full after 'timeout', the frame is kept and inserted by the next step.
+ */
+static int output_frame(exAVDecoder *d, exAVFrame *f, int64_t timeout) {
+	int ret = 0;
+	/* the serial of the packets it is decoded from, the converter drops it once a seek changes it */
+	((exFFFrame *)f)->serial = d->pkt_serial;
+	if (d->probe_check)
+		decoder_check_probe(d, f->avframe);
+	if (d->q->sink || d->m->headless) { /* headless, the frame is not cached */
+		ret = deliver_frame(d->m, d->q, f);
+		f->put(f);
+		return ret;
 	}
-	codec_ctx = avcodec_alloc_context3(codec);
-	if (codec_ctx == NULL) {
-		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: unable to allocate avcodec_context for %s\n", av_get_media_type_string(type), avcodec_get_name(stream->codecpar->codec_id));
+	ret = ex_av_queue_push(decoder_output(d), &f->list, timeout);
+	if (ret == AVERROR(EAGAIN))
+		d->frame = f;
+	else if (ret < 0)
+		f->put(f);
+	return ret;
+}
+
+/*
+ * Account the time spent in the codec by 'name' since 'start', and the frames it output; also traced as a span.
+ */
+static inline void decoder_account(exAVDecoder *d, int64_t start, int nb_decoded, const char *name, int64_t pts) {
+	__atomic_add_fetch(&d->q->decode_time, av_gettime_relative() - start, __ATOMIC_RELAXED);
+	if (nb_decoded)
+		__atomic_add_fetch(&d->q->nb_decoded, nb_decoded, __ATOMIC_RELAXED);
+	if (ex_av_trace_is_enabled())
+		ex_av_trace_record(name, start, d->stream->index, d->pkt_serial, pts);
+}
+
+static inline void decoder_dropped(exAVDecoder *d) {
+	__atomic_add_fetch(&d->q->nb_dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the number of threads the codec should be opened with.
+ */
+static int decoder_threads(exAVDecoder *d) {
+	if (d->m->decoder_threads > 0)
+		return d->m->decoder_threads;
+	if (d->budget)
+		return ex_av_thread_budget_share(&d->generation);
+	return 1;
+}
+
+static int decoder_open_codec(exAVDecoder *d) {
+	int ret = -1;
+	enum AVMediaType type = d->type;
+	d->codec_ctx = avcodec_alloc_context3(d->codec);
+	if (d->codec_ctx == NULL) {
+		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: unable to allocate avcodec_context for %s\n", av_get_media_type_string(type), avcodec_get_name(d->stream->codecpar->codec_id));
 		goto err0;
 	}
-	codec_ctx->pkt_timebase = stream->time_base;      // to fix the warning: Could not update timestamps for skipped samples
-	if ((ret = avcodec_parameters_to_context(codec_ctx, stream->codecpar)) < 0) {
+	d->codec_ctx->pkt_timebase = d->stream->time_base;      // to fix the warning: Could not update timestamps for skipped samples
+	if ((ret = avcodec_parameters_to_context(d->codec_ctx, d->stream->codecpar)) < 0) {
 		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: fill avcodec context: %s\n", av_get_media_type_string(type), av_err2str(ret));
 		goto err1;
 	}
-	if ((ret = avcodec_open2(codec_ctx, codec, NULL)) < 0) {
+	d->nb_threads = decoder_threads(d);
+	d->codec_ctx->thread_count = d->nb_threads;
+	d->codec_ctx->thread_type = d->m->decoder_thread_type;
+	if ((ret = avcodec_open2(d->codec_ctx, d->codec, NULL)) < 0) {
 		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: unable to open avcodec: %s\n", av_get_media_type_string(type), av_err2str(ret));
 		goto err1;
 	}
-	while (1) {
-		n = pkt_list->pop_front(pkt_list);
-		if (n == NULL) {
-			if(ex_av_media_packet_grabber_stopped(m))
-				goto err2;
-			/* the list maybe empty, then wait a bit moment */
-			av_usleep(500000);
-			continue;
-		}
-		exAVPacket *pkt = list_entry(n, exAVPacket, list);
-		ret = decode(codec_ctx, pkt, q);
-		pkt->put(pkt);
-		if(ret != 0) /* fatal error on decoding, then exit this thread */
-			break;
-	}
-err2:
-	avcodec_close(codec_ctx);
+	return 0;
 err1:
-	avcodec_free_context(&codec_ctx);
+	avcodec_free_context(&d->codec_ctx);
 err0:
-	pthread_detach(pthread_self());
-	return;
+	return ret < 0 ? ret : -1;
 }
 
 /*
- * video-decoder routine
+ * Whether the share of the thread budget of the decoder is changed since its codec was opened.
  */
-static void *video_decoder(void *arg) {
-	exAVMedia *m = (exAVMedia *)arg;
-	run_decode_routine(m, AVMEDIA_TYPE_VIDEO);
-	return NULL;
+static int decoder_budget_changed(exAVDecoder *d) {
+	if (!d->budget || ex_av_thread_budget_generation() == d->generation)
+		return 0;
+	return ex_av_thread_budget_share(&d->generation) != d->nb_threads;
 }
 
 /*
- * audio-decoder routine
+ * Whether the codec should be reopened before the packet, because its share of the thread budget is changed.
+ * The codec is only reopened where nothing decoded before is needed any more, see 'ex_av_packet_is_closed_gop';
+ * otherwise, it waits for the next flush, see 'decoder_step'.
  */
-static void *audio_decoder(void *arg) {
-	exAVMedia *m = (exAVMedia *)arg;
-	run_decode_routine(m, AVMEDIA_TYPE_AUDIO);
-	return NULL;
+static int decoder_should_reopen(exAVDecoder *d, exAVPacket *pkt) {
+	if (!d->budget)
+		return 0;
+	return ex_av_packet_is_closed_gop(d->stream->codecpar, pkt->avpkt) && decoder_budget_changed(d);
 }
 
 /*
- * subtitle-decoder routine
+ * Reopen the codec, drained or flushed, with its new share of the thread budget.
  */
-static void *subtitle_decoder(void *arg) {
-	exAVMedia *m = (exAVMedia *)arg;
-	run_decode_routine(m, AVMEDIA_TYPE_SUBTITLE);
-	return NULL;
+static int decoder_reopen_codec(exAVDecoder *d) {
+	int ret = 0;
+	int nb_threads = d->nb_threads;
+	avcodec_free_context(&d->codec_ctx);
+	if ((ret = decoder_open_codec(d)) < 0)
+		return ret;
+	av_log(NULL, AV_LOG_VERBOSE, "decoder(%s): threads %d -> %d\n", av_get_media_type_string(d->type), nb_threads, d->nb_threads);
+	return 0;
 }
 
-static void ex_av_media_free_packet_queue(exAVPacketQueue *q) {
-	q->serial = -1;
-	if (q->list) {
-		q->list->put(q->list, ex_av_packet_free_list_entry);
-		q->list = NULL;
+/*
+ * Send a packet to the codec. If the codec is full, the packet is kept and sent again by the next step,
+ * once the frames are received.
+ */
+static int decoder_send_packet(exAVDecoder *d, exAVPacket *pkt) {
+	int64_t start = av_gettime_relative();
+	int ret = avcodec_send_packet(d->codec_ctx, pkt->avpkt);
+	decoder_account(d, start, 0, "avcodec_send_packet", pkt->avpkt->pts);
+	if (ret == AVERROR(EAGAIN)) {
+		d->pending_pkt = pkt;
+		return 0;
 	}
+	pkt->put(pkt);
+	return ret;
 }
 
-static void ex_av_media_free_frame_queue(exAVFrameQueue *q) {
-	q->serial = -1;
-	if (q->list) {
-		q->list->put(q->list, ex_av_frame_free_list_entry);
-		q->list = NULL;
-	}
-	if (q->last) {
-		q->last->put(q->last);
-		q->last = NULL;
+/*
+ * Reopen the drained codec, and send it the packet it has been drained before.
+ */
+static int decoder_reopen(exAVDecoder *d) {
+	int ret = 0;
+	exAVPacket *pkt = d->reopen_pkt;
+	d->reopen_pkt = NULL;
+	if ((ret = decoder_reopen_codec(d)) < 0) {
+		pkt->put(pkt);
+		return ret;
 	}
+	return decoder_send_packet(d, pkt);
 }
 
-static void ex_av_media_free_caches(exAVMedia *m) {
-	ex_av_media_free_packet_queue(&m->vpackets);
-	ex_av_media_free_packet_queue(&m->apackets);
-	ex_av_media_free_packet_queue(&m->spackets);
-	ex_av_media_free_frame_queue(&m->vframes);
-	ex_av_media_free_frame_queue(&m->aframes);
-	ex_av_media_free_frame_queue(&m->sframes);
-}
+/*
+ * Discard settings of the video codec at every level of skipping, while the video lags behind.
+ */
+static const struct {
+	enum AVDiscard frame, loop_filter;
+} skip_levels[] = {
+	{ AVDISCARD_NONE,   AVDISCARD_NONE   },
+	{ AVDISCARD_NONE,   AVDISCARD_NONREF },
+	{ AVDISCARD_NONE,   AVDISCARD_ALL    },
+	{ AVDISCARD_NONREF, AVDISCARD_ALL    },
+};
+
+/*
+ * Whether the frame of the video packet ends before the target of the accurate seek, like 'frame_before_target';
+ * a packet whose duration is not known could hold the target.
+ */
+static int packet_before_target(exAVDecoder *d, AVPacket *pkt) {
+	int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	int64_t duration = pkt->duration;
+	AVRational frame_rate = d->stream->avg_frame_rate;
+	if (d->catch_up_pts == AV_NOPTS_VALUE || pts == AV_NOPTS_VALUE)
+		return 0;
+	if (duration <= 0 && frame_rate.num > 0 && frame_rate.den > 0)
+		duration = av_rescale_q(1, av_inv_q(frame_rate), d->stream->time_base);
+	return duration > 0 && pts + duration <= d->catch_up_pts;
+}
+
+/*
+ * Set the discard settings of the video codec for the packet 'pkt'(could be NULL): the settings it is opened
+ * with, raised by the level of skipping. Moreover, on the packets before the target of an accurate seek, the
+ * frames nobody refers to are not decoded, nor deblocked, since they would be dropped anyway; the reference
+ * frames are still fully decoded, so that the target is exact.
+ */
+static void decoder_apply_skip(exAVDecoder *d, AVPacket *pkt) {
+	enum AVDiscard discard = pkt && packet_before_target(d, pkt) ? AVDISCARD_NONREF : AVDISCARD_NONE;
+	if (d->type != AVMEDIA_TYPE_VIDEO)
+		return;
+	d->codec_ctx->skip_frame       = FFMAX3(d->skip_frame, discard, skip_levels[d->skip_level].frame);
+	d->codec_ctx->skip_loop_filter = FFMAX3(d->skip_loop_filter, discard, skip_levels[d->skip_level].loop_filter);
+	d->codec_ctx->skip_idct        = FFMAX(d->skip_idct, discard);
+}
+
+/*
+ * Start over the skipping, e.g. after seeking, when the lag is not known yet.
+ */
+static void decoder_reset_skip(exAVDecoder *d) {
+	d->skip_level = 0;
+	d->skip_clean = 0;
+	d->skip_checked = av_gettime_relative();
+	d->skip_decoded = __atomic_load_n(&d->q->nb_decoded, __ATOMIC_RELAXED);
+	d->skip_dropped = __atomic_load_n(&d->q->nb_dropped, __ATOMIC_RELAXED);
+}
+
+#if HAVE_SDL2
+/*
+ * Check the lag of the played video every 'SKIP_CHECK_INTERVAL': skip more work in the codec while it lags
+ * behind or more than a tenth of the frames are dropped, and less once it has caught up for a while.
+ */
+static void decoder_adapt_skip(exAVDecoder *d) {
+	exAVMedia *m = d->m;
+	int64_t now = av_gettime_relative();
+	int64_t decoded, dropped;
+	int behind, level = d->skip_level;
+	double lag;
+	if (d->type != AVMEDIA_TYPE_VIDEO || m->headless || d->q->sink || m->paused || !media_framedrop(m))
+		return;
+	if (now - d->skip_checked < SKIP_CHECK_INTERVAL)
+		return;
+	decoded = __atomic_load_n(&d->q->nb_decoded, __ATOMIC_RELAXED) - d->skip_decoded;
+	dropped = __atomic_load_n(&d->q->nb_dropped, __ATOMIC_RELAXED) - d->skip_dropped;
+	__atomic_load(&m->video_lag, &lag, __ATOMIC_RELAXED);
+	behind = lag > SKIP_LAG_THRESHOLD || dropped * 10 > decoded;
+	d->skip_clean = behind || dropped || lag > SKIP_CATCH_UP_THRESHOLD ? 0 : d->skip_clean + 1;
+	if (behind && level < FF_ARRAY_ELEMS(skip_levels) - 1)
+		level++;
+	else if (d->skip_clean >= SKIP_RELAX_CHECKS && level > 0) {
+		level--;
+		d->skip_clean = 0;
+	}
+	if (level != d->skip_level)
+		av_log(NULL, AV_LOG_VERBOSE, "decoder(video): lag %.3fs, %"PRId64"/%"PRId64" frames dropped, skip level %d -> %d\n",
+				lag, dropped, decoded, d->skip_level, level);
+	d->skip_level = level;
+	d->skip_checked = now;
+	d->skip_decoded += decoded;
+	d->skip_dropped += dropped;
+}
+
+/*
+ * Whether a decoded video frame is already late for the master clock, while there are more packets to
+ * decode, so that it is dropped before being cached and converted.
+ */
+static int decoder_frame_late(exAVDecoder *d, AVFrame *frame) {
+	exAVMedia *m = d->m;
+	int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+	double diff;
+	if (d->type != AVMEDIA_TYPE_VIDEO || m->headless || d->q->sink || pts == AV_NOPTS_VALUE || !media_framedrop(m))
+		return 0;
+	if (d->pkt_serial != m->video_avclock.serial || ex_av_queue_size(&d->pq->queue) == 0)
+		return 0;
+	diff = pts * av_q2d(d->stream->time_base) - get_master_clock(m);
+	return !isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD && diff < 0;
+}
+#else
+static inline void decoder_adapt_skip(exAVDecoder *d) {}
+static inline int decoder_frame_late(exAVDecoder *d, AVFrame *frame) { return 0; }
+#endif
+
+static void decoder_end_catch_up(exAVDecoder *d) {
+	if (d->catch_up_pts == AV_NOPTS_VALUE)
+		return;
+	d->catch_up_pts = AV_NOPTS_VALUE;
+	decoder_apply_skip(d, NULL);
+}
+
+/*
+ * The media has been seeked: drop what the codec buffers from before, and catch up with the target
+ * if the seek is accurate.
+ */
+static void decoder_flush(exAVDecoder *d, int serial) {
+	int64_t target = __atomic_load_n(&d->m->seek_target, __ATOMIC_ACQUIRE);
+	decoder_end_catch_up(d);
+	decoder_reset_skip(d);
+	avcodec_flush_buffers(d->codec_ctx);
+	d->pkt_serial = serial;
+	if (!d->m->accurate_seek || target == AV_NOPTS_VALUE || d->type == AVMEDIA_TYPE_SUBTITLE)
+		return;
+	d->catch_up_pts = av_rescale_q(target, AV_TIME_BASE_Q, d->stream->time_base);
+}
+
+/*
+ * Whether a decoded frame ends before the target of the accurate seek; the frame whose display interval
+ * holds the target is kept. A video frame lasts its own duration, or a frame period of the stream.
+ */
+static int frame_before_target(exAVDecoder *d, AVFrame *frame) {
+	int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+#if LIBAVUTIL_VERSION_MAJOR >= 58
+	int64_t duration = frame->duration;
+#else
+	int64_t duration = frame->pkt_duration;
+#endif
+	AVRational frame_rate = d->stream->avg_frame_rate;
+	if (pts == AV_NOPTS_VALUE)
+		return 0;
+	if (frame->sample_rate > 0)
+		duration = av_rescale_q(frame->nb_samples, (AVRational){ 1, frame->sample_rate }, d->stream->time_base);
+	else if (duration <= 0 && frame_rate.num > 0 && frame_rate.den > 0)
+		duration = av_rescale_q(1, av_inv_q(frame_rate), d->stream->time_base);
+	return duration > 0 ? pts + duration <= d->catch_up_pts : pts < d->catch_up_pts;
+}
+
+/*
+ * Receive a frame while catching up with the target of an accurate seek, into the scratch frame, so that
+ * the frames before the target are dropped without taking a frame from the pool.
+ * Return 0 if a frame is dropped, otherwise, return what 'output_frame' or 'avcodec_receive_frame' returns.
+ */
+static int decoder_catch_up(exAVDecoder *d, int64_t timeout) {
+	exAVFrame *f = NULL;
+	int64_t start = av_gettime_relative();
+	int ret = avcodec_receive_frame(d->codec_ctx, d->scratch);
+	decoder_account(d, start, ret == 0, "avcodec_receive_frame", ret == 0 ? d->scratch->pts : AV_NOPTS_VALUE);
+	if (ret < 0) {
+		if (ret == AVERROR_EOF)
+			decoder_end_catch_up(d); /* the target is beyond the end */
+		return ret;
+	}
+	if (frame_before_target(d, d->scratch)) {
+		av_frame_unref(d->scratch);
+		decoder_dropped(d);
+		return 0;
+	}
+	decoder_end_catch_up(d);
+	if ((f = ex_av_frame_pool_alloc(d->m->frame_pool)) == NULL) {
+		av_frame_unref(d->scratch);
+		return AVERROR(ENOMEM);
+	}
+	av_frame_move_ref(f->avframe, d->scratch);
+	return output_frame(d, f, timeout);
+}
+
+/*
+ * Run the decoder one step: output a decoded frame, or feed it with a packet, waiting at most 'timeout'
+ * microseconds for the caches. Return 0 if it made progress, AVERROR(EAGAIN) if timeout, AVERROR_EOF
+ * if it is drained, or another negative error code if it must stop.
+ */
+static int decoder_step(exAVDecoder *d, int64_t timeout) {
+	int ret = 0;
+	int64_t start = 0;
+	struct list_head *n = NULL;
+	exAVPacket *pkt = NULL;
+	exAVFrame *f = d->frame;
+
+	if (f) {
+		d->frame = NULL;
+		if (d->pkt_serial == d->pq->serial)
+			return output_frame(d, f, timeout);
+		f->put(f); /* decoded before seeking, the cache has been flushed */
+		decoder_dropped(d);
+	}
+	if (d->catch_up_pts != AV_NOPTS_VALUE) {
+		if ((ret = decoder_catch_up(d, timeout)) != AVERROR(EAGAIN))
+			return ret;
+	}
+	else {
+		if ((f = ex_av_frame_pool_alloc(d->m->frame_pool)) == NULL) {
+			av_log(NULL, AV_LOG_FATAL, "decoder_step error: unable to allocate frame: no memory\n");
+			return AVERROR(ENOMEM);
+		}
+		start = av_gettime_relative();
+		ret = avcodec_receive_frame(d->codec_ctx, f->avframe);
+		decoder_account(d, start, ret == 0, "avcodec_receive_frame", ret == 0 ? f->avframe->pts : AV_NOPTS_VALUE);
+		if (ret == 0 && decoder_frame_late(d, f->avframe)) {
+			f->put(f);
+			decoder_dropped(d);
+			return 0;
+		}
+		if (ret == 0)
+			return output_frame(d, f, timeout);
+		f->put(f);
+	}
+	if (ret == AVERROR_EOF && d->reopen_pkt)
+		return decoder_reopen(d);
+	if (ret != AVERROR(EAGAIN))
+		return ret;
+	if ((pkt = d->pending_pkt) != NULL) {
+		d->pending_pkt = NULL;
+		if (((exFFPacket *)pkt)->serial == d->pq->serial)
+			return decoder_send_packet(d, pkt);
+		pkt->put(pkt); /* grabbed before seeking */
+	}
+
+	/* the decoder needs more packets; wait until the grabber inserts a packet, finishes, or the decoding is stopped */
+	ret = ex_av_queue_pop(&d->pq->queue, &n, timeout);
+	if (ret == AVERROR_EOF)
+		return avcodec_send_packet(d->codec_ctx, NULL); /* enter draining mode */
+	if (ret < 0)
+		return ret;
+	pkt = list_entry(n, exAVPacket, list);
+	if (((exFFPacket *)pkt)->serial != d->pkt_serial) {
+		decoder_flush(d, ((exFFPacket *)pkt)->serial);
+		/* nothing before the flush is needed any more, a pending change of the thread budget is taken now */
+		if (decoder_budget_changed(d) && (ret = decoder_reopen_codec(d)) < 0) {
+			pkt->put(pkt);
+			return ret;
+		}
+	}
+	decoder_adapt_skip(d);
+	decoder_apply_skip(d, pkt->avpkt);
+	if (decoder_should_reopen(d, pkt)) {
+		/* drain the frames buffered in the codec, then reopen it before this keyframe */
+		d->reopen_pkt = pkt;
+		return avcodec_send_packet(d->codec_ctx, NULL);
+	}
+	return decoder_send_packet(d, pkt);
+}
+
+static int decoder_open(exAVDecoder *d, exAVMedia *m, enum AVMediaType type) {
+	int ret = -1;
+	int stream_idx = get_stream_idx(m, type);
+	memset(d, 0, sizeof(exAVDecoder));
+	d->m = m;
+	d->type = type;
+	d->q = get_frame_queue(m, type);
+	switch (type) {
+	case AVMEDIA_TYPE_VIDEO:
+		d->pq = &m->vpackets; break;
+	case AVMEDIA_TYPE_AUDIO:
+		d->pq = &m->apackets; break;
+	case AVMEDIA_TYPE_SUBTITLE:
+		d->pq = &m->spackets; break;
+	default: break;
+	}
+	/*
+	 * if there is no such stream of type 'type', then it's unnecessary to create
+	 * its corresponding decoder
+	 */
+	if (stream_idx < 0)
+		goto err0;
+	d->stream = m->ic->streams[stream_idx];
+	d->codec = avcodec_find_decoder(d->stream->codecpar->codec_id);
+	if (d->codec == NULL) {
+		av_log(NULL, AV_LOG_ERROR, "decode_routine(%s) error: no such avcodec for %s\n", av_get_media_type_string(type), avcodec_get_name(d->stream->codecpar->codec_id));
+		goto err0;
+	}
+	/* only the video decoders need more than one thread */
+	if (type == AVMEDIA_TYPE_VIDEO && m->decoder_threads <= 0) {
+		d->budget = 1;
+		ex_av_thread_budget_join();
+	}
+	if ((ret = decoder_open_codec(d)) < 0)
+		goto err1;
+	if ((d->scratch = av_frame_alloc()) == NULL) {
+		ret = AVERROR(ENOMEM);
+		goto err2;
+	}
+	d->pkt_serial = d->pq->serial;
+	d->catch_up_pts = AV_NOPTS_VALUE;
+	d->probe_check = m->probe_cached;
+	d->skip_frame       = d->codec_ctx->skip_frame;
+	d->skip_loop_filter = d->codec_ctx->skip_loop_filter;
+	d->skip_idct        = d->codec_ctx->skip_idct;
+	decoder_reset_skip(d);
+	return 0;
+err2:
+	avcodec_free_context(&d->codec_ctx);
+err1:
+	if (d->budget)
+		ex_av_thread_budget_leave();
+	d->budget = 0;
+err0:
+	return ret < 0 ? ret : -1;
+}
+
+/*
+ * Release the decoder, and tell the consumer of its frames that there are no more frames.
+ */
+static void decoder_close(exAVDecoder *d) {
+	if (d->frame) {
+		d->frame->put(d->frame);
+		d->frame = NULL;
+	}
+	if (d->reopen_pkt) {
+		d->reopen_pkt->put(d->reopen_pkt);
+		d->reopen_pkt = NULL;
+	}
+	if (d->pending_pkt) {
+		d->pending_pkt->put(d->pending_pkt);
+		d->pending_pkt = NULL;
+	}
+	if (d->budget)
+		ex_av_thread_budget_leave();
+	d->budget = 0;
+	av_frame_free(&d->scratch);
+	avcodec_free_context(&d->codec_ctx);
+	if (d->q)
+		ex_av_queue_finish(decoder_output(d));
+	media_set_flags(d->m, get_decoder_finished_flag(d->type));
+}
+
+static void run_decode_routine(exAVMedia *m, enum AVMediaType type) {
+	exAVDecoder d;
+	int ret = decoder_open(&d, m, type);
+	while (ret >= 0)
+		ret = decoder_step(&d, -1);
+	decoder_close(&d);
+}
+
+/*
+ * Decoder task on the executor
+ */
+static int decoder_task_step(exAVTask *t, void *arg) {
+	exAVDecoder *d = (exAVDecoder *)arg;
+	int ret = d->codec_ctx ? decoder_step(d, 0) : -1;
+	if (ret == AVERROR(EAGAIN))
+		return TASK_BLOCKED;
+	if (ret >= 0)
+		return TASK_AGAIN;
+	decoder_close(d);
+	return TASK_DONE;
+}
+
+/*
+ * video-decoder routine
+ */
+static void *video_decoder(void *arg) {
+	exAVMedia *m = (exAVMedia *)arg;
+	ex_av_trace_thread_name("video decoder");
+	run_decode_routine(m, AVMEDIA_TYPE_VIDEO);
+	return NULL;
+}
+
+/*
+ * audio-decoder routine
+ */
+static void *audio_decoder(void *arg) {
+	exAVMedia *m = (exAVMedia *)arg;
+	ex_av_trace_thread_name("audio decoder");
+	run_decode_routine(m, AVMEDIA_TYPE_AUDIO);
+	return NULL;
+}
+
+/*
+ * subtitle-decoder routine
+ */
+static void *subtitle_decoder(void *arg) {
+	exAVMedia *m = (exAVMedia *)arg;
+	ex_av_trace_thread_name("subtitle decoder");
+	run_decode_routine(m, AVMEDIA_TYPE_SUBTITLE);
+	return NULL;
+}
+
+#if HAVE_SDL2
+/*
+ * Size a video frame is converted to: downscaled to fit the window, keeping its aspect ratio, never upscaled.
+ */
+static void convert_size(exAVMedia *m, AVFrame *frame, int *width, int *height) {
+	int w = m->screen_width, h = m->screen_height;
+	*width = frame->width;
+	*height = frame->height;
+	if (w <= 0 || h <= 0 || (frame->width <= w && frame->height <= h))
+		return;
+	if ((int64_t)frame->width * h > (int64_t)frame->height * w) {
+		*width = w;
+		*height = av_rescale(frame->height, w, frame->width);
+	}
+	else {
+		*width = av_rescale(frame->width, h, frame->height);
+		*height = h;
+	}
+	/* even, for the subsampled chroma */
+	*width = FFMAX(*width & ~1, 2);
+	*height = FFMAX(*height & ~1, 2);
+}
+
+static int is_yuvj(int format) {
+	return format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P ||
+			format == AV_PIX_FMT_YUVJ440P || format == AV_PIX_FMT_YUVJ411P;
+}
+
+/* Alignment of the lines of the converted frames */
+#define CONVERT_BUFFER_ALIGN 32
+
+/*
+ * Attach a buffer from 'convert_pool' to the converted 'frame', whose format and size are set; the pool is
+ * created again once the size of the converted frames changes, the buffers still in use keep the old one.
+ */
+static int convert_frame_get_buffer(exAVMedia *m, AVFrame *frame) {
+	int ret, size = av_image_get_buffer_size(frame->format, frame->width, frame->height, CONVERT_BUFFER_ALIGN);
+	if (size < 0)
+		return size;
+	/* padded as 'av_frame_get_buffer' does, for the SIMD of swscale */
+	size += 16 + CONVERT_BUFFER_ALIGN - 1;
+	if (m->convert_pool == NULL || m->convert_pool_size != size) {
+		av_buffer_pool_uninit(&m->convert_pool);
+		if ((m->convert_pool = av_buffer_pool_init(size, NULL)) == NULL)
+			return AVERROR(ENOMEM);
+		m->convert_pool_size = size;
+	}
+	if ((frame->buf[0] = av_buffer_pool_get(m->convert_pool)) == NULL)
+		return AVERROR(ENOMEM);
+	ret = av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, frame->format,
+			frame->width, frame->height, CONVERT_BUFFER_ALIGN);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Convert a decoded video frame to be uploaded without any conversion: the formats uploaded as they are
+ * only get downscaled, the other ones are converted into YUV420P, or BGRA if they are RGB.
+ * Return the converted frame, or 'f' itself if there is nothing to do or if it failed.
+ */
+static exAVFrame *convert_frame(exAVMedia *m, exAVFrame *f) {
+	AVFrame *src = f->avframe;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+	int supported = sdl_texture_format_supported(src->format);
+	enum AVPixelFormat format = supported ? src->format : AV_PIX_FMT_YUV420P;
+	exAVFrame *c = NULL;
+	int width, height;
+	convert_size(m, src, &width, &height);
+	if (supported && width == src->width && height == src->height)
+		return f;
+	if (desc == NULL || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+		return f;
+	if (!supported && (desc->flags & AV_PIX_FMT_FLAG_RGB))
+		format = AV_PIX_FMT_BGRA;
+	m->convert_sws = sws_getCachedContext(m->convert_sws, src->width, src->height, src->format,
+			width, height, format, SWS_BILINEAR, NULL, NULL, NULL);
+	if (m->convert_sws == NULL || (c = ex_av_frame_pool_alloc(m->frame_pool)) == NULL)
+		return f;
+	c->avframe->format = format;
+	c->avframe->width = width;
+	c->avframe->height = height;
+	if (convert_frame_get_buffer(m, c->avframe) < 0 || av_frame_copy_props(c->avframe, src) < 0) {
+		c->put(c);
+		return f;
+	}
+	((exFFFrame *)c)->serial = ((exFFFrame *)f)->serial;
+	sws_scale(m->convert_sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, c->avframe->data, c->avframe->linesize);
+	/* swscale scales the full range of the yuvj formats into the limited range of the other ones */
+	if (is_yuvj(src->format) && !is_yuvj(format))
+		c->avframe->color_range = AVCOL_RANGE_MPEG;
+	f->put(f);
+	return c;
+}
+
+/*
+ * video-converter routine: from 'vconvert' to 'vframes', until the video decoder finishes or the decoding is stopped.
+ */
+static void *video_converter(void *arg) {
+	exAVMedia *m = (exAVMedia *)arg;
+	struct list_head *n = NULL;
+	exAVFrame *f = NULL;
+	int64_t trace;
+	int ret, serial;
+	ex_av_trace_thread_name("video converter");
+	while (1) {
+		if ((ret = ex_av_queue_pop(&m->vconvert, &n, -1)) < 0)
+			break;
+		/* stamped by the decoder, a frame decoded from the packets before a seek never matches again */
+		serial = ((exFFFrame *)list_entry(n, exAVFrame, list))->serial;
+		trace = ex_av_trace_begin();
+		f = convert_frame(m, list_entry(n, exAVFrame, list));
+		ex_av_trace_end(trace, "convert", m->video_idx, serial, f->avframe->pts);
+		if (serial != m->vpackets.serial) {
+			/* decoded before seeking, the cache has been flushed */
+			f->put(f);
+			continue;
+		}
+		if ((ret = ex_av_queue_push(&m->vframes.queue, &f->list, -1)) < 0) {
+			f->put(f);
+			break;
+		}
+		/*
+		 * a seek while it waited for room flushed the cache, which let the stale frame in behind the flush;
+		 * the converter is the only one inserting into it, so flushing it again only drops that frame
+		 */
+		if (serial != m->vpackets.serial)
+			ex_av_queue_flush(&m->vframes.queue, ex_av_frame_free_list_entry);
+	}
+	if (ret == AVERROR_EOF)
+		ex_av_queue_finish(&m->vframes.queue);
+	return NULL;
+}
+
+/*
+ * Start the converter if the media is played with the convert stage.
+ */
+static void start_video_converter(exAVMedia *m) {
+	m->converting = 0;
+	if (!m->convert_stage || m->headless || m->transcoder || m->vframes.sink)
+		return;
+	if (pthread_create(&m->video_converter, NULL, video_converter, m)) {
+		av_log(NULL, AV_LOG_ERROR, "start_video_converter error: unable to create the thread, the player converts\n");
+		return;
+	}
+	m->converting = 1;
+}
+
+static void stop_video_converter(exAVMedia *m) {
+	if (!m->converting)
+		return;
+	pthread_join(m->video_converter, NULL);
+	m->converting = 0;
+}
+#else
+static void start_video_converter(exAVMedia *m) {}
+static void stop_video_converter(exAVMedia *m) {}
+#endif
+
+static void ex_av_media_free_packet_queue(exAVPacketQueue *q) {
+	q->serial = -1;
+	ex_av_queue_destroy(&q->queue, ex_av_packet_free_list_entry);
+}
+
+static void ex_av_media_free_frame_queue(exAVFrameQueue *q) {
+	q->serial = -1;
+	ex_av_queue_destroy(&q->queue, ex_av_frame_free_list_entry);
+	if (q->last) {
+		q->last->put(q->last);
+		q->last = NULL;
+	}
+}
+
+static void ex_av_media_free_caches(exAVMedia *m) {
+	ex_av_media_free_packet_queue(&m->vpackets);
+	ex_av_media_free_packet_queue(&m->apackets);
+	ex_av_media_free_packet_queue(&m->spackets);
+	ex_av_media_free_frame_queue(&m->vframes);
+	ex_av_media_free_frame_queue(&m->aframes);
+	ex_av_media_free_frame_queue(&m->sframes);
+	if (m->convert_stage) {
+		ex_av_queue_destroy(&m->vconvert, ex_av_frame_free_list_entry);
+		m->convert_stage = 0;
+	}
+	sws_freeContext(m->convert_sws);
+	m->convert_sws = NULL;
+	av_buffer_pool_uninit(&m->convert_pool);
+	m->convert_pool_size = 0;
+	if (m->packet_pool)
+		av_log(NULL, AV_LOG_VERBOSE, "packet pool: %"PRId64" allocated, %"PRId64" reused\n", m->packet_pool->nb_allocs, m->packet_pool->nb_reuses);
+	if (m->frame_pool)
+		av_log(NULL, AV_LOG_VERBOSE, "frame pool: %"PRId64" allocated, %"PRId64" reused\n", m->frame_pool->nb_allocs, m->frame_pool->nb_reuses);
+	ex_av_packet_pool_free(&m->packet_pool);
+	ex_av_frame_pool_free(&m->frame_pool);
+}
+
+static void ex_av_media_abort_caches(exAVMedia *m) {
+	ex_av_queue_abort(&m->vpackets.queue);
+	ex_av_queue_abort(&m->apackets.queue);
+	ex_av_queue_abort(&m->spackets.queue);
+	ex_av_queue_abort(&m->vframes.queue);
+	ex_av_queue_abort(&m->aframes.queue);
+	ex_av_queue_abort(&m->sframes.queue);
+	if (m->convert_stage)
+		ex_av_queue_abort(&m->vconvert);
+}
+
+static void ex_av_media_start_caches(exAVMedia *m) {
+	ex_av_queue_start(&m->vpackets.queue);
+	ex_av_queue_start(&m->apackets.queue);
+	ex_av_queue_start(&m->spackets.queue);
+	ex_av_queue_start(&m->vframes.queue);
+	ex_av_queue_start(&m->aframes.queue);
+	ex_av_queue_start(&m->sframes.queue);
+	if (m->convert_stage)
+		ex_av_queue_start(&m->vconvert);
+}
+
+static void wake_task(void *task) {
+	ex_av_task_wake((exAVTask *)task);
+}
+
+/*
+ * Let the caches wake up the tasks of the grabber and the decoders.
+ */
+static void set_cache_wakers(exAVMedia *m) {
+	void (*wake)(void *) = m->packet_grabber_task ? wake_task : NULL;
+	ex_av_queue_set_wakers(&m->vpackets.queue, wake, m->packet_grabber_task, m->video_decoder_task);
+	ex_av_queue_set_wakers(&m->apackets.queue, wake, m->packet_grabber_task, m->audio_decoder_task);
+	ex_av_queue_set_wakers(&m->spackets.queue, wake, m->packet_grabber_task, m->subtitle_decoder_task);
+	if (m->converting) {
+		/* the converter thread is the producer of 'vframes' */
+		ex_av_queue_set_wakers(&m->vconvert, wake, m->video_decoder_task, NULL);
+		ex_av_queue_set_wakers(&m->vframes.queue, NULL, NULL, NULL);
+	}
+	else
+		ex_av_queue_set_wakers(&m->vframes.queue,  wake, m->video_decoder_task, NULL);
+	ex_av_queue_set_wakers(&m->aframes.queue,  wake, m->audio_decoder_task, NULL);
+	ex_av_queue_set_wakers(&m->sframes.queue,  wake, m->subtitle_decoder_task, NULL);
+	pthread_mutex_lock(&m->remux_mutex);
+	if (m->remuxer)
+		ex_av_remuxer_set_waker(m->remuxer, wake, m->packet_grabber_task);
+	pthread_mutex_unlock(&m->remux_mutex);
+}
+
+/*
+ * Stop the caches from waking up the tasks, even from the threads still running(renderer, converter),
+ * before the tasks are freed.
+ */
+static void clear_cache_wakers(exAVMedia *m) {
+	ex_av_queue_set_wakers(&m->vpackets.queue, NULL, NULL, NULL);
+	ex_av_queue_set_wakers(&m->apackets.queue, NULL, NULL, NULL);
+	ex_av_queue_set_wakers(&m->spackets.queue, NULL, NULL, NULL);
+	if (m->convert_stage)
+		ex_av_queue_set_wakers(&m->vconvert, NULL, NULL, NULL);
+	ex_av_queue_set_wakers(&m->vframes.queue, NULL, NULL, NULL);
+	ex_av_queue_set_wakers(&m->aframes.queue, NULL, NULL, NULL);
+	ex_av_queue_set_wakers(&m->sframes.queue, NULL, NULL, NULL);
+	pthread_mutex_lock(&m->remux_mutex);
+	if (m->remuxer)
+		ex_av_remuxer_set_waker(m->remuxer, NULL, NULL);
+	pthread_mutex_unlock(&m->remux_mutex);
+}
+
+static void free_decoder_task(exAVTask **t) {
+	if (*t == NULL)
+		return;
+	ex_av_task_wait(*t);
+	free((*t)->opaque);
+	ex_av_task_free(t);
+}
+
+static void stop_decode_tasks(exAVMedia *m) {
+	/* the caches are aborted, so the tasks finish without being woken up */
+	clear_cache_wakers(m);
+	if (m->packet_grabber_task) {
+		ex_av_task_wait(m->packet_grabber_task);
+		ex_av_task_free(&m->packet_grabber_task);
+	}
+	free_decoder_task(&m->video_decoder_task);
+	free_decoder_task(&m->audio_decoder_task);
+	free_decoder_task(&m->subtitle_decoder_task);
+}
+
+static int create_decoder_task(exAVMedia *m, enum AVMediaType type, exAVTask **t) {
+	exAVDecoder *d = NULL;
+	if (get_stream_idx(m, type) < 0)
+		return 0;
+	if ((d = malloc(sizeof(exAVDecoder))) == NULL)
+		return AVERROR(ENOMEM);
+	if ((*t = ex_av_task_create(m->executor, decoder_task_step, d)) == NULL) {
+		free(d);
+		return AVERROR(ENOMEM);
+	}
+	/* a decoder failed to open is closed by its first step */
+	decoder_open(d, m, type);
+	return 0;
+}
+
+/*
+ * Run the grabber and decoders as tasks on the shared executor instead of their own threads.
+ */
+static int start_decode_tasks(exAVMedia *m) {
+	if ((m->packet_grabber_task = ex_av_task_create(m->executor, packet_grabber_step, m)) == NULL)
+		goto err;
+	if (create_decoder_task(m, AVMEDIA_TYPE_VIDEO, &m->video_decoder_task)       ||
+			create_decoder_task(m, AVMEDIA_TYPE_AUDIO, &m->audio_decoder_task)   ||
+			create_decoder_task(m, AVMEDIA_TYPE_SUBTITLE, &m->subtitle_decoder_task))
+		goto err;
+	/* the wakers must be set before any task runs */
+	set_cache_wakers(m);
+	ex_av_task_wake(m->packet_grabber_task);
+	if (m->video_decoder_task)
+		ex_av_task_wake(m->video_decoder_task);
+	if (m->audio_decoder_task)
+		ex_av_task_wake(m->audio_decoder_task);
+	if (m->subtitle_decoder_task)
+		ex_av_task_wake(m->subtitle_decoder_task);
+	return 0;
+err:
+	av_log(NULL, AV_LOG_ERROR, "start_decode_tasks error: no memory\n");
+	/* the tasks never woken up are simply freed */
+	ex_av_task_free(&m->packet_grabber_task);
+	if (m->video_decoder_task) {
+		decoder_close(m->video_decoder_task->opaque);
+		free(m->video_decoder_task->opaque);
+		ex_av_task_free(&m->video_decoder_task);
+	}
+	if (m->audio_decoder_task) {
+		decoder_close(m->audio_decoder_task->opaque);
+		free(m->audio_decoder_task->opaque);
+		ex_av_task_free(&m->audio_decoder_task);
+	}
+	/* the subtitle decoder is the last one created, so it could not exist here */
+	return AVERROR(ENOMEM);
+}
 
 static void ex_av_media_stop_decode(exAVMedia *m) {
-	if (!ex_av_media_packet_grabber_stopped(m))
-		pthread_cancel(m->packet_grabber);
-	if (!ex_av_media_video_decoder_stopped(m))
-		pthread_cancel(m->video_decoder);
-	if (!ex_av_media_audio_decoder_stopped(m))
-		pthread_cancel(m->audio_decoder);
-	if (!ex_av_media_subtitle_decoder_stopped(m))
-		pthread_cancel(m->subtitle_decoder);
+	if (!m->decode_started)
+		return;
 	/*
-	 * Wait for the decoder or grabber to exit, if it exists.
+	 * Wake up the grabber and decoders blocked on the caches or on the I/O,
+	 * then wait for them to exit.
 	 */
-	pthread_join(m->packet_grabber, NULL);
-	pthread_join(m->video_decoder, NULL);
-	pthread_join(m->audio_decoder, NULL);
-	pthread_join(m->subtitle_decoder, NULL);
+	media_abort(m);
+	if (m->executor) {
+		stop_decode_tasks(m);
+	}
+	else {
+		pthread_join(m->packet_grabber, NULL);
+		if (m->video_idx >= 0)
+			pthread_join(m->video_decoder, NULL);
+		if (m->audio_idx >= 0)
+			pthread_join(m->audio_decoder, NULL);
+		if (m->subtitle_idx >= 0)
+			pthread_join(m->subtitle_decoder, NULL);
+	}
+	stop_video_converter(m);
 	m->decode_started = 0;
+	m->headless = 0;
 }
 
 static void ex_av_media_start_decode(exAVMedia *m) {
 	/* The media is not yet opened */
 	if (m->ic == NULL)
 		return;
+	if (m->grabber_only) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_start_decode error: the media is being saved without decoding\n");
+		return;
+	}
+
+	/* under the mutex, like every other change of them: a waiter of the previous decoding may still read them */
+	pthread_mutex_lock(&m->mutex);
+	__atomic_store_n(&m->abort_request, 0, __ATOMIC_RELEASE);
+	m->pace_start_time = AV_NOPTS_VALUE;
+	m->sink_error = 0;
+	m->flags &= ~(MEDIA_FLAG_GRABBER_FINISHED | MEDIA_FLAG_DECODER_FINISHED);
+	if (m->video_idx < 0)
+		m->flags |= MEDIA_FLAG_VIDEO_DECODER_FINISHED;
+	if (m->audio_idx < 0)
+		m->flags |= MEDIA_FLAG_AUDIO_DECODER_FINISHED;
+	if (m->subtitle_idx < 0)
+		m->flags |= MEDIA_FLAG_SUBTITLE_DECODER_FINISHED;
+	pthread_mutex_unlock(&m->mutex);
+	ex_av_media_start_caches(m);
+	/* before the video decoder, which inserts its frames according to it */
+	start_video_converter(m);
+
+	if (m->executor) {
+		if (start_decode_tasks(m) == 0)
+			m->decode_started = 1;
+		else if (m->converting) {
+			ex_av_queue_abort(&m->vconvert);
+			stop_video_converter(m);
+		}
+		return;
+	}
 
 	/* Start up packet-grabber and decoders */
 	pthread_create(&m->packet_grabber, NULL, packet_grabber, m);
@@ -1180,18 +2391,97 @@ static void ex_av_media_find_stream_index(exAVMedia *m, int open_flags) {
 		m->subtitle_idx = av_find_best_stream(m->ic, AVMEDIA_TYPE_SUBTITLE, -1, -1, NULL, 0);
 }
 
-static int ex_av_media_init_caches(exAVMedia *m) {
-	m->vpackets.list = list_create(MUTEX, VIDEO_PACKET_QUEUE_SIZE);
-	m->apackets.list = list_create(MUTEX, AUDIO_PACKET_QUEUE_SIZE);
-	m->spackets.list = list_create(MUTEX, SUBTITLE_PACKET_QUEUE_SIZE);
-	m->vframes.list  = list_create(MUTEX, VIDEO_PICTURE_QUEUE_SIZE);
-	m->aframes.list  = list_create(MUTEX, AUDIO_SAMPLE_QUEUE_SIZE);
-	m->sframes.list  = list_create(MUTEX, SUBTITLE_PICTURE_QUEUE_SIZE);
-	if (!m->vpackets.list || !m->apackets.list || !m->spackets.list ||
-			!m->vframes.list  || !m->aframes.list  || !m->sframes.list) {
+/*
+ * Measure a packet in the cache, in the time base of its stream.
+ */
+static void measure_packet(exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration) {
+	exAVPacket *pkt = list_entry(n, exAVPacket, list);
+	*bytes = pkt->avpkt->size + sizeof(exFFPacket);
+	*duration = pkt->avpkt->duration > 0 ? av_rescale_q(pkt->avpkt->duration, q->time_base, AV_TIME_BASE_Q) : 0;
+}
+
+/*
+ * Measure a decoded frame in the cache: the size of its buffers, and its duration.
+ */
+static void measure_frame(exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration) {
+	exAVFrame *f = list_entry(n, exAVFrame, list);
+	AVFrame *frame = f->avframe;
+#if LIBAVUTIL_VERSION_MAJOR >= 58
+	int64_t frame_duration = frame->duration;
+#else
+	int64_t frame_duration = frame->pkt_duration;
+#endif
+	*bytes = sizeof(exFFFrame);
+	for (int i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+		*bytes += frame->buf[i]->size;
+	for (int i = 0; i < frame->nb_extended_buf; i++)
+		*bytes += frame->extended_buf[i]->size;
+	if (frame->sample_rate > 0)
+		*duration = av_rescale(frame->nb_samples, AV_TIME_BASE, frame->sample_rate);
+	else if (frame_duration > 0)
+		*duration = av_rescale_q(frame_duration, q->time_base, AV_TIME_BASE_Q);
+	else
+		*duration = 0;
+}
+
+static void ex_av_media_set_cache_limits(exAVMedia *m, int64_t max_bytes, double min_duration) {
+	int64_t duration = min_duration * AV_TIME_BASE;
+	m->cache_max_bytes = max_bytes;
+	m->cache_min_duration = min_duration;
+	if (m->ic == NULL)
+		return; /* the caches are not yet created, they will be limited once the media is opened */
+	ex_av_queue_set_limits(&m->vpackets.queue, max_bytes, duration);
+	ex_av_queue_set_limits(&m->apackets.queue, max_bytes, duration);
+	ex_av_queue_set_limits(&m->spackets.queue, max_bytes, duration);
+	ex_av_queue_set_limits(&m->vframes.queue,  max_bytes, duration);
+	ex_av_queue_set_limits(&m->aframes.queue,  max_bytes, duration);
+	ex_av_queue_set_limits(&m->sframes.queue,  max_bytes, duration);
+}
+
+static AVRational get_stream_time_base(exAVMedia *m, int stream_idx) {
+	return stream_idx >= 0 ? m->ic->streams[stream_idx]->time_base : AV_TIME_BASE_Q;
+}
+
+static void ex_av_media_measure_caches(exAVMedia *m) {
+	ex_av_queue_set_measure(&m->vpackets.queue, measure_packet, get_stream_time_base(m, m->video_idx));
+	ex_av_queue_set_measure(&m->apackets.queue, measure_packet, get_stream_time_base(m, m->audio_idx));
+	ex_av_queue_set_measure(&m->spackets.queue, measure_packet, get_stream_time_base(m, m->subtitle_idx));
+	ex_av_queue_set_measure(&m->vframes.queue,  measure_frame,  get_stream_time_base(m, m->video_idx));
+	ex_av_queue_set_measure(&m->aframes.queue,  measure_frame,  get_stream_time_base(m, m->audio_idx));
+	ex_av_queue_set_measure(&m->sframes.queue,  measure_frame,  get_stream_time_base(m, m->subtitle_idx));
+	ex_av_media_set_cache_limits(m, m->cache_max_bytes, m->cache_min_duration);
+}
+
+static int ex_av_media_init_caches(exAVMedia *m, int open_flags) {
+	/* every cache has exactly one producer and one consumer, so the lock-free ring buffer could be used */
+	int type = (open_flags & MEDIA_FLAG_SPSC_QUEUE) ? QUEUE_SPSC : QUEUE_LIST;
+	/* the released packets and frames are recycled, so there is no allocation once the caches are filled */
+	m->packet_pool = ex_av_packet_pool_create(sizeof(exFFPacket), PACKET_POOL_SIZE);
+	m->frame_pool  = ex_av_frame_pool_create(sizeof(exFFFrame), FRAME_POOL_SIZE);
+	if (!m->packet_pool || !m->frame_pool) {
+		av_log(NULL, AV_LOG_ERROR, "unable to create pools: no memory\n");
+		goto err;
+	}
+	if (ex_av_queue_init(&m->vpackets.queue, type, VIDEO_PACKET_QUEUE_SIZE)    |
+			ex_av_queue_init(&m->apackets.queue, type, AUDIO_PACKET_QUEUE_SIZE)    |
+			ex_av_queue_init(&m->spackets.queue, type, SUBTITLE_PACKET_QUEUE_SIZE) |
+			ex_av_queue_init(&m->vframes.queue,  type, VIDEO_PICTURE_QUEUE_SIZE)   |
+			ex_av_queue_init(&m->aframes.queue,  type, AUDIO_SAMPLE_QUEUE_SIZE)    |
+			ex_av_queue_init(&m->sframes.queue,  type, SUBTITLE_PICTURE_QUEUE_SIZE)) {
 		av_log(NULL, AV_LOG_ERROR, "unable to create caches: no memory\n");
 		goto err;
 	}
+	m->vframes.nb_decoded = m->vframes.decode_time = m->vframes.nb_dropped = 0;
+	m->aframes.nb_decoded = m->aframes.decode_time = m->aframes.nb_dropped = 0;
+	m->sframes.nb_decoded = m->sframes.decode_time = m->sframes.nb_dropped = 0;
+	m->nb_seeks = 0;
+	if ((open_flags & MEDIA_FLAG_CONVERT) && m->video_idx >= 0) {
+		if (ex_av_queue_init(&m->vconvert, type, VIDEO_CONVERT_QUEUE_SIZE)) {
+			av_log(NULL, AV_LOG_ERROR, "unable to create caches: no memory\n");
+			goto err;
+		}
+		m->convert_stage = 1;
+	}
 	return 0;
 err:
 	ex_av_media_free_caches(m);
@@ -1243,37 +2533,110 @@ check_subtile:
 	goto check_audio;
 }
 
-static int _ex_av_media_open(exAVMedia *m, const char *url, int open_flags) {
+/*
+ * Index the keyframes of the main stream in the background, unless its sidecar file is complete.
+ */
+static void ex_av_media_open_key_index(exAVMedia *m, const char *url) {
+	int idx = m->video_idx >= 0 ? m->video_idx : m->audio_idx;
+	if ((m->key_index = ex_av_key_index_create(m->ic, url, idx)) == NULL)
+		return; /* the demuxer seeks well by itself */
+	/* the grabber starts from the beginning of the media */
+	m->key_index_contiguous = 1;
+	if (ex_av_key_index_build(m->key_index) < 0)
+		av_log(NULL, AV_LOG_WARNING, "ex_av_media_open: unable to start indexing %s\n", url);
+}
+
+static void media_close_user_pb(exAVMedia *m) {
+	if (m->user_pb)
+		m->user_pb_close(&m->user_pb);
+	m->user_pb_close = NULL;
+}
+
+/*
+ * Open the input of the media from 'pb' if not NULL, the media owns it from now on, otherwise from 'url'.
+ */
+static int media_open_input(exAVMedia *m, const char *url, AVIOContext *pb, void (*pb_close)(AVIOContext **), int open_flags) {
 	int ret = -1;
+	const char *name = url ? url : "custom io";
+	const AVInputFormat *iformat = NULL;
+	int probe_cache = url && (open_flags & MEDIA_FLAG_PROBE_CACHE);
 
 	if (m->ic) {
 		/* The media is already opened */
-		if (m->ic->url && !strcmp(m->ic->url, url))
+		if (url && m->ic->url && !strcmp(m->ic->url, url))
 			return 0;
 		m->close(m);
 	}
+	m->user_pb = pb;
+	m->user_pb_close = pb_close;
 
-	if ((ret = avformat_open_input(&m->ic, url, NULL, NULL)) < 0) {
-		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open: avformat_open_input error: %s: %s\n", av_err2str(ret), url);
+	if ((m->ic = avformat_alloc_context()) == NULL) {
+		ret = AVERROR(ENOMEM);
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open: avformat_alloc_context error: %s: %s\n", av_err2str(ret), name);
 		goto err0;
 	}
-	if ((ret = avformat_find_stream_info(m->ic, NULL)) < 0) {
-		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open: avformat_find_stream_info error: %s: %s\n", av_err2str(ret), url);
-		goto err1;
+	m->ic->interrupt_callback.callback = media_interrupt_cb;
+	m->ic->interrupt_callback.opaque = m;
+	if (m->user_pb) {
+		m->ic->pb = m->user_pb;
+		m->ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	else if ((open_flags & MEDIA_FLAG_MMAP) && ex_av_mmap_io_open(&m->mmap_pb, url) == 0) {
+		m->ic->pb = m->mmap_pb;
+		m->ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	else if ((open_flags & MEDIA_FLAG_PREFETCH) &&
+			ex_av_prefetch_io_open(&m->prefetch_pb, url, 0, &m->ic->interrupt_callback) == 0) {
+		m->ic->pb = m->prefetch_pb;
+		m->ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	if (probe_cache)
+		iformat = ex_av_probe_cache_format(url);
+	if ((ret = avformat_open_input(&m->ic, url, iformat, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open: avformat_open_input error: %s: %s\n", av_err2str(ret), name);
+		goto err0;
+	}
+	m->probe_cached = 0;
+	if (probe_cache && ex_av_probe_cache_apply(m->ic, url) == 0) {
+		av_log(NULL, AV_LOG_DEBUG, "ex_av_media_open: stream info of %s found in the probe cache\n", name);
+		m->probe_cached = 1;
+	}
+	else {
+		if ((ret = avformat_find_stream_info(m->ic, NULL)) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_media_open: avformat_find_stream_info error: %s: %s\n", av_err2str(ret), name);
+			goto err1;
+		}
+		if (probe_cache)
+			ex_av_probe_cache_store(m->ic, url);
 	}
 	ex_av_media_find_stream_index(m, open_flags);
-	if (ex_av_media_init_caches(m))
+	if (ex_av_media_init_caches(m, open_flags))
 		goto err1;
 	ex_av_media_read_stream_info(m);
+	ex_av_media_measure_caches(m);
+	if (url && (open_flags & MEDIA_FLAG_KEY_INDEX))
+		ex_av_media_open_key_index(m, url);
 	return 0;
 err1:
 	avformat_close_input(&m->ic);
 err0:
+	/* a custom AVIOContext is left to its owner */
+	ex_av_mmap_io_close(&m->mmap_pb);
+	ex_av_prefetch_io_close(&m->prefetch_pb);
+	media_close_user_pb(m);
 	return ret;
 }
 
+static int _ex_av_media_open(exAVMedia *m, const char *url, int open_flags) {
+	return media_open_input(m, url, NULL, NULL, open_flags);
+}
+
+static int ex_av_media_stop_save(exAVMedia *m);
+
 static void ex_av_media_stop(exAVMedia *m) {
 	if (m->ic) {
+		if (m->remuxer || m->transcoder)
+			ex_av_media_stop_save(m);
 		if (m->play_started)
 			m->stop_play(m);
 		if (m->decode_started)
@@ -1284,74 +2647,200 @@ static void ex_av_media_stop(exAVMedia *m) {
 static void ex_av_media_close(exAVMedia *m) {
 	ex_av_media_stop(m);
 	if (m->ic) {
+		ex_av_key_index_free(&m->key_index);
+		m->key_index_contiguous = 0;
 		ex_av_media_free_caches(m);
 		avformat_close_input(&m->ic);
+		ex_av_mmap_io_close(&m->mmap_pb);
+		ex_av_prefetch_io_close(&m->prefetch_pb);
+		media_close_user_pb(m);
 	}
 }
 
-static AVStream *create_output_stream(AVFormatContext *oc, const char *url, enum AVMediaType type) {
-	enum AVCodecID id = av_guess_codec(oc->oformat, NULL, url, NULL, type);
-	const AVCodec *codec = avcodec_find_encoder(id);
-	if (codec) {
-		return avformat_new_stream(oc, codec);
-	}
-	return NULL;
+/*
+ * Sink of the subtitles while transcoding, nobody takes them from the cache.
+ */
+static int discard_frame(exAVMedia *m, enum AVMediaType type, exAVFrame *f, void *opaque) {
+	return 0;
 }
 
-static int _ex_av_meda_save_as(exAVMedia *m, AVFormatContext *oc, AVStream *as, AVStream *vs, AVStream *ss) {
-	if (!media_is_decoding(m))
-		m->start_decode(m);
-
-	while (1) {
-		if (as) {
+/*
+ * Save the decoded video and audio of the media into 'url' re-encoded: the transcoder takes the frames
+ * from the caches, as a player would, and converts, encodes and writes them on its own threads.
+ */
+/*
+ * Whether the media could be transcoded: the decoded frames are taken by the transcoder, so nobody else
+ * must be decoding it nor taking its frames.
+ */
+static int media_can_transcode(exAVMedia *m) {
+	return !media_is_decoding(m) && m->vframes.sink == NULL && m->aframes.sink == NULL;
+}
 
-		}
+static int ex_av_media_transcode_as(exAVMedia *m, const char *url) {
+	int ret = 0;
+	AVStream *ist[2];
+	exAVQueue *input[2];
+	int nb_streams = 0;
+	exAVTranscoder *t = NULL;
+	if (m->ic == NULL)
+		return AVERROR(EINVAL);
+	if (m->remuxer || m->transcoder) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_transcode_as error: the media is already being saved\n");
+		return AVERROR(EBUSY);
 	}
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+	if (!media_can_transcode(m)) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_transcode_as error: the decoded frames are taken by others\n");
+		return AVERROR(EBUSY);
+	}
+	if (m->video_idx >= 0) {
+		ist[nb_streams] = m->ic->streams[m->video_idx];
+		input[nb_streams++] = &m->vframes.queue;
+	}
+	if (m->audio_idx >= 0) {
+		ist[nb_streams] = m->ic->streams[m->audio_idx];
+		input[nb_streams++] = &m->aframes.queue;
+	}
+	if (nb_streams == 0)
+		return AVERROR_STREAM_NOT_FOUND;
+	if (m->subtitle_idx >= 0)
+		av_log(NULL, AV_LOG_WARNING, "ex_av_media_transcode_as: subtitle stream %d is dropped, only video and audio are transcoded: %s\n", m->subtitle_idx, url);
+	if (m->sframes.sink == NULL)
+		m->sframes.sink = discard_frame;
+	/* start the caches before the transcoder takes from them, the frames wait there meanwhile */
+	m->start_decode(m);
+	if (!media_is_decoding(m)) {
+		ret = AVERROR(ENOMEM);
+		goto err0;
+	}
+	if ((ret = ex_av_transcoder_create(&t, url, ist, input, nb_streams)) < 0)
+		goto err1;
+	m->transcoder = t;
 	return 0;
+err1:
+	m->stop_decode(m);
+err0:
+	if (m->sframes.sink == discard_frame)
+		m->sframes.sink = NULL;
+	return ret;
 }
 
+/*
+ * Save the streams of the media into 'url' by stream copy: the grabber hands a reference of every packet
+ * to the remuxer, which writes it on its own thread. If the media is not being decoded, only the grabber
+ * is started. If a stream could not be copied into the container of 'url', the media is transcoded instead.
+ */
 static int ex_av_media_save_as(exAVMedia *m, const char *url) {
 	int ret = 0;
-	AVFormatContext *oc = NULL;
-	AVStream *as, *vs, *ss;
-	if ((ret = avformat_alloc_output_context2(&oc, NULL, NULL, url)) < 0) {
-		av_log(NULL, AV_LOG_ERROR, "ex_av_media_save_as: avformat_alloc_output_context2 error: %s\n", av_err2str(ret));
-		goto err0;
+	int stream_indexes[3], nb_streams = 0;
+	exAVRemuxer *r = NULL;
+	if (m->ic == NULL)
+		return AVERROR(EINVAL);
+	if (m->remuxer || m->transcoder) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_save_as error: the media is already being saved\n");
+		return AVERROR(EBUSY);
 	}
-	if (m->audio_idx >= 0)
-		as = create_output_stream(oc, url, AVMEDIA_TYPE_AUDIO);
 	if (m->video_idx >= 0)
-		vs = create_output_stream(oc, url, AVMEDIA_TYPE_VIDEO);
+		stream_indexes[nb_streams++] = m->video_idx;
+	if (m->audio_idx >= 0)
+		stream_indexes[nb_streams++] = m->audio_idx;
 	if (m->subtitle_idx >= 0)
-		ss = create_output_stream(oc, url, AVMEDIA_TYPE_SUBTITLE);
-
-	ret = _ex_av_meda_save_as(m, oc, as, vs, ss);
+		stream_indexes[nb_streams++] = m->subtitle_idx;
+	for (int i = 0; i < nb_streams; i++) {
+		AVCodecParameters *par = m->ic->streams[stream_indexes[i]]->codecpar;
+		if (par->codec_type == AVMEDIA_TYPE_SUBTITLE || ex_av_transcoder_can_copy(url, par->codec_id))
+			continue;
+		if (!media_can_transcode(m)) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_media_save_as error: %s could not be stored into %s as it is, "
+					"and the media could not be transcoded while it is being decoded or its frames are taken\n",
+					avcodec_get_name(par->codec_id), url);
+			return AVERROR(EBUSY);
+		}
+		av_log(NULL, AV_LOG_INFO, "ex_av_media_save_as: %s could not be stored into %s as it is, transcoding\n",
+				avcodec_get_name(par->codec_id), url);
+		return ex_av_media_transcode_as(m, url);
+	}
+	if ((ret = ex_av_remuxer_create(&r, m->ic, url, stream_indexes, nb_streams)) < 0)
+		return ret;
+	pthread_mutex_lock(&m->remux_mutex);
+	/* the grabber task never waits for the remuxer, it is woken up once a packet could be sent again */
+	if (m->packet_grabber_task)
+		ex_av_remuxer_set_waker(r, wake_task, m->packet_grabber_task);
+	m->remuxer = r;
+	/* the grabber has already read all the packets, nothing more will be sent */
+	if (media_is_decoding(m) && (m->flags & MEDIA_FLAG_GRABBER_FINISHED))
+		ex_av_remuxer_finish(r);
+	pthread_mutex_unlock(&m->remux_mutex);
+	if (!media_is_decoding(m)) {
+		/* grabber-only mode: the packets are not cached for decoding */
+		pthread_mutex_lock(&m->mutex);
+		__atomic_store_n(&m->abort_request, 0, __ATOMIC_RELEASE);
+		m->flags &= ~MEDIA_FLAG_GRABBER_FINISHED;
+		pthread_mutex_unlock(&m->mutex);
+		m->grabber_only = 1;
+		if ((ret = pthread_create(&m->packet_grabber, NULL, packet_grabber, m))) {
+			m->grabber_only = 0;
+			pthread_mutex_lock(&m->remux_mutex);
+			m->remuxer = NULL;
+			pthread_mutex_unlock(&m->remux_mutex);
+			ex_av_remuxer_free(&r);
+			return AVERROR(ret);
+		}
+	}
+	return 0;
+}
 
-	avformat_free_context(oc);
-err0:
+/*
+ * Stop saving the media, right now if 'abort', otherwise, once the grabber has read all the packets.
+ * Return 0 if the output is complete, otherwise, return a negative error code.
+ */
+static int media_end_save(exAVMedia *m, int abort) {
+	int ret = 0;
+	exAVRemuxer *r = m->remuxer;
+	exAVTranscoder *t = m->transcoder;
+	if (t) {
+		/* the decoders finish the caches at the end of the media, or wake the transcoder up when aborted */
+		if (abort) {
+			ex_av_transcoder_abort(t);
+			m->stop_decode(m);
+		}
+		ret = ex_av_transcoder_wait(t);
+		m->stop_decode(m);
+		if (m->sframes.sink == discard_frame)
+			m->sframes.sink = NULL;
+		m->transcoder = NULL;
+		ex_av_transcoder_free(&t);
+		return ret;
+	}
+	if (r == NULL)
+		return AVERROR(EINVAL);
+	if (abort)
+		ex_av_remuxer_abort(r);
+	ret = ex_av_remuxer_wait(r);
+	/* the thread may have exited on an error, wake up the grabber if it is still sending */
+	ex_av_remuxer_abort(r);
+	pthread_mutex_lock(&m->remux_mutex);
+	ex_av_remuxer_set_waker(r, NULL, NULL);
+	m->remuxer = NULL;
+	while (m->remux_sending)
+		pthread_cond_wait(&m->remux_cond, &m->remux_mutex);
+	pthread_mutex_unlock(&m->remux_mutex);
+	if (m->grabber_only) {
+		media_abort(m);
+		pthread_join(m->packet_grabber, NULL);
+		m->grabber_only = 0;
+	}
+	ex_av_remuxer_free(&r);
 	return ret;
 }
 
+static int ex_av_media_wait_save(exAVMedia *m) {
+	return media_end_save(m, 0);
+}
+
+static int ex_av_media_stop_save(exAVMedia *m) {
+	return media_end_save(m, 1);
+}
+
 static exAVMedia *ex_av_media_get(exAVMedia *self) {
 	if (atomic_inc_and_test(&self->refcount)) {
 		/* the media is being released */
@@ -1370,6 +2859,14 @@ static void ex_av_media_put(exAVMedia *self) {
 		ex_av_media_close(self);
 		pthread_rwlock_unlock(&self->rwlock);
 		pthread_rwlock_destroy(&self->rwlock);
+		pthread_cond_destroy(&self->cond);
+		pthread_mutex_destroy(&self->mutex);
+		pthread_cond_destroy(&self->remux_cond);
+		pthread_mutex_destroy(&self->remux_mutex);
+#if HAVE_SDL2
+		pthread_cond_destroy(&self->audio_render_cond);
+		pthread_mutex_destroy(&self->audio_render_mutex);
+#endif
 		free(self);
 	}
 }
@@ -1385,6 +2882,110 @@ static void ex_av_media_play(exAVMedia *m) {
 	}
 }
 
+static void ex_av_media_set_frame_sink(exAVMedia *m, enum AVMediaType type, exAVFrameSink sink, void *opaque) {
+	exAVFrameQueue *q = get_frame_queue(m, type);
+	if (q == NULL || media_is_decoding(m))
+		return;
+	q->sink = sink;
+	q->sink_opaque = opaque;
+}
+
+static int ex_av_media_wait(exAVMedia *m) {
+	int ret = 0;
+	if (!media_is_decoding(m))
+		return AVERROR(EINVAL);
+	pthread_mutex_lock(&m->mutex);
+	while ((m->flags & MEDIA_FLAG_DECODER_FINISHED) != MEDIA_FLAG_DECODER_FINISHED)
+		pthread_cond_wait(&m->cond, &m->mutex);
+	if (m->sink_error < 0)
+		ret = m->sink_error;
+	else if (m->abort_request)
+		ret = AVERROR_EXIT;
+	pthread_mutex_unlock(&m->mutex);
+	return ret;
+}
+
+static int ex_av_media_run(exAVMedia *m, int run_flags) {
+	int ret = 0;
+	if (m->ic == NULL)
+		return AVERROR(EINVAL);
+	if (media_is_decoding(m))
+		return AVERROR(EBUSY);
+	m->headless = 1;
+	m->paced = !!(run_flags & MEDIA_RUN_PACED);
+	m->start_decode(m);
+	if (!media_is_decoding(m)) {
+		m->headless = 0;
+		return AVERROR(ENOMEM);
+	}
+	if (run_flags & MEDIA_RUN_NOWAIT)
+		return 0;
+	ret = ex_av_media_wait(m);
+	m->stop_decode(m);
+	return ret;
+}
+
+static void ex_av_media_set_decoder_threads(exAVMedia *m, int nb_threads, int thread_type) {
+	if (media_is_decoding(m))
+		return;
+	m->decoder_threads = nb_threads;
+	m->decoder_thread_type = thread_type ? thread_type : (FF_THREAD_FRAME | FF_THREAD_SLICE);
+}
+
+static void ex_av_media_set_accurate_seek(exAVMedia *m, int enable) {
+	m->accurate_seek = !!enable;
+}
+
+static void ex_av_media_set_framedrop(exAVMedia *m, int framedrop) {
+	m->framedrop = framedrop;
+}
+
+static void stream_stats(exAVPacketQueue *pq, exAVFrameQueue *fq, exAVStreamStats *stats) {
+	ex_av_queue_get_stats(&pq->queue, &stats->packets);
+	ex_av_queue_get_stats(&fq->queue, &stats->frames);
+	stats->nb_decoded  = __atomic_load_n(&fq->nb_decoded, __ATOMIC_RELAXED);
+	stats->decode_time = __atomic_load_n(&fq->decode_time, __ATOMIC_RELAXED);
+	stats->nb_dropped  = __atomic_load_n(&fq->nb_dropped, __ATOMIC_RELAXED);
+}
+
+static void ex_av_media_get_stats(exAVMedia *m, exAVMediaStats *stats) {
+	stream_stats(&m->vpackets, &m->vframes, &stats->video);
+	stream_stats(&m->apackets, &m->aframes, &stats->audio);
+	stream_stats(&m->spackets, &m->sframes, &stats->subtitle);
+	stats->nb_seeks = __atomic_load_n(&m->nb_seeks, __ATOMIC_RELAXED);
+	stats->packet_allocs = stats->packet_reuses = stats->frame_allocs = stats->frame_reuses = 0;
+	if (m->packet_pool) {
+		stats->packet_allocs = __atomic_load_n(&m->packet_pool->nb_allocs, __ATOMIC_RELAXED);
+		stats->packet_reuses = __atomic_load_n(&m->packet_pool->nb_reuses, __ATOMIC_RELAXED);
+	}
+	if (m->frame_pool) {
+		stats->frame_allocs = __atomic_load_n(&m->frame_pool->nb_allocs, __ATOMIC_RELAXED);
+		stats->frame_reuses = __atomic_load_n(&m->frame_pool->nb_reuses, __ATOMIC_RELAXED);
+	}
+}
+
+static void ex_av_media_set_executor(exAVMedia *m, exAVExecutor *e) {
+	if (media_is_decoding(m))
+		return;
+	m->executor = e;
+}
+
+static int ex_av_media_get_frame(exAVMedia *m, enum AVMediaType type, exAVFrame **f, int64_t timeout) {
+	int ret = 0;
+	struct list_head *n = NULL;
+	exAVFrameQueue *q = get_frame_queue(m, type);
+	if (q == NULL || q->sink || get_stream_idx(m, type) < 0 || !media_is_decoding(m))
+		return AVERROR(EINVAL);
+	if ((ret = ex_av_queue_pop(&q->queue, &n, timeout)) < 0)
+		return ret;
+	*f = list_entry(n, exAVFrame, list);
+	if (m->paced && (ret = pace_frame(m, q, *f)) < 0) {
+		(*f)->put(*f);
+		*f = NULL;
+	}
+	return ret;
+}
+
 static void ex_av_media_init_ops(exAVMedia *m) {
 	m->get          = ex_av_media_get;
 	m->put          = ex_av_media_put;
@@ -1397,6 +2998,19 @@ static void ex_av_media_init_ops(exAVMedia *m) {
 	m->play         = ex_av_media_play;
 	m->stop         = ex_av_media_stop;
 	m->save_as      = ex_av_media_save_as;
+	m->transcode_as = ex_av_media_transcode_as;
+	m->wait_save    = ex_av_media_wait_save;
+	m->stop_save    = ex_av_media_stop_save;
+	m->set_cache_limits = ex_av_media_set_cache_limits;
+	m->set_frame_sink = ex_av_media_set_frame_sink;
+	m->run          = ex_av_media_run;
+	m->get_frame    = ex_av_media_get_frame;
+	m->wait         = ex_av_media_wait;
+	m->set_executor = ex_av_media_set_executor;
+	m->set_decoder_threads = ex_av_media_set_decoder_threads;
+	m->set_accurate_seek = ex_av_media_set_accurate_seek;
+	m->set_framedrop     = ex_av_media_set_framedrop;
+	m->get_stats    = ex_av_media_get_stats;
 #if HAVE_SDL2
 	m->set_window_size = set_window_size;
 #endif
@@ -1414,6 +3028,15 @@ static void ex_av_media_init_common(exAVMedia *m) {
 	ex_av_clock_init(&m->video_avclock);
 	ex_av_clock_init(&m->external_avclock);
 	m->seek_step = 30.0;
+	m->seek_target = AV_NOPTS_VALUE;
+	m->framedrop = -1;
+	m->cache_max_bytes = MAX_QUEUE_SIZE;
+	m->cache_min_duration = MIN_QUEUE_DURATION;
+	m->vframes.type = AVMEDIA_TYPE_VIDEO;
+	m->aframes.type = AVMEDIA_TYPE_AUDIO;
+	m->sframes.type = AVMEDIA_TYPE_SUBTITLE;
+	m->pace_start_time = AV_NOPTS_VALUE;
+	m->decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 }
 
 static int ex_av_media_init(exAVMedia *m) {
@@ -1425,7 +3048,22 @@ static int ex_av_media_init(exAVMedia *m) {
 		return ret;
 	ret = pthread_rwlock_init(&m->rwlock, &rwlockattr);
 	pthread_rwlockattr_destroy(&rwlockattr);
-	return ret;
+	if (ret)
+		return ret;
+	if ((ret = pthread_mutex_init(&m->mutex, NULL)))
+		return ret;
+	if ((ret = pthread_mutex_init(&m->remux_mutex, NULL)))
+		return ret;
+	if ((ret = pthread_cond_init(&m->remux_cond, NULL)))
+		return ret;
+#if HAVE_SDL2
+	/* signaled by the audio callback, it runs until the audio device is closed */
+	if ((ret = pthread_mutex_init(&m->audio_render_mutex, NULL)))
+		return ret;
+	if ((ret = pthread_cond_init(&m->audio_render_cond, NULL)))
+		return ret;
+#endif
+	return pthread_cond_init(&m->cond, NULL);
 }
 
 exAVMedia *ex_av_media_alloc(void) {
@@ -1439,6 +3077,52 @@ err:
 	return NULL;
 }
 
+/*
+ * Open a media reading 'pb', closed by 'pb_close' along with the media, or at once if failed.
+ */
+static exAVMedia *media_open_io(AVIOContext *pb, void (*pb_close)(AVIOContext **), int flags) {
+	exAVMedia *m = ex_av_media_alloc();
+	if (m == NULL) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open error: %s\n", av_err2str(AVERROR(ENOMEM)));
+		pb_close(&pb);
+		return NULL;
+	}
+	if (media_open_input(m, NULL, pb, pb_close, flags) < 0) {
+		m->put(m);
+		return NULL;
+	}
+	return m;
+}
+
+exAVMedia *ex_av_media_open_buffer(const uint8_t *data, int64_t size, int flags) {
+	AVIOContext *pb = NULL;
+	int ret = ex_av_memory_io_open(&pb, data, size);
+	if (ret < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open_buffer error: %s\n", av_err2str(ret));
+		return NULL;
+	}
+	return media_open_io(pb, ex_av_mmap_io_close, flags);
+}
+
+static void callback_io_close(AVIOContext **pb) {
+	if (*pb == NULL)
+		return;
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+}
+
+exAVMedia *ex_av_media_open_callbacks(int (*read)(void *opaque, uint8_t *buf, int size),
+		int64_t (*seek)(void *opaque, int64_t offset, int whence), void *opaque, int flags) {
+	AVIOContext *pb = NULL;
+	uint8_t *buf = av_malloc(MEDIA_IO_BUFFER_SIZE);
+	if (buf == NULL || (pb = avio_alloc_context(buf, MEDIA_IO_BUFFER_SIZE, 0, opaque, read, NULL, seek)) == NULL) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_media_open_callbacks error: %s\n", av_err2str(AVERROR(ENOMEM)));
+		av_free(buf);
+		return NULL;
+	}
+	return media_open_io(pb, callback_io_close, flags);
+}
+
 exAVMedia *ex_av_media_open(const char *url, int flags) {
 	exAVMedia *m = ex_av_media_alloc();
 	if (m == NULL) {
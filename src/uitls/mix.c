@@ -0,0 +1,248 @@
+/*
+ * mix.c
+ *
+ *  Created on: 2026-10-16 20:46:32
+ *      Author: yui
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/error.h>
+#include <libavutil/common.h>
+
+#include <mix.h>
+
+#if ARCH_X86 && defined(__GNUC__)
+#define HAVE_MIX_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_MIX_X86 0
+#endif
+
+/* The gain of the sample 'i' is always 'gain + i * step', so that all the kernels round it the same */
+static av_always_inline void s16_c(int16_t *dst, const int16_t *src, int i, int nb_samples, float gain, float step, int add) {
+	for (; i < nb_samples; i++) {
+		float x = src[i] * (gain + i * step);
+		dst[i] = av_clip_int16(lrintf(add ? dst[i] + x : x));
+	}
+}
+
+static av_always_inline void f32_c(float *dst, const float *src, int i, int nb_samples, float gain, float step, int add) {
+	for (; i < nb_samples; i++) {
+		float x = src[i] * (gain + i * step);
+		dst[i] = av_clipf(add ? dst[i] + x : x, -1.0f, 1.0f);
+	}
+}
+
+static void gain_s16_c(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_c(dst, src, 0, nb_samples, gain, step, 0);
+}
+
+static void mix_s16_c(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_c(dst, src, 0, nb_samples, gain, step, 1);
+}
+
+static void gain_f32_c(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_c(dst, src, 0, nb_samples, gain, step, 0);
+}
+
+static void mix_f32_c(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_c(dst, src, 0, nb_samples, gain, step, 1);
+}
+
+static const exAVMixKernels c_kernels = { "c", gain_s16_c, mix_s16_c, gain_f32_c, mix_f32_c };
+
+#if HAVE_MIX_X86
+/*
+ * The samples are converted to floats and back, and the gains are computed from the index of the sample
+ * rather than accumulated; so the rounding and the saturation of the packing give the same results as
+ * the c kernels when those compute in single precision(sse math), ramps included.
+ */
+static av_always_inline __attribute__((target("sse2")))
+__m128 gains_sse2(__m128 n, int i, float gain, float step) {
+	return _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_add_ps(n, _mm_set1_ps(i)), _mm_set1_ps(step)));
+}
+
+static av_always_inline __attribute__((target("sse2")))
+void s16_sse2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step, int add) {
+	int i = 0;
+	__m128 nlo = _mm_setr_ps(0, 1, 2, 3), nhi = _mm_setr_ps(4, 5, 6, 7);
+	for (; i + 8 <= nb_samples; i += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), gains_sse2(nlo, i, gain, step));
+		__m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), gains_sse2(nhi, i, gain, step));
+		if (add) {
+			__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+			lo = _mm_add_ps(lo, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16)));
+			hi = _mm_add_ps(hi, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+	}
+	s16_c(dst, src, i, nb_samples, gain, step, add);
+}
+
+static av_always_inline __attribute__((target("sse2")))
+void f32_sse2(float *dst, const float *src, int nb_samples, float gain, float step, int add) {
+	int i = 0;
+	__m128 n = _mm_setr_ps(0, 1, 2, 3), min = _mm_set1_ps(-1.0f), max = _mm_set1_ps(1.0f);
+	for (; i + 4 <= nb_samples; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), gains_sse2(n, i, gain, step));
+		if (add)
+			x = _mm_add_ps(_mm_loadu_ps(dst + i), x);
+		_mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(x, min), max));
+	}
+	f32_c(dst, src, i, nb_samples, gain, step, add);
+}
+
+static __attribute__((target("sse2"))) void gain_s16_sse2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_sse2(dst, src, nb_samples, gain, step, 0);
+}
+
+static __attribute__((target("sse2"))) void mix_s16_sse2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_sse2(dst, src, nb_samples, gain, step, 1);
+}
+
+static __attribute__((target("sse2"))) void gain_f32_sse2(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_sse2(dst, src, nb_samples, gain, step, 0);
+}
+
+static __attribute__((target("sse2"))) void mix_f32_sse2(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_sse2(dst, src, nb_samples, gain, step, 1);
+}
+
+static const exAVMixKernels sse2_kernels = { "sse2", gain_s16_sse2, mix_s16_sse2, gain_f32_sse2, mix_f32_sse2 };
+
+static av_always_inline __attribute__((target("avx2")))
+__m256 gains_avx2(__m256 n, int i, float gain, float step) {
+	return _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(_mm256_add_ps(n, _mm256_set1_ps(i)), _mm256_set1_ps(step)));
+}
+
+/*
+ * The unpacking and the packing work inside the 128-bit lanes, so the first half of the converted samples
+ * holds the samples 0-3 and 8-11, the second half 4-7 and 12-15; the gains are laid out the same way.
+ */
+static av_always_inline __attribute__((target("avx2")))
+void s16_avx2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step, int add) {
+	int i = 0;
+	__m256 nlo = _mm256_setr_ps(0, 1, 2, 3, 8, 9, 10, 11), nhi = _mm256_setr_ps(4, 5, 6, 7, 12, 13, 14, 15);
+	for (; i + 16 <= nb_samples; i += 16) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256 lo = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_unpacklo_epi16(x, x), 16)), gains_avx2(nlo, i, gain, step));
+		__m256 hi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_unpackhi_epi16(x, x), 16)), gains_avx2(nhi, i, gain, step));
+		if (add) {
+			__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+			lo = _mm256_add_ps(lo, _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_unpacklo_epi16(d, d), 16)));
+			hi = _mm256_add_ps(hi, _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_unpackhi_epi16(d, d), 16)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi)));
+	}
+	s16_c(dst, src, i, nb_samples, gain, step, add);
+}
+
+static av_always_inline __attribute__((target("avx2")))
+void f32_avx2(float *dst, const float *src, int nb_samples, float gain, float step, int add) {
+	int i = 0;
+	__m256 n = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), min = _mm256_set1_ps(-1.0f), max = _mm256_set1_ps(1.0f);
+	for (; i + 8 <= nb_samples; i += 8) {
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), gains_avx2(n, i, gain, step));
+		if (add)
+			x = _mm256_add_ps(_mm256_loadu_ps(dst + i), x);
+		_mm256_storeu_ps(dst + i, _mm256_min_ps(_mm256_max_ps(x, min), max));
+	}
+	f32_c(dst, src, i, nb_samples, gain, step, add);
+}
+
+static __attribute__((target("avx2"))) void gain_s16_avx2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_avx2(dst, src, nb_samples, gain, step, 0);
+}
+
+static __attribute__((target("avx2"))) void mix_s16_avx2(int16_t *dst, const int16_t *src, int nb_samples, float gain, float step) {
+	s16_avx2(dst, src, nb_samples, gain, step, 1);
+}
+
+static __attribute__((target("avx2"))) void gain_f32_avx2(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_avx2(dst, src, nb_samples, gain, step, 0);
+}
+
+static __attribute__((target("avx2"))) void mix_f32_avx2(float *dst, const float *src, int nb_samples, float gain, float step) {
+	f32_avx2(dst, src, nb_samples, gain, step, 1);
+}
+
+static const exAVMixKernels avx2_kernels = { "avx2", gain_s16_avx2, mix_s16_avx2, gain_f32_avx2, mix_f32_avx2 };
+#endif
+
+void ex_av_mix_get_kernels(int flags, exAVMixKernels *k) {
+	*k = c_kernels;
+#if HAVE_MIX_X86
+	if (flags & AV_CPU_FLAG_SSE2)
+		*k = sse2_kernels;
+	if (flags & AV_CPU_FLAG_AVX2)
+		*k = avx2_kernels;
+#endif
+}
+
+static exAVMixKernels kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void) {
+	ex_av_mix_get_kernels(av_get_cpu_flags(), &kernels);
+}
+
+const exAVMixKernels *ex_av_mix_kernels(void) {
+	pthread_once(&kernels_once, kernels_init);
+	return &kernels;
+}
+
+void ex_av_volume_init(exAVVolume *v, float gain, int ramp) {
+	memset(v, 0, sizeof(exAVVolume));
+	v->gain = v->target = av_clipf(gain, 0.0f, MIX_MAX_GAIN);
+	v->ramp = FFMAX(ramp, 1);
+	ex_av_mix_kernels();
+}
+
+void ex_av_volume_set(exAVVolume *v, float gain) {
+	gain = av_clipf(gain, 0.0f, MIX_MAX_GAIN);
+	if (gain == v->target)
+		return;
+	/* a ramp in progress continues from where it is */
+	v->target = gain;
+	v->remaining = v->ramp;
+	v->step = (gain - v->gain) / v->ramp;
+}
+
+int ex_av_volume_apply(exAVVolume *v, uint8_t *dst, const uint8_t *src, int nb_samples, enum AVSampleFormat fmt, int add) {
+	const exAVMixKernels *k = ex_av_mix_kernels();
+	int bps = av_get_bytes_per_sample(fmt);
+	if (fmt != AV_SAMPLE_FMT_S16 && fmt != AV_SAMPLE_FMT_FLT)
+		return AVERROR(EINVAL);
+	while (nb_samples > 0) {
+		int n = nb_samples, ramping = v->remaining > 0;
+		float step = 0;
+		if (ramping) {
+			n = FFMIN(n, v->remaining);
+			step = v->step;
+		} else if (v->gain == 0.0f) {
+			if (!add)
+				memset(dst, 0, nb_samples * bps);
+			return 0;
+		} else if (v->gain == 1.0f && !add) {
+			memcpy(dst, src, nb_samples * bps);
+			return 0;
+		}
+		if (fmt == AV_SAMPLE_FMT_S16)
+			(add ? k->mix_s16 : k->gain_s16)((int16_t *)dst, (const int16_t *)src, n, v->gain, step);
+		else
+			(add ? k->mix_f32 : k->gain_f32)((float *)dst, (const float *)src, n, v->gain, step);
+		if (ramping) {
+			v->remaining -= n;
+			v->gain = v->remaining > 0 ? v->gain + n * step : v->target;
+		}
+		dst += n * bps;
+		src += n * bps;
+		nb_samples -= n;
+	}
+	return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * mmapio.c
+ *
+ *  Created on: 2026-10-16 18:05:19
+ *      Author: yui
+ */
+
+/* 64-bit 'st_size' of 'stat' on the 32-bit systems */
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/common.h>
+
+#include <mmapio.h>
+
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#endif
+
+/*
+ * Return the path of a local file, or NULL if 'url' is not handled by the file protocol.
+ */
+static const char *local_path(const char *url) {
+	const char *path = NULL;
+	const char *proto = avio_find_protocol_name(url);
+	if (proto == NULL || strcmp(proto, "file"))
+		return NULL;
+	return av_strstart(url, "file:", &path) ? path : url;
+}
+
+#ifdef _WIN32
+/*
+ * Convert the UTF-8 'path' into UTF-16 for the wide API, as the file protocol of FFmpeg does.
+ * Return NULL if failed, otherwise, free the result by 'av_free'.
+ */
+static wchar_t *utf8_to_wide(const char *path) {
+	wchar_t *w = NULL;
+	int n = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, NULL, 0);
+	if (n <= 0 || (w = av_malloc_array(n, sizeof(wchar_t))) == NULL)
+		return NULL;
+	MultiByteToWideChar(CP_UTF8, 0, path, -1, w, n);
+	return w;
+}
+
+/*
+ * Convert the UTF-16 'w' into UTF-8. Return NULL if failed, otherwise, free the result by 'av_free'.
+ */
+static char *wide_to_utf8(const wchar_t *w) {
+	char *s = NULL;
+	int n = WideCharToMultiByte(CP_UTF8, 0, w, -1, NULL, 0, NULL, NULL);
+	if (n <= 0 || (s = av_malloc(n)) == NULL)
+		return NULL;
+	WideCharToMultiByte(CP_UTF8, 0, w, -1, s, n, NULL, NULL);
+	return s;
+}
+
+#endif
+
+#if HAVE_MMAP
+static int map_file(exAVMappedFile *mf, const char *path) {
+	struct stat st;
+	void *data = NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return AVERROR(errno);
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return AVERROR(EINVAL);
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return AVERROR(ENOMEM);
+	}
+	mf->data = data;
+	mf->size = st.st_size;
+	mf->fd = fd;
+	return 0;
+}
+
+static void unmap_file(exAVMappedFile *mf) {
+	munmap((void *)mf->data, mf->size);
+	close(mf->fd);
+}
+
+static int64_t file_size(exAVMappedFile *mf) {
+	struct stat st;
+	return fstat(mf->fd, &st) < 0 ? -1 : st.st_size;
+}
+
+static void advise(exAVMappedFile *mf, int64_t offset, int64_t len, int advice) {
+	int64_t page = sysconf(_SC_PAGESIZE);
+	int64_t start = offset / page * page;
+	madvise((void *)(mf->data + start), offset + len - start, advice);
+}
+
+#define ADVISE_SEQUENTIAL MADV_SEQUENTIAL
+#define ADVISE_RANDOM     MADV_RANDOM
+#define ADVISE_WILLNEED   MADV_WILLNEED
+
+#elif HAVE_MAPVIEWOFFILE
+static int map_file(exAVMappedFile *mf, const char *path) {
+	LARGE_INTEGER size;
+	wchar_t *wpath = utf8_to_wide(path);
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	if (wpath == NULL)
+		return AVERROR(EINVAL);
+	file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	av_free(wpath);
+	if (file == INVALID_HANDLE_VALUE)
+		return AVERROR(ENOENT);
+	if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL) {
+		CloseHandle(file);
+		return AVERROR(EINVAL);
+	}
+	if ((mf->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return AVERROR(ENOMEM);
+	}
+	mf->size = size.QuadPart;
+	mf->file = file;
+	mf->mapping = mapping;
+	return 0;
+}
+
+static void unmap_file(exAVMappedFile *mf) {
+	UnmapViewOfFile(mf->data);
+	CloseHandle(mf->mapping);
+	CloseHandle(mf->file);
+}
+
+static int64_t file_size(exAVMappedFile *mf) {
+	LARGE_INTEGER size;
+	return GetFileSizeEx(mf->file, &size) ? size.QuadPart : -1;
+}
+
+/* There is no access pattern hint on Windows, only the pages could be prefetched */
+static void advise(exAVMappedFile *mf, int64_t offset, int64_t len, int advice) {
+#if _WIN32_WINNT >= 0x0602
+	WIN32_MEMORY_RANGE_ENTRY range = { (PVOID)(mf->data + offset), (SIZE_T)len };
+	if (advice)
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+}
+
+#define ADVISE_SEQUENTIAL 0
+#define ADVISE_RANDOM     0
+#define ADVISE_WILLNEED   1
+
+#else
+static int map_file(exAVMappedFile *mf, const char *path) {
+	return AVERROR(ENOSYS);
+}
+
+static void unmap_file(exAVMappedFile *mf) {}
+
+static int64_t file_size(exAVMappedFile *mf) {
+	return mf->size;
+}
+
+static void advise(exAVMappedFile *mf, int64_t offset, int64_t len, int advice) {}
+
+#define ADVISE_SEQUENTIAL 0
+#define ADVISE_RANDOM     0
+#define ADVISE_WILLNEED   0
+#endif
+
+int ex_av_file_stat(const char *url, int64_t *size, int64_t *mtime) {
+	const char *path = local_path(url);
+#ifdef _WIN32
+	struct _stat64 st;
+	wchar_t *wpath = NULL;
+	int ret = -1;
+	if (path == NULL)
+		return AVERROR(ENOSYS);
+	if ((wpath = utf8_to_wide(path)) == NULL)
+		return AVERROR(EINVAL);
+	ret = _wstat64(wpath, &st);
+	av_free(wpath);
+#else
+	struct stat st;
+	int ret = -1;
+	if (path == NULL)
+		return AVERROR(ENOSYS);
+	ret = stat(path, &st);
+#endif
+	if (ret < 0)
+		return AVERROR(errno);
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return 0;
+}
+
+static int make_dir(const char *path) {
+#ifdef _WIN32
+	int ret = -1;
+	wchar_t *wpath = utf8_to_wide(path);
+	if (wpath == NULL)
+		return AVERROR(EINVAL);
+	ret = _wmkdir(wpath);
+	av_free(wpath);
+#else
+	int ret = mkdir(path, 0755);
+#endif
+	return ret < 0 ? AVERROR(errno) : 0;
+}
+
+int ex_av_file_make_dirs(const char *path) {
+	int ret = 0;
+	char *p = NULL, *s = NULL, c;
+	if (path[0] == '\0')
+		return AVERROR(EINVAL);
+	if ((p = av_strdup(path)) == NULL)
+		return AVERROR(ENOMEM);
+	/* every parent from the root, the root itself and the drives("C:") exist */
+	for (s = p + 1; ; s++) {
+		if ((c = *s) != '/' && c != '\\' && c != '\0')
+			continue;
+		*s = '\0';
+		if (s[-1] != '/' && s[-1] != '\\' && s[-1] != ':' && (ret = make_dir(p)) < 0 && ret != AVERROR(EEXIST))
+			break;
+		ret = 0;
+		if ((*s = c) == '\0')
+			break;
+	}
+	av_free(p);
+	return ret;
+}
+
+int ex_av_file_cache_dir(char **dir) {
+#ifdef _WIN32
+	const wchar_t *w = _wgetenv(L"LOCALAPPDATA");
+	if (w == NULL || w[0] == 0)
+		return AVERROR(ENOENT);
+	*dir = wide_to_utf8(w);
+#else
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && xdg[0])
+		*dir = av_strdup(xdg);
+	else if (home && home[0])
+		*dir = av_asprintf("%s/.cache", home);
+	else
+		return AVERROR(ENOENT);
+#endif
+	return *dir ? 0 : AVERROR(ENOMEM);
+}
+
+int ex_av_file_map(exAVMappedFile **mf, const char *url) {
+	int ret = 0;
+	exAVMappedFile *p = NULL;
+	const char *path = local_path(url);
+	if (path == NULL)
+		return AVERROR(ENOSYS);
+	if ((p = av_mallocz(sizeof(exAVMappedFile))) == NULL)
+		return AVERROR(ENOMEM);
+	if ((ret = map_file(p, path)) < 0) {
+		av_free(p);
+		return ret;
+	}
+	p->mapped = 1;
+	ex_av_file_advise(p, MMAP_IO_SEQUENTIAL);
+	*mf = p;
+	return 0;
+}
+
+void ex_av_file_advise(exAVMappedFile *mf, int advice) {
+	mf->advice = advice;
+	if (mf->mapped)
+		advise(mf, 0, mf->size, advice == MMAP_IO_RANDOM ? ADVISE_RANDOM : ADVISE_SEQUENTIAL);
+	/* the read-ahead restarts from the next read */
+	mf->readahead_end = 0;
+}
+
+void ex_av_file_readahead(exAVMappedFile *mf, int64_t pos) {
+	int64_t end = FFMIN(pos + MMAP_IO_READAHEAD, mf->size);
+	if (mf->advice != MMAP_IO_SEQUENTIAL || !mf->mapped)
+		return;
+	/* request a whole window once half of the previous one is consumed */
+	if (pos < mf->readahead_end - MMAP_IO_READAHEAD / 2 && pos >= mf->readahead_end - MMAP_IO_READAHEAD)
+		return;
+	if (end > pos)
+		advise(mf, pos, end - pos, ADVISE_WILLNEED);
+	mf->readahead_end = end;
+}
+
+int64_t ex_av_file_readable_size(exAVMappedFile *mf) {
+	/* the pages beyond the end of a file truncated meanwhile are gone, reading them would crash */
+	return mf->mapped ? FFMIN(mf->size, file_size(mf)) : mf->size;
+}
+
+void ex_av_file_unmap(exAVMappedFile **mf) {
+	if (*mf == NULL)
+		return;
+	if ((*mf)->mapped)
+		unmap_file(*mf);
+	av_freep(mf);
+}
+
+static int mmap_io_read(void *opaque, uint8_t *buf, int size) {
+	exAVMappedFile *mf = opaque;
+	int64_t left = ex_av_file_readable_size(mf) - mf->pos;
+	if (left <= 0)
+		return AVERROR_EOF;
+	size = FFMIN(size, left);
+	ex_av_file_readahead(mf, mf->pos);
+	memcpy(buf, mf->data + mf->pos, size);
+	mf->pos += size;
+	return size;
+}
+
+static int64_t mmap_io_seek(void *opaque, int64_t offset, int whence) {
+	exAVMappedFile *mf = opaque;
+	int64_t pos = 0;
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return mf->size;
+	case SEEK_SET:
+		pos = offset; break;
+	case SEEK_CUR:
+		pos = mf->pos + offset; break;
+	case SEEK_END:
+		pos = mf->size + offset; break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (pos < 0 || pos > mf->size)
+		return AVERROR(EINVAL);
+	mf->pos = pos;
+	return pos;
+}
+
+/*
+ * Open an AVIOContext reading 'mf', which is freed if failed.
+ */
+static int mmap_io_alloc(AVIOContext **pb, exAVMappedFile *mf) {
+	uint8_t *buf = NULL;
+	if ((buf = av_malloc(MMAP_IO_BUFFER_SIZE)) == NULL)
+		goto err0;
+	if ((*pb = avio_alloc_context(buf, MMAP_IO_BUFFER_SIZE, 0, mf, mmap_io_read, NULL, mmap_io_seek)) == NULL)
+		goto err1;
+	return 0;
+err1:
+	av_free(buf);
+err0:
+	ex_av_file_unmap(&mf);
+	return AVERROR(ENOMEM);
+}
+
+int ex_av_mmap_io_open(AVIOContext **pb, const char *url) {
+	int ret = 0;
+	exAVMappedFile *mf = NULL;
+	if ((ret = ex_av_file_map(&mf, url)) < 0)
+		return ret;
+	return mmap_io_alloc(pb, mf);
+}
+
+int ex_av_memory_io_open(AVIOContext **pb, const uint8_t *data, int64_t size) {
+	exAVMappedFile *mf = NULL;
+	if (data == NULL || size <= 0)
+		return AVERROR(EINVAL);
+	if ((mf = av_mallocz(sizeof(exAVMappedFile))) == NULL)
+		return AVERROR(ENOMEM);
+	mf->data = data;
+	mf->size = size;
+	/* already in memory, nothing to read ahead */
+	mf->advice = MMAP_IO_RANDOM;
+	return mmap_io_alloc(pb, mf);
+}
+
+void ex_av_mmap_io_advise(AVIOContext *pb, int advice) {
+	ex_av_file_advise(pb->opaque, advice);
+}
+
+void ex_av_mmap_io_close(AVIOContext **pb) {
+	exAVMappedFile *mf = NULL;
+	if (*pb == NULL)
+		return;
+	mf = (*pb)->opaque;
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+	ex_av_file_unmap(&mf);
+}
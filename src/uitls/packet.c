@@ -6,6 +6,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
 
 #include <list.h>
 
@@ -20,16 +23,54 @@ static exAVPacket *get(exAVPacket *self) {
 	return self;
 }
 
+static void packet_free(exAVPacket *self) {
+	av_packet_free(&self->avpkt);
+	pthread_rwlock_destroy(&self->rwlock);
+	free(self);
+}
+
+static void pool_destroy(exAVPacketPool *pool) {
+	for (int i = 0; i < pool->nb_packets; i++)
+		packet_free(pool->packets[i]);
+	free(pool->packets);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+/*
+ * Release the payload of a packet and give it back to its pool.
+ */
+static void packet_recycle(exAVPacket *self) {
+	int destroy = 0;
+	exAVPacketPool *pool = self->pool;
+	av_packet_unref(self->avpkt);
+	memset((uint8_t *)self + sizeof(exAVPacket), 0, pool->size - sizeof(exAVPacket));
+	INIT_LIST_HEAD(&self->list);
+	atomic_set(&self->refcount, 1);
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->closed && pool->nb_packets < pool->max_packets) {
+		pool->packets[pool->nb_packets++] = self;
+		self = NULL;
+	}
+	destroy = (--pool->refcount == 0);
+	pthread_mutex_unlock(&pool->mutex);
+	if (self)
+		packet_free(self);
+	if (destroy)
+		pool_destroy(pool);
+}
+
 static void put(exAVPacket *self) {
 	if (atomic_dec_and_test(&self->refcount)) {
 		if (pthread_rwlock_trywrlock(&self->rwlock))
 			return; /* there is someone else has 'get' this packet, so let that caller free the packet */
 		atomic_dec(&self->refcount);
 		list_del(&self->list);
-		av_packet_free(&self->avpkt);
 		pthread_rwlock_unlock(&self->rwlock);
-		pthread_rwlock_destroy(&self->rwlock);
-		free(self);
+		if (self->pool)
+			packet_recycle(self);
+		else
+			packet_free(self);
 	}
 }
 
@@ -74,3 +115,112 @@ void ex_av_packet_free_list_entry(struct list_head *n) {
 	exAVPacket *self = list_entry(n, exAVPacket, list);
 	put(self);
 }
+
+exAVPacketPool *ex_av_packet_pool_create(size_t size, int max_packets) {
+	exAVPacketPool *pool = calloc(1, sizeof(exAVPacketPool));
+	if (pool == NULL)
+		goto err0;
+	pool->size = size < sizeof(exAVPacket) ? sizeof(exAVPacket) : size;
+	pool->max_packets = max_packets;
+	pool->refcount = 1;
+	pool->packets = calloc(max_packets, sizeof(exAVPacket *));
+	if (pool->packets == NULL)
+		goto err1;
+	if (pthread_mutex_init(&pool->mutex, NULL))
+		goto err2;
+	return pool;
+err2:
+	free(pool->packets);
+err1:
+	free(pool);
+err0:
+	return NULL;
+}
+
+exAVPacket *ex_av_packet_pool_alloc(exAVPacketPool *pool) {
+	exAVPacket *p = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->nb_packets > 0) {
+		p = pool->packets[--pool->nb_packets];
+		pool->nb_reuses++;
+	}
+	else {
+		pool->nb_allocs++;
+	}
+	pool->refcount++;
+	pthread_mutex_unlock(&pool->mutex);
+	if (p)
+		return p;
+	p = ex_av_packet_alloc(pool->size);
+	if (p == NULL) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->refcount--; /* never reach 0 here, the caller still holds the pool */
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+	p->pool = pool;
+	return p;
+}
+
+void ex_av_packet_pool_free(exAVPacketPool **pool) {
+	int destroy = 0;
+	exAVPacketPool *p = *pool;
+	if (p == NULL)
+		return;
+	*pool = NULL;
+	pthread_mutex_lock(&p->mutex);
+	p->closed = 1;
+	destroy = (--p->refcount == 0);
+	pthread_mutex_unlock(&p->mutex);
+	if (destroy)
+		pool_destroy(p);
+}
+
+/*
+ * Whether the H.264/HEVC access unit 'pkt' holds an IDR picture: no picture after it refers to the ones before,
+ * unlike after a recovery point or a CRA picture, whose leading pictures refer to the previous GOP.
+ */
+static int packet_has_idr(const AVCodecParameters *par, const AVPacket *pkt) {
+	const uint8_t *p = pkt->data, *end = pkt->data + pkt->size, *nal = NULL;
+	int hevc = par->codec_id == AV_CODEC_ID_HEVC;
+	int length_size = 0, type, i;
+	uint32_t size;
+	/* avcC/hvcC extradata: the NAL units are prefixed by their size instead of a start code */
+	if (par->extradata && par->extradata_size >= (hevc ? 23 : 7) && par->extradata[0] == 1)
+		length_size = (par->extradata[hevc ? 21 : 4] & 3) + 1;
+	while (p < end) {
+		if (length_size) {
+			if (end - p < length_size)
+				break;
+			for (size = 0, i = 0; i < length_size; i++)
+				size = size << 8 | *p++;
+			if (size == 0 || size > end - p)
+				break;
+			nal = p;
+			p += size;
+		}
+		else {
+			while (end - p >= 3 && (p[0] || p[1] || p[2] != 1))
+				p++;
+			if (end - p < 4)
+				break;
+			nal = p += 3;
+		}
+		/* IDR_W_RADL and IDR_N_LP of HEVC, whose leading pictures only refer to the IDR itself; IDR slice of H.264 */
+		type = hevc ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+		if (hevc ? (type == 19 || type == 20) : type == 5)
+			return 1;
+	}
+	return 0;
+}
+
+int ex_av_packet_is_closed_gop(const AVCodecParameters *par, const AVPacket *pkt) {
+	const AVCodecDescriptor *desc = avcodec_descriptor_get(par->codec_id);
+	if (!(pkt->flags & AV_PKT_FLAG_KEY))
+		return 0;
+	if (desc == NULL || !(desc->props & AV_CODEC_PROP_REORDER))
+		return 1;
+	if (desc->id == AV_CODEC_ID_H264 || desc->id == AV_CODEC_ID_HEVC)
+		return packet_has_idr(par, pkt);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * pcmring.c
+ *
+ *  Created on: 2026-10-16 20:12:50
+ *      Author: yui
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/common.h>
+
+#include <pcmring.h>
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int ex_av_pcm_ring_alloc(exAVPcmRing **r, int size) {
+	unsigned int n = 1;
+	exAVPcmRing *p = NULL;
+	while (n < size)
+		n <<= 1;
+	if ((p = av_mallocz(sizeof(exAVPcmRing))) == NULL)
+		return AVERROR(ENOMEM);
+	if ((p->data = av_malloc(n)) == NULL) {
+		av_free(p);
+		return AVERROR(ENOMEM);
+	}
+	p->size = n;
+	p->mask = n - 1;
+	p->current.clock = NAN;
+	p->current.serial = -1;
+	*r = p;
+	return 0;
+}
+
+void ex_av_pcm_ring_free(exAVPcmRing **r) {
+	if (*r == NULL)
+		return;
+	av_free((*r)->data);
+	av_freep(r);
+}
+
+int ex_av_pcm_ring_size(exAVPcmRing *r) {
+	return r->size;
+}
+
+int ex_av_pcm_ring_write(exAVPcmRing *r, const uint8_t *data, int size, double clock, int serial) {
+	uint64_t pos = r->write_pos;
+	unsigned int tail = r->chunk_tail;
+	unsigned int offset = pos & r->mask, first = FFMIN(size, r->size - offset);
+	exAVPcmChunk *c = &r->chunks[tail & (PCM_RING_MAX_CHUNKS - 1)];
+	if (pos + size - load_acquire(&r->read_pos) > r->size || tail - load_acquire(&r->chunk_head) >= PCM_RING_MAX_CHUNKS)
+		return AVERROR(EAGAIN);
+	memcpy(r->data + offset, data, first);
+	memcpy(r->data, data + first, size - first);
+	c->end = pos + size;
+	c->clock = clock;
+	c->serial = serial;
+	/* the chunk is published before its bytes, so that every byte read has its chunk */
+	store_release(&r->chunk_tail, tail + 1);
+	store_release(&r->write_pos, pos + size);
+	return 0;
+}
+
+/*
+ * Move to the chunks ending at or before the read position.
+ */
+static void pass_chunks(exAVPcmRing *r) {
+	unsigned int head = r->chunk_head, tail = load_acquire(&r->chunk_tail);
+	while (head != tail) {
+		exAVPcmChunk *c = &r->chunks[head & (PCM_RING_MAX_CHUNKS - 1)];
+		r->current = *c;
+		if (c->end > r->read_pos)
+			break;
+		head++;
+	}
+	store_release(&r->chunk_head, head);
+}
+
+void ex_av_pcm_ring_drop_stale(exAVPcmRing *r, int serial) {
+	unsigned int head = r->chunk_head, tail = load_acquire(&r->chunk_tail);
+	uint64_t pos = r->read_pos;
+	while (head != tail) {
+		exAVPcmChunk *c = &r->chunks[head & (PCM_RING_MAX_CHUNKS - 1)];
+		if (c->serial == serial)
+			break;
+		pos = c->end;
+		head++;
+	}
+	if (pos != r->read_pos) {
+		/* the bytes are released before their chunks, as the producer checks them in this order */
+		store_release(&r->read_pos, pos);
+		store_release(&r->chunk_head, head);
+	}
+	if (r->current.serial != serial) {
+		/* its clock is of before seeking, the chunk of 'serial' read next if any is the current one */
+		r->current.end = 0;
+		r->current.clock = NAN;
+		r->current.serial = -1;
+		pass_chunks(r);
+	}
+}
+
+int ex_av_pcm_ring_peek(exAVPcmRing *r, const uint8_t **data, int size) {
+	uint64_t pos = r->read_pos;
+	unsigned int offset = pos & r->mask;
+	int64_t available = load_acquire(&r->write_pos) - pos;
+	*data = r->data + offset;
+	return FFMIN3(size, available, r->size - offset);
+}
+
+void ex_av_pcm_ring_advance(exAVPcmRing *r, int size) {
+	store_release(&r->read_pos, r->read_pos + size);
+	pass_chunks(r);
+}
+
+int ex_av_pcm_ring_position(exAVPcmRing *r, exAVPcmChunk *chunk, int *pending) {
+	if (r->current.end == 0)
+		return AVERROR(EAGAIN);
+	*chunk = r->current;
+	*pending = r->current.end > r->read_pos ? r->current.end - r->read_pos : 0;
+	return 0;
+}
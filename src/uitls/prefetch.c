@@ -0,0 +1,476 @@
+/*
+ * prefetch.c
+ *
+ *  Created on: 2026-10-16 18:36:10
+ *      Author: yui
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavutil/common.h>
+
+#include <prefetch.h>
+
+#if HAVE_LIBURING
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#endif
+
+/* Size of the buffer of the AVIOContext, the blocks are copied into it */
+#define PREFETCH_IO_BUFFER_SIZE (64 * 1024)
+/* How often a stalled read checks the interrupt callback, in microseconds */
+#define PREFETCH_WAIT_INTERVAL  10000
+
+/*
+ * Assign the next block of the ring to be read from 'next_pos'.
+ * Return its index, or -1 if there is nothing to read or no free block. Called with the mutex held.
+ */
+static int assign_block(exAVPrefetcher *p) {
+	int idx = p->tail;
+	exAVPrefetchBlock *b = &p->blocks[idx];
+	if (p->quit || p->eof || p->nb_assigned == p->depth || b->state != PREFETCH_BLOCK_EMPTY)
+		return -1;
+	if (p->size > 0 && p->next_pos >= p->size)
+		return -1;
+	b->pos = p->next_pos;
+	b->size = 0;
+	b->error = 0;
+	b->state = PREFETCH_BLOCK_PENDING;
+	p->next_pos += PREFETCH_BLOCK_SIZE;
+	p->tail = (p->tail + 1) % p->depth;
+	p->nb_assigned++;
+	return idx;
+}
+
+/*
+ * Record the result of reading a block: the bytes read, or a negative error code. Called with the mutex held.
+ */
+static void complete_block(exAVPrefetcher *p, exAVPrefetchBlock *b, int ret) {
+	if (b->state == PREFETCH_BLOCK_STALE) {
+		b->state = PREFETCH_BLOCK_EMPTY;
+	}
+	else if (ret < 0) {
+		b->state = PREFETCH_BLOCK_ERROR;
+		b->error = ret;
+	}
+	else {
+		b->state = PREFETCH_BLOCK_READY;
+		b->size = ret;
+		if (ret < PREFETCH_BLOCK_SIZE)
+			p->eof = 1;
+		p->stats.nb_reads++;
+		p->stats.nb_bytes += ret;
+	}
+	pthread_cond_broadcast(&p->cond);
+}
+
+/*
+ * Wake the threads reading the blocks, a block has been released or the position has changed.
+ * Called with the mutex held.
+ */
+static void wake_readers(exAVPrefetcher *p) {
+	pthread_cond_broadcast(&p->cond);
+#if HAVE_LIBURING
+	/* the io_uring thread may be waiting for a completion rather than on the condition */
+	if (p->backend == PREFETCH_BACKEND_URING)
+		eventfd_write(p->efd, 1);
+#endif
+}
+
+/*
+ * Release the block at the head of the ring; it is reused once read if it is still being read.
+ * Called with the mutex held.
+ */
+static void drop_head(exAVPrefetcher *p) {
+	exAVPrefetchBlock *b = &p->blocks[p->head];
+	b->state = b->state == PREFETCH_BLOCK_PENDING ? PREFETCH_BLOCK_STALE : PREFETCH_BLOCK_EMPTY;
+	p->head = (p->head + 1) % p->depth;
+	p->nb_assigned--;
+	wake_readers(p);
+}
+
+/*
+ * Read the block at 'b->pos' through the reader's own connection.
+ * Return the bytes read, or a negative error code.
+ */
+static int read_block(AVIOContext *src, exAVPrefetchBlock *b) {
+	int ret = 0;
+	src->error = 0; /* left by a previous read */
+	if ((ret = avio_seek(src, b->pos, SEEK_SET)) < 0)
+		return ret;
+	if ((ret = avio_read(src, b->data, PREFETCH_BLOCK_SIZE)) == AVERROR_EOF)
+		return 0;
+	/* a short read is the end of the file, unless it stopped on an error */
+	if (ret >= 0 && ret < PREFETCH_BLOCK_SIZE && src->error < 0)
+		return src->error;
+	return ret;
+}
+
+static void *reader_routine(void *arg) {
+	exAVPrefetchReader *r = arg;
+	exAVPrefetcher *p = r->p;
+	exAVPrefetchBlock *b = NULL;
+	int idx = -1, ret = 0;
+	pthread_mutex_lock(&p->mutex);
+	while (!p->quit) {
+		if ((idx = assign_block(p)) < 0) {
+			pthread_cond_wait(&p->cond, &p->mutex);
+			continue;
+		}
+		b = &p->blocks[idx];
+		pthread_mutex_unlock(&p->mutex);
+		ret = read_block(r->src, b);
+		pthread_mutex_lock(&p->mutex);
+		complete_block(p, b, ret);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+/*
+ * Open the connections of the thread backend: one per reader, up to PREFETCH_MAX_READERS but no more than
+ * the depth; a source which could not seek is read by a single reader.
+ */
+static int readers_open(exAVPrefetcher *p, const char *url, const AVIOInterruptCB *int_cb) {
+	int ret = 0, nb = FFMIN(p->depth, PREFETCH_MAX_READERS);
+	if ((ret = avio_open2(&p->readers[0].src, url, AVIO_FLAG_READ, int_cb, NULL)) < 0)
+		return ret;
+	p->size = avio_size(p->readers[0].src);
+	p->nb_readers = 1;
+	if (p->size <= 0 || !(p->readers[0].src->seekable & AVIO_SEEKABLE_NORMAL))
+		return 0;
+	for (; p->nb_readers < nb; p->nb_readers++) {
+		/* not fatal, the blocks are read by fewer readers */
+		if (avio_open2(&p->readers[p->nb_readers].src, url, AVIO_FLAG_READ, int_cb, NULL) < 0)
+			break;
+	}
+	return 0;
+}
+
+static void readers_stop(exAVPrefetcher *p, int nb) {
+	pthread_mutex_lock(&p->mutex);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	for (int i = 0; i < nb; i++)
+		pthread_join(p->readers[i].thread, NULL);
+}
+
+static int readers_start(exAVPrefetcher *p) {
+	int ret = 0;
+	for (int i = 0; i < p->nb_readers; i++) {
+		p->readers[i].p = p;
+		if ((ret = pthread_create(&p->readers[i].thread, NULL, reader_routine, &p->readers[i]))) {
+			readers_stop(p, i);
+			return AVERROR(ret);
+		}
+	}
+	return 0;
+}
+
+static void readers_close(exAVPrefetcher *p) {
+	for (int i = 0; i < p->nb_readers; i++)
+		avio_closep(&p->readers[i].src);
+}
+
+#if HAVE_LIBURING
+static void uring_submit(exAVPrefetcher *p, exAVPrefetchBlock *b) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&p->ring);
+	io_uring_prep_read(sqe, p->fd, b->data + b->size, PREFETCH_BLOCK_SIZE - b->size, b->pos + b->size);
+	io_uring_sqe_set_data(sqe, b);
+}
+
+/*
+ * Poll the eventfd written by 'wake_readers', its completion carries no block.
+ */
+static void uring_arm_wake(exAVPrefetcher *p) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&p->ring);
+	io_uring_prep_poll_add(sqe, p->efd, POLLIN);
+	io_uring_sqe_set_data(sqe, NULL);
+	p->wake_armed = 1;
+}
+
+/*
+ * Keep every free block of the ring being read, all of them in flight at once; a block released while
+ * waiting for the reads completes the poll of the eventfd, and is read right away.
+ */
+static void *uring_routine(void *arg) {
+	exAVPrefetcher *p = arg;
+	struct io_uring_cqe *cqe = NULL;
+	int idx = -1, ret = 0, in_flight = 0;
+	pthread_mutex_lock(&p->mutex);
+	while (!p->quit || in_flight > 0) {
+		while ((idx = assign_block(p)) >= 0) {
+			uring_submit(p, &p->blocks[idx]);
+			in_flight++;
+		}
+		if (in_flight == 0) {
+			pthread_cond_wait(&p->cond, &p->mutex);
+			continue;
+		}
+		if (!p->wake_armed)
+			uring_arm_wake(p);
+		pthread_mutex_unlock(&p->mutex);
+		io_uring_submit(&p->ring);
+		ret = io_uring_wait_cqe(&p->ring, &cqe);
+		pthread_mutex_lock(&p->mutex);
+		if (ret < 0)
+			continue;
+		do {
+			exAVPrefetchBlock *b = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			io_uring_cqe_seen(&p->ring, cqe);
+			if (b == NULL) {
+				eventfd_t value;
+				eventfd_read(p->efd, &value);
+				p->wake_armed = 0;
+				continue;
+			}
+			in_flight--;
+			if (res > 0 && b->state == PREFETCH_BLOCK_PENDING && b->size + res < PREFETCH_BLOCK_SIZE &&
+					(p->size <= 0 || b->pos + b->size + res < p->size)) {
+				/* short read in the middle of the file, read the rest */
+				b->size += res;
+				uring_submit(p, b);
+				in_flight++;
+				continue;
+			}
+			complete_block(p, b, res < 0 ? AVERROR(-res) : b->size + res);
+		} while (io_uring_peek_cqe(&p->ring, &cqe) == 0);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+
+static int uring_open(exAVPrefetcher *p, const char *url) {
+	struct stat st;
+	const char *path = NULL;
+	const char *proto = avio_find_protocol_name(url);
+	if (proto == NULL || strcmp(proto, "file"))
+		return AVERROR(ENOSYS);
+	if (!av_strstart(url, "file:", &path))
+		path = url;
+	if ((p->fd = open(path, O_RDONLY)) < 0)
+		return AVERROR(errno);
+	if ((p->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		close(p->fd);
+		return AVERROR(errno);
+	}
+	/* one entry per block, and one for the poll of the eventfd */
+	if (fstat(p->fd, &st) < 0 || io_uring_queue_init(p->depth + 1, &p->ring, 0) < 0) {
+		close(p->efd);
+		close(p->fd);
+		return AVERROR(ENOSYS);
+	}
+	p->size = st.st_size;
+	p->backend = PREFETCH_BACKEND_URING;
+	return 0;
+}
+
+static void uring_close(exAVPrefetcher *p) {
+	io_uring_queue_exit(&p->ring);
+	close(p->efd);
+	close(p->fd);
+}
+#endif
+
+static int prefetch_read(void *opaque, uint8_t *buf, int size) {
+	exAVPrefetcher *p = opaque;
+	int ret = 0, stalled = 0;
+	pthread_mutex_lock(&p->mutex);
+	while (1) {
+		exAVPrefetchBlock *b = &p->blocks[p->head];
+		if (p->nb_assigned > 0 && b->state == PREFETCH_BLOCK_READY) {
+			int offset = p->read_pos - b->pos;
+			if (offset >= b->size) {
+				ret = AVERROR_EOF; /* the last block of the file */
+				break;
+			}
+			ret = FFMIN(size, b->size - offset);
+			memcpy(buf, b->data + offset, ret);
+			p->read_pos += ret;
+			if (p->read_pos >= b->pos + PREFETCH_BLOCK_SIZE)
+				drop_head(p);
+			break;
+		}
+		if (p->nb_assigned > 0 && b->state == PREFETCH_BLOCK_ERROR) {
+			ret = b->error;
+			break;
+		}
+		if (p->nb_assigned == 0 && (p->eof || (p->size > 0 && p->read_pos >= p->size))) {
+			ret = AVERROR_EOF;
+			break;
+		}
+		/* the block is not yet read: the storage is slower than the demuxer */
+		if (p->int_cb.callback && p->int_cb.callback(p->int_cb.opaque)) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		if (!stalled) {
+			stalled = 1;
+			p->stats.nb_stalls++;
+		}
+		int64_t start = av_gettime_relative();
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PREFETCH_WAIT_INTERVAL * 1000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&p->cond, &p->mutex, &ts);
+		p->stats.stall_time += av_gettime_relative() - start;
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return ret;
+}
+
+static int64_t prefetch_seek(void *opaque, int64_t offset, int whence) {
+	exAVPrefetcher *p = opaque;
+	int64_t pos = 0;
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return p->size > 0 ? p->size : AVERROR(ENOSYS);
+	case SEEK_SET:
+		pos = offset; break;
+	case SEEK_CUR:
+		pos = p->read_pos + offset; break;
+	case SEEK_END:
+		if (p->size <= 0)
+			return AVERROR(ENOSYS);
+		pos = p->size + offset; break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (pos < 0)
+		return AVERROR(EINVAL);
+	pthread_mutex_lock(&p->mutex);
+	if (p->nb_assigned > 0 && pos >= p->blocks[p->head].pos && pos < p->next_pos) {
+		/* in the window read ahead, only the blocks before it are dropped */
+		while (pos >= p->blocks[p->head].pos + PREFETCH_BLOCK_SIZE)
+			drop_head(p);
+	}
+	else {
+		while (p->nb_assigned > 0)
+			drop_head(p);
+		p->next_pos = pos;
+		p->eof = 0;
+	}
+	p->read_pos = pos;
+	wake_readers(p);
+	pthread_mutex_unlock(&p->mutex);
+	return pos;
+}
+
+static void prefetcher_free(exAVPrefetcher *p) {
+	for (int i = 0; i < p->depth; i++)
+		av_free(p->blocks[i].data);
+	av_free(p->blocks);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mutex);
+	av_free(p);
+}
+
+int ex_av_prefetch_io_open(AVIOContext **pb, const char *url, int depth, const AVIOInterruptCB *int_cb) {
+	int ret = AVERROR(ENOMEM);
+	uint8_t *buf = NULL;
+	exAVPrefetcher *p = av_mallocz(sizeof(exAVPrefetcher));
+	if (p == NULL)
+		goto err0;
+	p->depth = av_clip(depth > 0 ? depth : PREFETCH_DEFAULT_DEPTH, 1, PREFETCH_MAX_DEPTH);
+	if ((p->blocks = av_calloc(p->depth, sizeof(exAVPrefetchBlock))) == NULL)
+		goto err1;
+	for (int i = 0; i < p->depth; i++) {
+		if ((p->blocks[i].data = av_malloc(PREFETCH_BLOCK_SIZE)) == NULL)
+			goto err1;
+	}
+	if (pthread_mutex_init(&p->mutex, NULL))
+		goto err1;
+	if (pthread_cond_init(&p->cond, NULL))
+		goto err2;
+	if (int_cb)
+		p->int_cb = *int_cb;
+	p->backend = PREFETCH_BACKEND_THREAD;
+#if HAVE_LIBURING
+	if (uring_open(p, url) < 0)
+#endif
+	{
+		if ((ret = readers_open(p, url, int_cb)) < 0)
+			goto err4;
+	}
+	ret = AVERROR(ENOMEM);
+	if ((buf = av_malloc(PREFETCH_IO_BUFFER_SIZE)) == NULL)
+		goto err4;
+	if ((*pb = avio_alloc_context(buf, PREFETCH_IO_BUFFER_SIZE, 0, p, prefetch_read, NULL, prefetch_seek)) == NULL)
+		goto err5;
+#if HAVE_LIBURING
+	if (p->backend == PREFETCH_BACKEND_URING)
+		ret = AVERROR(pthread_create(&p->thread, NULL, uring_routine, p));
+	else
+#endif
+	ret = readers_start(p);
+	if (ret < 0)
+		goto err6;
+	if (p->size <= 0)
+		(*pb)->seekable = 0;
+	return 0;
+err6:
+	avio_context_free(pb);
+err5:
+	av_free(buf);
+err4:
+#if HAVE_LIBURING
+	if (p->backend == PREFETCH_BACKEND_URING)
+		uring_close(p);
+#endif
+	readers_close(p);
+	pthread_cond_destroy(&p->cond);
+err2:
+	pthread_mutex_destroy(&p->mutex);
+err1:
+	for (int i = 0; p->blocks && i < p->depth; i++)
+		av_free(p->blocks[i].data);
+	av_free(p->blocks);
+	av_free(p);
+err0:
+	return ret;
+}
+
+void ex_av_prefetch_io_stats(AVIOContext *pb, exAVPrefetchStats *stats) {
+	exAVPrefetcher *p = pb->opaque;
+	pthread_mutex_lock(&p->mutex);
+	*stats = p->stats;
+	stats->backend = p->backend;
+	stats->depth = p->depth;
+	stats->max_in_flight = p->backend == PREFETCH_BACKEND_URING ? p->depth : p->nb_readers;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void ex_av_prefetch_io_close(AVIOContext **pb) {
+	exAVPrefetcher *p = NULL;
+	if (*pb == NULL)
+		return;
+	p = (*pb)->opaque;
+#if HAVE_LIBURING
+	if (p->backend == PREFETCH_BACKEND_URING) {
+		pthread_mutex_lock(&p->mutex);
+		p->quit = 1;
+		wake_readers(p);
+		pthread_mutex_unlock(&p->mutex);
+		pthread_join(p->thread, NULL);
+		uring_close(p);
+	}
+	else
+#endif
+	readers_stop(p, p->nb_readers);
+	readers_close(p);
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+	prefetcher_free(p);
+}
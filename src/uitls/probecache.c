@@ -0,0 +1,246 @@
+/*
+ * probecache.c
+ *
+ *  Created on: 2026-10-16 19:06:40
+ *      Author: yui
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include <probecache.h>
+#include <mmapio.h>
+
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static exAVProbeEntry **probe_cache;
+static int probe_cache_size;
+static int probe_cache_capacity = PROBE_CACHE_DEFAULT_CAPACITY;
+static uint64_t probe_cache_clock;
+
+/*
+ * Get the size and the modification time of 'url' if it is a local file, otherwise, -1.
+ */
+static void fingerprint(const char *url, int64_t *size, int64_t *mtime) {
+	if (ex_av_file_stat(url, size, mtime) < 0)
+		*size = *mtime = -1;
+}
+
+static void entry_free(exAVProbeEntry **e) {
+	for (int i = 0; (*e)->streams && i < (*e)->nb_streams; i++)
+		avcodec_parameters_free(&(*e)->streams[i].codecpar);
+	av_free((*e)->streams);
+	av_free((*e)->url);
+	av_freep(e);
+}
+
+/* Called with the mutex held, as the following ones. */
+static void entry_remove(int i) {
+	entry_free(&probe_cache[i]);
+	probe_cache[i] = probe_cache[--probe_cache_size];
+}
+
+static void entry_evict(void) {
+	int lru = 0;
+	for (int i = 1; i < probe_cache_size; i++) {
+		if (probe_cache[i]->last_used < probe_cache[lru]->last_used)
+			lru = i;
+	}
+	entry_remove(lru);
+}
+
+static int entry_index(const char *url) {
+	for (int i = 0; i < probe_cache_size; i++) {
+		if (!strcmp(probe_cache[i]->url, url))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Return the index of the entry of 'url' with the same fingerprint, or -1; an entry of a changed file is dropped.
+ */
+static int entry_find(const char *url, int64_t size, int64_t mtime) {
+	int i = entry_index(url);
+	if (i < 0)
+		return -1;
+	if (probe_cache[i]->size != size || probe_cache[i]->mtime != mtime) {
+		entry_remove(i);
+		return -1;
+	}
+	probe_cache[i]->last_used = ++probe_cache_clock;
+	return i;
+}
+
+void ex_av_probe_cache_set_capacity(int capacity) {
+	pthread_mutex_lock(&probe_cache_mutex);
+	probe_cache_capacity = capacity > 0 ? capacity : PROBE_CACHE_DEFAULT_CAPACITY;
+	while (probe_cache_size > probe_cache_capacity)
+		entry_evict();
+	pthread_mutex_unlock(&probe_cache_mutex);
+}
+
+const AVInputFormat *ex_av_probe_cache_format(const char *url) {
+	int64_t size = -1, mtime = -1;
+	const AVInputFormat *iformat = NULL;
+	int i = -1;
+	fingerprint(url, &size, &mtime);
+	/* the format of a stream is told by its protocol or its first bytes, which may change */
+	if (size < 0)
+		return NULL;
+	pthread_mutex_lock(&probe_cache_mutex);
+	if ((i = entry_find(url, size, mtime)) >= 0)
+		iformat = probe_cache[i]->iformat;
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return iformat;
+}
+
+/*
+ * Check the streams demuxed so far against the first ones cached; a stream whose codec is not yet known
+ * by the demuxer matches any.
+ */
+static int streams_match(AVFormatContext *ic, exAVProbeEntry *e) {
+	if (ic->iformat != e->iformat || ic->nb_streams > e->nb_streams)
+		return 0;
+	if (ic->nb_streams < e->nb_streams && !(ic->ctx_flags & AVFMTCTX_NOHEADER))
+		return 0;
+	for (int i = 0; i < ic->nb_streams; i++) {
+		AVCodecParameters *par = ic->streams[i]->codecpar;
+		exAVProbeStream *ps = &e->streams[i];
+		if (par->codec_type != AVMEDIA_TYPE_UNKNOWN && par->codec_type != ps->codecpar->codec_type)
+			return 0;
+		if (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != ps->codecpar->codec_id)
+			return 0;
+		if (av_cmp_q(ic->streams[i]->time_base, ps->time_base))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check a decoded frame against the parameters cached of its stream, those unknown when probed match any.
+ */
+static int frame_matches(const AVCodecParameters *par, const AVFrame *frame) {
+	switch (par->codec_type) {
+	case AVMEDIA_TYPE_VIDEO:
+		return (par->width <= 0 || par->width == frame->width) && (par->height <= 0 || par->height == frame->height) &&
+				(par->format < 0 || par->format == frame->format);
+	case AVMEDIA_TYPE_AUDIO:
+		return (par->sample_rate <= 0 || par->sample_rate == frame->sample_rate) &&
+				(par->format < 0 || par->format == frame->format) &&
+				(par->ch_layout.nb_channels <= 0 || par->ch_layout.nb_channels == frame->ch_layout.nb_channels);
+	default:
+		return 1;
+	}
+}
+
+int ex_av_probe_cache_apply(AVFormatContext *ic, const char *url) {
+	int ret = AVERROR(ENOENT);
+	int64_t size = -1, mtime = -1;
+	exAVProbeEntry *e = NULL;
+	int i = -1;
+	fingerprint(url, &size, &mtime);
+	pthread_mutex_lock(&probe_cache_mutex);
+	if ((i = entry_find(url, size, mtime)) < 0)
+		goto end;
+	e = probe_cache[i];
+	if (!streams_match(ic, e)) {
+		/* a live source changed its streams */
+		entry_remove(i);
+		goto end;
+	}
+	for (i = 0; i < ic->nb_streams; i++) {
+		AVStream *st = ic->streams[i];
+		exAVProbeStream *ps = &e->streams[i];
+		if ((ret = avcodec_parameters_copy(st->codecpar, ps->codecpar)) < 0)
+			goto end;
+		st->avg_frame_rate = ps->avg_frame_rate;
+		st->r_frame_rate = ps->r_frame_rate;
+		if (st->start_time == AV_NOPTS_VALUE)
+			st->start_time = ps->start_time;
+		if (st->duration == AV_NOPTS_VALUE)
+			st->duration = ps->duration;
+	}
+	if (ic->start_time == AV_NOPTS_VALUE)
+		ic->start_time = e->start_time;
+	if (ic->duration == AV_NOPTS_VALUE)
+		ic->duration = e->duration;
+	if (ic->bit_rate <= 0)
+		ic->bit_rate = e->bit_rate;
+	ret = ic->nb_streams < e->nb_streams ? AVERROR(EAGAIN) : 0;
+end:
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return ret;
+}
+
+void ex_av_probe_cache_store(AVFormatContext *ic, const char *url) {
+	exAVProbeEntry *e = av_mallocz(sizeof(exAVProbeEntry));
+	int i = -1;
+	if (e == NULL)
+		return;
+	e->url = av_strdup(url);
+	e->streams = av_calloc(ic->nb_streams, sizeof(exAVProbeStream));
+	if (e->url == NULL || e->streams == NULL)
+		goto err;
+	e->nb_streams = ic->nb_streams;
+	for (i = 0; i < e->nb_streams; i++) {
+		AVStream *st = ic->streams[i];
+		exAVProbeStream *ps = &e->streams[i];
+		if ((ps->codecpar = avcodec_parameters_alloc()) == NULL || avcodec_parameters_copy(ps->codecpar, st->codecpar) < 0)
+			goto err;
+		ps->time_base = st->time_base;
+		ps->avg_frame_rate = st->avg_frame_rate;
+		ps->r_frame_rate = st->r_frame_rate;
+		ps->start_time = st->start_time;
+		ps->duration = st->duration;
+	}
+	e->iformat = ic->iformat;
+	e->start_time = ic->start_time;
+	e->duration = ic->duration;
+	e->bit_rate = ic->bit_rate;
+	fingerprint(url, &e->size, &e->mtime);
+
+	pthread_mutex_lock(&probe_cache_mutex);
+	if ((i = entry_index(url)) >= 0)
+		entry_remove(i);
+	if (probe_cache_size >= probe_cache_capacity)
+		entry_evict();
+	e->last_used = ++probe_cache_clock;
+	if (av_dynarray_add_nofree(&probe_cache, &probe_cache_size, e) < 0) {
+		pthread_mutex_unlock(&probe_cache_mutex);
+		goto err;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return;
+err:
+	entry_free(&e);
+}
+
+int ex_av_probe_cache_verify(const char *url, int stream_index, const AVFrame *frame) {
+	int ret = 0, i = -1;
+	pthread_mutex_lock(&probe_cache_mutex);
+	if ((i = entry_index(url)) >= 0 && stream_index < probe_cache[i]->nb_streams &&
+			!frame_matches(probe_cache[i]->streams[stream_index].codecpar, frame)) {
+		entry_remove(i);
+		ret = AVERROR_INVALIDDATA;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return ret;
+}
+
+void ex_av_probe_cache_remove(const char *url) {
+	int i = -1;
+	pthread_mutex_lock(&probe_cache_mutex);
+	if (url == NULL) {
+		while (probe_cache_size > 0)
+			entry_remove(probe_cache_size - 1);
+		av_freep(&probe_cache);
+	}
+	else if ((i = entry_index(url)) >= 0) {
+		entry_remove(i);
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+}
@@ -0,0 +1,599 @@
+/*
+ * queue.c
+ *
+ *  Created on: 2026-10-16 09:13:05
+ *      Author: yui
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavutil/common.h>
+
+#include <queue.h>
+
+/*
+ * Ring buffer of the QUEUE_SPSC backend. 'tail' is only written by the producer and
+ * 'head' only by the consumer; they are kept on different cache lines to avoid false sharing.
+ */
+typedef struct exAVRing {
+	unsigned int tail;                  /* next slot to fill */
+	char pad0[QUEUE_CACHE_LINE_SIZE - sizeof(unsigned int)];
+	unsigned int head;                  /* next slot to pop */
+	unsigned int flush_ack;             /* the last flush request handled by the consumer */
+	char pad1[QUEUE_CACHE_LINE_SIZE - 2 * sizeof(unsigned int)];
+	unsigned int flush_req;             /* increased by every flush */
+	unsigned int flush_tail;            /* entries before it are released by the consumer */
+	unsigned int mask;
+	struct list_head *slots[];
+} exAVRing;
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/*
+ * Convert a relative 'timeout'(in microseconds) into an absolute time used by 'pthread_cond_timedwait'.
+ */
+static void queue_deadline(struct timespec *ts, int64_t timeout) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec  += timeout / 1000000;
+	ts->tv_nsec += (timeout % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Wait on the condition of the queue; the mutex must be held. The time waited is added to '*wait_time'.
+ * Return 0 if woken up, otherwise, return AVERROR(EAGAIN) if timeout.
+ */
+static int queue_wait(exAVQueue *q, int64_t timeout, const struct timespec *deadline, int64_t *wait_time) {
+	int ret = 0;
+	int64_t start = 0;
+	if (timeout == 0)
+		return AVERROR(EAGAIN);
+	start = av_gettime_relative();
+	if (timeout < 0)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	else if (pthread_cond_timedwait(&q->cond, &q->mutex, deadline) == ETIMEDOUT)
+		ret = AVERROR(EAGAIN);
+	__atomic_add_fetch(wait_time, av_gettime_relative() - start, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/*
+ * Account the time a side not waiting(timeout 0) was blocked, from its first failed attempt('*parked')
+ * until it succeeds; 'ret' is the result of its attempt. Only a side woken by the other one('*side' set,
+ * a parked task) is blocked meanwhile, a consumer polling the queue is not.
+ */
+static void queue_parked(void **side, int64_t *parked, int64_t *wait_time, int ret) {
+	int64_t since = 0;
+	if (__atomic_load_n(side, __ATOMIC_ACQUIRE) == NULL) {
+		__atomic_store_n(parked, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	if (ret == AVERROR(EAGAIN)) {
+		__atomic_compare_exchange_n(parked, &since, av_gettime_relative(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		return;
+	}
+	since = __atomic_exchange_n(parked, 0, __ATOMIC_RELAXED);
+	if (since && ret == 0)
+		__atomic_add_fetch(wait_time, av_gettime_relative() - since, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wake up the other side after a lock-free operation, if it is sleeping.
+ */
+static void queue_wake(exAVQueue *q) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&q->mutex);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->mutex);
+	}
+}
+
+/*
+ * Tell a task-driven side of the queue that it could make progress. 'notifying' lets the wakers be
+ * cleared while the sides run: once they are cleared, no 'wake' is in progress.
+ */
+static inline void queue_notify(exAVQueue *q, void **side) {
+	void *opaque = NULL;
+	if (__atomic_load_n(side, __ATOMIC_RELAXED) == NULL)
+		return;
+	__atomic_add_fetch(&q->notifying, 1, __ATOMIC_SEQ_CST);
+	if ((opaque = __atomic_load_n(side, __ATOMIC_SEQ_CST)) != NULL)
+		q->wake(opaque);
+	__atomic_sub_fetch(&q->notifying, 1, __ATOMIC_RELEASE);
+}
+
+static inline void queue_measure(exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration) {
+	*bytes = *duration = 0;
+	if (q->measure)
+		q->measure(q, n, bytes, duration);
+}
+
+static inline void queue_account(exAVQueue *q, int64_t bytes, int64_t duration) {
+	__atomic_add_fetch(&q->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->duration, duration, __ATOMIC_RELAXED);
+}
+
+static inline void queue_unaccount(exAVQueue *q, struct list_head *n) {
+	int64_t bytes, duration;
+	queue_measure(q, n, &bytes, &duration);
+	queue_account(q, -bytes, -duration);
+}
+
+/*
+ * Count an entry pushed into the queue, which holds 'count' entries now.
+ */
+static inline void queue_pushed(exAVQueue *q, int count) {
+	int high_water = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->nb_pushed, 1, __ATOMIC_RELAXED);
+	while (count > high_water &&
+			!__atomic_compare_exchange_n(&q->high_water, &high_water, count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Return non-zero value if no more entries could be inserted into a queue holding 'count' entries.
+ */
+static int queue_is_full(exAVQueue *q, unsigned int count) {
+	if (count >= q->capacity)
+		return 1;
+	if (count < QUEUE_MIN_ENTRIES)
+		return 0;
+	if (q->max_bytes > 0 && __atomic_load_n(&q->bytes, __ATOMIC_RELAXED) >= q->max_bytes)
+		return 1;
+	if (q->min_duration > 0 && __atomic_load_n(&q->duration, __ATOMIC_RELAXED) >= q->min_duration)
+		return 1;
+	return 0;
+}
+
+/*
+ * Release the flushed entries; only called by the consumer.
+ * Return how many entries released.
+ */
+static int ring_discard(exAVQueue *q) {
+	exAVRing *r = q->ring;
+	unsigned int req = load_acquire(&r->flush_req), head = r->head, until;
+	int count = 0;
+	if (req == r->flush_ack)
+		return 0;
+	until = __atomic_load_n(&r->flush_tail, __ATOMIC_RELAXED);
+	while ((int)(until - head) > 0) {
+		queue_unaccount(q, r->slots[head & r->mask]);
+		if (q->free_entry)
+			q->free_entry(r->slots[head & r->mask]);
+		head++;
+		count++;
+	}
+	store_release(&r->head, head);
+	r->flush_ack = req;
+	__atomic_add_fetch(&q->nb_flushed, count, __ATOMIC_RELAXED);
+	return count;
+}
+
+/*
+ * The entries of the QUEUE_LIST backend are linked through their own 'list' member, under the mutex of
+ * the queue; a removed entry is left pointing to itself, the way 'list_del' expects it when it is released.
+ */
+static void entries_insert_tail(exAVQueue *q, struct list_head *n) {
+	n->prev = q->entries.prev;
+	n->next = &q->entries;
+	q->entries.prev->next = n;
+	q->entries.prev = n;
+	q->count++;
+}
+
+static struct list_head *entries_pop_front(exAVQueue *q) {
+	struct list_head *n = q->entries.next;
+	if (n == &q->entries)
+		return NULL;
+	list_del(n);
+	INIT_LIST_HEAD(n);
+	q->count--;
+	return n;
+}
+
+static struct list_head *entries_peek(exAVQueue *q, int idx) {
+	struct list_head *n = q->entries.next;
+	if (idx < 0 || idx >= q->count)
+		return NULL;
+	while (idx-- > 0)
+		n = n->next;
+	return n;
+}
+
+static int ring_push(exAVQueue *q, struct list_head *n, int64_t bytes, int64_t duration) {
+	exAVRing *r = q->ring;
+	unsigned int tail = r->tail, count = tail - load_acquire(&r->head);
+	if (queue_is_full(q, count))
+		return 0;
+	r->slots[tail & r->mask] = n;
+	queue_account(q, bytes, duration);
+	store_release(&r->tail, tail + 1);
+	queue_pushed(q, count + 1);
+	return 1;
+}
+
+static struct list_head *ring_pop(exAVQueue *q) {
+	exAVRing *r = q->ring;
+	unsigned int head = r->head;
+	struct list_head *n = NULL;
+	if (head == load_acquire(&r->tail))
+		return NULL;
+	n = r->slots[head & r->mask];
+	queue_unaccount(q, n);
+	store_release(&r->head, head + 1);
+	__atomic_add_fetch(&q->nb_popped, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+static int ring_size(exAVQueue *q) {
+	exAVRing *r = q->ring;
+	unsigned int head = load_acquire(&r->head), tail = load_acquire(&r->tail);
+	if (load_acquire(&r->flush_req) != r->flush_ack) {
+		unsigned int until = __atomic_load_n(&r->flush_tail, __ATOMIC_RELAXED);
+		if ((int)(until - head) > 0)
+			head = until;
+	}
+	return tail - head;
+}
+
+/*
+ * Try to insert 'n' without waiting. Return 1 if success.
+ */
+static int queue_try_push(exAVQueue *q, struct list_head *n, int64_t bytes, int64_t duration) {
+	int count = 0;
+	if (q->type == QUEUE_SPSC)
+		return ring_push(q, n, bytes, duration);
+	count = q->count;
+	if (queue_is_full(q, count))
+		return 0;
+	entries_insert_tail(q, n);
+	queue_account(q, bytes, duration);
+	queue_pushed(q, count + 1);
+	return 1;
+}
+
+/*
+ * Try to remove the head without waiting. Return NULL if empty.
+ */
+static struct list_head *queue_try_pop(exAVQueue *q) {
+	struct list_head *n = NULL;
+	if (q->type == QUEUE_SPSC)
+		return ring_pop(q);
+	if ((n = entries_pop_front(q)) != NULL) {
+		queue_unaccount(q, n);
+		__atomic_add_fetch(&q->nb_popped, 1, __ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+int ex_av_queue_init(exAVQueue *q, int type, int capacity) {
+	q->type = type;
+	q->capacity = capacity;
+	q->abort_request = 0;
+	q->finished = 0;
+	q->waiters = 0;
+	q->free_entry = NULL;
+	q->measure = NULL;
+	q->time_base = (AVRational){ 1, AV_TIME_BASE };
+	q->bytes = q->duration = 0;
+	q->max_bytes = q->min_duration = 0;
+	q->entries.next = q->entries.prev = NULL;
+	q->count = 0;
+	q->ring = NULL;
+	q->wake = NULL;
+	q->producer = q->consumer = NULL;
+	q->notifying = 0;
+	q->high_water = 0;
+	q->nb_pushed = q->nb_popped = q->nb_flushed = 0;
+	q->push_wait = q->pop_wait = 0;
+	q->push_parked = q->pop_parked = 0;
+	if (type == QUEUE_SPSC) {
+		unsigned int size = 1;
+		while (size < capacity)
+			size <<= 1;
+		q->ring = av_mallocz(sizeof(exAVRing) + size * sizeof(struct list_head *));
+		if (q->ring == NULL)
+			goto err0;
+		q->ring->mask = size - 1;
+		q->capacity = size;
+	}
+	if (pthread_mutex_init(&q->mutex, NULL))
+		goto err1;
+	if (pthread_cond_init(&q->cond, NULL))
+		goto err2;
+	if (type != QUEUE_SPSC)
+		INIT_LIST_HEAD(&q->entries);
+	return 0;
+err2:
+	pthread_mutex_destroy(&q->mutex);
+err1:
+	av_freep(&q->ring);
+err0:
+	return AVERROR(ENOMEM);
+}
+
+void ex_av_queue_set_measure(exAVQueue *q,
+                             void (*measure)(exAVQueue *q, struct list_head *n, int64_t *bytes, int64_t *duration),
+                             AVRational time_base) {
+	q->measure = measure;
+	q->time_base = time_base;
+}
+
+void ex_av_queue_set_limits(exAVQueue *q, int64_t max_bytes, int64_t min_duration) {
+	pthread_mutex_lock(&q->mutex);
+	q->max_bytes = max_bytes;
+	q->min_duration = min_duration;
+	/* the queue may be no longer full */
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	queue_notify(q, &q->producer);
+}
+
+void ex_av_queue_set_wakers(exAVQueue *q, void (*wake)(void *opaque), void *producer, void *consumer) {
+	if (wake) {
+		q->wake = wake;
+		__atomic_store_n(&q->producer, producer, __ATOMIC_RELEASE);
+		__atomic_store_n(&q->consumer, consumer, __ATOMIC_RELEASE);
+		return;
+	}
+	__atomic_store_n(&q->producer, NULL, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&q->consumer, NULL, __ATOMIC_SEQ_CST);
+	/* wait for the 'wake' calls which have already read a side */
+	while (__atomic_load_n(&q->notifying, __ATOMIC_SEQ_CST))
+		sched_yield();
+	q->wake = NULL;
+}
+
+int64_t ex_av_queue_bytes(exAVQueue *q) {
+	return __atomic_load_n(&q->bytes, __ATOMIC_RELAXED);
+}
+
+int64_t ex_av_queue_duration(exAVQueue *q) {
+	return __atomic_load_n(&q->duration, __ATOMIC_RELAXED);
+}
+
+void ex_av_queue_get_stats(exAVQueue *q, exAVQueueStats *stats) {
+	stats->nb_pushed  = __atomic_load_n(&q->nb_pushed, __ATOMIC_RELAXED);
+	stats->nb_popped  = __atomic_load_n(&q->nb_popped, __ATOMIC_RELAXED);
+	stats->nb_flushed = __atomic_load_n(&q->nb_flushed, __ATOMIC_RELAXED);
+	stats->size       = FFMAX(0, stats->nb_pushed - stats->nb_popped - stats->nb_flushed);
+	stats->high_water = __atomic_load_n(&q->high_water, __ATOMIC_RELAXED);
+	stats->bytes      = __atomic_load_n(&q->bytes, __ATOMIC_RELAXED);
+	stats->duration   = __atomic_load_n(&q->duration, __ATOMIC_RELAXED);
+	stats->push_wait  = __atomic_load_n(&q->push_wait, __ATOMIC_RELAXED);
+	stats->pop_wait   = __atomic_load_n(&q->pop_wait, __ATOMIC_RELAXED);
+}
+
+void ex_av_queue_destroy(exAVQueue *q, void (*free_entry)(struct list_head *)) {
+	struct list_head *n = NULL;
+	if (q->entries.next == NULL && q->ring == NULL)
+		return;
+	if (q->type == QUEUE_SPSC) {
+		q->free_entry = free_entry;
+		ring_discard(q);
+		while ((n = ring_pop(q)) != NULL)
+			free_entry(n);
+		av_freep(&q->ring);
+	}
+	else {
+		while ((n = entries_pop_front(q)) != NULL)
+			free_entry(n);
+		q->entries.next = q->entries.prev = NULL;
+	}
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mutex);
+}
+
+int ex_av_queue_push(exAVQueue *q, struct list_head *n, int64_t timeout) {
+	int ret = 0;
+	int64_t bytes, duration;
+	struct timespec deadline;
+	queue_measure(q, n, &bytes, &duration);
+	/* lock-free fast path */
+	if (q->type == QUEUE_SPSC && !load_acquire(&q->abort_request) && ring_push(q, n, bytes, duration)) {
+		if (timeout == 0)
+			queue_parked(&q->producer, &q->push_parked, &q->push_wait, 0);
+		queue_wake(q);
+		queue_notify(q, &q->consumer);
+		return 0;
+	}
+	if (timeout > 0)
+		queue_deadline(&deadline, timeout);
+	pthread_mutex_lock(&q->mutex);
+	__atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	while (1) {
+		if (q->abort_request) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		if (queue_try_push(q, n, bytes, duration)) {
+			pthread_cond_broadcast(&q->cond);
+			ret = 0;
+			break;
+		}
+		if ((ret = queue_wait(q, timeout, &deadline, &q->push_wait)) < 0)
+			break;
+	}
+	__atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->mutex);
+	if (timeout == 0)
+		queue_parked(&q->producer, &q->push_parked, &q->push_wait, ret);
+	if (ret == 0)
+		queue_notify(q, &q->consumer);
+	return ret;
+}
+
+int ex_av_queue_pop(exAVQueue *q, struct list_head **n, int64_t timeout) {
+	int ret = 0, discarded = 0;
+	struct timespec deadline;
+	*n = NULL;
+	/* lock-free fast path */
+	if (q->type == QUEUE_SPSC && !load_acquire(&q->abort_request)) {
+		discarded = ring_discard(q);
+		if ((*n = ring_pop(q)) != NULL || discarded) {
+			queue_wake(q);
+			queue_notify(q, &q->producer);
+		}
+		if (*n) {
+			if (timeout == 0)
+				queue_parked(&q->consumer, &q->pop_parked, &q->pop_wait, 0);
+			return 0;
+		}
+	}
+	if (timeout > 0)
+		queue_deadline(&deadline, timeout);
+	pthread_mutex_lock(&q->mutex);
+	__atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	while (1) {
+		if (q->abort_request) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		if (q->type == QUEUE_SPSC && ring_discard(q)) {
+			pthread_cond_broadcast(&q->cond);
+			discarded = 1;
+		}
+		if ((*n = queue_try_pop(q)) != NULL) {
+			pthread_cond_broadcast(&q->cond);
+			ret = 0;
+			break;
+		}
+		if (q->finished) {
+			ret = AVERROR_EOF;
+			break;
+		}
+		if ((ret = queue_wait(q, timeout, &deadline, &q->pop_wait)) < 0)
+			break;
+	}
+	__atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->mutex);
+	if (timeout == 0)
+		queue_parked(&q->consumer, &q->pop_parked, &q->pop_wait, ret);
+	if (ret == 0 || discarded)
+		queue_notify(q, &q->producer);
+	return ret;
+}
+
+struct list_head *ex_av_queue_peek_ref(exAVQueue *q, int idx, void (*ref)(struct list_head *)) {
+	struct list_head *n = NULL;
+	if (q->type == QUEUE_SPSC) {
+		exAVRing *r = q->ring;
+		if (ring_discard(q)) {
+			queue_wake(q);
+			queue_notify(q, &q->producer);
+		}
+		/* only this thread releases the entries */
+		if (idx >= 0 && idx < (int)(load_acquire(&r->tail) - r->head))
+			n = r->slots[(r->head + idx) & r->mask];
+		if (n && ref)
+			ref(n);
+		return n;
+	}
+	pthread_mutex_lock(&q->mutex);
+	if ((n = entries_peek(q, idx)) != NULL && ref)
+		ref(n);
+	pthread_mutex_unlock(&q->mutex);
+	return n;
+}
+
+struct list_head *ex_av_queue_peek(exAVQueue *q, int idx) {
+	return ex_av_queue_peek_ref(q, idx, NULL);
+}
+
+int ex_av_queue_pop_entry(exAVQueue *q, struct list_head *n) {
+	int ret = AVERROR(EAGAIN);
+	if (q->type == QUEUE_SPSC) {
+		exAVRing *r = q->ring;
+		int discarded = ring_discard(q);
+		if (r->head != load_acquire(&r->tail) && r->slots[r->head & r->mask] == n) {
+			ring_pop(q);
+			ret = 0;
+		}
+		if (ret == 0 || discarded) {
+			queue_wake(q);
+			queue_notify(q, &q->producer);
+		}
+		return ret;
+	}
+	pthread_mutex_lock(&q->mutex);
+	if (q->entries.next == n) {
+		entries_pop_front(q);
+		queue_unaccount(q, n);
+		__atomic_add_fetch(&q->nb_popped, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&q->cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	if (ret == 0)
+		queue_notify(q, &q->producer);
+	return ret;
+}
+
+int ex_av_queue_size(exAVQueue *q) {
+	int size = 0;
+	if (q->type == QUEUE_SPSC)
+		return ring_size(q);
+	pthread_mutex_lock(&q->mutex);
+	size = q->count;
+	pthread_mutex_unlock(&q->mutex);
+	return size;
+}
+
+void ex_av_queue_flush(exAVQueue *q, void (*free_entry)(struct list_head *)) {
+	pthread_mutex_lock(&q->mutex);
+	if (q->type == QUEUE_SPSC) {
+		/* only the consumer may move 'head', so just tell it what to release */
+		q->free_entry = free_entry;
+		__atomic_store_n(&q->ring->flush_tail, load_acquire(&q->ring->tail), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&q->ring->flush_req, 1, __ATOMIC_RELEASE);
+	}
+	else {
+		struct list_head *n = NULL;
+		int count = 0;
+		while ((n = entries_pop_front(q)) != NULL) {
+			queue_unaccount(q, n);
+			free_entry(n);
+			count++;
+		}
+		__atomic_add_fetch(&q->nb_flushed, count, __ATOMIC_RELAXED);
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	/* the consumer of a QUEUE_SPSC queue has to release the flushed entries before the producer goes on */
+	queue_notify(q, q->type == QUEUE_SPSC ? &q->consumer : &q->producer);
+}
+
+void ex_av_queue_abort(exAVQueue *q) {
+	pthread_mutex_lock(&q->mutex);
+	store_release(&q->abort_request, 1);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	queue_notify(q, &q->producer);
+	queue_notify(q, &q->consumer);
+}
+
+void ex_av_queue_finish(exAVQueue *q) {
+	pthread_mutex_lock(&q->mutex);
+	q->finished = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	queue_notify(q, &q->consumer);
+}
+
+void ex_av_queue_start(exAVQueue *q) {
+	pthread_mutex_lock(&q->mutex);
+	store_release(&q->abort_request, 0);
+	q->finished = 0;
+	pthread_mutex_unlock(&q->mutex);
+}
@@ -0,0 +1,302 @@
+/*
+ * remux.c
+ *
+ *  Created on: 2026-10-16 15:21:30
+ *      Author: yui
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+
+#include <remux.h>
+
+/* Containers storing H.264/HEVC in Annex B, while MP4/Matroska store them in AVCC(and convert Annex B by themselves) */
+#define ANNEXB_FORMATS "mpegts,rtp_mpegts,h264,hevc"
+/* Containers storing AAC with an AudioSpecificConfig instead of ADTS headers */
+#define ASC_FORMATS    "mp4,mov,ipod,ismv,3gp,3g2,psp,f4v,flv,matroska,webm"
+
+/*
+ * Return the name of the bitstream filter needed to store a stream of 'par' into 'oc', or NULL if none.
+ */
+static const char *choose_bsf(AVFormatContext *oc, AVCodecParameters *par) {
+	int avcc = par->extradata_size > 0 && par->extradata[0] == 1;
+	switch (par->codec_id) {
+	case AV_CODEC_ID_H264:
+		if (avcc && av_match_name(oc->oformat->name, ANNEXB_FORMATS))
+			return "h264_mp4toannexb";
+		break;
+	case AV_CODEC_ID_HEVC:
+		if (avcc && av_match_name(oc->oformat->name, ANNEXB_FORMATS))
+			return "hevc_mp4toannexb";
+		break;
+	case AV_CODEC_ID_AAC:
+		/* there is no AudioSpecificConfig when it is carried in ADTS */
+		if (par->extradata_size == 0 && av_match_name(oc->oformat->name, ASC_FORMATS))
+			return "aac_adtstoasc";
+		break;
+	default:
+		break;
+	}
+	return NULL;
+}
+
+static int add_stream(exAVRemuxer *r, AVStream *is, int idx) {
+	int ret = 0;
+	AVCodecParameters *par = is->codecpar;
+	const char *name = choose_bsf(r->oc, par);
+	AVStream *os = avformat_new_stream(r->oc, NULL);
+	if (os == NULL)
+		return AVERROR(ENOMEM);
+	if (name) {
+		const AVBitStreamFilter *filter = av_bsf_get_by_name(name);
+		if (filter == NULL) {
+			av_log(NULL, AV_LOG_WARNING, "ex_av_remuxer: no such bitstream filter: %s\n", name);
+		}
+		else {
+			if ((ret = av_bsf_alloc(filter, &r->bsfs[idx])) < 0)
+				return ret;
+			if ((ret = avcodec_parameters_copy(r->bsfs[idx]->par_in, par)) < 0)
+				return ret;
+			r->bsfs[idx]->time_base_in = is->time_base;
+			if ((ret = av_bsf_init(r->bsfs[idx])) < 0)
+				return ret;
+			par = r->bsfs[idx]->par_out;
+		}
+	}
+	if ((ret = avcodec_parameters_copy(os->codecpar, par)) < 0)
+		return ret;
+	os->codecpar->codec_tag = 0;    /* let the muxer choose the tag of its container */
+	os->time_base = is->time_base;
+	os->avg_frame_rate = is->avg_frame_rate;
+	os->sample_aspect_ratio = is->sample_aspect_ratio;
+	av_dict_copy(&os->metadata, is->metadata, 0);
+	r->wait_keyframe[idx] = (par->codec_type == AVMEDIA_TYPE_VIDEO);
+	return 0;
+}
+
+/*
+ * All the streams are shifted by the same offset to stay in sync; a stream starting before the first
+ * timestamp written gets negative timestamps, made non-negative by the muxer, see 'ex_av_remuxer_create'.
+ */
+static int write_packet(exAVRemuxer *r, AVPacket *pkt, int idx, AVRational time_base) {
+	AVStream *os = r->oc->streams[idx];
+	int64_t offset = av_rescale_q(r->start_dts, AV_TIME_BASE_Q, time_base);
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pkt->pts -= offset;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		pkt->dts -= offset;
+	av_packet_rescale_ts(pkt, time_base, os->time_base);
+	pkt->stream_index = idx;
+	pkt->pos = -1;
+	r->nb_packets++;
+	r->nb_bytes += pkt->size;
+	return av_interleaved_write_frame(r->oc, pkt);
+}
+
+/*
+ * Pass 'in' through the bitstream filter of the output stream 'idx' if any, and write the results.
+ * A NULL 'in' flushes the filter.
+ */
+static int filter_packet(exAVRemuxer *r, AVPacket *in, AVPacket *out, int idx, AVRational time_base) {
+	int ret = 0;
+	AVBSFContext *bsf = r->bsfs[idx];
+	if (bsf == NULL)
+		return in ? write_packet(r, in, idx, time_base) : 0;
+	if ((ret = av_bsf_send_packet(bsf, in)) < 0)
+		return ret;
+	while ((ret = av_bsf_receive_packet(bsf, out)) == 0) {
+		if ((ret = write_packet(r, out, idx, bsf->time_base_out)) < 0)
+			return ret;
+	}
+	return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static int remux_packet(exAVRemuxer *r, AVPacket *pkt, AVPacket *out) {
+	int idx = r->stream_map[pkt->stream_index];
+	AVRational time_base = r->ic->streams[pkt->stream_index]->time_base;
+	if (r->wait_keyframe[idx]) {
+		/* the frames before the first keyframe could not be decoded */
+		if (!(pkt->flags & AV_PKT_FLAG_KEY))
+			return 0;
+		r->wait_keyframe[idx] = 0;
+	}
+	if (r->start_dts == AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE)
+		r->start_dts = av_rescale_q(pkt->dts, time_base, AV_TIME_BASE_Q);
+	if (r->start_dts == AV_NOPTS_VALUE)
+		return 0;
+	return filter_packet(r, pkt, out, idx, time_base);
+}
+
+static void *remux_routine(void *arg) {
+	exAVRemuxer *r = arg;
+	int ret = 0, err = 0;
+	struct list_head *n = NULL;
+	AVPacket *out = av_packet_alloc();
+	if (out == NULL)
+		ret = AVERROR(ENOMEM);
+	while (ret >= 0) {
+		/* wait until the grabber sends a packet, finishes, or the saving is stopped */
+		if ((ret = ex_av_queue_pop(&r->queue, &n, -1)) < 0)
+			break;
+		exAVPacket *pkt = list_entry(n, exAVPacket, list);
+		ret = remux_packet(r, pkt->avpkt, out);
+		pkt->put(pkt);
+	}
+	if (ret == AVERROR_EOF) {
+		ret = 0;
+		for (int i = 0; i < r->oc->nb_streams && ret >= 0; i++)
+			ret = filter_packet(r, NULL, out, i, r->oc->streams[i]->time_base);
+	}
+	if (ret == AVERROR_EXIT) {
+		/* aborted, the partial output is removed when the remuxer is freed */
+		r->discard = 1;
+	}
+	else {
+		if (ret < 0)
+			av_log(NULL, AV_LOG_ERROR, "ex_av_remuxer error: %s: %s\n", r->oc->url, av_err2str(ret));
+		/* write the trailer even after an error, so that what has been written could be played */
+		if ((err = av_write_trailer(r->oc)) < 0 && ret >= 0)
+			ret = err;
+	}
+	av_log(NULL, AV_LOG_VERBOSE, "ex_av_remuxer: %s: %"PRId64" packets, %"PRId64" bytes\n", r->oc->url, r->nb_packets, r->nb_bytes);
+	r->result = ret;
+	av_packet_free(&out);
+	return NULL;
+}
+
+/*
+ * Remove the output file of an aborted remuxer, only a local file.
+ */
+static void remove_output(const char *url) {
+	const char *path = url;
+	const char *protocol = avio_find_protocol_name(url);
+	if (protocol == NULL || strcmp(protocol, "file"))
+		return;
+	av_strstart(url, "file:", &path);
+	if (remove(path) < 0)
+		av_log(NULL, AV_LOG_WARNING, "ex_av_remuxer: unable to remove the partial output: %s\n", url);
+}
+
+static void remuxer_free_streams(exAVRemuxer *r) {
+	if (r->bsfs) {
+		for (int i = 0; i < r->oc->nb_streams; i++)
+			av_bsf_free(&r->bsfs[i]);
+	}
+	if (!(r->oc->oformat->flags & AVFMT_NOFILE)) {
+		avio_closep(&r->oc->pb);
+		if (r->discard)
+			remove_output(r->oc->url);
+	}
+	avformat_free_context(r->oc);
+	r->oc = NULL;
+}
+
+int ex_av_remuxer_create(exAVRemuxer **rr, AVFormatContext *ic, const char *url, const int *stream_indexes, int nb_streams) {
+	int ret = AVERROR(ENOMEM);
+	exAVRemuxer *r = av_mallocz(sizeof(exAVRemuxer));
+	if (r == NULL)
+		goto err0;
+	r->ic = ic;
+	r->start_dts = AV_NOPTS_VALUE;
+	r->nb_input_streams = ic->nb_streams;
+	r->stream_map = av_malloc_array(ic->nb_streams, sizeof(int));
+	r->bsfs = av_calloc(nb_streams, sizeof(AVBSFContext *));
+	r->wait_keyframe = av_calloc(nb_streams, sizeof(int));
+	if (!r->stream_map || !r->bsfs || !r->wait_keyframe)
+		goto err1;
+	for (int i = 0; i < ic->nb_streams; i++)
+		r->stream_map[i] = -1;
+	if ((ret = ex_av_queue_init(&r->queue, QUEUE_LIST, REMUX_QUEUE_SIZE)) < 0)
+		goto err1;
+	if ((ret = avformat_alloc_output_context2(&r->oc, NULL, NULL, url)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_remuxer_create: avformat_alloc_output_context2 error: %s: %s\n", av_err2str(ret), url);
+		goto err2;
+	}
+	r->oc->avoid_negative_ts = AVFMT_AVOID_NEG_TS_MAKE_NON_NEGATIVE;
+	for (int i = 0; i < nb_streams; i++) {
+		if ((ret = add_stream(r, ic->streams[stream_indexes[i]], i)) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_remuxer_create: unable to add stream #%d: %s: %s\n", stream_indexes[i], av_err2str(ret), url);
+			goto err3;
+		}
+		r->stream_map[stream_indexes[i]] = i;
+	}
+	if (!(r->oc->oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&r->oc->pb, url, AVIO_FLAG_WRITE)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_remuxer_create: avio_open error: %s: %s\n", av_err2str(ret), url);
+		goto err3;
+	}
+	if ((ret = avformat_write_header(r->oc, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_remuxer_create: avformat_write_header error: %s: %s\n", av_err2str(ret), url);
+		goto err3;
+	}
+	if ((ret = pthread_create(&r->thread, NULL, remux_routine, r))) {
+		ret = AVERROR(ret);
+		goto err3;
+	}
+	r->thread_started = 1;
+	*rr = r;
+	return 0;
+err3:
+	remuxer_free_streams(r);
+err2:
+	ex_av_queue_destroy(&r->queue, ex_av_packet_free_list_entry);
+err1:
+	av_freep(&r->stream_map);
+	av_freep(&r->bsfs);
+	av_freep(&r->wait_keyframe);
+	av_free(r);
+err0:
+	return ret;
+}
+
+int ex_av_remuxer_send(exAVRemuxer *r, exAVPacket *pkt, int64_t timeout) {
+	int ret = 0;
+	int idx = pkt->avpkt->stream_index;
+	if (idx >= r->nb_input_streams || r->stream_map[idx] < 0) {
+		pkt->put(pkt);
+		return 0;
+	}
+	/* the output is written at disk speed, the packet is kept by the caller if it is still full */
+	if ((ret = ex_av_queue_push(&r->queue, &pkt->list, timeout)) < 0 && ret != AVERROR(EAGAIN))
+		pkt->put(pkt);
+	return ret;
+}
+
+void ex_av_remuxer_set_waker(exAVRemuxer *r, void (*wake)(void *opaque), void *opaque) {
+	ex_av_queue_set_wakers(&r->queue, wake, opaque, NULL);
+}
+
+void ex_av_remuxer_finish(exAVRemuxer *r) {
+	ex_av_queue_finish(&r->queue);
+}
+
+void ex_av_remuxer_abort(exAVRemuxer *r) {
+	ex_av_queue_abort(&r->queue);
+}
+
+int ex_av_remuxer_wait(exAVRemuxer *r) {
+	if (r->thread_started) {
+		pthread_join(r->thread, NULL);
+		r->thread_started = 0;
+	}
+	return r->result;
+}
+
+void ex_av_remuxer_free(exAVRemuxer **r) {
+	exAVRemuxer *p = *r;
+	if (p == NULL)
+		return;
+	*r = NULL;
+	ex_av_remuxer_abort(p);
+	ex_av_remuxer_wait(p);
+	remuxer_free_streams(p);
+	ex_av_queue_destroy(&p->queue, ex_av_packet_free_list_entry);
+	av_freep(&p->stream_map);
+	av_freep(&p->bsfs);
+	av_freep(&p->wait_keyframe);
+	av_free(p);
+}
@@ -0,0 +1,407 @@
+/*
+ * thumbnail.c
+ *
+ *  Created on: 2026-10-16 17:33:52
+ *      Author: yui
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
+
+#include <thumbnail.h>
+
+typedef struct exAVThumbnailer {
+	AVFormatContext *ic;
+	AVCodecContext *cc;
+	AVStream *st;
+	AVPacket *pkt;
+	AVFrame *frame;
+	struct SwsContext *sws;
+	int width, height;                  /* size of the thumbnails */
+} exAVThumbnailer;
+
+/*
+ * A worker extracts the thumbnails of a contiguous share of the timestamps, so that it mostly seeks forward.
+ */
+typedef struct exAVThumbnailWorker {
+	pthread_t thread;
+	const char *url;
+	exAVThumbnailer *opened;            /* opened by the caller already, NULL to open its own */
+	const int64_t *timestamps;          /* in AV_TIME_BASE */
+	exAVFrame **thumbnails;             /* NULL if the thumbnails are scaled into the tiles of 'sheet' */
+	AVFrame *sheet;
+	int first, cols;                    /* tile of the first timestamp, and the columns of 'sheet' */
+	int nb;
+	int width, height;
+	int nb_extracted;
+	int error;                          /* the last error */
+} exAVThumbnailWorker;
+
+static void thumbnailer_close(exAVThumbnailer *t) {
+	sws_freeContext(t->sws);
+	av_frame_free(&t->frame);
+	av_packet_free(&t->pkt);
+	avcodec_free_context(&t->cc);
+	avformat_close_input(&t->ic);
+}
+
+/*
+ * Compute the size of the thumbnails from the display aspect ratio of 'st', if not specified.
+ */
+static void thumbnail_size(AVStream *st, int *width, int *height) {
+	AVCodecParameters *par = st->codecpar;
+	AVRational sar = av_guess_sample_aspect_ratio(NULL, st, NULL);
+	double dar = par->height > 0 ? (double)par->width / par->height : 1.0;
+	if (sar.num > 0 && sar.den > 0)
+		dar *= av_q2d(sar);
+	if (*width <= 0 && *height <= 0)
+		*width = THUMBNAIL_DEFAULT_WIDTH;
+	if (*width <= 0)
+		*width = lrint(*height * dar);
+	if (*height <= 0)
+		*height = lrint(*width / dar);
+	/* YUV420P needs even dimensions */
+	*width  = FFMAX(*width & ~1, 2);
+	*height = FFMAX(*height & ~1, 2);
+}
+
+/*
+ * Choose the largest reduction of the resolution done by the codec itself, still not smaller than the thumbnails.
+ */
+static int thumbnail_lowres(const AVCodec *codec, AVCodecParameters *par, int width, int height) {
+	int lowres = 0;
+	while (lowres < codec->max_lowres && (par->width >> (lowres + 1)) >= width && (par->height >> (lowres + 1)) >= height)
+		lowres++;
+	return lowres;
+}
+
+static int thumbnailer_open(exAVThumbnailer *t, const char *url, int width, int height) {
+	int ret = 0, idx = -1;
+	const AVCodec *codec = NULL;
+	memset(t, 0, sizeof(exAVThumbnailer));
+	if ((ret = avformat_open_input(&t->ic, url, NULL, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_thumbnails: avformat_open_input error: %s: %s\n", av_err2str(ret), url);
+		goto err;
+	}
+	if ((ret = avformat_find_stream_info(t->ic, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_thumbnails: avformat_find_stream_info error: %s: %s\n", av_err2str(ret), url);
+		goto err;
+	}
+	if ((ret = idx = av_find_best_stream(t->ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_thumbnails: no video stream: %s\n", url);
+		goto err;
+	}
+	t->st = t->ic->streams[idx];
+	for (int i = 0; i < t->ic->nb_streams; i++) {
+		if (i != idx)
+			t->ic->streams[i]->discard = AVDISCARD_ALL;
+	}
+	ret = AVERROR(ENOMEM);
+	if ((t->cc = avcodec_alloc_context3(codec)) == NULL || (t->pkt = av_packet_alloc()) == NULL || (t->frame = av_frame_alloc()) == NULL)
+		goto err;
+	if ((ret = avcodec_parameters_to_context(t->cc, t->st->codecpar)) < 0)
+		goto err;
+	t->cc->pkt_timebase = t->st->time_base;
+	/* the workers run in parallel, a thread each is enough */
+	t->cc->thread_count = 1;
+	t->cc->skip_frame = AVDISCARD_NONKEY;
+	t->width = width;
+	t->height = height;
+	thumbnail_size(t->st, &t->width, &t->height);
+	/* decode at reduced resolution if the codec could, e.g. the DCT-based ones */
+	t->cc->lowres = thumbnail_lowres(codec, t->st->codecpar, t->width, t->height);
+	if ((ret = avcodec_open2(t->cc, codec, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_thumbnails: avcodec_open2 error: %s: %s\n", av_err2str(ret), url);
+		goto err;
+	}
+	return 0;
+err:
+	thumbnailer_close(t);
+	return ret;
+}
+
+/*
+ * Decode the keyframe nearest before 'ts' into 't->frame'.
+ */
+static int thumbnailer_decode(exAVThumbnailer *t, int64_t ts) {
+	int ret = 0;
+	if ((ret = avformat_seek_file(t->ic, -1, INT64_MIN, ts, ts, 0)) < 0 &&
+			(ret = avformat_seek_file(t->ic, -1, INT64_MIN, ts, INT64_MAX, 0)) < 0)
+		return ret;
+	avcodec_flush_buffers(t->cc);
+	while ((ret = av_read_frame(t->ic, t->pkt)) >= 0) {
+		if (t->pkt->stream_index != t->st->index || !(t->pkt->flags & AV_PKT_FLAG_KEY)) {
+			av_packet_unref(t->pkt);
+			continue;
+		}
+		ret = avcodec_send_packet(t->cc, t->pkt);
+		av_packet_unref(t->pkt);
+		if (ret < 0)
+			return ret;
+		/* drain the codec, so that a delayed keyframe comes out without decoding another one */
+		if ((ret = avcodec_send_packet(t->cc, NULL)) < 0)
+			return ret;
+		ret = avcodec_receive_frame(t->cc, t->frame);
+		if (ret != AVERROR_EOF)
+			return ret;
+		avcodec_flush_buffers(t->cc); /* a broken keyframe, try the next one */
+	}
+	return ret;
+}
+
+/*
+ * Scale the decoded frame into the picture 'dst' of the size of the thumbnails, YUV420P.
+ */
+static int thumbnailer_scale_into(exAVThumbnailer *t, uint8_t *const dst[4], const int linesize[4]) {
+	AVFrame *src = t->frame;
+	t->sws = sws_getCachedContext(t->sws, src->width, src->height, src->format,
+			t->width, t->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+	if (t->sws == NULL)
+		return AVERROR(ENOMEM);
+	return FFMIN(sws_scale(t->sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, dst, linesize), 0);
+}
+
+static int thumbnailer_scale(exAVThumbnailer *t, exAVFrame **thumbnail) {
+	int ret = 0;
+	exAVFrame *f = ex_av_frame_alloc(sizeof(exAVFrame));
+	if (f == NULL)
+		return AVERROR(ENOMEM);
+	f->avframe->width = t->width;
+	f->avframe->height = t->height;
+	f->avframe->format = AV_PIX_FMT_YUV420P;
+	if ((ret = av_frame_get_buffer(f->avframe, 0)) < 0 || (ret = thumbnailer_scale_into(t, f->avframe->data, f->avframe->linesize)) < 0) {
+		f->put(f);
+		return ret;
+	}
+	f->avframe->pts = t->frame->best_effort_timestamp;
+	f->avframe->sample_aspect_ratio = (AVRational){ 1, 1 };
+	*thumbnail = f;
+	return 0;
+}
+
+/*
+ * Scale the decoded frame straight into the tile 'i' of the sheet, without an intermediate picture.
+ */
+static int thumbnailer_draw(exAVThumbnailer *t, AVFrame *sheet, int i, int cols) {
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(sheet->format);
+	int x = (i % cols) * t->width, y = (i / cols) * t->height;
+	uint8_t *dst[4] = { NULL };
+	int linesize[4] = { 0 };
+	for (int p = 0; p < 3; p++) {
+		int sx = p ? desc->log2_chroma_w : 0, sy = p ? desc->log2_chroma_h : 0;
+		dst[p] = sheet->data[p] + (y >> sy) * sheet->linesize[p] + (x >> sx);
+		linesize[p] = sheet->linesize[p];
+	}
+	return thumbnailer_scale_into(t, dst, linesize);
+}
+
+static void *thumbnail_worker(void *arg) {
+	int ret = 0;
+	exAVThumbnailWorker *w = arg;
+	exAVThumbnailer opened, *t = w->opened;
+	if (t == NULL) {
+		if ((ret = thumbnailer_open(&opened, w->url, w->width, w->height)) < 0) {
+			w->error = ret;
+			return NULL;
+		}
+		t = &opened;
+	}
+	for (int i = 0; i < w->nb; i++) {
+		int64_t ts = w->timestamps[i];
+		if (t->ic->start_time != AV_NOPTS_VALUE)
+			ts += t->ic->start_time;
+		if ((ret = thumbnailer_decode(t, ts)) >= 0)
+			ret = w->sheet ? thumbnailer_draw(t, w->sheet, w->first + i, w->cols) : thumbnailer_scale(t, &w->thumbnails[i]);
+		av_frame_unref(t->frame);
+		if (ret < 0)
+			w->error = ret;
+		else
+			w->nb_extracted++;
+	}
+	thumbnailer_close(t);
+	return NULL;
+}
+
+/*
+ * Return the timestamps of the thumbnails in AV_TIME_BASE, evenly spaced over the media opened by 't'
+ * if 'timestamps' is NULL, or NULL if no memory.
+ */
+static int64_t *thumbnail_timestamps(exAVThumbnailer *t, const double *timestamps, int nb) {
+	int64_t *ts = av_malloc_array(nb, sizeof(int64_t));
+	if (ts == NULL)
+		return NULL;
+	for (int i = 0; i < nb; i++) {
+		if (timestamps)
+			ts[i] = llrint(timestamps[i] * AV_TIME_BASE);
+		else
+			ts[i] = t->ic->duration > 0 ? av_rescale(t->ic->duration, 2 * i + 1, 2 * nb) : 0;
+	}
+	return ts;
+}
+
+/*
+ * Share the timestamps among the workers, the first share is done by the calling thread with the thumbnailer
+ * 't' opened already, which is closed then. The thumbnails go into 'thumbnails', or into the tiles of 'sheet'.
+ * Return how many thumbnails extracted, and set the last error into '*error'.
+ */
+static int run_workers(exAVThumbnailer *t, const char *url, const int64_t *ts, int nb, int nb_workers,
+		exAVFrame **thumbnails, AVFrame *sheet, int cols, int *error) {
+	int ret = 0, nb_started = 0;
+	exAVThumbnailWorker workers[THUMBNAIL_MAX_WORKERS];
+	if (nb_workers <= 0)
+		nb_workers = av_cpu_count();
+	nb_workers = av_clip(nb_workers, 1, FFMIN(nb, THUMBNAIL_MAX_WORKERS));
+	for (int i = 0; i < nb_workers; i++) {
+		exAVThumbnailWorker *w = &workers[i];
+		int start = (int64_t)nb * i / nb_workers, end = (int64_t)nb * (i + 1) / nb_workers;
+		memset(w, 0, sizeof(exAVThumbnailWorker));
+		w->url = url;
+		w->opened = i == 0 ? t : NULL;
+		w->timestamps = ts + start;
+		w->thumbnails = thumbnails ? thumbnails + start : NULL;
+		w->sheet = sheet;
+		w->first = start;
+		w->cols = cols;
+		w->nb = end - start;
+		/* the size resolved by 't', so that all the tiles are the same */
+		w->width = t->width;
+		w->height = t->height;
+	}
+	for (nb_started = 1; nb_started < nb_workers; nb_started++) {
+		if (pthread_create(&workers[nb_started].thread, NULL, thumbnail_worker, &workers[nb_started]))
+			break;
+	}
+	thumbnail_worker(&workers[0]);
+	*error = 0;
+	for (int i = 0; i < nb_workers; i++) {
+		if (i >= nb_started) {
+			/* unable to start the thread, do its share here */
+			thumbnail_worker(&workers[i]);
+		}
+		else if (i > 0) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		ret += workers[i].nb_extracted;
+		if (workers[i].error < 0)
+			*error = workers[i].error;
+	}
+	return ret;
+}
+
+int ex_av_thumbnails_extract(const char *url, const double *timestamps, int nb, int width, int height,
+		int nb_workers, exAVFrame **thumbnails) {
+	int ret = 0, error = 0;
+	int64_t *ts = NULL;
+	exAVThumbnailer t;
+	if (nb <= 0)
+		return AVERROR(EINVAL);
+	memset(thumbnails, 0, nb * sizeof(exAVFrame *));
+	/* the first worker goes on with it, after the duration is known */
+	if ((ret = thumbnailer_open(&t, url, width, height)) < 0)
+		return ret;
+	if ((ts = thumbnail_timestamps(&t, timestamps, nb)) == NULL) {
+		thumbnailer_close(&t);
+		return AVERROR(ENOMEM);
+	}
+	ret = run_workers(&t, url, ts, nb, nb_workers, thumbnails, NULL, 0, &error);
+	av_free(ts);
+	return ret;
+}
+
+int ex_av_thumbnails_save(const char *url, const double *timestamps, int nb, int width, int height,
+		int nb_workers, const char *pattern) {
+	int ret = 0, nb_saved = 0;
+	char name[1024];
+	exAVFrame **thumbnails = NULL;
+	if (nb <= 0)
+		return AVERROR(EINVAL);
+	if ((thumbnails = av_calloc(nb, sizeof(exAVFrame *))) == NULL)
+		return AVERROR(ENOMEM);
+	if ((ret = ex_av_thumbnails_extract(url, timestamps, nb, width, height, nb_workers, thumbnails)) < 0)
+		goto out;
+	for (int i = 0; i < nb; i++) {
+		if (thumbnails[i] == NULL)
+			continue;
+		if (av_get_frame_filename2(name, sizeof(name), pattern, i, AV_FRAME_FILENAME_FLAGS_MULTIPLE) < 0) {
+			av_log(NULL, AV_LOG_ERROR, "ex_av_thumbnails_save: invalid pattern: %s\n", pattern);
+			ret = AVERROR(EINVAL);
+		}
+		else if (thumbnails[i]->save(thumbnails[i], name) == 0) {
+			nb_saved++;
+		}
+		thumbnails[i]->put(thumbnails[i]);
+	}
+	if (ret >= 0)
+		ret = nb_saved;
+out:
+	av_free(thumbnails);
+	return ret;
+}
+
+/*
+ * Create the contact sheet, see 'ex_av_contact_sheet_create'.
+ * Return 0 if success, otherwise, return a negative error code, the last one if no tile could be extracted.
+ */
+static int contact_sheet_create(AVFrame **out, const char *url, int cols, int rows, int width, int height, int nb_workers) {
+	int ret = 0, error = 0, nb = cols * rows;
+	int64_t *ts = NULL;
+	AVFrame *sheet = NULL;
+	exAVThumbnailer t;
+	if (cols <= 0 || rows <= 0)
+		return AVERROR(EINVAL);
+	/* it tells the duration and the size of the tiles, then the first worker goes on with it */
+	if ((ret = thumbnailer_open(&t, url, width, height)) < 0)
+		return ret;
+	if ((ts = thumbnail_timestamps(&t, NULL, nb)) == NULL || (sheet = av_frame_alloc()) == NULL) {
+		ret = AVERROR(ENOMEM);
+		goto err0;
+	}
+	sheet->width = t.width * cols;
+	sheet->height = t.height * rows;
+	sheet->format = AV_PIX_FMT_YUV420P;
+	if ((ret = av_frame_get_buffer(sheet, 0)) < 0)
+		goto err0;
+	/* black background, for the tiles failed */
+	memset(sheet->data[0], 0x10, sheet->linesize[0] * sheet->height);
+	memset(sheet->data[1], 0x80, sheet->linesize[1] * AV_CEIL_RSHIFT(sheet->height, 1));
+	memset(sheet->data[2], 0x80, sheet->linesize[2] * AV_CEIL_RSHIFT(sheet->height, 1));
+	if (run_workers(&t, url, ts, nb, nb_workers, NULL, sheet, cols, &error) == 0) {
+		ret = error < 0 ? error : AVERROR_INVALIDDATA;
+		goto err1;
+	}
+	av_free(ts);
+	*out = sheet;
+	return 0;
+err0:
+	thumbnailer_close(&t);
+err1:
+	av_frame_free(&sheet);
+	av_free(ts);
+	return ret;
+}
+
+AVFrame *ex_av_contact_sheet_create(const char *url, int cols, int rows, int width, int height, int nb_workers) {
+	AVFrame *sheet = NULL;
+	int ret = contact_sheet_create(&sheet, url, cols, rows, width, height, nb_workers);
+	if (ret < 0)
+		av_log(NULL, AV_LOG_ERROR, "ex_av_contact_sheet_create error: %s: %s\n", av_err2str(ret), url);
+	return sheet;
+}
+
+int ex_av_contact_sheet_save(const char *url, int cols, int rows, int width, int height, int nb_workers, const char *out) {
+	int ret = 0;
+	AVFrame *sheet = NULL;
+	if ((ret = contact_sheet_create(&sheet, url, cols, rows, width, height, nb_workers)) < 0)
+		return ret;
+	ret = av_frame_save(sheet, out);
+	av_frame_free(&sheet);
+	return ret;
+}
@@ -0,0 +1,241 @@
+/*
+ * trace.c
+ *
+ *  Created on: 2026-10-16 19:36:52
+ *      Author: yui
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+#include <libavformat/avio.h>
+
+#include <trace.h>
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int ex_av_trace_enabled;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;  /* taken where the buffers are allocated */
+static exAVTraceBuffer *trace_buffers;          /* only removed by 'ex_av_trace_free' */
+static unsigned int trace_generation;           /* increased by every start */
+static int trace_capacity = TRACE_DEFAULT_CAPACITY;
+static int trace_next_tid;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;                 /* buffer of the calling thread */
+static __thread char trace_thread_name[32];
+
+static void release_buffer(void *arg) {
+	exAVTraceBuffer *b = arg;
+	store_release(&b->in_use, 0);
+}
+
+static void trace_init(void) {
+	pthread_key_create(&trace_key, release_buffer);
+}
+
+/*
+ * Allocate the spans of a buffer, unless it has them already; a buffer no thread owns is given the current
+ * capacity. Called with the mutex held.
+ */
+static void alloc_events(exAVTraceBuffer *b) {
+	exAVTraceEvent *events = NULL;
+	int capacity = trace_capacity;
+	if (b->events && (b->in_use || b->capacity == capacity))
+		return;
+	av_freep(&b->events);
+	b->capacity = 0;
+	if ((events = av_malloc_array(capacity, sizeof(exAVTraceEvent))) == NULL)
+		return;
+	b->capacity = capacity;
+	store_release(&b->events, events);
+}
+
+/*
+ * Claim the buffer of an exited thread which holds no span of the current tracing, or allocate a new one,
+ * for the calling thread. Called with the mutex held.
+ */
+static exAVTraceBuffer *claim_buffer(void) {
+	exAVTraceBuffer *b = NULL;
+	unsigned int generation = load_acquire(&trace_generation);
+	pthread_once(&trace_once, trace_init);
+	if ((b = pthread_getspecific(trace_key)) != NULL)
+		return b;
+	for (b = trace_buffers; b; b = b->next) {
+		int in_use = 0;
+		if (load_acquire(&b->generation) != generation &&
+				__atomic_compare_exchange_n(&b->in_use, &in_use, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if (b == NULL) {
+		if ((b = av_mallocz(sizeof(exAVTraceBuffer))) == NULL)
+			return NULL;
+		b->in_use = 1;
+		b->generation = generation - 1; /* reset before its first span */
+		b->next = trace_buffers;
+		store_release(&trace_buffers, b);
+	}
+	b->tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+	pthread_setspecific(trace_key, b);
+	return b;
+}
+
+/*
+ * Return the buffer of the calling thread, emptied if it holds the spans of the last tracing, or NULL if
+ * the thread is not traced. Nothing is allocated here, on the paths being traced.
+ */
+static exAVTraceBuffer *thread_buffer(void) {
+	exAVTraceBuffer *b = NULL;
+	unsigned int generation = load_acquire(&trace_generation);
+	pthread_once(&trace_once, trace_init);
+	if ((b = pthread_getspecific(trace_key)) == NULL || load_acquire(&b->events) == NULL)
+		return NULL;
+	if (b->generation != generation) {
+		b->count = 0;
+		b->nb_lost = 0;
+		av_strlcpy(b->name, trace_thread_name, sizeof(b->name));
+		/* visible to 'ex_av_trace_dump' from now on */
+		store_release(&b->generation, generation);
+	}
+	return b;
+}
+
+void ex_av_trace_start(int capacity) {
+	pthread_mutex_lock(&trace_mutex);
+	trace_capacity = capacity > 0 ? capacity : TRACE_DEFAULT_CAPACITY;
+	claim_buffer();
+	for (exAVTraceBuffer *b = trace_buffers; b; b = b->next)
+		alloc_events(b);
+	__atomic_add_fetch(&trace_generation, 1, __ATOMIC_RELEASE);
+	store_release(&ex_av_trace_enabled, 1);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void ex_av_trace_stop(void) {
+	store_release(&ex_av_trace_enabled, 0);
+}
+
+void ex_av_trace_free(void) {
+	exAVTraceBuffer *b = NULL, *next = NULL;
+	ex_av_trace_stop();
+	pthread_mutex_lock(&trace_mutex);
+	pthread_once(&trace_once, trace_init);
+	pthread_setspecific(trace_key, NULL);
+	for (b = trace_buffers; b; b = next) {
+		next = b->next;
+		av_free(b->events);
+		av_free(b);
+	}
+	trace_buffers = NULL;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void ex_av_trace_thread_name(const char *name) {
+	exAVTraceBuffer *b = NULL;
+	av_strlcpy(trace_thread_name, name, sizeof(trace_thread_name));
+	pthread_mutex_lock(&trace_mutex);
+	if ((b = claim_buffer()) != NULL) {
+		if (ex_av_trace_is_enabled())
+			alloc_events(b);
+		av_strlcpy(b->name, name, sizeof(b->name));
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void ex_av_trace_record(const char *name, int64_t start, int stream, int serial, int64_t pts) {
+	int64_t now = av_gettime_relative();
+	exAVTraceBuffer *b = thread_buffer();
+	exAVTraceEvent *e = NULL;
+	if (b == NULL)
+		return;
+	if (b->count >= b->capacity) {
+		b->nb_lost++;
+		return;
+	}
+	e = &b->events[b->count];
+	e->name   = name;
+	e->ts     = start;
+	e->dur    = now - start;
+	e->stream = stream;
+	e->serial = serial;
+	e->pts    = pts;
+	store_release(&b->count, b->count + 1);
+}
+
+int ex_av_trace_collect(const char *name, int64_t **durations) {
+	int nb = 0;
+	exAVTraceBuffer *b = NULL;
+	unsigned int generation = load_acquire(&trace_generation);
+	*durations = NULL;
+	for (b = load_acquire(&trace_buffers); b; b = b->next) {
+		int count = 0;
+		if (load_acquire(&b->generation) != generation)
+			continue;
+		count = load_acquire(&b->count);
+		for (int i = 0; i < count; i++) {
+			exAVTraceEvent *e = &load_acquire(&b->events)[i];
+			if (e->pts == AV_NOPTS_VALUE || strcmp(e->name, name))
+				continue;
+			if (av_dynarray2_add((void **)durations, &nb, sizeof(int64_t), (const uint8_t *)&e->dur) == NULL)
+				return AVERROR(ENOMEM); /* the array is freed by av_dynarray2_add */
+		}
+	}
+	return nb;
+}
+
+static void dump_thread_name(AVIOContext *pb, exAVTraceBuffer *b) {
+	char name[sizeof(b->name)];
+	av_strlcpy(name, b->name, sizeof(name));
+	/* the names are given by ourselves, just keep the JSON valid */
+	for (char *p = name; *p; p++) {
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+			*p = '_';
+	}
+	avio_printf(pb, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", b->tid, name);
+}
+
+static void dump_event(AVIOContext *pb, exAVTraceBuffer *b, exAVTraceEvent *e) {
+	avio_printf(pb, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%"PRId64",\"dur\":%"PRId64
+			",\"args\":{\"stream\":%d,\"serial\":%d", e->name, b->tid, e->ts, e->dur, e->stream, e->serial);
+	if (e->pts != AV_NOPTS_VALUE)
+		avio_printf(pb, ",\"pts\":%"PRId64, e->pts);
+	avio_printf(pb, "}}");
+}
+
+int ex_av_trace_dump(const char *path) {
+	int ret = 0;
+	AVIOContext *pb = NULL;
+	exAVTraceBuffer *b = NULL;
+	unsigned int generation = load_acquire(&trace_generation);
+	if ((ret = avio_open(&pb, path, AVIO_FLAG_WRITE)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_trace_dump: unable to open %s: %s\n", path, av_err2str(ret));
+		return ret;
+	}
+	/* every event follows a comma, so the array starts with the process name */
+	avio_printf(pb, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"libffmpeg\"}}");
+	for (b = load_acquire(&trace_buffers); b; b = b->next) {
+		int count = 0;
+		if (load_acquire(&b->generation) != generation)
+			continue;
+		count = load_acquire(&b->count);
+		if (b->name[0])
+			dump_thread_name(pb, b);
+		for (int i = 0; i < count; i++)
+			dump_event(pb, b, &load_acquire(&b->events)[i]);
+		if (b->nb_lost)
+			av_log(NULL, AV_LOG_WARNING, "ex_av_trace_dump: %"PRId64" spans of thread %d lost, its buffer is full\n", b->nb_lost, b->tid);
+	}
+	avio_printf(pb, "\n]}\n");
+	avio_flush(pb);
+	ret = pb->error;
+	avio_closep(&pb);
+	return ret;
+}
@@ -0,0 +1,499 @@
+/*
+ * transcode.c
+ *
+ *  Created on: 2026-10-16 16:06:40
+ *      Author: yui
+ */
+
+#include <libavutil/time.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/log.h>
+#include <libavutil/common.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+
+#include <transcode.h>
+
+static inline void stage_start(exAVStage *s, const char *name) {
+	s->name = name;
+	s->nb_items = 0;
+	s->starved = s->stalled = 0;
+	s->end_time = 0;
+	s->start_time = av_gettime_relative();
+}
+
+static inline void stage_end(exAVStage *s) {
+	s->end_time = av_gettime_relative();
+}
+
+/*
+ * Pop the input of a stage, the waiting time is accounted as starved.
+ */
+static int stage_pop(exAVStage *s, exAVQueue *q, struct list_head **n) {
+	int64_t start = av_gettime_relative();
+	int ret = ex_av_queue_pop(q, n, -1);
+	s->starved += av_gettime_relative() - start;
+	return ret;
+}
+
+/*
+ * Push the output of a stage, the waiting time is accounted as stalled.
+ */
+static int stage_push(exAVStage *s, exAVQueue *q, struct list_head *n) {
+	int64_t start = av_gettime_relative();
+	int ret = ex_av_queue_push(q, n, -1);
+	s->stalled += av_gettime_relative() - start;
+	if (ret == 0)
+		s->nb_items++;
+	return ret;
+}
+
+static void stage_report(exAVStage *s, const char *prefix) {
+	int64_t elapsed = FFMAX((s->end_time ? s->end_time : av_gettime_relative()) - s->start_time, 1);
+	int64_t busy = FFMAX(elapsed - s->starved - s->stalled, 0);
+	av_log(NULL, AV_LOG_INFO, "transcode %s%-6s: %8"PRId64" items, %8.1f items/s, busy %5.1f%%, starved %5.1f%%, stalled %5.1f%%\n",
+			prefix, s->name, s->nb_items, s->nb_items * 1000000.0 / elapsed,
+			busy * 100.0 / elapsed, s->starved * 100.0 / elapsed, s->stalled * 100.0 / elapsed);
+}
+
+/*
+ * Record the first error of the threads.
+ */
+static void transcoder_fail(exAVTranscoder *t, int err) {
+	int expected = 0;
+	if (err < 0 && err != AVERROR_EXIT)
+		__atomic_compare_exchange_n(&t->result, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Convert a video frame for the encoder; the frame is passed through if it is already suitable.
+ */
+static exAVFrame *convert_picture(exAVTranscodeStream *ts, exAVFrame *in) {
+	AVFrame *src = in->avframe;
+	AVCodecContext *enc = ts->enc;
+	exAVFrame *out = NULL;
+	int64_t pts = src->best_effort_timestamp != AV_NOPTS_VALUE ? src->best_effort_timestamp : src->pts;
+	pts = pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(pts, ts->ist->time_base, enc->time_base);
+	if (src->width == enc->width && src->height == enc->height && src->format == enc->pix_fmt) {
+		src->pts = pts;
+		src->pict_type = AV_PICTURE_TYPE_NONE;
+		return in;
+	}
+	ts->sws = sws_getCachedContext(ts->sws, src->width, src->height, src->format,
+			enc->width, enc->height, enc->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+	if (ts->sws == NULL || (out = ex_av_frame_pool_alloc(ts->t->frame_pool)) == NULL)
+		goto err;
+	out->avframe->width = enc->width;
+	out->avframe->height = enc->height;
+	out->avframe->format = enc->pix_fmt;
+	if (av_frame_get_buffer(out->avframe, 0) < 0)
+		goto err;
+	sws_scale(ts->sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, out->avframe->data, out->avframe->linesize);
+	out->avframe->pts = pts;
+	in->put(in);
+	return out;
+err:
+	if (out)
+		out->put(out);
+	in->put(in);
+	return NULL;
+}
+
+/*
+ * Move the samples of the fifo into frames of the frame size of the encoder; the last frame
+ * could be shorter if 'flush'.
+ */
+static int push_samples(exAVTranscodeStream *ts, int flush) {
+	int ret = 0;
+	AVCodecContext *enc = ts->enc;
+	while (av_audio_fifo_size(ts->fifo) >= ts->frame_size || (flush && av_audio_fifo_size(ts->fifo) > 0)) {
+		exAVFrame *out = ex_av_frame_pool_alloc(ts->t->frame_pool);
+		if (out == NULL)
+			return AVERROR(ENOMEM);
+		out->avframe->nb_samples = FFMIN(ts->frame_size, av_audio_fifo_size(ts->fifo));
+		out->avframe->format = enc->sample_fmt;
+		out->avframe->sample_rate = enc->sample_rate;
+		if ((ret = av_channel_layout_copy(&out->avframe->ch_layout, &enc->ch_layout)) < 0 ||
+				(ret = av_frame_get_buffer(out->avframe, 0)) < 0) {
+			out->put(out);
+			return ret;
+		}
+		av_audio_fifo_read(ts->fifo, (void **)out->avframe->data, out->avframe->nb_samples);
+		out->avframe->pts = ts->next_pts;
+		ts->next_pts += out->avframe->nb_samples;
+		if ((ret = stage_push(&ts->filter, &ts->converted, &out->list)) < 0) {
+			out->put(out);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Resample an audio frame(NULL to flush the resampler) for the encoder, into the fifo.
+ */
+static int convert_samples(exAVTranscodeStream *ts, AVFrame *src) {
+	int ret = 0, nb_samples = 0;
+	uint8_t **buf = NULL;
+	AVCodecContext *enc = ts->enc;
+	if (src && ts->swr == NULL) {
+		if ((ret = swr_alloc_set_opts2(&ts->swr, &enc->ch_layout, enc->sample_fmt, enc->sample_rate,
+				&src->ch_layout, src->format, src->sample_rate, 0, NULL)) < 0 || (ret = swr_init(ts->swr)) < 0)
+			return ret;
+		if (src->pts != AV_NOPTS_VALUE)
+			ts->next_pts = av_rescale_q(src->pts, ts->ist->time_base, enc->time_base);
+	}
+	if (ts->swr == NULL)
+		return 0;
+	nb_samples = swr_get_out_samples(ts->swr, src ? src->nb_samples : 0);
+	if (nb_samples <= 0)
+		return 0;
+	if ((ret = av_samples_alloc_array_and_samples(&buf, NULL, enc->ch_layout.nb_channels, nb_samples, enc->sample_fmt, 0)) < 0)
+		return ret;
+	ret = swr_convert(ts->swr, buf, nb_samples, src ? (const uint8_t **)src->extended_data : NULL, src ? src->nb_samples : 0);
+	if (ret > 0 && av_audio_fifo_write(ts->fifo, (void **)buf, ret) < ret)
+		ret = AVERROR(ENOMEM);
+	av_freep(&buf[0]);
+	av_freep(&buf);
+	return ret < 0 ? ret : 0;
+}
+
+static void *filter_routine(void *arg) {
+	exAVTranscodeStream *ts = arg;
+	struct list_head *n = NULL;
+	int ret = 0;
+	while (1) {
+		/* wait until the decoder inserts a frame, finishes, or the transcoding is stopped */
+		if ((ret = stage_pop(&ts->decode, ts->input, &n)) < 0)
+			break;
+		exAVFrame *in = list_entry(n, exAVFrame, list);
+		ts->decode.nb_items++;
+		if (ts->type == AVMEDIA_TYPE_VIDEO) {
+			exAVFrame *out = convert_picture(ts, in);
+			if (out == NULL) {
+				ret = AVERROR(ENOMEM);
+				break;
+			}
+			if ((ret = stage_push(&ts->filter, &ts->converted, &out->list)) < 0) {
+				out->put(out);
+				break;
+			}
+		}
+		else {
+			ret = convert_samples(ts, in->avframe);
+			in->put(in);
+			if (ret < 0 || (ret = push_samples(ts, 0)) < 0)
+				break;
+		}
+	}
+	if (ret == AVERROR_EOF) {
+		ret = 0;
+		if (ts->type == AVMEDIA_TYPE_AUDIO && (ret = convert_samples(ts, NULL)) == 0)
+			ret = push_samples(ts, 1);
+	}
+	transcoder_fail(ts->t, ret);
+	ex_av_queue_finish(&ts->converted);
+	stage_end(&ts->decode);
+	stage_end(&ts->filter);
+	return NULL;
+}
+
+/*
+ * Receive all the packets available from the encoder, and queue them for the muxer.
+ */
+static int receive_packets(exAVTranscodeStream *ts) {
+	int ret = 0;
+	while (1) {
+		exAVPacket *pkt = ex_av_packet_pool_alloc(ts->t->packet_pool);
+		if (pkt == NULL)
+			return AVERROR(ENOMEM);
+		if ((ret = avcodec_receive_packet(ts->enc, pkt->avpkt)) < 0) {
+			pkt->put(pkt);
+			return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+		}
+		av_packet_rescale_ts(pkt->avpkt, ts->enc->time_base, ts->ost->time_base);
+		pkt->avpkt->stream_index = ts->idx;
+		if ((ret = stage_push(&ts->encode, &ts->t->packets, &pkt->list)) < 0) {
+			pkt->put(pkt);
+			return ret;
+		}
+	}
+}
+
+static void *encoder_routine(void *arg) {
+	exAVTranscodeStream *ts = arg;
+	exAVTranscoder *t = ts->t;
+	struct list_head *n = NULL;
+	int ret = 0;
+	while (1) {
+		if ((ret = stage_pop(&ts->encode, &ts->converted, &n)) < 0)
+			break;
+		exAVFrame *f = list_entry(n, exAVFrame, list);
+		ret = avcodec_send_frame(ts->enc, f->avframe);
+		f->put(f);
+		if (ret < 0 || (ret = receive_packets(ts)) < 0)
+			break;
+	}
+	if (ret == AVERROR_EOF) {
+		/* drain the encoder */
+		if ((ret = avcodec_send_frame(ts->enc, NULL)) == 0)
+			ret = receive_packets(ts);
+	}
+	transcoder_fail(t, ret);
+	stage_end(&ts->encode);
+	if (__atomic_sub_fetch(&t->nb_encoders_running, 1, __ATOMIC_ACQ_REL) == 0)
+		ex_av_queue_finish(&t->packets);
+	return NULL;
+}
+
+static void *muxer_routine(void *arg) {
+	exAVTranscoder *t = arg;
+	struct list_head *n = NULL;
+	int ret = 0;
+	while (1) {
+		if ((ret = stage_pop(&t->mux, &t->packets, &n)) < 0)
+			break;
+		exAVPacket *pkt = list_entry(n, exAVPacket, list);
+		ret = av_interleaved_write_frame(t->oc, pkt->avpkt);
+		pkt->put(pkt);
+		if (ret < 0)
+			break;
+		t->mux.nb_items++;
+	}
+	if (ret == AVERROR_EOF)
+		ret = 0;
+	transcoder_fail(t, ret);
+	/* always write the trailer, so that what has been written could be played */
+	transcoder_fail(t, av_write_trailer(t->oc));
+	stage_end(&t->mux);
+	return NULL;
+}
+
+int ex_av_transcoder_can_copy(const char *url, enum AVCodecID codec_id) {
+	const AVOutputFormat *fmt = av_guess_format(NULL, url, NULL);
+	return fmt && avformat_query_codec(fmt, codec_id, FF_COMPLIANCE_NORMAL) == 1;
+}
+
+static int open_video_encoder(exAVTranscodeStream *ts, const AVCodec *codec) {
+	AVCodecContext *enc = ts->enc;
+	AVCodecParameters *par = ts->ist->codecpar;
+	AVRational frame_rate = ts->ist->avg_frame_rate.num ? ts->ist->avg_frame_rate : ts->ist->r_frame_rate;
+	enc->width = par->width;
+	enc->height = par->height;
+	enc->sample_aspect_ratio = par->sample_aspect_ratio;
+	enc->pix_fmt = codec->pix_fmts ? avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, par->format, 0, NULL) : par->format;
+	enc->framerate = frame_rate;
+	enc->time_base = frame_rate.num ? av_inv_q(frame_rate) : ts->ist->time_base;
+	return 0;
+}
+
+static int open_audio_encoder(exAVTranscodeStream *ts, const AVCodec *codec) {
+	int ret = 0;
+	AVCodecContext *enc = ts->enc;
+	AVCodecParameters *par = ts->ist->codecpar;
+	enc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : par->format;
+	enc->sample_rate = par->sample_rate;
+	if (codec->supported_samplerates) {
+		enc->sample_rate = codec->supported_samplerates[0];
+		for (int i = 0; codec->supported_samplerates[i]; i++) {
+			if (codec->supported_samplerates[i] == par->sample_rate)
+				enc->sample_rate = par->sample_rate;
+		}
+	}
+	if ((ret = av_channel_layout_copy(&enc->ch_layout, &par->ch_layout)) < 0)
+		return ret;
+	enc->time_base = (AVRational){ 1, enc->sample_rate };
+	return 0;
+}
+
+static int add_stream(exAVTranscoder *t, AVStream *ist, exAVQueue *input) {
+	int ret = 0;
+	exAVTranscodeStream *ts = &t->streams[t->nb_streams];
+	enum AVMediaType type = ist->codecpar->codec_type;
+	enum AVCodecID id = av_guess_codec(t->oc->oformat, NULL, t->oc->url, NULL, type);
+	const AVCodec *codec = avcodec_find_encoder(id);
+	if (codec == NULL) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder: no %s encoder for %s\n", av_get_media_type_string(type), t->oc->url);
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+	ts->t = t;
+	ts->idx = t->nb_streams;
+	ts->type = type;
+	ts->ist = ist;
+	ts->input = input;
+	if ((ret = ex_av_queue_init(&ts->converted, QUEUE_SPSC, TRANSCODE_FRAME_QUEUE_SIZE)) < 0)
+		return ret;
+	t->nb_streams++;
+	if ((ts->enc = avcodec_alloc_context3(codec)) == NULL || (ts->ost = avformat_new_stream(t->oc, NULL)) == NULL)
+		return AVERROR(ENOMEM);
+	ret = type == AVMEDIA_TYPE_VIDEO ? open_video_encoder(ts, codec) : open_audio_encoder(ts, codec);
+	if (ret < 0)
+		return ret;
+	if (t->oc->oformat->flags & AVFMT_GLOBALHEADER)
+		ts->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if ((ret = avcodec_open2(ts->enc, codec, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder: unable to open encoder %s: %s\n", codec->name, av_err2str(ret));
+		return ret;
+	}
+	if ((ret = avcodec_parameters_from_context(ts->ost->codecpar, ts->enc)) < 0)
+		return ret;
+	ts->ost->time_base = ts->enc->time_base;
+	if (type == AVMEDIA_TYPE_AUDIO) {
+		ts->frame_size = ts->enc->frame_size > 0 ? ts->enc->frame_size : 1024;
+		if ((ts->fifo = av_audio_fifo_alloc(ts->enc->sample_fmt, ts->enc->ch_layout.nb_channels, ts->frame_size)) == NULL)
+			return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+
+static void free_streams(exAVTranscoder *t) {
+	for (int i = 0; i < t->nb_streams; i++) {
+		exAVTranscodeStream *ts = &t->streams[i];
+		avcodec_free_context(&ts->enc);
+		sws_freeContext(ts->sws);
+		ts->sws = NULL;
+		swr_free(&ts->swr);
+		if (ts->fifo)
+			av_audio_fifo_free(ts->fifo);
+		ts->fifo = NULL;
+		ex_av_queue_destroy(&ts->converted, ex_av_frame_free_list_entry);
+	}
+	t->nb_streams = 0;
+}
+
+/*
+ * Start the threads of all the stages. If a thread could not be created, the ones started are stopped
+ * and joined; the inputs are aborted for it, their owner has to restart them.
+ */
+static int start_threads(exAVTranscoder *t) {
+	int ret = 0, i = 0, nb_filters = 0, nb_encoders = 0;
+	stage_start(&t->mux, "mux");
+	t->nb_encoders_running = t->nb_streams;
+	for (i = 0; i < t->nb_streams; i++) {
+		exAVTranscodeStream *ts = &t->streams[i];
+		stage_start(&ts->decode, "decode");
+		stage_start(&ts->filter, ts->type == AVMEDIA_TYPE_VIDEO ? "scale" : "resample");
+		stage_start(&ts->encode, "encode");
+		if ((ret = pthread_create(&ts->filter_thread, NULL, filter_routine, ts)))
+			goto err;
+		nb_filters++;
+		if ((ret = pthread_create(&ts->encoder_thread, NULL, encoder_routine, ts)))
+			goto err;
+		nb_encoders++;
+	}
+	if ((ret = pthread_create(&t->muxer_thread, NULL, muxer_routine, t)))
+		goto err;
+	t->threads_started = 1;
+	return 0;
+err:
+	av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder_create: unable to create thread: %s\n", av_err2str(AVERROR(ret)));
+	ex_av_transcoder_abort(t);
+	for (i = 0; i < t->nb_streams; i++)
+		ex_av_queue_abort(t->streams[i].input);
+	for (i = 0; i < nb_filters; i++)
+		pthread_join(t->streams[i].filter_thread, NULL);
+	for (i = 0; i < nb_encoders; i++)
+		pthread_join(t->streams[i].encoder_thread, NULL);
+	return AVERROR(ret);
+}
+
+int ex_av_transcoder_create(exAVTranscoder **tt, const char *url, AVStream **ist, exAVQueue **input, int nb_streams) {
+	int ret = AVERROR(ENOMEM);
+	exAVTranscoder *t = av_mallocz(sizeof(exAVTranscoder));
+	if (t == NULL)
+		goto err0;
+	t->frame_pool = ex_av_frame_pool_create(sizeof(exAVFrame), TRANSCODE_MAX_STREAMS * (TRANSCODE_FRAME_QUEUE_SIZE + 2));
+	t->packet_pool = ex_av_packet_pool_create(sizeof(exAVPacket), TRANSCODE_PACKET_QUEUE_SIZE + TRANSCODE_MAX_STREAMS);
+	if (!t->frame_pool || !t->packet_pool)
+		goto err1;
+	if ((ret = ex_av_queue_init(&t->packets, QUEUE_LIST, TRANSCODE_PACKET_QUEUE_SIZE)) < 0)
+		goto err1;
+	if ((ret = avformat_alloc_output_context2(&t->oc, NULL, NULL, url)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder_create: avformat_alloc_output_context2 error: %s: %s\n", av_err2str(ret), url);
+		goto err2;
+	}
+	for (int i = 0; i < nb_streams && t->nb_streams < TRANSCODE_MAX_STREAMS; i++) {
+		enum AVMediaType type = ist[i]->codecpar->codec_type;
+		if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+			av_log(NULL, AV_LOG_WARNING, "ex_av_transcoder_create: %s stream %d is not transcoded: %s\n",
+					av_get_media_type_string(type), ist[i]->index, url);
+			continue;
+		}
+		if ((ret = add_stream(t, ist[i], input[i])) < 0)
+			goto err3;
+	}
+	if (!(t->oc->oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&t->oc->pb, url, AVIO_FLAG_WRITE)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder_create: avio_open error: %s: %s\n", av_err2str(ret), url);
+		goto err3;
+	}
+	if ((ret = avformat_write_header(t->oc, NULL)) < 0) {
+		av_log(NULL, AV_LOG_ERROR, "ex_av_transcoder_create: avformat_write_header error: %s: %s\n", av_err2str(ret), url);
+		goto err4;
+	}
+	if ((ret = start_threads(t)) < 0)
+		goto err4;
+	*tt = t;
+	return 0;
+err4:
+	if (!(t->oc->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&t->oc->pb);
+err3:
+	free_streams(t);
+	avformat_free_context(t->oc);
+err2:
+	ex_av_queue_destroy(&t->packets, ex_av_packet_free_list_entry);
+err1:
+	ex_av_frame_pool_free(&t->frame_pool);
+	ex_av_packet_pool_free(&t->packet_pool);
+	av_free(t);
+err0:
+	return ret;
+}
+
+void ex_av_transcoder_abort(exAVTranscoder *t) {
+	for (int i = 0; i < t->nb_streams; i++)
+		ex_av_queue_abort(&t->streams[i].converted);
+	ex_av_queue_abort(&t->packets);
+}
+
+void ex_av_transcoder_report(exAVTranscoder *t) {
+	for (int i = 0; i < t->nb_streams; i++) {
+		exAVTranscodeStream *ts = &t->streams[i];
+		const char *prefix = ts->type == AVMEDIA_TYPE_VIDEO ? "video " : "audio ";
+		stage_report(&ts->decode, prefix);
+		stage_report(&ts->filter, prefix);
+		stage_report(&ts->encode, prefix);
+	}
+	stage_report(&t->mux, "");
+}
+
+int ex_av_transcoder_wait(exAVTranscoder *t) {
+	if (!t->threads_started)
+		return t->result;
+	for (int i = 0; i < t->nb_streams; i++) {
+		pthread_join(t->streams[i].filter_thread, NULL);
+		pthread_join(t->streams[i].encoder_thread, NULL);
+	}
+	pthread_join(t->muxer_thread, NULL);
+	t->threads_started = 0;
+	ex_av_transcoder_report(t);
+	return t->result;
+}
+
+void ex_av_transcoder_free(exAVTranscoder **t) {
+	exAVTranscoder *p = *t;
+	if (p == NULL)
+		return;
+	*t = NULL;
+	ex_av_transcoder_abort(p);
+	ex_av_transcoder_wait(p);
+	free_streams(p);
+	if (!(p->oc->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&p->oc->pb);
+	avformat_free_context(p->oc);
+	ex_av_queue_destroy(&p->packets, ex_av_packet_free_list_entry);
+	ex_av_frame_pool_free(&p->frame_pool);
+	ex_av_packet_pool_free(&p->packet_pool);
+	av_free(p);
+}